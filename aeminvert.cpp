@@ -54,7 +54,7 @@ extern "C" {
 
 #include "aemutil.hpp"
 
-static char short_options[] = "i:I:s:M:o:d:l:D:t:S:H:L:k:B:Pw:W:v:h";
+static char short_options[] = "i:I:s:M:o:d:l:D:t:S:H:L:k:B:PZ:Y:w:W:v:h";
 static struct option long_options[] = {
   {"input", required_argument, 0, 'i'},
   {"initial", required_argument, 0, 'I'},
@@ -79,6 +79,9 @@ static struct option long_options[] = {
 
   {"posteriork", 0, 0, 'P'},
 
+  {"screen", required_argument, 0, 'Z'},
+  {"screen-adapt", required_argument, 0, 'Y'},
+
   {"wavelet-vertical", required_argument, 0, 'w'},
   {"wavelet-horizontal", required_argument, 0, 'W'},
 
@@ -121,6 +124,9 @@ int main(int argc, char *argv[])
 
   bool posteriork;
 
+  double screen_drift;
+  int screen_adapt;
+
   int wavelet_v;
   int wavelet_h;
 
@@ -150,6 +156,9 @@ int main(int argc, char *argv[])
 
   posteriork = false;
 
+  screen_drift = 0.0;
+  screen_adapt = 0;
+
   wavelet_v = 0;
   wavelet_h = 0;
 
@@ -256,6 +265,22 @@ int main(int argc, char *argv[])
       posteriork = true;
       break;
 
+    case 'Z':
+      screen_drift = atof(optarg);
+      if (screen_drift <= 0.0) {
+	fprintf(stderr, "error: screening drift must be greater than 0\n");
+	return -1;
+      }
+      break;
+
+    case 'Y':
+      screen_adapt = atoi(optarg);
+      if (screen_adapt < 0) {
+	fprintf(stderr, "error: screening adaptation must be 0 or greater\n");
+	return -1;
+      }
+      break;
+
     case 'w':
       wavelet_v = atoi(optarg);
       if (wavelet_v < 0 || wavelet_v > Global::WAVELET_MAX) {
@@ -319,6 +344,10 @@ int main(int argc, char *argv[])
 		wavelet_h,
 		wavelet_v);
 
+  if (screen_drift > 0.0 && !posteriork) {
+    global.initialize_screening(screen_drift);
+  }
+
   Birth birth(global);
   Death death(global);
   Value value(global);
@@ -356,6 +385,10 @@ int main(int argc, char *argv[])
 
   for (int i = 0; i < total; i ++) {
 
+    if (i >= screen_adapt) {
+      global.freeze_screening();
+    }
+    
     double u = global.random.uniform();
 
     if (u < Pb) {
@@ -610,6 +643,11 @@ static void usage(const char *pname)
 	  " -B|--birth-probability <float>  Birth probability\n"
 	  " -P|--posteriork                 Posterior k simulation\n"
 	  "\n"
+	  " -Z|--screen <float>             Screen birth/value proposals with linearised forward models,\n"
+	  "                                 re-linearising columns that drift more than this (log conductivity)\n"
+	  " -Y|--screen-adapt <int>         Iterations before the linearisations are frozen, screening is only\n"
+	  "                                 exact after this (default 0)\n"
+	  "\n"
 	  " -w|--wavelet-vertical <int>     Wavelet basis to use for vertical direction\n"
 	  " -W|--wavelet-horizontal <int>   Wavelet basis to use for horizontal direction\n"
 	  "\n"
@@ -31,6 +31,7 @@
 #include <math.h>
 
 #include <getopt.h>
+#include <unistd.h>
 
 #include <gmp.h>
 
@@ -54,10 +55,12 @@ extern "C" {
 #include "death.hpp"
 #include "value.hpp"
 #include "hierarchical.hpp"
+#include "checkpoint.hpp"
+#include "profiler.hpp"
 
 #include "aemutil.hpp"
 
-static char short_options[] = "i:I:s:M:o:d:l:D:t:S:u:H:L:k:B:P:w:W:v:c:h";
+static char short_options[] = "i:I:s:M:o:d:l:D:t:S:u:H:L:k:B:P:w:W:v:c:N:K:Xh";
 static struct option long_options[] = {
   {"input", required_argument, 0, 'i'},
   {"initial", required_argument, 0, 'I'},
@@ -80,6 +83,7 @@ static struct option long_options[] = {
   {"kmax", required_argument, 0, 'k'},
 
   {"birth-probability", required_argument, 0, 'B'},
+  {"value-tries", required_argument, 0, 'N'},
 
   {"posteriork", 0, 0, 'P'},
 
@@ -90,6 +94,9 @@ static struct option long_options[] = {
 
   {"chains", required_argument, 0, 'c'},
 
+  {"checkpoint", required_argument, 0, 'K'},
+  {"restart", no_argument, 0, 'X'},
+
   {"help", no_argument, 0, 'h'},
   
   {0, 0, 0, 0}
@@ -125,6 +132,7 @@ int main(int argc, char *argv[])
   double lambda_std;
 
   double Pb;
+  int value_tries;
 
   bool posteriork;
 
@@ -135,6 +143,9 @@ int main(int argc, char *argv[])
 
   int chains;
 
+  int checkpoint_rate;
+  bool restart;
+
   int mpi_size;
   int mpi_rank;
 
@@ -164,6 +175,7 @@ int main(int argc, char *argv[])
   lambda_std = 0.0;
 
   Pb = 0.05;
+  value_tries = 1;
 
   posteriork = false;
 
@@ -174,6 +186,9 @@ int main(int argc, char *argv[])
 
   chains = 1;
 
+  checkpoint_rate = 0;
+  restart = false;
+
   //
   // Command line parameters
   //
@@ -275,6 +290,14 @@ int main(int argc, char *argv[])
       }
       break;
 
+    case 'N':
+      value_tries = atoi(optarg);
+      if (value_tries < 1) {
+	fprintf(stderr, "error: value tries must be 1 or greater\n");
+	return -1;
+      }
+      break;
+
     case 'P':
       posteriork = true;
       break;
@@ -307,6 +330,18 @@ int main(int argc, char *argv[])
       }
       break;
 
+    case 'K':
+      checkpoint_rate = atoi(optarg);
+      if (checkpoint_rate < 0) {
+	fprintf(stderr, "error: checkpoint rate must be 0 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'X':
+      restart = true;
+      break;
+
     case 'h':
     default:
       usage(argv[0]);
@@ -316,7 +351,7 @@ int main(int argc, char *argv[])
 
   std::string logfile = mkfilenamerank(output_prefix, "log.txt", mpi_rank);
   if (slog_set_output_file(logfile.c_str(),
-			   SLOG_FLAGS_CLEAR) < 0) {
+			   restart ? 0 : SLOG_FLAGS_CLEAR) < 0) {
     fprintf(stderr, "error: failed to redirect log file\n");
     return -1;
   }
@@ -363,7 +398,7 @@ int main(int argc, char *argv[])
 
   Birth birth(global);
   Death death(global);
-  Value value(global);
+  Value value(global, value_tries);
 
   Hierarchical *hierarchical = nullptr;
   if (lambda_std > 0.0) {
@@ -433,14 +468,70 @@ int main(int argc, char *argv[])
     }
 
     std::string filename = mkfilenamerank(output_prefix, "ch.dat", global_rank);
-    fp_ch = fopen(filename.c_str(), "w");
+    fp_ch = fopen(filename.c_str(), restart ? "r+" : "w");
     if (fp_ch == NULL) {
       ERROR("error: failed to create chain history file\n");
       return -1;
     }
   }
 
-  for (int i = 0; i < total; i ++) {
+  //
+  // Restore the complete sampler state from the last checkpoint
+  //
+  int start_iteration = 0;
+  int checkpoint_generation = 0;
+  if (restart) {
+    off_t ch_offset;
+
+    if (checkpoint::load(MPI_COMM_WORLD,
+			 output_prefix,
+			 checkpoint_generation,
+			 start_iteration,
+			 ch_offset,
+			 khistogram,
+			 kmax,
+			 [&](checkpoint &cp) {
+			   global.load_state(cp);
+			   birth.load_state(cp);
+			   death.load_state(cp);
+			   value.load_state(cp);
+			   if (hierarchical != nullptr) {
+			     hierarchical->load_state(cp);
+			   }
+			 }) < 0) {
+      ERROR("error: failed to load checkpoint\n");
+      return -1;
+    }
+
+    checkpoint_generation = (checkpoint_generation + 1) % checkpoint::GENERATIONS;
+
+    if (fp_ch != NULL) {
+      //
+      // Discard any chain history written after the checkpoint
+      //
+      if (fflush(fp_ch) != 0 ||
+	  ftruncate(fileno(fp_ch), ch_offset) < 0 ||
+	  fseeko(fp_ch, ch_offset, SEEK_SET) < 0) {
+	ERROR("error: failed to rewind chain history\n");
+	return -1;
+      }
+
+      if (chain_history_initialise(global.ch,
+				   wavetree2d_sub_get_S_v(global.wt),
+				   global.current_likelihood,
+				   1.0,
+				   1.0) < 0) {
+	ERROR("error: failed to initialise chain history\n");
+	return -1;
+      }
+    }
+
+    if (local_rank == 0) {
+      INFO("%03d Restarted at %d: %f\n", global_rank, start_iteration, global.current_likelihood);
+    }
+  }
+
+  for (int i = start_iteration; i < total; i ++) {
 
     double u;
     if (local_rank == 0) {
@@ -489,6 +580,7 @@ int main(int argc, char *argv[])
       if (!posteriork) {
 	
 	if (chain_history_full(global.ch)) {
+	  PROFILE_SCOPE(profiler::CHAIN_HISTORY);
 	  
 	  /*
 	   * Flush chain history to file
@@ -548,6 +640,7 @@ int main(int argc, char *argv[])
 	  step.header.hierarchical = global.lambda_scale;
 	  
 	  if (chain_history_full(global.ch)) {
+	    PROFILE_SCOPE(profiler::CHAIN_HISTORY);
 	    
 	    /*
 	     * Flush chain history to file
@@ -593,6 +686,78 @@ int main(int argc, char *argv[])
       }
     }
 
+    if (profiler::enabled && verbosity > 0 && (i + 1) % verbosity == 0) {
+      std::string profile = profiler::summary(local_communicator);
+      if (local_rank == 0) {
+	INFO("%03d %s", global_rank, profile.c_str());
+      }
+    }
+
+    //
+    // Checkpoint
+    //
+    if (checkpoint_rate > 0 && (i + 1) % checkpoint_rate == 0 && (i + 1) < total) {
+      PROFILE_SCOPE(profiler::CHECKPOINT);
+
+      off_t ch_offset = 0;
+
+      if (fp_ch != NULL) {
+	PROFILE_SCOPE(profiler::CHAIN_HISTORY);
+	//
+	// Flush and reinitialize chain history so that the file ends at a
+	// segment boundary consistent with the checkpoint.
+	//
+	if (chain_history_write(global.ch,
+				(ch_write_t)fwrite,
+				fp_ch) < 0) {
+	  ERROR("error: failed to write chain history segment to file\n");
+	  return -1;
+	}
+
+	if (fflush(fp_ch) != 0) {
+	  ERROR("error: failed to flush chain history\n");
+	  return -1;
+	}
+	ch_offset = ftello(fp_ch);
+
+	if (chain_history_initialise(global.ch,
+				     wavetree2d_sub_get_S_v(global.wt),
+				     global.current_likelihood,
+				     1.0,
+				     1.0) < 0) {
+	  ERROR("error: failed to initialise chain history\n");
+	  return -1;
+	}
+      }
+
+      //
+      // The prior proposal generator is reseeded from our own generator so
+      // that a restart continues with the same proposal sequence.
+      //
+      global.reseed_proposal((int)(global.random.uniform() * 2147483647.0));
+
+      if (checkpoint::save(MPI_COMM_WORLD,
+			   output_prefix,
+			   checkpoint_generation,
+			   i + 1,
+			   ch_offset,
+			   khistogram,
+			   kmax,
+			   [&](checkpoint &cp) {
+			     global.save_state(cp);
+			     birth.save_state(cp);
+			     death.save_state(cp);
+			     value.save_state(cp);
+			     if (hierarchical != nullptr) {
+			       hierarchical->save_state(cp);
+			     }
+			   }) < 0) {
+	ERROR("error: failed to save checkpoint\n");
+	return -1;
+      }
+
+      checkpoint_generation = (checkpoint_generation + 1) % checkpoint::GENERATIONS;
+    }
   }
 
   if (local_rank == 0) {
@@ -612,6 +777,7 @@ int main(int argc, char *argv[])
        * If there are remaining steps to save
        */
       if (chain_history_nsteps(global.ch) > 1) {
+	PROFILE_SCOPE(profiler::CHAIN_HISTORY);
 	/*
 	 * Flush chain history to file
 	 */
@@ -652,6 +818,14 @@ int main(int argc, char *argv[])
       return -1;
     }
   }
+
+  if (profiler::enabled) {
+    std::string filename = mkfilenamerank(output_prefix, "profile.txt", mpi_rank);
+    if (profiler::save(filename.c_str()) < 0) {
+      ERROR("Failed to save profile timers");
+      return -1;
+    }
+  }
   
   MPI_Finalize();
   
@@ -685,6 +859,7 @@ static void usage(const char *pname)
 	  " -k|--kmax <int>                 Max. no. of coefficients\n"
 	  "\n"
 	  " -B|--birth-probability <float>  Birth probability\n"
+	  " -N|--value-tries <int>          No. of multiple-try candidates per value step (1 = standard)\n"
 	  " -P|--posteriork                 Posterior k simulation\n"
 	  "\n"
 	  " -w|--wavelet-vertical <int>     Wavelet basis to use for vertical direction\n"
@@ -694,6 +869,9 @@ static void usage(const char *pname)
 	  "\n"
 	  " -c|--chains <int>               No. of indepedent chains\n"
 	  "\n"
+	  " -K|--checkpoint <int>           No. of iterations between checkpoints (0 = disable)\n"
+	  " -X|--restart                    Restart from the last checkpoint\n"
+	  "\n"
 	  " -h|--help                       Show usage information\n"
 	  "\n",
 	  pname);
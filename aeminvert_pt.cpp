@@ -30,6 +30,8 @@
 #include <math.h>
 
 #include <getopt.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
 #include <gmp.h>
 
@@ -52,16 +54,20 @@ extern "C" {
 #include "birth.hpp"
 #include "death.hpp"
 #include "value.hpp"
+#include "parallelsweep.hpp"
 #include "hierarchical.hpp"
 #include "hierarchicalprior.hpp"
 #include "ptexchange.hpp"
+#include "temperatureladder.hpp"
+#include "checkpoint.hpp"
 #include "resample.hpp"
+#include "profiler.hpp"
 
 #include "aemutil.hpp"
 
 #include "constants.hpp"
 
-static char short_options[] = "i:I:s:M:o:d:l:D:t:S:F:H:L:p:k:B:Pw:W:v:c:T:m:e:rU:R:h";
+static char short_options[] = "i:I:s:M:o:d:l:D:t:S:F:H:L:p:k:B:Pw:W:v:c:T:m:a:A:j:J:e:rU:R:N:Z:Q:q:K:Y:XObgh";
 static struct option long_options[] = {
   {"input", required_argument, 0, 'i'},
   {"initial", required_argument, 0, 'I'},
@@ -80,11 +86,17 @@ static struct option long_options[] = {
 
   {"hierarchical", required_argument, 0, 'H'},
   {"lambda-std", required_argument, 0, 'L'},
+  {"lambda-gibbs", no_argument, 0, 'g'},
   {"prior-std", required_argument, 0, 'p'},
 
   {"kmax", required_argument, 0, 'k'},
 
   {"birth-probability", required_argument, 0, 'B'},
+  {"value-tries", required_argument, 0, 'N'},
+  {"screen", required_argument, 0, 'Z'},
+  {"screen-adapt", required_argument, 0, 'Y'},
+  {"sweep-probability", required_argument, 0, 'Q'},
+  {"sweep-size", required_argument, 0, 'q'},
 
   {"posteriork", no_argument, 0, 'P'},
 
@@ -96,6 +108,10 @@ static struct option long_options[] = {
   {"chains", required_argument, 0, 'c'},
   {"temperatures", required_argument, 0, 'T'},
   {"max-temperature", required_argument, 0, 'm'},
+  {"adapt-temperatures", required_argument, 0, 'a'},
+  {"temperature-ladder", required_argument, 0, 'A'},
+  {"adapt-proposal", required_argument, 0, 'j'},
+  {"target-acceptance", required_argument, 0, 'J'},
 
   {"exchange-rate", required_argument, 0, 'e'},
 
@@ -103,6 +119,12 @@ static struct option long_options[] = {
   {"resample-temperature", required_argument, 0, 'U'},
   {"resample-rate", required_argument, 0, 'R'},
 
+  {"checkpoint", required_argument, 0, 'K'},
+  {"restart", no_argument, 0, 'X'},
+
+  {"broadcast-observations", no_argument, 0, 'O'},
+  {"partition-observations", no_argument, 0, 'b'},
+
   {"help", no_argument, 0, 'h'},
   
   {0, 0, 0, 0}
@@ -110,6 +132,11 @@ static struct option long_options[] = {
 
 static void usage(const char *pname);
 
+//
+// No. of exchange proposals between temperature ladder updates
+//
+static const int TEMPERATURE_ADAPT_EXCHANGES = 10;
+
 int main(int argc, char *argv[])
 {
   int c;
@@ -135,10 +162,16 @@ int main(int argc, char *argv[])
   int seed_mult;
 
   double lambda_std;
+  bool lambda_gibbs;
   double prior_std;
   int kmax;
 
   double Pb;
+  int value_tries;
+  double screen_drift;
+  int screen_adapt;
+  double Ps;
+  int sweep_size;
 
   bool posteriork;
 
@@ -151,11 +184,21 @@ int main(int argc, char *argv[])
   int temperatures;
   int exchange_rate;
   double max_temperature;
+  int adapt_temperatures;
+  int adapt_proposal;
+  double target_acceptance;
+  char *temperature_ladder;
 
   bool resample;
   double resample_temperature;
   int resample_rate;
 
+  int checkpoint_rate;
+  bool restart;
+
+  bool broadcast_observations;
+  bool partition_observations;
+
   int mpi_size;
   int mpi_rank;
 
@@ -184,10 +227,16 @@ int main(int argc, char *argv[])
   seed_mult = 101;
 
   lambda_std = 0.0;
+  lambda_gibbs = false;
   prior_std = 0.0;
   kmax = 100;
 
   Pb = 0.05;
+  value_tries = 1;
+  screen_drift = 0.0;
+  screen_adapt = 0;
+  Ps = 0.0;
+  sweep_size = 8;
 
   posteriork = false;
 
@@ -199,12 +248,22 @@ int main(int argc, char *argv[])
   chains = 1;
   temperatures = 1;
   max_temperature = 1000.0;
+  adapt_temperatures = 0;
+  adapt_proposal = 0;
+  target_acceptance = 0.44;
+  temperature_ladder = nullptr;
   exchange_rate = 10;
 
   resample = false;
   resample_temperature = 1.0;
   resample_rate = 0;
 
+  checkpoint_rate = 0;
+  restart = false;
+
+  broadcast_observations = false;
+  partition_observations = false;
+
   //
   // Command line parameters
   //
@@ -294,6 +353,10 @@ int main(int argc, char *argv[])
       }
       break;
 
+    case 'g':
+      lambda_gibbs = true;
+      break;
+
     case 'p':
       prior_std = atof(optarg);
       if (prior_std <= 0.0) {
@@ -318,6 +381,46 @@ int main(int argc, char *argv[])
       }
       break;
 
+    case 'N':
+      value_tries = atoi(optarg);
+      if (value_tries < 1) {
+	fprintf(stderr, "error: value tries must be 1 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'Z':
+      screen_drift = atof(optarg);
+      if (screen_drift <= 0.0) {
+	fprintf(stderr, "error: screening drift must be greater than 0\n");
+	return -1;
+      }
+      break;
+
+    case 'Y':
+      screen_adapt = atoi(optarg);
+      if (screen_adapt < 0) {
+	fprintf(stderr, "error: screening adaptation must be 0 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'Q':
+      Ps = atof(optarg);
+      if (Ps < 0.0 || Ps > 1.0) {
+	fprintf(stderr, "error: sweep probability must be between 0 and 1\n");
+	return -1;
+      }
+      break;
+
+    case 'q':
+      sweep_size = atoi(optarg);
+      if (sweep_size < 1) {
+	fprintf(stderr, "error: sweep size must be 1 or greater\n");
+	return -1;
+      }
+      break;
+
     case 'P':
       posteriork = true;
       break;
@@ -366,6 +469,34 @@ int main(int argc, char *argv[])
       }
       break;
 
+    case 'a':
+      adapt_temperatures = atoi(optarg);
+      if (adapt_temperatures < 0) {
+	fprintf(stderr, "error: temperature adaptation iterations must be 0 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'A':
+      temperature_ladder = optarg;
+      break;
+
+    case 'j':
+      adapt_proposal = atoi(optarg);
+      if (adapt_proposal < 0) {
+	fprintf(stderr, "error: proposal adaptation iterations must be 0 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'J':
+      target_acceptance = atof(optarg);
+      if (target_acceptance <= 0.0 || target_acceptance >= 1.0) {
+	fprintf(stderr, "error: target acceptance must be between 0 and 1\n");
+	return -1;
+      }
+      break;
+
     case 'e':
       exchange_rate = atoi(optarg);
       if (exchange_rate < 0) {
@@ -394,6 +525,26 @@ int main(int argc, char *argv[])
       }
       break;
       
+    case 'K':
+      checkpoint_rate = atoi(optarg);
+      if (checkpoint_rate < 0) {
+	fprintf(stderr, "error: checkpoint rate must be 0 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'X':
+      restart = true;
+      break;
+
+    case 'O':
+      broadcast_observations = true;
+      break;
+
+    case 'b':
+      partition_observations = true;
+      break;
+      
     case 'h':
     default:
       usage(argv[0]);
@@ -403,7 +554,7 @@ int main(int argc, char *argv[])
 
   std::string logfile = mkfilenamerank(output_prefix, "log.txt", mpi_rank);
   if (slog_set_output_file(logfile.c_str(),
-			   SLOG_FLAGS_CLEAR) < 0) {
+			   restart ? 0 : SLOG_FLAGS_CLEAR) < 0) {
     fprintf(stderr, "error: failed to redirect log file\n");
     return -1;
   }
@@ -418,6 +569,11 @@ int main(int argc, char *argv[])
     return -1;
   }
 
+  if ((2.0 * Pb + Ps) > 1.0) {
+    ERROR("error: birth, death and sweep probabilities exceed 1\n");
+    return -1;
+  }
+
   if (prior_file == nullptr) {
     ERROR("error: required prior file parameter missing\n");
     return -1;
@@ -467,12 +623,18 @@ int main(int argc, char *argv[])
   int chain_id = mpi_rank/processesperchain;
   int chain_rank = mpi_rank % processesperchain;
   int temp_id = chain_id/chains;
-  double temperature;
-  if (temperatures == 1) {
-    temperature = 1.0;
-  } else {
-    temperature = pow(10.0, log10(max_temperature) * (double)temp_id/(double)(temperatures - 1));
+
+  //
+  // Geometric ladder by default, optionally loaded from a previous adaptive run
+  //
+  TemperatureLadder ladder(temperatures, max_temperature);
+  if (temperature_ladder != nullptr) {
+    if (!ladder.load(temperature_ladder)) {
+      ERROR("error: failed to load temperature ladder\n");
+      return -1;
+    }
   }
+  double temperature = ladder.temperature(temp_id);
 
   const char *initial_model_ptr = nullptr;
   std::string initial_model_rank;
@@ -481,6 +643,8 @@ int main(int argc, char *argv[])
     initial_model_ptr = initial_model_rank.c_str();
   }
 
+  double startup_time = MPI_Wtime();
+  
   Global *global = new Global(input_obs,
 			      stm_files,
 			      initial_model_ptr,
@@ -493,14 +657,49 @@ int main(int argc, char *argv[])
 			      kmax,
 			      posteriork,
 			      wavelet_h,
-			      wavelet_v);
+			      wavelet_v,
+			      broadcast_observations ? MPI_COMM_WORLD : MPI_COMM_NULL);
+
+  //
+  // Report startup time and resident memory
+  //
+  {
+    struct rusage usage;
+    double local_stats[2];
+    double max_stats[2];
+    double total_rss;
+
+    getrusage(RUSAGE_SELF, &usage);
+    
+    local_stats[0] = MPI_Wtime() - startup_time;
+    local_stats[1] = (double)usage.ru_maxrss/1024.0;
+
+    MPI_Reduce(local_stats, max_stats, 2, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&local_stats[1], &total_rss, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    INFO("Startup: %.3f s, max resident %.1f MB", local_stats[0], local_stats[1]);
+    if (mpi_rank == 0) {
+      INFO("Startup (all processes): %.3f s max, resident %.1f MB max %.1f MB total",
+	   max_stats[0],
+	   max_stats[1],
+	   total_rss);
+    }
+  }
+
+  if (screen_drift > 0.0 && !posteriork) {
+    global->initialize_screening(screen_drift);
+  }
 
   Birth *birth = new Birth(*global);
   Death *death = new Death(*global);
-  Value *value = new Value(*global);
+  Value *value = new Value(*global, value_tries);
+  ParallelSweep *sweep = nullptr;
+  if (Ps > 0.0) {
+    sweep = new ParallelSweep(*global, sweep_size);
+  }
   Hierarchical *hierarchical = nullptr;
   if (lambda_std > 0.0) {
-    hierarchical = new Hierarchical(*global, lambda_std);
+    hierarchical = new Hierarchical(*global, lambda_std, lambda_gibbs);
   }
   HierarchicalPrior *hierarchical_prior = nullptr;
   if (prior_std > 0.0) {
@@ -518,10 +717,13 @@ int main(int argc, char *argv[])
   MPI_Comm_split(MPI_COMM_WORLD, chain_id, mpi_rank, &chain_communicator);
   MPI_Comm_set_errhandler(chain_communicator, MPI_ERRORS_RETURN);
 
-  global->initialize_mpi(chain_communicator, temperature);
+  global->initialize_mpi(chain_communicator, temperature, partition_observations);
   birth->initialize_mpi(chain_communicator);
   death->initialize_mpi(chain_communicator);
   value->initialize_mpi(chain_communicator);
+  if (sweep) {
+    sweep->initialize_mpi(chain_communicator);
+  }
   if (hierarchical) {
     hierarchical->initialize_mpi(chain_communicator);
   }
@@ -567,7 +769,7 @@ int main(int argc, char *argv[])
 			      temperature_communicator,
 			      chain_communicator);
     
-    if (initial_model != nullptr) {
+    if (initial_model != nullptr && !restart) {
       int resampled = resampler->step(resample_temperature);
 
       if (resampled < 0) {
@@ -605,18 +807,90 @@ int main(int argc, char *argv[])
     }
 
     std::string filename = mkfilenamerank(output_prefix, "ch.dat", chain_id);
-    fp_ch = fopen(filename.c_str(), "w");
+    fp_ch = fopen(filename.c_str(), restart ? "r+" : "w");
     if (fp_ch == NULL) {
       ERROR("error: failed to create chain history file\n");
       return -1;
     }
   }
 
+  if (adapt_proposal > 0) {
+    value->start_adaptation(target_acceptance);
+  }
+  
+  //
+  // Restore the complete sampler state from the last checkpoint
+  //
+  int start_iteration = 0;
+  int checkpoint_generation = 0;
+  if (restart) {
+    off_t ch_offset;
+    
+    if (checkpoint::load(MPI_COMM_WORLD,
+			 output_prefix,
+			 checkpoint_generation,
+			 start_iteration,
+			 ch_offset,
+			 khistogram,
+			 kmax,
+			 [&](checkpoint &cp) {
+			   global->load_state(cp);
+			   birth->load_state(cp);
+			   death->load_state(cp);
+			   value->load_state(cp);
+			   if (sweep != nullptr) {
+			     sweep->load_state(cp);
+			   }
+			   if (hierarchical != nullptr) {
+			     hierarchical->load_state(cp);
+			   }
+			   if (hierarchical_prior != nullptr) {
+			     hierarchical_prior->load_state(cp);
+			   }
+			   ptexchange->load_state(cp);
+			   ladder.load_state(cp);
+			   if (resampler != nullptr) {
+			     resampler->load_state(cp);
+			   }
+			 }) < 0) {
+      ERROR("error: failed to load checkpoint\n");
+      return -1;
+    }
+
+    temperature = global->temperature;
+    checkpoint_generation = (checkpoint_generation + 1) % checkpoint::GENERATIONS;
+    
+    if (fp_ch != NULL) {
+      //
+      // Discard any chain history written after the checkpoint
+      //
+      if (fflush(fp_ch) != 0 ||
+	  ftruncate(fileno(fp_ch), ch_offset) < 0 ||
+	  fseeko(fp_ch, ch_offset, SEEK_SET) < 0) {
+	ERROR("error: failed to rewind chain history\n");
+	return -1;
+      }
+
+      if (chain_history_initialise(global->ch,
+				   wavetree2d_sub_get_S_v(global->wt),
+				   global->current_likelihood,
+				   global->temperature,
+				   global->lambda_scale) < 0) {
+	ERROR("error: failed to initialise chain history\n");
+	return -1;
+      }
+    }
+
+    if (chain_rank == 0) {
+      INFO("%03d Restarted at %d: %f (%f)\n", chain_id, start_iteration, global->current_likelihood, global->current_log_normalization);
+    }
+  }
+
   if (chain_rank == 0) {
     INFO("Starting Iterations");
   }
   
-  for (int i = 0; i < total; i ++) {
+  for (int i = start_iteration; i < total; i ++) {
 
     //
     // Make sure we're all here
@@ -624,6 +898,10 @@ int main(int argc, char *argv[])
     if (MPI_Barrier(MPI_COMM_WORLD) != MPI_SUCCESS) {
       throw AEMEXCEPTION("Failed to barrier\n");
     }
+
+    if (i >= screen_adapt) {
+      global->freeze_screening();
+    }
   
     double u;
     if (chain_rank == 0) {
@@ -631,7 +909,8 @@ int main(int argc, char *argv[])
     }
 
     MPI_Bcast(&u, 1, MPI_DOUBLE, 0, chain_communicator);
-    
+
+    bool swept = false;
     if (u < Pb) {
 
       //
@@ -652,6 +931,17 @@ int main(int argc, char *argv[])
 	return -1;
       }
 
+    } else if (u < (2.0 * Pb + Ps)) {
+
+      //
+      // Parallel sweep
+      //
+      if (sweep->step() < 0) {
+	ERROR("error: failed to do sweep step\n");
+	return -1;
+      }
+      swept = true;
+      
     } else {
 
       //
@@ -671,39 +961,51 @@ int main(int argc, char *argv[])
       khistogram[current_k - 1] ++;
 
       if (!posteriork) {
+
+	//
+	// A sweep records each of its accepted value changes, or a
+	// single no change step when nothing was accepted
+	//
+	int nsteps = swept ? sweep->get_step_count() : 1;
 	
-	if (chain_history_full(global->ch)) {
+	for (int s = 0; s < nsteps; s ++) {
 	  
-	  /*
-	   * Flush chain history to file
-	   */
-	  if (chain_history_write(global->ch,
-				  (ch_write_t)fwrite,
-				  fp_ch) < 0) {
-	    ERROR("error: failed to write chain history segment to file\n");
-	    return -1;
+	  if (chain_history_full(global->ch)) {
+	    PROFILE_SCOPE(profiler::CHAIN_HISTORY);
+	    
+	    /*
+	     * Flush chain history to file
+	     */
+	    if (chain_history_write(global->ch,
+				    (ch_write_t)fwrite,
+				    fp_ch) < 0) {
+	      ERROR("error: failed to write chain history segment to file\n");
+	      return -1;
+	    }
+	    
+	    if (chain_history_reset(global->ch) < 0) {
+	      ERROR("error: failed to reset chain history\n");
+	      return -1;
+	    }
+	    
 	  }
 	  
-	  if (chain_history_reset(global->ch) < 0) {
-	    ERROR("error: failed to reset chain history\n");
+	  chain_history_change_t step;
+
+	  if (swept) {
+	    sweep->get_step(s, &step);
+	  } else if (wavetree2d_sub_get_last_perturbation(global->wt, &step) < 0) {
+	    ERROR("error: failed to get last step\n");
 	    return -1;
 	  }
 	  
-	}
-
-	chain_history_change_t step;
-      
-	if (wavetree2d_sub_get_last_perturbation(global->wt, &step) < 0) {
-	  ERROR("error: failed to get last step\n");
-	  return -1;
-	}
-	
-	step.header.likelihood = global->current_likelihood;
-	step.header.temperature = 1.0;
-	step.header.hierarchical = global->lambda_scale;
-	if (chain_history_add_step(global->ch, &step) < 0) {
-	  ERROR("error: failed to add step to chain history\n");
-	  return -1;
+	  step.header.likelihood = global->current_likelihood;
+	  step.header.temperature = 1.0;
+	  step.header.hierarchical = global->lambda_scale;
+	  if (chain_history_add_step(global->ch, &step) < 0) {
+	    ERROR("error: failed to add step to chain history\n");
+	    return -1;
+	  }
 	}
       }
     }
@@ -727,6 +1029,7 @@ int main(int argc, char *argv[])
 	step.header.hierarchical = global->lambda_scale;
 	
 	if (chain_history_full(global->ch)) {
+	  PROFILE_SCOPE(profiler::CHAIN_HISTORY);
 	  
 	  /*
 	   * Flush chain history to file
@@ -773,6 +1076,7 @@ int main(int argc, char *argv[])
         step.header.hierarchical = global->lambda_scale;
         
         if (chain_history_full(global->ch)) {
+	  PROFILE_SCOPE(profiler::CHAIN_HISTORY);
           
 	  /*
            * Flush chain history to file
@@ -813,7 +1117,16 @@ int main(int argc, char *argv[])
 	global->invalidate_residuals();
       }
       
+      if (adapt_temperatures > 0 &&
+	  i < adapt_temperatures &&
+	  ((i + 1) % (exchange_rate * TEMPERATURE_ADAPT_EXCHANGES) == 0)) {
+	
+	ptexchange->adapt_temperatures(ladder);
+	temperature = global->temperature;
+      }
+
       if (!posteriork && chain_rank == 0 && exchanged == 1) {
+	PROFILE_SCOPE(profiler::CHAIN_HISTORY);
 	//
 	// Flush and reinitialize chain history to deal with completely new model.
 	//
@@ -837,6 +1150,40 @@ int main(int argc, char *argv[])
       
     }
 
+    //
+    // End of temperature adaptation, the ladder is now fixed
+    //
+    if (adapt_temperatures > 0 && (i + 1) == adapt_temperatures) {
+      if (mpi_rank == 0) {
+	std::string filename = mkfilename(output_prefix, "temperatures.txt");
+	if (!ladder.save(filename.c_str())) {
+	  ERROR("error: failed to save temperature ladder\n");
+	  return -1;
+	}
+
+	for (int j = 0; j < ladder.size() - 1; j ++) {
+	  INFO("Temperature %2d: %10.3f %7.3f", j, ladder.temperature(j), 100.0 * ladder.pair_acceptance(j));
+	}
+      }
+    }
+
+    //
+    // End of proposal adaptation, the value proposal widths are now fixed
+    //
+    if (adapt_proposal > 0 && (i + 1) == adapt_proposal) {
+      value->stop_adaptation();
+      
+      if (chain_rank == 0) {
+	INFO("%03d %s", chain_id, value->write_proposal_scales().c_str());
+	
+	std::string filename = mkfilenamerank(output_prefix, "proposal_scales.txt", chain_id);
+	if (!value->save_proposal_scales(filename.c_str())) {
+	  ERROR("error: failed to save proposal scales\n");
+	  return -1;
+	}
+      }
+    }
+
     if (resample && resample_rate > 0 && ((i + 1) % resample_rate == 0)) {
       int resampled = resampler->step(resample_temperature);
       if (resampled < 0) {
@@ -848,6 +1195,7 @@ int main(int argc, char *argv[])
       }
       
       if (!posteriork && chain_rank == 0 && resampled == 1) {
+	PROFILE_SCOPE(profiler::CHAIN_HISTORY);
 	//
 	// Flush and reinitialize chain history to deal with completely new model.
 	//
@@ -884,6 +1232,12 @@ int main(int argc, char *argv[])
       INFO(birth->write_long_stats().c_str());
       INFO(death->write_long_stats().c_str());
       INFO(value->write_long_stats().c_str());
+      if (adapt_proposal > 0) {
+	INFO(value->write_proposal_scales().c_str());
+      }
+      if (sweep != nullptr) {
+	INFO(sweep->write_long_stats().c_str());
+      }
 
       if (hierarchical != nullptr) {
 	INFO(hierarchical->write_long_stats().c_str());
@@ -899,6 +1253,97 @@ int main(int argc, char *argv[])
 	INFO(resampler->write_long_stats().c_str());
       }      
     }
+
+    if (profiler::enabled && verbosity > 0 && (i + 1) % verbosity == 0) {
+      //
+      // Collective over the chain so every chain process takes part
+      //
+      std::string profile = profiler::summary(chain_communicator);
+      if (chain_rank == 0) {
+	INFO("%03d %s", chain_id, profile.c_str());
+      }
+    }
+
+    //
+    // Checkpoint
+    //
+    if (checkpoint_rate > 0 && (i + 1) % checkpoint_rate == 0 && (i + 1) < total) {
+      PROFILE_SCOPE(profiler::CHECKPOINT);
+
+      off_t ch_offset = 0;
+      
+      if (fp_ch != NULL) {
+	PROFILE_SCOPE(profiler::CHAIN_HISTORY);
+	//
+	// Flush and reinitialize chain history so that the file ends at a
+	// segment boundary consistent with the checkpoint.
+	//
+	if (chain_history_write(global->ch,
+				(ch_write_t)fwrite,
+				fp_ch) < 0) {
+	  ERROR("error: failed to write chain history segment to file\n");
+	  return -1;
+	}
+	
+	if (fflush(fp_ch) != 0) {
+	  ERROR("error: failed to flush chain history\n");
+	  return -1;
+	}
+	ch_offset = ftello(fp_ch);
+	
+	if (chain_history_initialise(global->ch,
+				     wavetree2d_sub_get_S_v(global->wt),
+				     global->current_likelihood,
+				     global->temperature,
+				     global->lambda_scale) < 0) {
+	  ERROR("error: failed to initialise chain history\n");
+	  return -1;
+	}
+      }
+
+      //
+      // The prior proposal generator is reseeded from our own generator so
+      // that a restart continues with the same proposal sequence.
+      //
+      global->reseed_proposal((int)(global->random.uniform() * 2147483647.0));
+
+      if (checkpoint::save(MPI_COMM_WORLD,
+			   output_prefix,
+			   checkpoint_generation,
+			   i + 1,
+			   ch_offset,
+			   khistogram,
+			   kmax,
+			   [&](checkpoint &cp) {
+			     global->save_state(cp);
+			     birth->save_state(cp);
+			     death->save_state(cp);
+			     value->save_state(cp);
+			     if (sweep != nullptr) {
+			       sweep->save_state(cp);
+			     }
+			     if (hierarchical != nullptr) {
+			       hierarchical->save_state(cp);
+			     }
+			     if (hierarchical_prior != nullptr) {
+			       hierarchical_prior->save_state(cp);
+			     }
+			     ptexchange->save_state(cp);
+			     ladder.save_state(cp);
+			     if (resampler != nullptr) {
+			       resampler->save_state(cp);
+			     }
+			   }) < 0) {
+	ERROR("error: failed to save checkpoint\n");
+	return -1;
+      }
+
+      checkpoint_generation = (checkpoint_generation + 1) % checkpoint::GENERATIONS;
+    }
+  }
+
+  if (!posteriork) {
+    global->gather_residuals();
   }
 
   if (chain_rank == 0) {
@@ -918,6 +1363,7 @@ int main(int argc, char *argv[])
        * If there are remaining steps to save
        */
       if (chain_history_nsteps(global->ch) > 1) {
+	PROFILE_SCOPE(profiler::CHAIN_HISTORY);
 	/*
 	 * Flush chain history to file
 	 */
@@ -943,6 +1389,10 @@ int main(int argc, char *argv[])
     fprintf(fp, "\n");
     fprintf(fp, value->write_long_stats().c_str());
     fprintf(fp, "\n");
+    if (sweep != nullptr) {
+      fprintf(fp, sweep->write_long_stats().c_str());
+      fprintf(fp, "\n");
+    }
     if (hierarchical != nullptr) {
       fprintf(fp, hierarchical->write_long_stats().c_str());
       fprintf(fp, "\n");
@@ -996,6 +1446,14 @@ int main(int argc, char *argv[])
     }
   }
   
+  if (profiler::enabled) {
+    std::string filename = mkfilenamerank(output_prefix, "profile.txt", mpi_rank);
+    if (profiler::save(filename.c_str()) < 0) {
+      ERROR("Failed to save profile timers");
+      return -1;
+    }
+  }
+  
   MPI_Finalize();
   
   return 0;
@@ -1023,11 +1481,19 @@ static void usage(const char *pname)
 	  "\n"
 	  " -H|--hierarchical <filename>    Hierarchical model filename (one for each stm file)\n"
 	  " -L|--lambda-std <float>         Std deviation for lambda scaling sampling\n"
+	  " -g|--lambda-gibbs               Gibbs sample lambda scaling where possible\n"
 	  " -p|--prior-std <float>          Std deviation for prior width sampling\n"
 	  "\n"
 	  " -k|--kmax <int>                 Max. no. of coefficients\n"
 	  "\n"
 	  " -B|--birth-probability <float>  Birth probability\n"
+	  " -N|--value-tries <int>          No. of multiple-try candidates per value step (1 = standard)\n"
+	  " -Z|--screen <float>             Screen birth/value proposals with linearised forward models (one\n"
+	  "                                 process per chain only), re-linearising on this log conductivity drift\n"
+	  " -Y|--screen-adapt <int>         Iterations before the linearisations are frozen, screening is only\n"
+	  "                                 exact after this (default 0)\n"
+	  " -Q|--sweep-probability <float>  Probability of a parallel sweep of disjoint coefficients\n"
+	  " -q|--sweep-size <int>           Max. no. of coefficients per parallel sweep\n"
 	  " -P|--posteriork                 Posterior k simulation\n"
 	  "\n"
 	  " -w|--wavelet-vertical <int>     Wavelet basis to use for vertical direction\n"
@@ -1036,8 +1502,19 @@ static void usage(const char *pname)
 	  " -c|--chains <int>               No. of chains per temperature\n"
 	  " -T|--temperatures <int>         No. of temperature levels\n"
 	  " -m|--max-temperature <float>    Max. Temperature\n"
+	  " -a|--adapt-temperatures <int>   No. of initial iterations to adapt the temperature ladder\n"
+	  " -A|--temperature-ladder <file>  Load a fixed temperature ladder (eg from a previous adaptive run)\n"
 	  " -e|--exchange-rate <int>        No. of steps between exchange proposals\n"
 	  "\n"
+	  " -j|--adapt-proposal <int>       No. of initial iterations to adapt value proposal widths per depth\n"
+	  " -J|--target-acceptance <float>  Target value acceptance rate for adaptation (default 0.44)\n"
+	  "\n"
+	  " -K|--checkpoint <int>           No. of iterations between checkpoints (0 = disable)\n"
+	  " -X|--restart                    Restart from the last checkpoint\n"
+	  "\n"
+	  " -O|--broadcast-observations     Parse the observation file once and broadcast it\n"
+	  " -b|--partition-observations     Only store the observations/residuals of each process's columns\n"
+	  "\n"
 	  " -v|--verbosity <int>            Number steps between status printouts (0 = disable\n"
 	  " -h|--help                       Show usage information\n"
 	  "\n",
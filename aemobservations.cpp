@@ -26,3 +26,4 @@
 
 #include "aemobservations.hpp"
 
+const char aemobservations::BINARY_MAGIC[8] = {'A', 'E', 'M', 'O', 'B', 'S', 'B', '1'};
@@ -30,6 +30,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
 
 #include <vector>
 
@@ -225,13 +227,31 @@ public:
   {
   }
 
+  //
+  // Loads either the text format or, if the file starts with BINARY_MAGIC,
+  // the binary format written by save_binary.
+  //
   aemobservations(const char *filename)
   {
-    FILE *fp = fopen(filename, "r");
+    FILE *fp = fopen(filename, "rb");
     if (fp == NULL) {
       throw AEMEXCEPTION("Failed to open %s for reading\n", filename);
     }
 
+    char magic[sizeof(BINARY_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+	memcmp(magic, BINARY_MAGIC, sizeof(magic)) == 0) {
+
+      bool ok = read_binary(fp);
+      fclose(fp);
+      
+      if (!ok) {
+	throw AEMEXCEPTION("Failed to read binary observations from %s\n", filename);
+      }
+      return;
+    }
+    rewind(fp);
+
     while (true) {
       aempoint p;
 
@@ -239,12 +259,15 @@ public:
 	if (feof(fp)) {
 	  break;
 	} else {
+	  fclose(fp);
 	  throw AEMEXCEPTION("Failed to read line from file\n");
 	}
       }
 
       points.push_back(p);
     }
+
+    fclose(fp);
   }
 
   bool save(const char *filename) const
@@ -264,6 +287,147 @@ public:
     return true;
   }
 
+  //
+  // Binary format: BINARY_MAGIC, the number of doubles as a 64 bit integer
+  // then the packed form below.
+  //
+  bool save_binary(const char *filename) const
+  {
+    std::vector<double> buffer;
+    pack(buffer);
+
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) {
+      return false;
+    }
+
+    long long n = (long long)buffer.size();
+    if (fwrite(BINARY_MAGIC, 1, sizeof(BINARY_MAGIC), fp) != sizeof(BINARY_MAGIC) ||
+	fwrite(&n, sizeof(long long), 1, fp) != 1 ||
+	fwrite(buffer.data(), sizeof(double), buffer.size(), fp) != buffer.size()) {
+      fclose(fp);
+      return false;
+    }
+
+    fclose(fp);
+    return true;
+  }
+
+  bool read_binary(FILE *fp)
+  {
+    long long n;
+    if (fread(&n, sizeof(long long), 1, fp) != 1 || n < 1) {
+      return false;
+    }
+
+    //
+    // Check the count against the file before allocating for it
+    //
+    off_t here = ftello(fp);
+    if (here < 0 || fseeko(fp, 0, SEEK_END) != 0) {
+      return false;
+    }
+    off_t end = ftello(fp);
+    if (fseeko(fp, here, SEEK_SET) != 0 ||
+	(unsigned long long)(end - here)/sizeof(double) < (unsigned long long)n) {
+      return false;
+    }
+
+    std::vector<double> buffer(n);
+    if (fread(buffer.data(), sizeof(double), n, fp) != (size_t)n) {
+      return false;
+    }
+
+    return unpack(buffer.data(), buffer.size());
+  }
+
+  static const char BINARY_MAGIC[8];
+  
+  //
+  // Flat binary form of the observations for copying between processes:
+  // npoints then for each point the 10 geometry parameters, nresponses and
+  // for each response the direction, the count and the values.
+  //
+  void pack(std::vector<double> &buffer) const
+  {
+    buffer.clear();
+    buffer.push_back((double)points.size());
+
+    for (auto &p : points) {
+      buffer.push_back(p.tx_height);
+      buffer.push_back(p.tx_roll);
+      buffer.push_back(p.tx_pitch);
+      buffer.push_back(p.tx_yaw);
+      buffer.push_back(p.txrx_dx);
+      buffer.push_back(p.txrx_dy);
+      buffer.push_back(p.txrx_dz);
+      buffer.push_back(p.rx_roll);
+      buffer.push_back(p.rx_pitch);
+      buffer.push_back(p.rx_yaw);
+
+      buffer.push_back((double)p.responses.size());
+      for (auto &r : p.responses) {
+	buffer.push_back((double)r.d);
+	buffer.push_back((double)r.response.size());
+	buffer.insert(buffer.end(), r.response.begin(), r.response.end());
+      }
+    }
+  }
+
+  bool unpack(const double *buffer, size_t n)
+  {
+    size_t o = 0;
+
+    points.clear();
+    if (n < 1) {
+      return false;
+    }
+    
+    int npoints = (int)buffer[o ++];
+    for (int i = 0; i < npoints; i ++) {
+
+      if (o + 11 > n) {
+	return false;
+      }
+      
+      aempoint p(buffer[o],
+		 buffer[o + 1],
+		 buffer[o + 2],
+		 buffer[o + 3],
+		 buffer[o + 4],
+		 buffer[o + 5],
+		 buffer[o + 6],
+		 buffer[o + 7],
+		 buffer[o + 8],
+		 buffer[o + 9]);
+      o += 10;
+
+      int nresponses = (int)buffer[o ++];
+      for (int j = 0; j < nresponses; j ++) {
+
+	if (o + 2 > n) {
+	  return false;
+	}
+	
+	aemresponse r((aemresponse::direction_t)(int)buffer[o]);
+	size_t nr = (size_t)buffer[o + 1];
+	o += 2;
+
+	if (o + nr > n) {
+	  return false;
+	}
+	r.response.assign(buffer + o, buffer + o + nr);
+	o += nr;
+
+	p.responses.push_back(r);
+      }
+
+      points.push_back(p);
+    }
+
+    return o == n;
+  }
+
   int total_response_datapoints()
   {
     int c = 0;
@@ -278,6 +442,19 @@ public:
 
     return c;
   }
+
+  //
+  // Release the response data of all points outside [first, first + count),
+  // the points themselves are kept so that indexing is unchanged.
+  //
+  void retain(int first, int count)
+  {
+    for (int i = 0; i < (int)points.size(); i ++) {
+      if (i < first || i >= (first + count)) {
+	std::vector<aemresponse>().swap(points[i].responses);
+      }
+    }
+  }
   
   std::vector<aempoint> points;
 };
@@ -27,10 +27,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
+#include <dirent.h>
 #include <getopt.h>
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
 #include "global.hpp"
+#include "workerpool.hpp"
 
 extern "C" {
 #include "cdf97_lift.h"
@@ -43,13 +50,17 @@ extern "C" {
 #include "wavetree2d_sub.h"
 }
 
-static char short_options[] = "i:c:t:T:d:l:w:W:Lnh";
+static char short_options[] = "i:D:c:t:T:s:o:d:l:w:W:j:Lnh";
 static struct option long_options[] = {
   {"input", required_argument, 0, 'i'},
+  {"directory", required_argument, 0, 'D'},
   {"coefficients", required_argument, 0, 'c'},
 
   {"threshold", required_argument, 0, 't'},
   {"threshold-file", required_argument, 0, 'T'},
+
+  {"sweep", required_argument, 0, 's'},
+  {"sweep-output", required_argument, 0, 'o'},
   
   {"degree-depth", required_argument, 0, 'd'},
   {"degree-lateral", required_argument, 0, 'l'},
@@ -57,6 +68,8 @@ static struct option long_options[] = {
   {"wavelet-vertical", required_argument, 0, 'w'},
   {"wavelet-horizontal", required_argument, 0, 'W'},
 
+  {"threads", required_argument, 0, 'j'},
+
   {"log", no_argument, 0, 'L'},
   {"norm", no_argument, 0, 'n'},
 
@@ -64,6 +77,62 @@ static struct option long_options[] = {
   {0, 0, 0, 0}
 };
 
+//
+// Per coefficient index translation computed once from the wavetree, with
+// the indices ordered deepest first so that a single pass can propagate
+// values from children to parents.
+//
+struct coefficient_table {
+  std::vector<int> depth;
+  std::vector<int> offset;
+  std::vector<int> parent;
+  std::vector<int> order;
+};
+
+struct depth_statistics {
+  int n;
+  double mean;
+  double min;
+  double max;
+};
+
+struct image_analysis {
+  std::vector<depth_statistics> stats;
+  double l1norm;
+  std::vector<int> sweep_k;
+  std::vector<double> sweep_rms;
+};
+
+struct wavelet_functions {
+  generic_lift_forward1d_step_t hforward;
+  generic_lift_forward1d_step_t vforward;
+  generic_lift_inverse1d_step_t hinverse;
+  generic_lift_inverse1d_step_t vinverse;
+};
+
+static int build_coefficient_table(wavetree2d_sub_t *wt, int width, coefficient_table &table);
+
+static int analyse_image(const char *filename,
+			 int width,
+			 int height,
+			 bool logimage,
+			 const coefficient_table &table,
+			 int degree_max,
+			 const wavelet_functions &wavelets,
+			 const std::vector<double> &thresholds,
+			 double *model,
+			 double *workspace,
+			 image_analysis &result);
+
+static void print_analysis(const image_analysis &result, bool norm);
+
+static int save_sweep(const char *filename,
+		      const std::vector<double> &thresholds,
+		      const std::vector<image_analysis> &results);
+
+static bool parse_thresholds(const char *s, std::vector<double> &thresholds);
+static int list_directory(const char *directory, std::vector<std::string> &files);
+
 static void update_m3(double v, int *n, double *mean, double *min, double *max);
 
 static void usage(const char *pname);
@@ -76,11 +145,14 @@ int main(int argc, char *argv[])
   int c;
   int option_index;
 
-  char *input_model;
+  std::vector<std::string> input_models;
   char *coeff_file;
 
   double threshold;
   char *threshold_file;
+
+  std::vector<double> thresholds;
+  char *sweep_file;
   
   int degree_depth;
   int degree_lateral;
@@ -93,38 +165,26 @@ int main(int argc, char *argv[])
   double *model;
   double *workspace;
 
-  int i;
-  int j;
-  int k;
-  int l;
-
   int degree_max;
-  int ncoeff;
-  
-  double minc;
-  double maxc;
-  double meanc;
-  int meann;
 
   int waveletv;
   int waveleth;
 
-  generic_lift_forward1d_step_t hwaveletf;
-  generic_lift_forward1d_step_t vwaveletf;
-
-  generic_lift_inverse1d_step_t hwaveleti;
-  generic_lift_inverse1d_step_t vwaveleti;
+  wavelet_functions wavelets;
 
   wavetree2d_sub_t *wt;
 
+  int threads;
+  
   bool logimage;
   bool norm;
 
-  input_model = nullptr;
   coeff_file = nullptr;
 
   threshold = 0.1;
   threshold_file = nullptr;
+
+  sweep_file = nullptr;
   
   degree_depth = 5;
   degree_lateral = 7;
@@ -132,6 +192,8 @@ int main(int argc, char *argv[])
   waveletv = 0;
   waveleth = 0;
 
+  threads = 0;
+  
   logimage = false;
   norm = false;
 
@@ -144,9 +206,16 @@ int main(int argc, char *argv[])
     switch(c) {
 
     case 'i':
-      input_model = optarg;
+      input_models.push_back(optarg);
       break;  
 
+    case 'D':
+      if (list_directory(optarg, input_models) < 0) {
+	fprintf(stderr, "error: failed to list directory %s\n", optarg);
+	return -1;
+      }
+      break;
+
     case 'c':
       coeff_file = optarg;
       break;
@@ -163,6 +232,17 @@ int main(int argc, char *argv[])
       threshold_file = optarg;
       break;
 
+    case 's':
+      if (!parse_thresholds(optarg, thresholds)) {
+	fprintf(stderr, "error: failed to parse thresholds, expected t1,t2,... or min:max:n\n");
+	return -1;
+      }
+      break;
+
+    case 'o':
+      sweep_file = optarg;
+      break;
+
     case 'd':
       degree_depth = atoi(optarg);
       if (degree_depth < 1) {
@@ -195,6 +275,14 @@ int main(int argc, char *argv[])
       }
       break;
 
+    case 'j':
+      threads = atoi(optarg);
+      if (threads < 0) {
+	fprintf(stderr, "error: threads must be 0 or greater\n");
+	return -1;
+      }
+      break;
+
     case 'L':
       logimage = true;
       break;
@@ -211,11 +299,16 @@ int main(int argc, char *argv[])
     }
   }
 
-  if (input_model == NULL) {
+  if (input_models.size() == 0) {
     fprintf(stderr, "error: require the input of a model file\n");
     return -1;
   }
 
+  if (input_models.size() > 1 && (coeff_file != nullptr || threshold_file != nullptr)) {
+    fprintf(stderr, "error: coefficient and threshold file output require a single input model\n");
+    return -1;
+  }
+
   width = 1 << degree_lateral;
   height = 1 << degree_depth;
 
@@ -223,44 +316,16 @@ int main(int argc, char *argv[])
   printf(" %d x %d image\n", width, height);
   
   size = width * height;
-  model = new double[size];
-
-  if (load_image(input_model, width, height, model) < 0) {
-    fprintf(stderr, "error: failed to load model\n");
-    return -1;
-  }
-
-  if (logimage) {
-    for (int i = 0; i < size; i ++) {
-      model[i] = log(model[i]);
-    }
-  }
 
   workspace_size = width;
   if (height > workspace_size) {
     workspace_size = height;
   }
     
-  workspace = new double[workspace_size];
-
-  /*
-   * Forward transform
-   */
-  vwaveletf = Global::wavelet_forward_function_from_id(waveletv);
-  hwaveletf = Global::wavelet_forward_function_from_id(waveleth);
-  vwaveleti = Global::wavelet_inverse_function_from_id(waveletv);
-  hwaveleti = Global::wavelet_inverse_function_from_id(waveleth);
-  if (generic_lift_forward2d(model, 
-			     width,
-			     height,
-			     width,
-			     workspace,
-			     hwaveletf,
-			     vwaveletf,
-			     1) < 0) {
-    fprintf(stderr, "error: failed to do forward transform\n");
-    return -1;
-  }
+  wavelets.vforward = Global::wavelet_forward_function_from_id(waveletv);
+  wavelets.hforward = Global::wavelet_forward_function_from_id(waveleth);
+  wavelets.vinverse = Global::wavelet_inverse_function_from_id(waveletv);
+  wavelets.hinverse = Global::wavelet_inverse_function_from_id(waveleth);
 
   wt = wavetree2d_sub_create(degree_lateral, degree_depth, 0.0);
   if (wt == NULL) {
@@ -270,55 +335,73 @@ int main(int argc, char *argv[])
 
   printf(" %d x %d wavetree\n", wavetree2d_sub_get_width(wt), wavetree2d_sub_get_height(wt));
   
-  ncoeff = wavetree2d_sub_get_ncoeff(wt);
   degree_max = wavetree2d_sub_maxdepth(wt);
-  
-  
-  /*
-   * Compute Coefficient statistics
-   */
-  minc = 1e9;
-  maxc = -1e9;
-  meanc = 0.0;
-  meann = 0;
 
+  coefficient_table table;
+  if (build_coefficient_table(wt, width, table) < 0) {
+    fprintf(stderr, "error: failed to build coefficient table\n");
+    return -1;
+  }
 
-  for (l = 1; l < ncoeff; l ++) {
-    if (wavetree2d_sub_depthofindex(wt, l) == 1) {
-      if (wavetree2d_sub_2dindices(wt, l, &i, &j) < 0) {
-	fprintf(stderr, "error: failed to get 2d indices\n");
-	return -1;
-      }
+  //
+  // Each image is independent so a stack of images is processed by a pool
+  // of workers, each with its own image and workspace.
+  //
+  int nimages = (int)input_models.size();
+  std::vector<image_analysis> results(nimages);
+  
+  if (threads == 0) {
+    threads = workerpool::hardware_workers();
+  }
+  if (threads > nimages) {
+    threads = nimages;
+  }
+  workerpool pool(threads);
 
-      update_m3(model[j * width + i], &meann, &meanc, &minc, &maxc);
-    }
+  std::vector<double*> models(pool.size());
+  std::vector<double*> workspaces(pool.size());
+  for (int w = 0; w < pool.size(); w ++) {
+    models[w] = new double[size];
+    workspaces[w] = new double[workspace_size];
   }
-  printf("%2d %10.6f %10.6f %10.6f (%d)\n", 0, meanc, meanc, meanc, meann);
-  
-  for (k = 1; k <= degree_max; k ++) {
 
-    minc = 1e9;
-    maxc = -1e9;
-    meanc = 0.0;
-    meann = 0;
+  if (pool.run(nimages, [&](int worker, int item) -> int {
+	return analyse_image(input_models[item].c_str(),
+			     width,
+			     height,
+			     logimage,
+			     table,
+			     degree_max,
+			     wavelets,
+			     thresholds,
+			     models[worker],
+			     workspaces[worker],
+			     results[item]);
+      }) < 0) {
+    return -1;
+  }
 
-    /* printf("%2d: %5d ... %5d\n", k + 1, degree_start, degree_end); */
-    for (l = 1; l < ncoeff; l ++) {
+  for (int i = 0; i < nimages; i ++) {
+    if (nimages > 1) {
+      printf("%s\n", input_models[i].c_str());
+    }
+    print_analysis(results[i], norm);
+  }
 
-      if (wavetree2d_sub_depthofindex(wt, l) == k) {
-	c ++;
-	if (wavetree2d_sub_2dindices(wt, l, &i, &j) < 0) {
-	  fprintf(stderr, "error: failed to get 2d indices\n");
-	  return -1;
-	}
-	
-	update_m3(model[j * width + i], &meann, &meanc, &minc, &maxc);
-      }
+  if (thresholds.size() > 0) {
+    if (save_sweep(sweep_file, thresholds, results) < 0) {
+      fprintf(stderr, "error: failed to save threshold sweep\n");
+      return -1;
     }
-    
-    printf("%2d %10.6f %10.6f %10.6f (%d)\n", k, minc, meanc, maxc, meann);
   }
 
+  //
+  // With a single input the coefficients of the last (only) image are
+  // still in the first worker's buffer
+  //
+  model = models[0];
+  workspace = workspaces[0];
+
   if (coeff_file != NULL) {
     if (save_image(coeff_file, width, height, model) < 0) {
       fprintf(stderr, "error: failed to save coefficients\n");
@@ -326,14 +409,6 @@ int main(int argc, char *argv[])
     }
   }
 
-  if (norm) {
-    double l1norm = 0.0;
-    for (int i = 0; i < size; i ++) {
-      l1norm += fabs(model[i]);
-    }
-    printf("l1 %10.6f\n", l1norm);
-  }
-	 
   if (threshold_file != nullptr) {
     //
     // Create model
@@ -367,8 +442,8 @@ int main(int argc, char *argv[])
 			       height,
 			       width,
 			       workspace,
-			       hwaveleti,
-			       vwaveleti,
+			       wavelets.hinverse,
+			       wavelets.vinverse,
 			       1) < 0) {
       fprintf(stderr, "error: failed to do inverse transform\n");
       return -1;
@@ -389,8 +464,325 @@ int main(int argc, char *argv[])
     
   }
 
+  for (int w = 0; w < pool.size(); w ++) {
+    delete [] models[w];
+    delete [] workspaces[w];
+  }
+
+  return 0;
+
+}
+
+static int build_coefficient_table(wavetree2d_sub_t *wt, int width, coefficient_table &table)
+{
+  int ncoeff = wavetree2d_sub_get_ncoeff(wt);
+
+  table.depth.resize(ncoeff);
+  table.offset.resize(ncoeff);
+  table.parent.resize(ncoeff);
+  table.order.resize(ncoeff);
+
+  for (int l = 0; l < ncoeff; l ++) {
+    int i;
+    int j;
+    
+    if (wavetree2d_sub_2dindices(wt, l, &i, &j) < 0) {
+      fprintf(stderr, "error: failed to get 2d indices\n");
+      return -1;
+    }
+
+    table.depth[l] = wavetree2d_sub_depthofindex(wt, l);
+    table.offset[l] = j * width + i;
+    table.parent[l] = (l == 0) ? -1 : wavetree2d_sub_parent_index(wt, l);
+    table.order[l] = l;
+  }
+
+  std::stable_sort(table.order.begin(), table.order.end(), [&](int a, int b) {
+      return table.depth[a] > table.depth[b];
+    });
+
+  return 0;
+}
+
+static int analyse_image(const char *filename,
+			 int width,
+			 int height,
+			 bool logimage,
+			 const coefficient_table &table,
+			 int degree_max,
+			 const wavelet_functions &wavelets,
+			 const std::vector<double> &thresholds,
+			 double *model,
+			 double *workspace,
+			 image_analysis &result)
+{
+  int size = width * height;
+  int ncoeff = (int)table.depth.size();
+  
+  if (load_image(filename, width, height, model) < 0) {
+    fprintf(stderr, "error: failed to load model %s\n", filename);
+    return -1;
+  }
+
+  if (logimage) {
+    for (int i = 0; i < size; i ++) {
+      model[i] = log(model[i]);
+    }
+  }
+
+  std::vector<double> image;
+  if (thresholds.size() > 0) {
+    image.assign(model, model + size);
+  }
+
+  /*
+   * Forward transform
+   */
+  if (generic_lift_forward2d(model, 
+			     width,
+			     height,
+			     width,
+			     workspace,
+			     wavelets.hforward,
+			     wavelets.vforward,
+			     1) < 0) {
+    fprintf(stderr, "error: failed to do forward transform\n");
+    return -1;
+  }
+
+  /*
+   * Compute Coefficient statistics for all depths in one pass
+   */
+  result.stats.resize(degree_max + 1);
+  for (auto &s : result.stats) {
+    s.n = 0;
+    s.mean = 0.0;
+    s.min = 1e9;
+    s.max = -1e9;
+  }
+
+  for (int l = 1; l < ncoeff; l ++) {
+    depth_statistics &s = result.stats[table.depth[l]];
+    update_m3(model[table.offset[l]], &s.n, &s.mean, &s.min, &s.max);
+  }
+
+  result.l1norm = 0.0;
+  for (int i = 0; i < size; i ++) {
+    result.l1norm += fabs(model[i]);
+  }
+
+  if (thresholds.size() > 0) {
+
+    //
+    // A thresholded tree model keeps every coefficient above the threshold
+    // and all of its ancestors, ie a coefficient is kept if the largest
+    // magnitude in its subtree is above the threshold. This is computed
+    // once so that every threshold is a simple comparison.
+    //
+    std::vector<double> subtree_max(ncoeff);
+    for (int l = 0; l < ncoeff; l ++) {
+      subtree_max[l] = fabs(model[table.offset[l]]);
+    }
+    for (auto l : table.order) {
+      int p = table.parent[l];
+      if (p >= 0 && subtree_max[l] > subtree_max[p]) {
+	subtree_max[p] = subtree_max[l];
+      }
+    }
+
+    std::vector<double> reconstruction(size);
+    
+    result.sweep_k.resize(thresholds.size());
+    result.sweep_rms.resize(thresholds.size());
+    
+    for (int t = 0; t < (int)thresholds.size(); t ++) {
+
+      std::fill(reconstruction.begin(), reconstruction.end(), 0.0);
+
+      //
+      // The root is always present
+      //
+      int k = 1;
+      reconstruction[table.offset[0]] = model[table.offset[0]];
+      for (int l = 1; l < ncoeff; l ++) {
+	if (subtree_max[l] > thresholds[t]) {
+	  reconstruction[table.offset[l]] = model[table.offset[l]];
+	  k ++;
+	}
+      }
+
+      if (generic_lift_inverse2d(reconstruction.data(),
+				 width,
+				 height,
+				 width,
+				 workspace,
+				 wavelets.hinverse,
+				 wavelets.vinverse,
+				 1) < 0) {
+	fprintf(stderr, "error: failed to do inverse transform\n");
+	return -1;
+      }
+
+      double sum = 0.0;
+      for (int i = 0; i < size; i ++) {
+	double d = reconstruction[i] - image[i];
+	sum += d * d;
+      }
+
+      result.sweep_k[t] = k;
+      result.sweep_rms[t] = sqrt(sum/(double)size);
+    }
+  }
+  
+  return 0;
+}
+
+static void print_analysis(const image_analysis &result, bool norm)
+{
+  //
+  // Row 0 reports the mean of the first level of detail coefficients
+  //
+  const depth_statistics &first = result.stats[1];
+  printf("%2d %10.6f %10.6f %10.6f (%d)\n", 0, first.mean, first.mean, first.mean, first.n);
+  
+  for (int k = 1; k < (int)result.stats.size(); k ++) {
+    const depth_statistics &s = result.stats[k];
+    printf("%2d %10.6f %10.6f %10.6f (%d)\n", k, s.min, s.mean, s.max, s.n);
+  }
+
+  if (norm) {
+    printf("l1 %10.6f\n", result.l1norm);
+  }
+}
+
+static int save_sweep(const char *filename,
+		      const std::vector<double> &thresholds,
+		      const std::vector<image_analysis> &results)
+{
+  FILE *fp = stdout;
+  if (filename != nullptr) {
+    fp = fopen(filename, "w");
+    if (fp == NULL) {
+      fprintf(stderr, "save_sweep: failed to create %s\n", filename);
+      return -1;
+    }
+  }
+
+  fprintf(fp, "# threshold mean_k min_k max_k mean_rms max_rms\n");
+  for (int t = 0; t < (int)thresholds.size(); t ++) {
+
+    double mean_k = 0.0;
+    int min_k = -1;
+    int max_k = -1;
+    double mean_rms = 0.0;
+    double max_rms = 0.0;
+
+    for (auto &r : results) {
+      int k = r.sweep_k[t];
+      
+      mean_k += (double)k;
+      if (min_k < 0 || k < min_k) {
+	min_k = k;
+      }
+      if (k > max_k) {
+	max_k = k;
+      }
+
+      mean_rms += r.sweep_rms[t];
+      if (r.sweep_rms[t] > max_rms) {
+	max_rms = r.sweep_rms[t];
+      }
+    }
+
+    mean_k /= (double)results.size();
+    mean_rms /= (double)results.size();
+    
+    fprintf(fp, "%.9g %.3f %d %d %.9g %.9g\n",
+	    thresholds[t],
+	    mean_k,
+	    min_k,
+	    max_k,
+	    mean_rms,
+	    max_rms);
+  }
+
+  if (fp != stdout) {
+    fclose(fp);
+  }
+
   return 0;
+}
+
+static bool parse_thresholds(const char *s, std::vector<double> &thresholds)
+{
+  double tmin;
+  double tmax;
+  int n;
+  
+  thresholds.clear();
+
+  if (sscanf(s, "%lf:%lf:%d", &tmin, &tmax, &n) == 3) {
+    //
+    // Log spaced range
+    //
+    if (tmin <= 0.0 || tmax < tmin || n < 1) {
+      return false;
+    }
+
+    for (int i = 0; i < n; i ++) {
+      if (n == 1) {
+	thresholds.push_back(tmin);
+      } else {
+	thresholds.push_back(tmin * pow(tmax/tmin, (double)i/(double)(n - 1)));
+      }
+    }
+
+    return true;
+  }
 
+  while (*s != '\0') {
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || v <= 0.0) {
+      return false;
+    }
+
+    thresholds.push_back(v);
+
+    s = end;
+    if (*s == ',') {
+      s ++;
+    } else if (*s != '\0') {
+      return false;
+    }
+  }
+
+  return thresholds.size() > 0;
+}
+
+static int list_directory(const char *directory, std::vector<std::string> &files)
+{
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    return -1;
+  }
+
+  std::vector<std::string> names;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+
+    names.push_back(std::string(directory) + "/" + entry->d_name);
+  }
+
+  closedir(dir);
+
+  std::sort(names.begin(), names.end());
+  files.insert(files.end(), names.begin(), names.end());
+  
+  return 0;
 }
 
 static void update_m3(double v, int *n, double *mean, double *min, double *max)
@@ -415,18 +807,24 @@ static void usage(const char *pname)
 	  "usage: %s [options]\n"
 	  "where options is one or more of:\n"
 	  "\n"
-	  " -i | --input <filename>           Model raw image filename (required)\n"
+	  " -i | --input <filename>           Model raw image filename (required, may be repeated)\n"
+	  " -D | --directory <path>           Add all model raw images in a directory\n"
 	  " -c | --coefficients <filename>    Output raw coefficents (opt.)\n"
 	  "\n"
 	  " -t | --threshold <float>          Threshold value for thresholded model output\n"
 	  " -T | --threshold-file <filename>  Threshold model output file (image written to filename.image)\n"
 	  "\n"
+	  " -s | --sweep <t1,t2,...|min:max:n> Thresholds to sweep (min:max:n is log spaced)\n"
+	  " -o | --sweep-output <filename>    Sweep table output (default stdout)\n"
+	  "\n"
 	  " -d | --degree-depth <int>         No. depth layers as power of 2\n"
 	  " -l | --degree-lateral <int>       No. horizontal points as power of 2\n"
 	  "\n"
 	  " -w | --wavelet-vertical <int>     Wavelet to use vertically\n"
 	  " -W | --wavelet-horizontal <int>   Wavelet to use horizontally\n"
 	  "\n"
+	  " -j | --threads <int>              No. worker threads (default 0 = all cores)\n"
+	  "\n"
 	  " -L | --log                        Take log of image\n"
 	  " -n | --norm                       Print l1 norm of wavelet coefficients\n"
 	  "\n"
@@ -0,0 +1,963 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "aemutil.hpp"
+
+#include "tdemsystem.h"
+#include "general_types.h"
+
+//
+// Micro benchmark of the forward model. Each system description is timed
+// over a grid of layer counts, conductivity contrasts and transmitter
+// heights, both for a complete forward model and for its individual stages
+// so that changes to ga-aem can be measured against a saved baseline.
+//
+// With --validate the same grid is instead used to check that the
+// precomputed linear operator reproduces the spline, FFT and windowing path,
+// and with --jacobian that the analytic Jacobian with respect to the log
+// conductivity of each layer matches central finite differences.
+//
+
+static char short_options[] = "d:s:l:c:H:T:b:n:o:JB:t:V:G:h";
+static struct option long_options[] = {
+  {"stm-directory", required_argument, 0, 'd'},
+  {"stm", required_argument, 0, 's'},
+
+  {"layers", required_argument, 0, 'l'},
+  {"contrasts", required_argument, 0, 'c'},
+  {"heights", required_argument, 0, 'H'},
+  {"thickness", required_argument, 0, 'T'},
+  {"background-conductivity", required_argument, 0, 'b'},
+  
+  {"repeats", required_argument, 0, 'n'},
+
+  {"output", required_argument, 0, 'o'},
+  {"json", no_argument, 0, 'J'},
+
+  {"baseline", required_argument, 0, 'B'},
+  {"tolerance", required_argument, 0, 't'},
+
+  {"validate", required_argument, 0, 'V'},
+  {"jacobian", required_argument, 0, 'G'},
+  
+  {"help", no_argument, 0, 'h'},
+  {0, 0, 0, 0}
+};
+
+static const char *default_stm[] = {
+  "Skytem-HM.stm",
+  "Skytem-LM.stm",
+  "SkytemHM-BHMAR.stm",
+  "SkytemLM-BHMAR.stm",
+  "Tempest-standard.stm",
+  nullptr
+};
+
+struct bench_result {
+  std::string system;
+  int layers;
+  double contrast;
+  double height;
+  std::string stage;
+  int calls;
+  double mean;
+  double min;
+};
+
+static bool parse_list(const char *s, std::vector<double> &values);
+
+static void time_stage(int repeats,
+		       std::function<void()> stage,
+		       double &mean,
+		       double &min);
+
+static int bench_system(const char *filename,
+			const std::vector<double> &layers,
+			const std::vector<double> &contrasts,
+			const std::vector<double> &heights,
+			double thickness,
+			double background_conductivity,
+			int repeats,
+			std::vector<bench_result> &results);
+
+static int validate_system(const char *filename,
+			   const std::vector<double> &layers,
+			   const std::vector<double> &contrasts,
+			   const std::vector<double> &heights,
+			   double thickness,
+			   double background_conductivity,
+			   double tolerance);
+
+static int jacobian_system(const char *filename,
+			   const std::vector<double> &layers,
+			   const std::vector<double> &contrasts,
+			   const std::vector<double> &heights,
+			   double thickness,
+			   double background_conductivity,
+			   double tolerance);
+
+static std::string result_key(const std::string &system,
+			      int layers,
+			      double contrast,
+			      double height,
+			      const std::string &stage);
+
+static void save_csv(FILE *fp, const std::vector<bench_result> &results);
+static void save_json(FILE *fp, const std::vector<bench_result> &results);
+
+static int load_baseline(const char *filename, std::map<std::string, double> &baseline);
+
+static void usage(const char *pname);
+
+int main(int argc, char *argv[])
+{
+  int c;
+  int option_index;
+
+  //
+  // Options
+  //
+  const char *stm_directory;
+  std::vector<std::string> stm_files;
+
+  std::vector<double> layers;
+  std::vector<double> contrasts;
+  std::vector<double> heights;
+  double thickness;
+  double background_conductivity;
+
+  int repeats;
+
+  char *output_file;
+  bool json;
+
+  char *baseline_file;
+  double tolerance;
+
+  double validate_tolerance;
+  double jacobian_tolerance;
+
+  //
+  // Defaults
+  //
+  stm_directory = "stm";
+
+  parse_list("4,16,32,64", layers);
+  parse_list("1,10,100", contrasts);
+  parse_list("30,60,120", heights);
+  thickness = 10.0;
+  background_conductivity = 0.01;
+
+  repeats = 20;
+
+  output_file = nullptr;
+  json = false;
+
+  baseline_file = nullptr;
+  tolerance = 10.0;
+
+  validate_tolerance = -1.0;
+  jacobian_tolerance = -1.0;
+
+  //
+  // Cmd line arguments
+  //
+  option_index = -1;
+  while (true) {
+
+    c = getopt_long(argc, argv, short_options, long_options, &option_index);
+    if (c == -1) {
+      break;
+    }
+
+    switch (c) {
+
+    case 'd':
+      stm_directory = optarg;
+      break;
+
+    case 's':
+      stm_files.push_back(optarg);
+      break;
+
+    case 'l':
+      if (!parse_list(optarg, layers)) {
+	fprintf(stderr, "error: failed to parse layer list\n");
+	return -1;
+      }
+      break;
+
+    case 'c':
+      if (!parse_list(optarg, contrasts)) {
+	fprintf(stderr, "error: failed to parse contrast list\n");
+	return -1;
+      }
+      break;
+
+    case 'H':
+      if (!parse_list(optarg, heights)) {
+	fprintf(stderr, "error: failed to parse height list\n");
+	return -1;
+      }
+      break;
+
+    case 'T':
+      thickness = atof(optarg);
+      if (thickness <= 0.0) {
+	fprintf(stderr, "error: layer thickness must be greater than 0\n");
+	return -1;
+      }
+      break;
+
+    case 'b':
+      background_conductivity = atof(optarg);
+      if (background_conductivity <= 0.0) {
+	fprintf(stderr, "error: background conductivity must be greater than 0\n");
+	return -1;
+      }
+      break;
+
+    case 'n':
+      repeats = atoi(optarg);
+      if (repeats < 1) {
+	fprintf(stderr, "error: repeats must be 1 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'o':
+      output_file = optarg;
+      break;
+
+    case 'J':
+      json = true;
+      break;
+
+    case 'B':
+      baseline_file = optarg;
+      break;
+
+    case 't':
+      tolerance = atof(optarg);
+      if (tolerance < 0.0) {
+	fprintf(stderr, "error: tolerance must be 0 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'V':
+      validate_tolerance = atof(optarg);
+      if (validate_tolerance <= 0.0) {
+	fprintf(stderr, "error: validation tolerance must be greater than 0\n");
+	return -1;
+      }
+      break;
+
+    case 'G':
+      jacobian_tolerance = atof(optarg);
+      if (jacobian_tolerance <= 0.0) {
+	fprintf(stderr, "error: jacobian tolerance must be greater than 0\n");
+	return -1;
+      }
+      break;
+
+    case 'h':
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  for (auto &l : layers) {
+    if (l < 1.0) {
+      fprintf(stderr, "error: layer counts must be 1 or greater\n");
+      return -1;
+    }
+  }
+
+  if (stm_files.size() == 0) {
+    for (int i = 0; default_stm[i] != nullptr; i ++) {
+      stm_files.push_back(std::string(stm_directory) + "/" + default_stm[i]);
+    }
+  }
+
+  if (validate_tolerance > 0.0) {
+    int failures = 0;
+    for (auto &s : stm_files) {
+      int r = validate_system(s.c_str(),
+			      layers,
+			      contrasts,
+			      heights,
+			      thickness,
+			      background_conductivity,
+			      validate_tolerance);
+      if (r < 0) {
+	fprintf(stderr, "error: failed to validate %s\n", s.c_str());
+	return -1;
+      }
+      failures += r;
+    }
+
+    return failures > 0 ? 1 : 0;
+  }
+
+  if (jacobian_tolerance > 0.0) {
+    int failures = 0;
+    for (auto &s : stm_files) {
+      int r = jacobian_system(s.c_str(),
+			      layers,
+			      contrasts,
+			      heights,
+			      thickness,
+			      background_conductivity,
+			      jacobian_tolerance);
+      if (r < 0) {
+	fprintf(stderr, "error: failed to check jacobian of %s\n", s.c_str());
+	return -1;
+      }
+      failures += r;
+    }
+
+    return failures > 0 ? 1 : 0;
+  }
+
+  std::vector<bench_result> results;
+  for (auto &s : stm_files) {
+    if (bench_system(s.c_str(),
+		     layers,
+		     contrasts,
+		     heights,
+		     thickness,
+		     background_conductivity,
+		     repeats,
+		     results) < 0) {
+      fprintf(stderr, "error: failed to benchmark %s\n", s.c_str());
+      return -1;
+    }
+  }
+
+  FILE *fp = stdout;
+  if (output_file != nullptr) {
+    fp = fopen(output_file, "w");
+    if (fp == NULL) {
+      fprintf(stderr, "error: failed to create output file %s\n", output_file);
+      return -1;
+    }
+  }
+
+  if (json) {
+    save_json(fp, results);
+  } else {
+    save_csv(fp, results);
+  }
+
+  if (fp != stdout) {
+    fclose(fp);
+  }
+
+  if (baseline_file != nullptr) {
+    //
+    // Compare the minimum time per call as it is the least sensitive to
+    // other load on the machine.
+    //
+    std::map<std::string, double> baseline;
+    if (load_baseline(baseline_file, baseline) < 0) {
+      fprintf(stderr, "error: failed to load baseline %s\n", baseline_file);
+      return -1;
+    }
+
+    int compared = 0;
+    int regressions = 0;
+    for (auto &r : results) {
+      auto b = baseline.find(result_key(r.system, r.layers, r.contrast, r.height, r.stage));
+      if (b == baseline.end() || b->second <= 0.0) {
+	continue;
+      }
+
+      double change = 100.0 * (r.min - b->second)/b->second;
+      compared ++;
+      if (change > tolerance) {
+	fprintf(stderr, "regression: %s %d %g %g %s %.3fus -> %.3fus (%+.1f%%)\n",
+		r.system.c_str(),
+		r.layers,
+		r.contrast,
+		r.height,
+		r.stage.c_str(),
+		1.0e6 * b->second,
+		1.0e6 * r.min,
+		change);
+	regressions ++;
+      }
+    }
+
+    fprintf(stderr, "%d of %d results slower than baseline by more than %.1f%%\n",
+	    regressions,
+	    compared,
+	    tolerance);
+
+    if (regressions > 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static bool parse_list(const char *s, std::vector<double> &values)
+{
+  values.clear();
+
+  while (*s != '\0') {
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s) {
+      return false;
+    }
+
+    values.push_back(v);
+
+    s = end;
+    if (*s == ',') {
+      s ++;
+    } else if (*s != '\0') {
+      return false;
+    }
+  }
+
+  return values.size() > 0;
+}
+
+static void time_stage(int repeats,
+		       std::function<void()> stage,
+		       double &mean,
+		       double &min)
+{
+  double total = 0.0;
+
+  min = 0.0;
+  for (int i = 0; i < repeats; i ++) {
+    auto start = std::chrono::steady_clock::now();
+    stage();
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+
+    total += d.count();
+    if (i == 0 || d.count() < min) {
+      min = d.count();
+    }
+  }
+
+  mean = total/(double)repeats;
+}
+
+static int bench_system(const char *filename,
+			const std::vector<double> &layers,
+			const std::vector<double> &contrasts,
+			const std::vector<double> &heights,
+			double thickness,
+			double background_conductivity,
+			int repeats,
+			std::vector<bench_result> &results)
+{
+  FILE *fp = fopen(filename, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to open system description %s\n", filename);
+    return -1;
+  }
+  fclose(fp);
+
+  cTDEmSystem system(filename);
+
+  std::string name = filename;
+  size_t slash = name.find_last_of('/');
+  if (slash != std::string::npos) {
+    name = name.substr(slash + 1);
+  }
+
+  std::vector<double> window(system.description().NumberOfWindows);
+
+  for (auto l : layers) {
+
+    int nlayers = (int)l;
+    
+    for (auto contrast : contrasts) {
+
+      //
+      // Alternating layers of the background conductivity and the contrasted
+      // conductivity over a half space.
+      //
+      cEarth1D earth;
+      earth.conductivity.resize(nlayers);
+      earth.thickness.resize(nlayers - 1);
+      for (int i = 0; i < nlayers; i ++) {
+	earth.conductivity[i] = background_conductivity * ((i % 2) ? contrast : 1.0);
+      }
+      for (int i = 0; i < nlayers - 1; i ++) {
+	earth.thickness[i] = thickness;
+      }
+      
+      for (auto height : heights) {
+
+	cTDEmGeometry geometry(height, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0);
+	cTDEmResponse response;
+
+	//
+	// Warm up and leave the system in a consistent state for the stages
+	//
+	system.forwardmodel(geometry, earth, response);
+
+	struct {
+	  const char *stage;
+	  std::function<void()> f;
+	} stages[] = {
+	  {"forwardmodel", [&]() {
+	      system.forwardmodel(geometry, earth, response);
+	    }},
+	  {"setupcomputations", [&]() {
+	      system.setupcomputations();
+	    }},
+	  {"primaryfields", [&]() {
+	      system.setprimaryfields();
+	    }},
+	  {"integrals", [&]() {
+	      for (size_t fi = 0; fi < system.description().NumberOfDiscreteFrequencies; fi ++) {
+		system.Earth.dointegrals(fi);
+	      }
+	    }},
+	  {"secondaryfields", [&]() {
+	      for (size_t fi = 0; fi < system.description().NumberOfDiscreteFrequencies; fi ++) {
+		system.Earth.setsecondaryfields(fi);
+	      }
+	    }},
+	  {"spline", [&]() {
+	      system.spline_interp();
+	    }},
+	  {"fft", [&]() {
+	      const std::vector<cdouble> &transfer = system.description().Transfer;
+	      std::copy(transfer.begin(), transfer.begin() + system.FFTWork.size(), system.FFTWork.begin());
+	      system.inversefft();
+	    }},
+	  {"window", [&]() {
+	      system.computewindow((double*)system.FFTWork.data(), window);
+	    }},
+	  {"operator", [&]() {
+	      system.applylinearoperators();
+	    }}
+	};
+
+	for (auto &s : stages) {
+	  bench_result r;
+
+	  r.system = name;
+	  r.layers = nlayers;
+	  r.contrast = contrast;
+	  r.height = height;
+	  r.stage = s.stage;
+	  r.calls = repeats;
+
+	  time_stage(repeats, s.f, r.mean, r.min);
+
+	  results.push_back(r);
+	}
+      }
+    }
+  }
+
+  return 0;
+}
+
+static void max_difference(const std::vector<double> &expected,
+			   const std::vector<double> &actual,
+			   double &scale,
+			   double &difference)
+{
+  for (size_t i = 0; i < expected.size(); i ++) {
+    scale = std::max(scale, fabs(expected[i]));
+    difference = std::max(difference, fabs(expected[i] - actual[i]));
+  }
+}
+
+static int validate_system(const char *filename,
+			   const std::vector<double> &layers,
+			   const std::vector<double> &contrasts,
+			   const std::vector<double> &heights,
+			   double thickness,
+			   double background_conductivity,
+			   double tolerance)
+{
+  FILE *fp = fopen(filename, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to open system description %s\n", filename);
+    return -1;
+  }
+  fclose(fp);
+
+  //
+  // Two workspaces on the one description, the reference using the spline,
+  // FFT and windowing path and the other the linear operator
+  //
+  cTDEmSystem reference(filename);
+  cTDEmSystem system(reference.shared_description());
+  reference.UseLinearOperator = false;
+  system.UseLinearOperator = true;
+
+  int failures = 0;
+  int compared = 0;
+  double worst = 0.0;
+  
+  for (auto l : layers) {
+
+    int nlayers = (int)l;
+    
+    for (auto contrast : contrasts) {
+
+      cEarth1D earth;
+      earth.conductivity.resize(nlayers);
+      earth.thickness.resize(nlayers - 1);
+      for (int i = 0; i < nlayers; i ++) {
+	earth.conductivity[i] = background_conductivity * ((i % 2) ? contrast : 1.0);
+      }
+      for (int i = 0; i < nlayers - 1; i ++) {
+	earth.thickness[i] = thickness;
+      }
+      
+      for (auto height : heights) {
+
+	cTDEmGeometry geometry(height, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0);
+	cTDEmResponse expected;
+	cTDEmResponse actual;
+
+	reference.forwardmodel(geometry, earth, expected);
+	system.forwardmodel(geometry, earth, actual);
+
+	//
+	// Relative to the largest response of any component as a component
+	// that should be zero (eg Y with no lateral offset) is only noise
+	//
+	double scale = 0.0;
+	double d = 0.0;
+	max_difference(expected.SX, actual.SX, scale, d);
+	max_difference(expected.SY, actual.SY, scale, d);
+	max_difference(expected.SZ, actual.SZ, scale, d);
+	if (scale > 0.0) {
+	  d /= scale;
+	}
+
+	compared ++;
+	worst = std::max(worst, d);
+	if (d > tolerance) {
+	  fprintf(stderr, "mismatch: %s %d %g %g relative difference %.3e\n",
+		  filename,
+		  nlayers,
+		  contrast,
+		  height,
+		  d);
+	  failures ++;
+	}
+      }
+    }
+  }
+
+  fprintf(stderr, "%s: %d of %d models differ by more than %.1e (worst %.3e)\n",
+	  filename,
+	  failures,
+	  compared,
+	  tolerance,
+	  worst);
+
+  return failures;
+}
+
+static int jacobian_system(const char *filename,
+			   const std::vector<double> &layers,
+			   const std::vector<double> &contrasts,
+			   const std::vector<double> &heights,
+			   double thickness,
+			   double background_conductivity,
+			   double tolerance)
+{
+  //
+  // Step in log conductivity for the central differences, small enough
+  // for the O(h^2) truncation error to be well below useful tolerances.
+  // The Hankel abscissae are placed from the model's approximate halfspace
+  // conductivity (LE::setintegrationnodes), so the differences also see the
+  // quadrature moving while the analytic Jacobian holds it fixed. This
+  // shows as a relative difference of a few 1e-5 at low heights that does
+  // not shrink with h, hence the suggested tolerance of 1e-4.
+  //
+  const double h = 1.0e-4;
+  
+  FILE *fp = fopen(filename, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to open system description %s\n", filename);
+    return -1;
+  }
+  fclose(fp);
+
+  //
+  // Both time domain paths as the Jacobian applies each to the derivatives
+  //
+  cTDEmSystem fft(filename);
+  cTDEmSystem linear(fft.shared_description());
+  fft.UseLinearOperator = false;
+  linear.UseLinearOperator = true;
+
+  cTDEmSystem *systems[2] = {&fft, &linear};
+  const char *names[2] = {"fft", "operator"};
+  
+  int failures = 0;
+  int compared = 0;
+  double worst = 0.0;
+  
+  for (int si = 0; si < 2; si ++) {
+
+    cTDEmSystem &system = *systems[si];
+    
+    for (auto l : layers) {
+
+      int nlayers = (int)l;
+    
+      for (auto contrast : contrasts) {
+
+	cEarth1D earth;
+	earth.conductivity.resize(nlayers);
+	earth.thickness.resize(nlayers - 1);
+	for (int i = 0; i < nlayers; i ++) {
+	  earth.conductivity[i] = background_conductivity * ((i % 2) ? contrast : 1.0);
+	}
+	for (int i = 0; i < nlayers - 1; i ++) {
+	  earth.thickness[i] = thickness;
+	}
+      
+	for (auto height : heights) {
+
+	  cTDEmGeometry geometry(height, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0);
+	  cTDEmResponse response;
+	  std::vector<double> JX, JY, JZ;
+
+	  system.forwardmodel_jacobian(geometry, earth, response, JX, JY, JZ);
+
+	  std::vector<double> DX(JX.size()), DY(JY.size()), DZ(JZ.size());
+	  int nwindows = (int)(JZ.size()/nlayers);
+	  
+	  for (int li = 0; li < nlayers; li ++) {
+
+	    double c = earth.conductivity[li];
+	    cTDEmResponse plus;
+	    cTDEmResponse minus;
+
+	    earth.conductivity[li] = c * exp(h);
+	    system.forwardmodel(geometry, earth, plus);
+	    earth.conductivity[li] = c * exp(-h);
+	    system.forwardmodel(geometry, earth, minus);
+	    earth.conductivity[li] = c;
+
+	    for (int w = 0; w < nwindows; w ++) {
+	      DX[w * nlayers + li] = (plus.SX[w] - minus.SX[w])/(2.0 * h);
+	      DY[w * nlayers + li] = (plus.SY[w] - minus.SY[w])/(2.0 * h);
+	      DZ[w * nlayers + li] = (plus.SZ[w] - minus.SZ[w])/(2.0 * h);
+	    }
+	  }
+
+	  //
+	  // Relative to the largest derivative of any component as for
+	  // --validate
+	  //
+	  double scale = 0.0;
+	  double d = 0.0;
+	  max_difference(DX, JX, scale, d);
+	  max_difference(DY, JY, scale, d);
+	  max_difference(DZ, JZ, scale, d);
+	  if (scale > 0.0) {
+	    d /= scale;
+	  }
+
+	  compared ++;
+	  worst = std::max(worst, d);
+	  if (d > tolerance) {
+	    fprintf(stderr, "mismatch: %s %s %d %g %g relative difference %.3e\n",
+		    filename,
+		    names[si],
+		    nlayers,
+		    contrast,
+		    height,
+		    d);
+	    failures ++;
+	  }
+	}
+      }
+    }
+  }
+
+  fprintf(stderr, "%s: %d of %d jacobians differ by more than %.1e (worst %.3e)\n",
+	  filename,
+	  failures,
+	  compared,
+	  tolerance,
+	  worst);
+
+  return failures;
+}
+
+static std::string result_key(const std::string &system,
+			      int layers,
+			      double contrast,
+			      double height,
+			      const std::string &stage)
+{
+  return mkformatstring("%s,%d,%g,%g,%s", system.c_str(), layers, contrast, height, stage.c_str());
+}
+
+static void save_csv(FILE *fp, const std::vector<bench_result> &results)
+{
+  fprintf(fp, "system,layers,contrast,height,stage,calls,mean_us,min_us\n");
+  for (auto &r : results) {
+    fprintf(fp, "%s,%d,%g,%g,%s,%d,%.3f,%.3f\n",
+	    r.system.c_str(),
+	    r.layers,
+	    r.contrast,
+	    r.height,
+	    r.stage.c_str(),
+	    r.calls,
+	    1.0e6 * r.mean,
+	    1.0e6 * r.min);
+  }
+}
+
+static void save_json(FILE *fp, const std::vector<bench_result> &results)
+{
+  fprintf(fp, "[\n");
+  for (size_t i = 0; i < results.size(); i ++) {
+    const bench_result &r = results[i];
+    fprintf(fp,
+	    "  {\"system\": \"%s\", \"layers\": %d, \"contrast\": %g, \"height\": %g, "
+	    "\"stage\": \"%s\", \"calls\": %d, \"mean_us\": %.3f, \"min_us\": %.3f}%s\n",
+	    r.system.c_str(),
+	    r.layers,
+	    r.contrast,
+	    r.height,
+	    r.stage.c_str(),
+	    r.calls,
+	    1.0e6 * r.mean,
+	    1.0e6 * r.min,
+	    (i + 1) < results.size() ? "," : "");
+  }
+  fprintf(fp, "]\n");
+}
+
+static int load_baseline(const char *filename, std::map<std::string, double> &baseline)
+{
+  FILE *fp = fopen(filename, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+
+  char line[1024];
+  char system[256];
+  char stage[256];
+  int layers;
+  double contrast;
+  double height;
+  int calls;
+  double mean;
+  double min;
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (strncmp(line, "system,", 7) == 0) {
+      continue;
+    }
+
+    if (sscanf(line, "%255[^,],%d,%lf,%lf,%255[^,],%d,%lf,%lf",
+	       system,
+	       &layers,
+	       &contrast,
+	       &height,
+	       stage,
+	       &calls,
+	       &mean,
+	       &min) != 8) {
+      fprintf(stderr, "error: failed to parse baseline line: %s", line);
+      fclose(fp);
+      return -1;
+    }
+
+    baseline[result_key(system, layers, contrast, height, stage)] = min/1.0e6;
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+static void usage(const char *pname)
+{
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "where options is one or more of:\n"
+          "\n"
+	  " -d|--stm-directory <path>             Directory of the default system descriptions (default stm)\n"
+	  " -s|--stm <filename>                   System description to benchmark (may be repeated,\n"
+	  "                                       default all systems in the stm directory)\n"
+	  "\n"
+	  " -l|--layers <list>                    Comma separated layer counts (default 4,16,32,64)\n"
+	  " -c|--contrasts <list>                 Comma separated conductivity contrasts (default 1,10,100)\n"
+	  " -H|--heights <list>                   Comma separated Tx heights in metres (default 30,60,120)\n"
+	  " -T|--thickness <float>                Layer thickness in metres (default 10.0)\n"
+	  " -b|--background-conductivity <float>  Background conductivity (default 0.01)\n"
+	  "\n"
+	  " -n|--repeats <int>                    Timed calls per stage (default 20)\n"
+	  "\n"
+	  " -o|--output <filename>                Output file (default stdout)\n"
+	  " -J|--json                             Write JSON instead of CSV\n"
+	  "\n"
+	  " -B|--baseline <filename>              CSV output of a previous run to compare against\n"
+	  " -t|--tolerance <float>                Percentage slow down reported as a regression (default 10)\n"
+	  "\n"
+	  " -V|--validate <float>                 Instead of timing, check the linear operator against the\n"
+	  "                                       FFT path to this relative tolerance (e.g. 1e-8)\n"
+	  " -G|--jacobian <float>                 Instead of timing, check the layer Jacobian against central\n"
+	  "                                       finite differences to this relative tolerance (e.g. 1e-4)\n"
+	  "\n"
+	  " -h|--help                             Usage information\n"
+	  "\n"
+	  "With a baseline the exit status is 1 if any stage regressed, when validating\n"
+	  "or checking the Jacobian it is 1 if any model exceeds the tolerance.\n"
+	  "\n",
+	  pname);
+}
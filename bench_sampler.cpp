@@ -0,0 +1,933 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+
+extern "C" {
+#include "slog.h"
+};
+
+#include "global.hpp"
+#include "birth.hpp"
+#include "death.hpp"
+#include "value.hpp"
+#include "checkpoint.hpp"
+#include "synthetic.hpp"
+#include "workerpool.hpp"
+#include "aemexception.hpp"
+
+//
+// End to end throughput of the sampler. A synthetic survey is built in
+// memory (image, flight path and noisy observations as the mksynthetic
+// tools would produce) and a fixed number of Birth/Death/Value steps are
+// timed across the processes of MPI_COMM_WORLD. Running under mpirun with
+// 1 .. N processes gives the scaling of a single chain.
+//
+// With -c the state after the timed steps is also checkpointed, restored
+// into a freshly constructed sampler and both samplers are run on, failing
+// unless the restored one reproduces the original exactly.
+//
+// With -g the gradient of the likelihood with respect to a sample of wavelet
+// coefficients (Global::coefficient_gradient) is checked against central
+// finite differences of the column likelihoods about the final model.
+//
+
+static char short_options[] = "s:H:M:x:y:D:m:B:C:n:k:P:w:W:S:j:o:c:g:h";
+static struct option long_options[] = {
+  {"stm", required_argument, 0, 's'},
+  {"hierarchical", required_argument, 0, 'H'},
+  {"prior-file", required_argument, 0, 'M'},
+
+  {"degree-x", required_argument, 0, 'x'},
+  {"degree-y", required_argument, 0, 'y'},
+  {"depth", required_argument, 0, 'D'},
+
+  {"model", required_argument, 0, 'm'},
+  {"background-conductivity", required_argument, 0, 'B'},
+  {"conductivity", required_argument, 0, 'C'},
+
+  {"steps", required_argument, 0, 'n'},
+  {"kmax", required_argument, 0, 'k'},
+  {"birth-probability", required_argument, 0, 'P'},
+  {"wavelet-vertical", required_argument, 0, 'w'},
+  {"wavelet-horizontal", required_argument, 0, 'W'},
+  {"seed", required_argument, 0, 'S'},
+
+  {"threads", required_argument, 0, 'j'},
+
+  {"output", required_argument, 0, 'o'},
+  {"checkpoint", required_argument, 0, 'c'},
+  {"gradient", required_argument, 0, 'g'},
+
+  {"help", no_argument, 0, 'h'},
+  {0, 0, 0, 0}
+};
+
+//
+// Count of bytes and allocations through operator new in this process
+//
+static std::atomic<long long> allocated_bytes(0);
+static std::atomic<long long> allocation_count(0);
+
+void *operator new(size_t size)
+{
+  allocated_bytes += size;
+  allocation_count ++;
+
+  void *p = malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+
+  return p;
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+static aemobservations *mksurvey(const aemimage &image,
+				 const std::vector<std::string> &stm_files,
+				 const std::vector<std::string> &hierarchical_files,
+				 int threads,
+				 int seed);
+
+static int run_steps(Global &global,
+		     Birth &birth,
+		     Death &death,
+		     Value &value,
+		     int steps,
+		     double Pb,
+		     int mpi_rank);
+
+static bool same_state(Global &a, Global &b);
+
+static bool check_gradient(Global &global, double tolerance, int seed);
+
+static void usage(const char *pname);
+
+int main(int argc, char *argv[])
+{
+  int c;
+  int option_index;
+
+  //
+  // Options
+  //
+  std::vector<std::string> stm_files;
+  std::vector<std::string> hierarchical_files;
+  char *prior_file;
+
+  int degreex;
+  int degreey;
+  double depth;
+
+  const char *model_name;
+  double background_conductivity;
+  double conductivity;
+
+  int steps;
+  int kmax;
+  double Pb;
+  int wavelet_v;
+  int wavelet_h;
+  int seed;
+
+  int threads;
+
+  char *output_file;
+  char *checkpoint_prefix;
+  double gradient_tolerance;
+
+  int mpi_size;
+  int mpi_rank;
+
+  MPI_Init(&argc, &argv);
+  MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+  MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+
+  //
+  // Defaults
+  //
+  prior_file = nullptr;
+
+  degreex = 7;
+  degreey = 5;
+  depth = 150.0;
+
+  model_name = "dettmer";
+  background_conductivity = 0.050;
+  conductivity = 0.200;
+
+  steps = 100;
+  kmax = 100;
+  Pb = 0.05;
+  wavelet_v = 0;
+  wavelet_h = 0;
+  seed = 983;
+
+  threads = 0;
+
+  output_file = nullptr;
+  checkpoint_prefix = nullptr;
+  gradient_tolerance = -1.0;
+
+  //
+  // Cmd line arguments
+  //
+  option_index = -1;
+  while (true) {
+
+    c = getopt_long(argc, argv, short_options, long_options, &option_index);
+    if (c == -1) {
+      break;
+    }
+
+    switch (c) {
+
+    case 's':
+      stm_files.push_back(optarg);
+      break;
+
+    case 'H':
+      hierarchical_files.push_back(optarg);
+      break;
+
+    case 'M':
+      prior_file = optarg;
+      break;
+
+    case 'x':
+      degreex = atoi(optarg);
+      if (degreex < 1 || degreex >= 16) {
+	fprintf(stderr, "error: degree x must be between 1 and 15\n");
+	return -1;
+      }
+      break;
+
+    case 'y':
+      degreey = atoi(optarg);
+      if (degreey < 1 || degreey >= 16) {
+	fprintf(stderr, "error: degree y must be between 1 and 15\n");
+	return -1;
+      }
+      break;
+
+    case 'D':
+      depth = atof(optarg);
+      if (depth <= 0.0) {
+	fprintf(stderr, "error: depth must be greater than 0\n");
+	return -1;
+      }
+      break;
+
+    case 'm':
+      model_name = optarg;
+      break;
+
+    case 'B':
+      background_conductivity = atof(optarg);
+      break;
+
+    case 'C':
+      conductivity = atof(optarg);
+      break;
+
+    case 'n':
+      steps = atoi(optarg);
+      if (steps < 1) {
+	fprintf(stderr, "error: steps must be 1 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'k':
+      kmax = atoi(optarg);
+      if (kmax < 1) {
+	fprintf(stderr, "error: kmax must be 1 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'P':
+      Pb = atof(optarg);
+      if (Pb < 0.0 || Pb > 0.5) {
+	fprintf(stderr, "error: birth probability must be between 0 and 0.5\n");
+	return -1;
+      }
+      break;
+
+    case 'w':
+      wavelet_v = atoi(optarg);
+      if (wavelet_v < 0 || wavelet_v > Global::WAVELET_MAX) {
+	fprintf(stderr, "error: vertical wavelet must be between 0 and %d\n", Global::WAVELET_MAX);
+	return -1;
+      }
+      break;
+
+    case 'W':
+      wavelet_h = atoi(optarg);
+      if (wavelet_h < 0 || wavelet_h > Global::WAVELET_MAX) {
+	fprintf(stderr, "error: horizontal wavelet must be between 0 and %d\n", Global::WAVELET_MAX);
+	return -1;
+      }
+      break;
+
+    case 'S':
+      seed = atoi(optarg);
+      break;
+
+    case 'j':
+      threads = atoi(optarg);
+      if (threads < 0) {
+	fprintf(stderr, "error: threads must be 0 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'o':
+      output_file = optarg;
+      break;
+
+    case 'c':
+      checkpoint_prefix = optarg;
+      break;
+
+    case 'g':
+      gradient_tolerance = atof(optarg);
+      if (gradient_tolerance <= 0.0) {
+	fprintf(stderr, "error: gradient tolerance must be greater than 0\n");
+	return -1;
+      }
+      break;
+
+    case 'h':
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if (stm_files.size() == 0) {
+    fprintf(stderr, "error: required stm file parameter missing\n");
+    return -1;
+  }
+
+  if (hierarchical_files.size() != stm_files.size()) {
+    fprintf(stderr, "error: one hierarchical noise model is required for each stm file\n");
+    return -1;
+  }
+
+  if (prior_file == nullptr) {
+    fprintf(stderr, "error: required prior file parameter missing\n");
+    return -1;
+  }
+
+  int columns = 1 << degreex;
+  int rows = 1 << degreey;
+  
+  //
+  // Each process builds the same survey from the same seed so that no
+  // communication or files are needed.
+  //
+  aemimage *image = synthetic_image(model_name,
+				    columns,
+				    rows,
+				    depth,
+				    background_conductivity,
+				    conductivity);
+  if (image == nullptr) {
+    fprintf(stderr, "error: no model name %s\n", model_name);
+    return -1;
+  }
+
+  aemobservations *observations = mksurvey(*image, stm_files, hierarchical_files, threads, seed);
+  if (observations == nullptr) {
+    fprintf(stderr, "error: failed to create synthetic survey\n");
+    return -1;
+  }
+
+  delete image;
+
+  //
+  // The restored sampler for the checkpoint check needs its own copy
+  //
+  aemobservations *restored_observations = nullptr;
+  if (checkpoint_prefix != nullptr) {
+    restored_observations = new aemobservations(*observations);
+  }
+
+  try {
+    
+    Global global(observations,
+		  stm_files,
+		  nullptr,
+		  prior_file,
+		  degreex,
+		  degreey,
+		  depth,
+		  hierarchical_files,
+		  seed,
+		  kmax,
+		  false,
+		  wavelet_h,
+		  wavelet_v);
+
+    Birth birth(global);
+    Death death(global);
+    Value value(global);
+
+    global.initialize_mpi(MPI_COMM_WORLD);
+    birth.initialize_mpi(MPI_COMM_WORLD);
+    death.initialize_mpi(MPI_COMM_WORLD);
+    value.initialize_mpi(MPI_COMM_WORLD);
+
+    global.current_likelihood = global.likelihood_mpi(global.current_log_normalization);
+    global.accept();
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    
+    global.forwardmodel_count = 0;
+    allocated_bytes = 0;
+    allocation_count = 0;
+    
+    double start = MPI_Wtime();
+    
+    if (run_steps(global, birth, death, value, steps, Pb, mpi_rank) < 0) {
+      return -1;
+    }
+
+    double elapsed = MPI_Wtime() - start;
+
+    //
+    // Totals over all processes, the time is the slowest process
+    //
+    double local[3];
+    double total[3];
+    double max_elapsed;
+    struct rusage rusage;
+
+    local[0] = (double)global.forwardmodel_count;
+    local[1] = (double)allocated_bytes;
+    local[2] = (double)allocation_count;
+    
+    MPI_Reduce(local, total, 3, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&elapsed, &max_elapsed, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    getrusage(RUSAGE_SELF, &rusage);
+    double local_rss = (double)rusage.ru_maxrss/1024.0;
+    double max_rss;
+    MPI_Reduce(&local_rss, &max_rss, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    if (mpi_rank == 0) {
+      double steps_per_second = (double)steps/max_elapsed;
+      double solves_per_step = total[0]/(double)steps;
+      double bytes_per_step = total[1]/(double)steps;
+      double allocations_per_step = total[2]/(double)steps;
+      int k = wavetree2d_sub_coeff_count(global.wt);
+      
+      printf("processes %d columns %d rows %d systems %d steps %d k %d\n",
+	     mpi_size,
+	     columns,
+	     rows,
+	     (int)stm_files.size(),
+	     steps,
+	     k);
+      printf("  %.3f s, %.3f steps/s, %.1f forward solves/step\n",
+	     max_elapsed,
+	     steps_per_second,
+	     solves_per_step);
+      printf("  %.0f bytes/step in %.1f allocations/step, max resident %.1f MB\n",
+	     bytes_per_step,
+	     allocations_per_step,
+	     max_rss);
+
+      if (output_file != nullptr) {
+	bool exists = access(output_file, F_OK) == 0;
+	
+	FILE *fp = fopen(output_file, "a");
+	if (fp == NULL) {
+	  fprintf(stderr, "error: failed to open output file %s\n", output_file);
+	  return -1;
+	}
+
+	if (!exists) {
+	  fprintf(fp, "processes,columns,rows,systems,steps,seconds,steps_per_second,solves_per_step,bytes_per_step,allocations_per_step,max_rss_mb\n");
+	}
+
+	fprintf(fp, "%d,%d,%d,%d,%d,%.6f,%.6f,%.3f,%.1f,%.3f,%.3f\n",
+		mpi_size,
+		columns,
+		rows,
+		(int)stm_files.size(),
+		steps,
+		max_elapsed,
+		steps_per_second,
+		solves_per_step,
+		bytes_per_step,
+		allocations_per_step,
+		max_rss);
+	
+	fclose(fp);
+      }
+    }
+
+    if (checkpoint_prefix != nullptr) {
+
+      //
+      // As in the inversion drivers, the proposal generator is reseeded
+      // before saving as its state cannot be written.
+      //
+      global.reseed_proposal((int)(global.random.uniform() * 2147483647.0));
+      
+      if (checkpoint::save(MPI_COMM_WORLD,
+			   checkpoint_prefix,
+			   0,
+			   steps,
+			   0,
+			   nullptr,
+			   0,
+			   [&](checkpoint &cp) {
+			     global.save_state(cp);
+			     birth.save_state(cp);
+			     death.save_state(cp);
+			     value.save_state(cp);
+			   }) < 0) {
+	fprintf(stderr, "error: failed to save checkpoint\n");
+	return -1;
+      }
+
+      Global restored(restored_observations,
+		      stm_files,
+		      nullptr,
+		      prior_file,
+		      degreex,
+		      degreey,
+		      depth,
+		      hierarchical_files,
+		      seed + 1,
+		      kmax,
+		      false,
+		      wavelet_h,
+		      wavelet_v);
+
+      Birth restored_birth(restored);
+      Death restored_death(restored);
+      Value restored_value(restored);
+
+      restored.initialize_mpi(MPI_COMM_WORLD);
+      restored_birth.initialize_mpi(MPI_COMM_WORLD);
+      restored_death.initialize_mpi(MPI_COMM_WORLD);
+      restored_value.initialize_mpi(MPI_COMM_WORLD);
+
+      int generation;
+      int iteration;
+      off_t ch_offset;
+      if (checkpoint::load(MPI_COMM_WORLD,
+			   checkpoint_prefix,
+			   generation,
+			   iteration,
+			   ch_offset,
+			   nullptr,
+			   0,
+			   [&](checkpoint &cp) {
+			     restored.load_state(cp);
+			     restored_birth.load_state(cp);
+			     restored_death.load_state(cp);
+			     restored_value.load_state(cp);
+			   }) < 0) {
+	fprintf(stderr, "error: failed to load checkpoint\n");
+	return -1;
+      }
+
+      bool restored_ok = (iteration == steps) && same_state(global, restored);
+
+      //
+      // The restored sampler must then follow the same trajectory
+      //
+      if (run_steps(global, birth, death, value, steps, Pb, mpi_rank) < 0 ||
+	  run_steps(restored, restored_birth, restored_death, restored_value, steps, Pb, mpi_rank) < 0) {
+	return -1;
+      }
+
+      restored_ok = restored_ok && same_state(global, restored);
+
+      int local_ok = restored_ok ? 1 : 0;
+      int all_ok;
+      MPI_Allreduce(&local_ok, &all_ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+
+      if (mpi_rank == 0) {
+	printf("  checkpoint round trip %s\n", all_ok ? "passed" : "FAILED");
+      }
+
+      if (!all_ok) {
+	return -1;
+      }
+    }
+
+    if (gradient_tolerance > 0.0) {
+
+      //
+      // Every process holds the full observations and model, so the check
+      // is done once
+      //
+      int ok = 1;
+      if (mpi_rank == 0) {
+	ok = check_gradient(global, gradient_tolerance, seed) ? 1 : 0;
+	printf("  coefficient gradient check %s\n", ok ? "passed" : "FAILED");
+      }
+
+      MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+      if (!ok) {
+	return -1;
+      }
+    }
+
+  } catch (aemexception &e) {
+    fprintf(stderr, "error: failed to run benchmark\n");
+    return -1;
+  }
+
+  MPI_Finalize();
+
+  return 0;
+}
+
+static int run_steps(Global &global,
+		     Birth &birth,
+		     Death &death,
+		     Value &value,
+		     int steps,
+		     double Pb,
+		     int mpi_rank)
+{
+  for (int i = 0; i < steps; i ++) {
+
+    double u;
+    if (mpi_rank == 0) {
+      u = global.random.uniform();
+    }
+
+    MPI_Bcast(&u, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+    int r;
+    if (u < Pb) {
+      r = birth.step();
+    } else if (u < (2.0 * Pb)) {
+      r = death.step();
+    } else {
+      r = value.step();
+    }
+
+    if (r < 0) {
+      fprintf(stderr, "error: failed to do step %d\n", i);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+//
+// Compares the model, likelihood and residuals of two samplers bit for bit
+//
+static bool same_state(Global &a, Global &b)
+{
+  int buffer_size = a.ncoeff * 3 * sizeof(double);
+  std::vector<char> encoded_a(buffer_size);
+  std::vector<char> encoded_b(buffer_size);
+
+  int length_a = wavetree2d_sub_encode(a.wt, encoded_a.data(), buffer_size);
+  int length_b = wavetree2d_sub_encode(b.wt, encoded_b.data(), buffer_size);
+  if (length_a < 0 || length_a != length_b ||
+      memcmp(encoded_a.data(), encoded_b.data(), length_a) != 0) {
+    fprintf(stderr, "error: restored model differs\n");
+    return false;
+  }
+
+  if (a.current_likelihood != b.current_likelihood ||
+      a.current_log_normalization != b.current_log_normalization ||
+      a.lambda_scale != b.lambda_scale) {
+    fprintf(stderr, "error: restored likelihood differs (%.17g %.17g)\n",
+	    a.current_likelihood,
+	    b.current_likelihood);
+    return false;
+  }
+
+  int n = a.get_residual_size();
+  if (n != b.get_residual_size() ||
+      memcmp(a.residual, b.residual, n * sizeof(double)) != 0 ||
+      memcmp(a.mean_residual, b.mean_residual, n * sizeof(double)) != 0 ||
+      memcmp(a.last_valid_residual, b.last_valid_residual, n * sizeof(double)) != 0) {
+    fprintf(stderr, "error: restored residuals differ\n");
+    return false;
+  }
+
+  return true;
+}
+
+//
+// Sum of the column likelihoods lo .. hi of the model coefficients with one
+// coefficient offset by delta
+//
+static double perturbed_likelihood(Global &global,
+				   const std::vector<double> &coefficients,
+				   int index,
+				   double delta,
+				   int lo,
+				   int hi)
+{
+  std::vector<double> image(coefficients);
+  std::vector<double> workspace(std::max(global.width, global.height));
+
+  image[index] += delta;
+  if (generic_lift_inverse2d(image.data(),
+			     global.width,
+			     global.height,
+			     global.width,
+			     workspace.data(),
+			     global.hwaveletf,
+			     global.vwaveletf,
+			     1) < 0) {
+    throw AEMEXCEPTION("Failed to do inverse transform on coefficients\n");
+  }
+
+  cEarth1D earth1d;
+  earth1d.conductivity.resize(global.image->rows);
+  earth1d.thickness.resize(global.image->rows - 1);
+  for (int j = 0; j < (global.image->rows - 1); j ++) {
+    earth1d.thickness[j] = global.image->layer_thickness[j];
+  }
+  
+  std::vector<double> residual(global.residuals_per_column);
+  std::vector<double> residual_normed(global.residuals_per_column);
+
+  double sum = 0.0;
+  for (int i = lo; i <= hi; i ++) {
+    double log_normalization = 0.0;
+    sum += global.column_likelihood(i,
+				    image.data(),
+				    earth1d,
+				    residual.data(),
+				    residual_normed.data(),
+				    log_normalization);
+  }
+
+  return sum;
+}
+
+//
+// Compares the analytic gradient of the likelihood for the DC coefficient
+// and a random sample of others (active or not, as the gradient is of the
+// coefficient array) against central differences. The error is relative to
+// the largest difference gradient so that coefficients with no influence
+// do not dominate.
+//
+static bool check_gradient(Global &global, double tolerance, int seed)
+{
+  const int nsamples = 32;
+  const double h = 1.0e-4;
+
+  Rng random(seed);
+  
+  std::vector<int> indices;
+  indices.push_back(0);
+  for (int i = 1; i < nsamples; i ++) {
+    indices.push_back((int)(random.uniform() * global.ncoeff) % global.ncoeff);
+  }
+
+  std::vector<double> gradient(indices.size());
+  global.coefficient_gradient((int)indices.size(), indices.data(), gradient.data());
+
+  std::vector<double> coefficients(global.size, 0.0);
+  if (wavetree2d_sub_map_to_array(global.wt, coefficients.data(), global.size) < 0) {
+    throw AEMEXCEPTION("Failed to map model to array\n");
+  }
+
+  std::vector<double> difference(indices.size());
+  double scale = 0.0;
+  for (int c = 0; c < (int)indices.size(); c ++) {
+    int lo, hi;
+    global.column_support(indices[c], lo, hi);
+
+    difference[c] = (perturbed_likelihood(global, coefficients, indices[c], h, lo, hi) -
+		     perturbed_likelihood(global, coefficients, indices[c], -h, lo, hi))/(2.0 * h);
+    scale = std::max(scale, fabs(difference[c]));
+  }
+
+  int failures = 0;
+  double worst = 0.0;
+  for (int c = 0; c < (int)indices.size(); c ++) {
+    double d = fabs(gradient[c] - difference[c]);
+    if (scale > 0.0) {
+      d /= scale;
+    }
+
+    worst = std::max(worst, d);
+    if (d > tolerance) {
+      fprintf(stderr, "mismatch: coefficient %d analytic %.9e difference %.9e relative error %.3e\n",
+	      indices[c],
+	      gradient[c],
+	      difference[c],
+	      d);
+      failures ++;
+    }
+  }
+
+  fprintf(stderr, "%d of %d coefficient gradients differ by more than %.1e (worst %.3e)\n",
+	  failures,
+	  (int)indices.size(),
+	  tolerance,
+	  worst);
+  
+  return failures == 0;
+}
+
+static aemobservations *mksurvey(const aemimage &image,
+				 const std::vector<std::string> &stm_files,
+				 const std::vector<std::string> &hierarchical_files,
+				 int threads,
+				 int seed)
+{
+  Rng random(seed);
+  aemobservations *obs = new aemobservations();
+
+  synthetic_flightpath(*obs, image.columns, syntheticpath(), random);
+
+  workerpool pool(threads);
+
+  std::vector<std::vector<cTDEmSystem*>> forwardmodel(pool.size());
+  std::vector<double*> forwardmodel_time;
+  std::vector<hierarchicalmodel*> noise;
+  
+  for (auto &s : stm_files) {
+
+    forwardmodel[0].push_back(new cTDEmSystem(s));
+    cTDEmSystem *p = forwardmodel[0].back();
+    for (int w = 1; w < pool.size(); w ++) {
+      forwardmodel[w].push_back(new cTDEmSystem(p->shared_description()));
+    }
+
+    double *centre_time = new double[p->description().WinSpec.size()];
+
+    int t = 0;
+    for (auto &w : p->description().WinSpec) {
+      centre_time[t] = (w.TimeLow + w.TimeHigh)/2.0;
+      t ++;
+    }
+
+    forwardmodel_time.push_back(centre_time);
+  }
+
+  for (auto &h : hierarchical_files) {
+    hierarchicalmodel *m = hierarchicalmodel::load(h.c_str());
+    if (m == nullptr) {
+      fprintf(stderr, "error: failed to load hierarchical noise model %s\n", h.c_str());
+      return nullptr;
+    }
+
+    noise.push_back(m);
+  }
+
+  std::vector<aemresponse::direction_t> components;
+  components.push_back(aemresponse::DIRECTION_Z);
+  
+  if (synthetic_responses(*obs, image, forwardmodel, components, pool, 0, image.columns) < 0) {
+    return nullptr;
+  }
+
+  synthetic_noise(*obs, noise, forwardmodel_time, random);
+
+  for (auto &f : forwardmodel) {
+    for (auto &s : f) {
+      delete s;
+    }
+  }
+
+  for (auto &t : forwardmodel_time) {
+    delete [] t;
+  }
+
+  for (auto &n : noise) {
+    delete n;
+  }
+  
+  return obs;
+}
+
+static void usage(const char *pname)
+{
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "where options is one or more of:\n"
+          "\n"
+	  " -s|--stm <filename>                   System description (required, may be repeated)\n"
+	  " -H|--hierarchical <filename>          Noise model for each system (required, may be repeated)\n"
+	  " -M|--prior-file <filename>            Prior/proposal file (required)\n"
+	  "\n"
+	  " -x|--degree-x <int>                   Horizontal degree, columns = 2^x (default 7)\n"
+	  " -y|--degree-y <int>                   Vertical degree, rows = 2^y (default 5)\n"
+	  " -D|--depth <float>                    Depth in metres (default 150.0)\n"
+	  "\n"
+	  " -m|--model <model name>               Synthetic image model (default dettmer)\n"
+	  " -B|--background-conductivity <float>  Background conductivity (default 0.05)\n"
+	  " -C|--conductivity <float>             Anomaly conductivity (default 0.2)\n"
+	  "\n"
+	  " -n|--steps <int>                      Timed steps (default 100)\n"
+	  " -k|--kmax <int>                       Max. no. coefficients (default 100)\n"
+	  " -P|--birth-probability <float>        Birth/death probability (default 0.05)\n"
+	  " -w|--wavelet-vertical <int>           Vertical wavelet basis (default 0)\n"
+	  " -W|--wavelet-horizontal <int>         Horizontal wavelet basis (default 0)\n"
+	  " -S|--seed <int>                       Random seed (default 983)\n"
+	  "\n"
+	  " -j|--threads <int>                    Threads used to build the survey (default all cores)\n"
+	  "\n"
+	  " -o|--output <filename>                Append a CSV row of the results to this file\n"
+	  " -c|--checkpoint <prefix>              Check a checkpoint save and restore of the final state\n"
+	  " -g|--gradient <float>                 Check the coefficient gradient of the final state against\n"
+	  "                                       central finite differences to this relative tolerance (e.g. 1e-5)\n"
+	  "\n"
+	  " -h|--help                             Usage information\n"
+	  "\n",
+	  pname);
+}
@@ -31,11 +31,15 @@ extern "C" {
 #include "birth.hpp"
 
 #include "aemutil.hpp"
+#include "checkpoint.hpp"
+#include "linearisation.hpp"
+#include "profiler.hpp"
 
 Birth::Birth(Global &_global) :
   global(_global),
   propose(0),
   accept(0),
+  screen_reject(0),
   propose_depth(new int[global.treemaxdepth + 1]),
   accept_depth(new int[global.treemaxdepth + 1]),
   communicator(MPI_COMM_NULL),
@@ -126,21 +130,42 @@ Birth::step()
 	return -1;
       }
       
-      if (compute_likelihood(birth_idx, proposed_likelihood, proposed_log_normalization) < 0) {
+      bool accept_proposal = false;
+      double screen_delta = 0.0;
+      bool screen_pass = true;
+
+      if (screen_proposal(birth_valid,
+			  birth_idx,
+			  birth_value,
+			  reverse_prob,
+			  choose_prob,
+			  birth_prob,
+			  ratio,
+			  prior_prob,
+			  screen_delta,
+			  screen_pass) < 0) {
 	return -1;
       }
-    
-      bool accept_proposal = false;
 
-      if (compute_acceptance(proposed_likelihood,
-			     proposed_log_normalization,
-			     reverse_prob,
-			     choose_prob,
-			     birth_prob,
-			     ratio,
-			     prior_prob,
-			     accept_proposal) < 0) {
-	return -1;
+      if (screen_pass) {
+	if (compute_likelihood(birth_idx, proposed_likelihood, proposed_log_normalization) < 0) {
+	  return -1;
+	}
+	
+	if (compute_acceptance(proposed_likelihood,
+			       proposed_log_normalization,
+			       reverse_prob,
+			       choose_prob,
+			       birth_prob,
+			       ratio,
+			       prior_prob,
+			       screening(),
+			       screen_delta,
+			       accept_proposal) < 0) {
+	  return -1;
+	}
+      } else {
+	screen_reject ++;
       }
 
       if (communicate_acceptance(accept_proposal) < 0) {
@@ -215,6 +240,10 @@ Birth::write_long_stats()
     s = s + mkformatstring("%7.3f ",
 			   propose_depth[i] == 0 ? 0.0 : 100.0*(double)accept_depth[i]/(double)propose_depth[i]);
   }
+
+  if (screening()) {
+    s = s + mkformatstring(" screened %6d", screen_reject);
+  }
   
   return s;
 }
@@ -238,6 +267,16 @@ Birth::primary() const
   return (communicator == MPI_COMM_NULL || mpi_rank == 0);
 }
 
+bool
+Birth::screening() const
+{
+  //
+  // The linearisations are per process so screening is only used when the
+  // likelihood is not distributed
+  //
+  return (global.screen != nullptr && (communicator == MPI_COMM_NULL || mpi_size == 1));
+}
+
 int
 Birth::choose_birth_location_and_value(int k,
 				       double &ratio,
@@ -290,13 +329,12 @@ Birth::choose_birth_location_and_value(int k,
       return -1;
     }
       
-    if (wavetree2d_sub_2dindices(global.wt, birth_idx, &ii, &ij) < 0) {
-      ERROR("failed to compute 2d indices for birth\n");
-      return -1;
-    }
+    const coefficient_index &c = global.coefficients[birth_idx];
+    ii = c.ii;
+    ij = c.ij;
     
     if (wavetree2d_sub_get_coeff(global.wt,
-				 wavetree2d_sub_parent_index(global.wt, birth_idx),
+				 c.parent,
 				 &birth_parent_coeff) < 0) {
       ERROR("failed to get parent coefficient for birth (idx = %d)\n", birth_idx);
       return -1;
@@ -326,6 +364,7 @@ Birth::communicate_birth_location_and_value(int &birth_valid,
 					    double &birth_value)
 {
   if (communicator != MPI_COMM_NULL) {
+    PROFILE_SCOPE(profiler::MPI_BCAST);
 
     if (MPI_Bcast(&birth_valid, 1, MPI_INT, 0, communicator) != MPI_SUCCESS) {
       throw AEMEXCEPTION("Failed to broadcast birth valid\n");
@@ -408,6 +447,52 @@ Birth::compute_reverse_birth_probability(int birth_depth,
   return 0;
 }
 
+int
+Birth::screen_proposal(int birth_valid,
+		       int birth_idx,
+		       double birth_value,
+		       double reverse_prob,
+		       double choose_prob,
+		       double birth_prob,
+		       double ratio,
+		       double prior_prob,
+		       double &screen_delta,
+		       bool &screen_pass)
+{
+  screen_delta = 0.0;
+  screen_pass = true;
+
+  if (birth_valid && screening()) {
+
+    if (prior_prob <= 0.0) {
+      //
+      // Outside the coefficient prior so it can never be accepted, no need
+      // to evaluate the linearisation (or the full likelihood)
+      //
+      screen_pass = false;
+      return 0;
+    }
+    
+    //
+    // First stage of delayed acceptance with the linearised likelihood in
+    // place of the full likelihood
+    //
+    screen_delta = global.screen->delta_likelihood(birth_idx, birth_value);
+
+    double u = log(global.random.uniform());
+
+    screen_pass = u < (-screen_delta/global.temperature                 /* Approximate likelihood ratio */
+		       + log(reverse_prob) - 
+		       log(choose_prob)                                      /* Depth/Node proposal ratio */
+		       - log(birth_prob)                                     /* Coefficient proposal */
+		       + log(ratio)                                          /* Tree Prior */
+		       + log(prior_prob)                                     /* Coefficient prior */
+		       );
+  }
+
+  return 0;
+}
+
 int
 Birth::compute_likelihood(int birth_idx,
 			  double &proposed_likelihood,
@@ -430,10 +515,22 @@ Birth::compute_acceptance(double proposed_likelihood,
 			  double birth_prob,
 			  double ratio,
 			  double prior_prob,
+			  bool screened,
+			  double screen_delta,
 			  bool &accept_proposal)
 {
   if (primary()) {
     double u = log(global.random.uniform());
+
+    if (screened) {
+      //
+      // Second stage of delayed acceptance, the proposal and prior terms
+      // cancel with those of the first stage leaving the ratio of the full to
+      // approximate likelihood ratios.
+      //
+      accept_proposal = u < (global.current_likelihood - proposed_likelihood + screen_delta)/global.temperature;
+      return 0;
+    }
     
     accept_proposal = u < ((global.current_likelihood - proposed_likelihood)/global.temperature /* Likelihood ratio */
 			   + log(reverse_prob) - 
@@ -453,6 +550,7 @@ Birth::communicate_acceptance(bool &accept_proposal)
 {
   
   if (communicator != MPI_COMM_NULL) {
+    PROFILE_SCOPE(profiler::MPI_BCAST);
 
     int ta;
 
@@ -473,3 +571,22 @@ Birth::communicate_acceptance(bool &accept_proposal)
   return 0;
 }
 
+void
+Birth::save_state(checkpoint &cp)
+{
+  cp.section("birth");
+  cp.write(propose);
+  cp.write(accept);
+  cp.write_array(propose_depth, global.treemaxdepth + 1);
+  cp.write_array(accept_depth, global.treemaxdepth + 1);
+}
+
+void
+Birth::load_state(checkpoint &cp)
+{
+  cp.section("birth");
+  cp.read(propose);
+  cp.read(accept);
+  cp.read_array(propose_depth, global.treemaxdepth + 1);
+  cp.read_array(accept_depth, global.treemaxdepth + 1);
+}
@@ -44,12 +44,21 @@ public:
 
   std::string write_long_stats();
 
+  void save_state(checkpoint &cp);
+  void load_state(checkpoint &cp);
+
   void initialize_mpi(MPI_Comm communicator);
 
   Global &global;
   int propose;
   int accept;
 
+  //
+  // Proposals rejected by the linearised screening stage without a full
+  // likelihood evaluation (see Global::initialize_screening)
+  //
+  int screen_reject;
+
   int *propose_depth;
   int *accept_depth;
 
@@ -61,6 +70,8 @@ private:
 
   bool primary() const;
 
+  bool screening() const;
+
   int choose_birth_location_and_value(int k,
 				      double &ratio,
 				      int &birth_depth,
@@ -92,6 +103,17 @@ private:
 					double &reverse_prob,
 					double &prior_prob);
 
+  int screen_proposal(int birth_valid,
+		      int birth_idx,
+		      double birth_value,
+		      double reverse_prob,
+		      double choose_prob,
+		      double birth_prob,
+		      double ratio,
+		      double prior_prob,
+		      double &screen_delta,
+		      bool &screen_pass);
+
   int compute_likelihood(int birth_idx, double &proposed_likelihood, double &proposed_log_normalization);
 
   int compute_acceptance(double proposed_likelihood,
@@ -101,6 +123,8 @@ private:
 			 double birth_prob,
 			 double ratio,
 			 double prior_prob,
+			 bool screened,
+			 double screen_delta,
 			 bool &accept_proposal);
 
   int communicate_acceptance(bool &accept_proposal);
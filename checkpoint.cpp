@@ -0,0 +1,414 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "checkpoint.hpp"
+
+#include "aemexception.hpp"
+#include "aemutil.hpp"
+
+extern "C" {
+  #include "slog.h"
+};
+
+static const char MAGIC[8] = "AEMCKPT";
+
+checkpoint::checkpoint() :
+  fp(NULL),
+  writing(false)
+{
+}
+
+checkpoint::~checkpoint()
+{
+  if (fp != NULL) {
+    fclose(fp);
+  }
+}
+
+std::string
+checkpoint::filename(const char *prefix, int generation, int rank)
+{
+  return mkfilenamerank(prefix, mkformatstring("checkpoint%d.dat", generation).c_str(), rank);
+}
+
+bool
+checkpoint::create(const char *filename, int rank, int iteration)
+{
+  int version = VERSION;
+  
+  fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    return false;
+  }
+
+  writing = true;
+  
+  if (fwrite(MAGIC, sizeof(MAGIC), 1, fp) != 1 ||
+      fwrite(&version, sizeof(int), 1, fp) != 1 ||
+      fwrite(&rank, sizeof(int), 1, fp) != 1 ||
+      fwrite(&iteration, sizeof(int), 1, fp) != 1) {
+    return false;
+  }
+
+  return true;
+}
+
+bool
+checkpoint::open(const char *filename, int rank, int iteration)
+{
+  char magic[sizeof(MAGIC)];
+  int version;
+  int stored_rank;
+  int stored_iteration;
+  
+  fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    return false;
+  }
+
+  writing = false;
+  
+  if (fread(magic, sizeof(MAGIC), 1, fp) != 1 ||
+      fread(&version, sizeof(int), 1, fp) != 1 ||
+      fread(&stored_rank, sizeof(int), 1, fp) != 1 ||
+      fread(&stored_iteration, sizeof(int), 1, fp) != 1) {
+    return false;
+  }
+
+  if (memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || version != VERSION) {
+    fprintf(stderr, "checkpoint::open: %s is not a valid checkpoint\n", filename);
+    return false;
+  }
+
+  if (stored_rank != rank || stored_iteration != iteration) {
+    fprintf(stderr, "checkpoint::open: %s is for rank %d iteration %d, expected rank %d iteration %d\n",
+	    filename, stored_rank, stored_iteration, rank, iteration);
+    return false;
+  }
+
+  return true;
+}
+
+bool
+checkpoint::close()
+{
+  bool r = true;
+  
+  if (fp != NULL) {
+    if (writing) {
+      //
+      // On disk, not just in the page cache, before the manifest can refer
+      // to it
+      //
+      r = (fflush(fp) == 0 && fsync(fileno(fp)) == 0);
+    }
+    
+    if (fclose(fp) != 0) {
+      r = false;
+    }
+    fp = NULL;
+  }
+
+  return r;
+}
+
+void
+checkpoint::section(const char *name)
+{
+  char tag[SECTION_LENGTH];
+  char stored[SECTION_LENGTH];
+
+  memset(tag, 0, SECTION_LENGTH);
+  strncpy(tag, name, SECTION_LENGTH - 1);
+  
+  if (writing) {
+    write(tag, SECTION_LENGTH, 1);
+  } else {
+    read(stored, SECTION_LENGTH, 1);
+    if (memcmp(tag, stored, SECTION_LENGTH) != 0) {
+      stored[SECTION_LENGTH - 1] = '\0';
+      throw AEMEXCEPTION("Checkpoint section mismatch: expected %s got %s\n", tag, stored);
+    }
+  }
+}
+
+void
+checkpoint::write(const void *data, size_t size, size_t n)
+{
+  if (n > 0 && fwrite(data, size, n, fp) != n) {
+    throw AEMEXCEPTION("Failed to write checkpoint\n");
+  }
+}
+
+void
+checkpoint::read(void *data, size_t size, size_t n)
+{
+  if (n > 0 && fread(data, size, n, fp) != n) {
+    throw AEMEXCEPTION("Failed to read checkpoint\n");
+  }
+}
+
+FILE *
+checkpoint::file()
+{
+  return fp;
+}
+
+bool
+checkpoint::save_manifest(const char *prefix, int generation, int iteration, int size)
+{
+  std::string filename = mkfilename(prefix, "checkpoint.txt");
+  std::string tmpfilename = filename + ".tmp";
+  
+  FILE *fp = fopen(tmpfilename.c_str(), "w");
+  if (fp == NULL) {
+    return false;
+  }
+
+  fprintf(fp, "%d %d %d\n", iteration, generation, size);
+  for (int i = 0; i < size; i ++) {
+    fprintf(fp, "%s\n", checkpoint::filename(prefix, generation, i).c_str());
+  }
+
+  if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+    fclose(fp);
+    return false;
+  }
+  
+  if (fclose(fp) != 0) {
+    return false;
+  }
+
+  //
+  // Rename is atomic so the manifest is either the old or new one, and
+  // syncing the directory makes the rename itself durable
+  //
+  if (rename(tmpfilename.c_str(), filename.c_str()) != 0) {
+    return false;
+  }
+
+  std::string directory = ".";
+  size_t slash = filename.find_last_of('/');
+  if (slash != std::string::npos) {
+    directory = filename.substr(0, slash + 1);
+  }
+  
+  int fd = ::open(directory.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    ::close(fd);
+  }
+
+  return true;
+}
+
+bool
+checkpoint::load_manifest(const char *prefix, int &generation, int &iteration, int &size)
+{
+  std::string filename = mkfilename(prefix, "checkpoint.txt");
+  
+  FILE *fp = fopen(filename.c_str(), "r");
+  if (fp == NULL) {
+    return false;
+  }
+
+  if (fscanf(fp, "%d %d %d\n", &iteration, &generation, &size) != 3) {
+    fclose(fp);
+    return false;
+  }
+
+  fclose(fp);
+  return (generation >= 0 && generation < GENERATIONS && iteration >= 0 && size > 0);
+}
+
+int
+checkpoint::save(MPI_Comm communicator,
+		 const char *prefix,
+		 int generation,
+		 int iteration,
+		 off_t ch_offset,
+		 int *khistogram,
+		 int kmax,
+		 state_t state)
+{
+  int mpi_rank;
+  int mpi_size;
+  int ok;
+  int all_ok;
+
+  MPI_Comm_rank(communicator, &mpi_rank);
+  MPI_Comm_size(communicator, &mpi_size);
+
+  ok = 1;
+  try {
+    checkpoint cp;
+    std::string filename = checkpoint::filename(prefix, generation, mpi_rank);
+    
+    if (!cp.create(filename.c_str(), mpi_rank, iteration)) {
+      throw AEMEXCEPTION("Failed to create checkpoint file %s\n", filename.c_str());
+    }
+
+    cp.section("sampler");
+    cp.write((long long)ch_offset);
+    cp.write(khistogram != nullptr);
+    if (khistogram != nullptr) {
+      cp.write_array(khistogram, kmax);
+    }
+
+    state(cp);
+
+    if (!cp.close()) {
+      throw AEMEXCEPTION("Failed to close checkpoint file %s\n", filename.c_str());
+    }
+    
+  } catch (aemexception &e) {
+    ok = 0;
+  }
+
+  //
+  // Only update the manifest once every process has its state on disk
+  //
+  if (MPI_Allreduce(&ok, &all_ok, 1, MPI_INT, MPI_LAND, communicator) != MPI_SUCCESS) {
+    return -1;
+  }
+
+  if (!all_ok) {
+    return -1;
+  }
+
+  if (mpi_rank == 0) {
+    if (!save_manifest(prefix, generation, iteration, mpi_size)) {
+      ERROR("error: failed to save checkpoint manifest\n");
+      ok = 0;
+    } else {
+      INFO("Checkpoint %d saved", iteration);
+    }
+  }
+
+  if (MPI_Bcast(&ok, 1, MPI_INT, 0, communicator) != MPI_SUCCESS || !ok) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+checkpoint::load(MPI_Comm communicator,
+		 const char *prefix,
+		 int &generation,
+		 int &iteration,
+		 off_t &ch_offset,
+		 int *khistogram,
+		 int kmax,
+		 state_t state)
+{
+  int mpi_rank;
+  int mpi_size;
+  int manifest[3];
+  int ok;
+  int all_ok;
+
+  MPI_Comm_rank(communicator, &mpi_rank);
+  MPI_Comm_size(communicator, &mpi_size);
+
+  if (mpi_rank == 0) {
+    if (!load_manifest(prefix, manifest[0], manifest[1], manifest[2])) {
+      ERROR("error: failed to load checkpoint manifest\n");
+      manifest[2] = -1;
+    }
+  }
+
+  if (MPI_Bcast(manifest, 3, MPI_INT, 0, communicator) != MPI_SUCCESS) {
+    return -1;
+  }
+
+  if (manifest[2] != mpi_size) {
+    if (manifest[2] > 0) {
+      ERROR("error: checkpoint was created with %d processes, now %d\n", manifest[2], mpi_size);
+    }
+    return -1;
+  }
+
+  generation = manifest[0];
+  iteration = manifest[1];
+
+  ok = 1;
+  try {
+    checkpoint cp;
+    std::string filename = checkpoint::filename(prefix, generation, mpi_rank);
+    if (!cp.open(filename.c_str(), mpi_rank, iteration)) {
+      throw AEMEXCEPTION("Failed to open checkpoint file %s\n", filename.c_str());
+    }
+    
+    long long offset;
+    bool has_khistogram;
+    
+    cp.section("sampler");
+    cp.read(offset);
+    ch_offset = offset;
+    cp.read(has_khistogram);
+    if (has_khistogram != (khistogram != nullptr)) {
+      throw AEMEXCEPTION("Checkpoint process layout mismatch\n");
+    }
+    if (khistogram != nullptr) {
+      cp.read_array(khistogram, kmax);
+    }
+
+    state(cp);
+    
+    cp.close();
+    
+  } catch (aemexception &e) {
+    ok = 0;
+  }
+
+  //
+  // A missing or corrupt file on any one process fails the restart on all
+  // of them, otherwise the rest would continue into collectives alone
+  //
+  if (MPI_Allreduce(&ok, &all_ok, 1, MPI_INT, MPI_LAND, communicator) != MPI_SUCCESS) {
+    return -1;
+  }
+
+  if (!all_ok) {
+    return -1;
+  }
+  
+  return 0;
+}
+
+void
+checkpoint::check_size(long long stored, long long expected)
+{
+  if (stored != expected) {
+    throw AEMEXCEPTION("Checkpoint size mismatch: expected %lld got %lld\n", expected, stored);
+  }
+}
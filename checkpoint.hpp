@@ -0,0 +1,167 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#pragma once
+#ifndef checkpoint_hpp
+#define checkpoint_hpp
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+
+//
+// Binary per process checkpoint file. Each process writes its own file and
+// process 0 writes a small text manifest once all processes have finished,
+// so the manifest always refers to a complete set. Two generations of files
+// are alternated so that an interrupted checkpoint leaves the previous one
+// intact.
+//
+// Objects save and load their state in the same order through write/read,
+// and section tags are used to detect a mismatch in the sampler
+// configuration between the original run and the restart.
+//
+class checkpoint {
+public:
+
+  static const int VERSION = 2;
+  static const int GENERATIONS = 2;
+  static const int SECTION_LENGTH = 16;
+
+  checkpoint();
+  ~checkpoint();
+
+  static std::string filename(const char *prefix, int generation, int rank);
+  
+  bool create(const char *filename, int rank, int iteration);
+  bool open(const char *filename, int rank, int iteration);
+  bool close();
+
+  void section(const char *name);
+  
+  void write(const void *data, size_t size, size_t n);
+  void read(void *data, size_t size, size_t n);
+
+  template<typename T> void write(const T &v)
+  {
+    write(&v, sizeof(T), 1);
+  }
+
+  template<typename T> void read(T &v)
+  {
+    read(&v, sizeof(T), 1);
+  }
+
+  template<typename T> void write_array(const T *v, size_t n)
+  {
+    long long stored_n = (long long)n;
+    write(&stored_n, sizeof(long long), 1);
+    write(v, sizeof(T), n);
+  }
+
+  template<typename T> void read_array(T *v, size_t n)
+  {
+    long long stored_n;
+    read(&stored_n, sizeof(long long), 1);
+    check_size(stored_n, (long long)n);
+    read(v, sizeof(T), n);
+  }
+
+  //
+  // Reads an array written by write_array whose length is only known to be
+  // at most max, returning the stored length
+  //
+  template<typename T> size_t read_array_bounded(T *v, size_t max)
+  {
+    long long stored_n;
+    read(&stored_n, sizeof(long long), 1);
+    if (stored_n < 0 || stored_n > (long long)max) {
+      check_size(stored_n, (long long)max);
+    }
+    read(v, sizeof(T), (size_t)stored_n);
+    return (size_t)stored_n;
+  }
+
+  template<typename T> void write_vector(const std::vector<T> &v)
+  {
+    write_array(v.data(), v.size());
+  }
+
+  template<typename T> void read_vector(std::vector<T> &v)
+  {
+    read_array(v.data(), v.size());
+  }
+
+  FILE *file();
+  
+  //
+  // Manifest written by rank 0 only
+  //
+  static bool save_manifest(const char *prefix, int generation, int iteration, int size);
+  static bool load_manifest(const char *prefix, int &generation, int &iteration, int &size);
+
+  //
+  // Collective save/load of the complete sampler state of every process in
+  // the communicator. The common sampler section (chain history offset and
+  // the optional k histogram) is handled here and state then writes/reads
+  // the driver specific objects in a fixed order. Both return 0 on every
+  // process or -1 on every process so that callers can abort together.
+  //
+  typedef std::function<void(checkpoint &cp)> state_t;
+
+  static int save(MPI_Comm communicator,
+		  const char *prefix,
+		  int generation,
+		  int iteration,
+		  off_t ch_offset,
+		  int *khistogram,
+		  int kmax,
+		  state_t state);
+
+  static int load(MPI_Comm communicator,
+		  const char *prefix,
+		  int &generation,
+		  int &iteration,
+		  off_t &ch_offset,
+		  int *khistogram,
+		  int kmax,
+		  state_t state);
+
+private:
+
+  void check_size(long long stored, long long expected);
+
+  FILE *fp;
+  bool writing;
+  
+};
+
+#endif // checkpoint_hpp
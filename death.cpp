@@ -31,6 +31,8 @@ extern "C" {
 #include "death.hpp"
 
 #include "aemutil.hpp"
+#include "checkpoint.hpp"
+#include "profiler.hpp"
 
 Death::Death(Global &_global) :
   global(_global),
@@ -272,6 +274,7 @@ Death::communicate_death_location(int &death_valid,
 				  int &death_depth)
 {
   if (communicator != MPI_COMM_NULL) {
+    PROFILE_SCOPE(profiler::MPI_BCAST);
 
     if (MPI_Bcast(&death_valid, 1, MPI_INT, 0, communicator) != MPI_SUCCESS) {
       throw AEMEXCEPTION("Failed to broadcast death valid\n");
@@ -327,13 +330,12 @@ Death::compute_reverse_death_probability(int death_idx,
 {
   if (primary()) {
     
-    if (wavetree2d_sub_2dindices(global.wt, death_idx, &ii, &ij) < 0) {
-      ERROR("failed to compute 2d indices for death\n");
-      return -1;
-    }
+    const coefficient_index &c = global.coefficients[death_idx];
+    ii = c.ii;
+    ij = c.ij;
     
     if (wavetree2d_sub_get_coeff(global.wt,
-				 wavetree2d_sub_parent_index(global.wt, death_idx),
+				 c.parent,
 				 &death_parent_coeff) < 0) {
       ERROR("failed to get parent coefficient for death\n");
       return -1;
@@ -424,6 +426,7 @@ int
 Death::communicate_acceptance(bool &accept_proposal)
 {
   if (communicator != MPI_COMM_NULL) {
+    PROFILE_SCOPE(profiler::MPI_BCAST);
 
     int ta;
 
@@ -442,3 +445,23 @@ Death::communicate_acceptance(bool &accept_proposal)
 
   return 0;
 }
+
+void
+Death::save_state(checkpoint &cp)
+{
+  cp.section("death");
+  cp.write(propose);
+  cp.write(accept);
+  cp.write_array(propose_depth, global.treemaxdepth + 1);
+  cp.write_array(accept_depth, global.treemaxdepth + 1);
+}
+
+void
+Death::load_state(checkpoint &cp)
+{
+  cp.section("death");
+  cp.read(propose);
+  cp.read(accept);
+  cp.read_array(propose_depth, global.treemaxdepth + 1);
+  cp.read_array(accept_depth, global.treemaxdepth + 1);
+}
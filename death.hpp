@@ -42,6 +42,9 @@ public:
 
   std::string write_long_stats();
 
+  void save_state(checkpoint &cp);
+  void load_state(checkpoint &cp);
+
   void initialize_mpi(MPI_Comm communicator);
 
   Global &global;
@@ -790,6 +790,51 @@ inline void LE::integrand(const size_t& fi, const size_t& ai)
 	
 }
 
+void LE::dointegrals_conductivityderivatives(const size_t& fi)
+{
+	//Same trapezoid rule as dointegrals_trapezoid with calculation_type CT_CONDUCTIVITYDERIVATIVE
+	//but the abscissa terms are shared between the layers and the propogation matrices
+	//from the forward model are reused
+	dCI0.assign(NumLayers, cdouble(0.0, 0.0));
+	dCI1.assign(NumLayers, cdouble(0.0, 0.0));
+	dCI2.assign(NumLayers, cdouble(0.0, 0.0));
+
+	for (size_t ai = 0; ai < NumAbscissa; ai++){
+		AbscissaNode& A = Frequency[fi].Abscissa[ai];
+		number_integrand_calls++;
+
+		double weight = 1.0;
+		if (ai == 0 || ai == NumAbscissa - 1) weight = 0.5;
+
+		double loopfactor = 1.0;
+		if (ModellingLoopRadius > 0.0){	
+			double lambda_a = A.Lambda*ModellingLoopRadius;
+			loopfactor = 2.0 * besselj1(lambda_a) / lambda_a;
+		}
+
+		const double e = exp(-(Z + H)*A.Lambda);
+		const double l2e = weight*loopfactor*A.Lambda2*e;
+		const double l3e = weight*loopfactor*A.Lambda3*e;
+		const double l3ej0 = l3e*A.j0LambdaR;
+		const double l3ej1 = l3e*A.j1LambdaR;
+		const double l2ej1 = l2e*A.j1LambdaR;
+
+		for (size_t li = 0; li < NumLayers; li++){
+			const cdouble k = dP21onP11dCj(fi, ai, li);
+			dCI0[li] += k*l3ej0;
+			dCI1[li] += k*l3ej1;
+			dCI2[li] += k*l2ej1;
+		}
+	}
+
+	const double spacing = Frequency[fi].AbscissaSpacing;
+	for (size_t li = 0; li < NumLayers; li++){
+		dCI0[li] *= spacing;
+		dCI1[li] *= spacing;
+		dCI2[li] *= spacing;
+	}
+}
+
 void LE::setverticaldipolefields(const size_t& fi)
 {
 	setverticaldipoleprimaryfields();
@@ -200,6 +200,13 @@ class LE{
 
   void integrand(const size_t& fi, const size_t& ai);        
   cdouble integrand_result[3];
+
+  //Conductivity derivative integrals for all layers in one pass over the abscissae
+  //dCI0[li], dCI1[li] and dCI2[li] are I0.dC, I1.dC and I2.dC for derivative_layer li
+  void dointegrals_conductivityderivatives(const size_t& fi);
+  std::vector<cdouble> dCI0;
+  std::vector<cdouble> dCI1;
+  std::vector<cdouble> dCI2;
   
       
   //////////////////////////////////////////////////
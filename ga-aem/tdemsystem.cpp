@@ -11,7 +11,10 @@ Author: Ross C. Brodie, Geoscience Australia.
 #include <cmath>
 #include <cstring>
 #include <vector>
+#include <algorithm>
 #include <complex>
+#include <memory>
+#include <mutex>
 
 #include "general_utils.h"
 #include "file_utils.h"
@@ -19,22 +22,37 @@ Author: Ross C. Brodie, Geoscience Australia.
 #include "tdemsystem.h"
 #include "vector_utils.h"
 
+#ifdef AEM_PROFILE
+#include "../profiler.hpp"
+#else
+#define PROFILE_SCOPE(id)
+#endif
+
 using namespace std;
 
-cTDEmSystem::cTDEmSystem()
+//The FFTW planner is not thread safe, only fftw_execute is
+static std::mutex fftwplanner_mutex;
+
+cTDEmSystemDescription::cTDEmSystemDescription(std::string systemdescriptorfile)
 {
-	initialise();
+	readsystemdescriptorfile(systemdescriptorfile);
 };
 
 cTDEmSystem::cTDEmSystem(std::string systemdescriptorfile)
+	: cTDEmSystem(std::make_shared<const cTDEmSystemDescription>(systemdescriptorfile))
+{
+};
+
+cTDEmSystem::cTDEmSystem(std::shared_ptr<const cTDEmSystemDescription> description)
+	: Description(description), D(*description)
 {
 	initialise();
-	readsystemdescriptorfile(systemdescriptorfile);
 };
 
 cTDEmSystem::~cTDEmSystem()
 {
 	if (fftwplan_backward){
+		std::lock_guard<std::mutex> lock(fftwplanner_mutex);
 		fftw_destroy_plan(fftwplan_backward);
 	}
 };
@@ -46,28 +64,57 @@ void cTDEmSystem::initialise()
 	zaxis = cVec(0.0, 0.0, 1.0);
 	Earth.calculation_type = CT_FORWARDMODEL;
 	Earth.rzerotype = RZM_PROPOGATIONMATRIX;
-	fftwplan_backward = 0;
+	Earth.ModellingLoopRadius = D.ModellingLoopRadius;
+	Earth.NumAbscissa = D.NumAbscissa;
+	SaveDiagnosticFiles = D.SaveDiagnosticFiles;
+	//The diagnostic files need the intermediate spectra and time series
+	UseLinearOperator = D.LinearOperator && !SaveDiagnosticFiles;
+
+	X.resize(D.NumberOfWindows);
+	Y.resize(D.NumberOfWindows);
+	Z.resize(D.NumberOfWindows);
+
+	setup_splines();
+
+	//Inverse transform work array, in place so NumberOfFFTFrequencies complex values
+	//hold the SamplesPerWaveform real output. Only that many leading values of the
+	//Transfer are copied in, the buffer is never reallocated under the plan.
+	FFTWork.resize(D.NumberOfFFTFrequencies);
+
+#if defined MULTITHREADED
+	//FFTW_MEASURE does not seem to be thread safe
+	unsigned int FLAGS = FFTW_ESTIMATE;		
+#else
+	unsigned int FLAGS = FFTW_MEASURE;
+#endif
+
+	std::lock_guard<std::mutex> lock(fftwplanner_mutex);
+	fftw_complex* invin = (fftw_complex*)&(FFTWork[0]);
+	double* invout = (double*)&(FFTWork[0]);
+	fftwplan_backward = fftw_plan_dft_c2r_1d((int)D.SamplesPerWaveform, invin, invout, FLAGS);
 }
 
-void cTDEmSystem::createwaveform()
+void cTDEmSystemDescription::createwaveform()
 {
 	NumberOfFFTFrequencies = SamplesPerWaveform / 2 + 1;
 	fft_frequency.resize(NumberOfFFTFrequencies);
 
 	size_t N = SamplesPerWaveform;
 	size_t NC = N;
-	size_t NR = 2 * (N / 2 + 1);
 
 	//Forward transform
 	F_Waveform.resize(NC);
 	double* in = (double*)&(T_Waveform[0]);
 	fftw_complex* out = (fftw_complex*)&(F_Waveform[0]);
-	fftw_plan fftwplan_forward = fftw_plan_dft_r2c_1d((int)N, in, out, FFTW_ESTIMATE);
 	for (size_t k = 0; k < SamplesPerWaveform; k++){
 		T_Waveform[k] /= (double)SamplesPerWaveform;
 	}
-	fftw_execute(fftwplan_forward);
-	fftw_destroy_plan(fftwplan_forward);
+	{
+		std::lock_guard<std::mutex> lock(fftwplanner_mutex);
+		fftw_plan fftwplan_forward = fftw_plan_dft_r2c_1d((int)N, in, out, FFTW_ESTIMATE);
+		fftw_execute(fftwplan_forward);
+		fftw_destroy_plan(fftwplan_forward);
+	}
 
 	for (size_t k = 0; k < NumberOfFFTFrequencies; k++){
 		fft_frequency[k] = calculate_fft_frequency(k);
@@ -114,23 +161,9 @@ void cTDEmSystem::createwaveform()
 	for (size_t k = 0; k < NumberOfSplinedFrequencies; k++){
 		SplinedFrequencieslog10[k] = log10(fabs(fft_frequency[k * 2 + 1]));
 	}
-
-	//Setup inverse transform work array	
-	FFTWork.resize(NR);
-
-#if defined MULTITHREADED
-	//FFTW_MEASURE does not seem to be thread safe
-	unsigned int FLAGS = FFTW_ESTIMATE;		
-#else
-	unsigned int FLAGS = FFTW_MEASURE;
-#endif
-
-	fftw_complex* invin = (fftw_complex*)&(FFTWork[0]);
-	double* invout = (double*)&(FFTWork[0]);
-	fftwplan_backward = fftw_plan_dft_c2r_1d((int)N, invin, invout, FLAGS);
 }
 
-double cTDEmSystem::calculate_fft_frequency(size_t index)
+double cTDEmSystemDescription::calculate_fft_frequency(size_t index) const
 {
 	double deltaF = 1.0 / ((double)SamplesPerWaveform*SampleInterval);
 
@@ -143,38 +176,29 @@ double cTDEmSystem::calculate_fft_frequency(size_t index)
 
 void cTDEmSystem::setup_splines()
 {
-	HxR = std::vector<double>(NumberOfDiscreteFrequencies);
-	HxI = std::vector<double>(NumberOfDiscreteFrequencies);
-	HyR = std::vector<double>(NumberOfDiscreteFrequencies);
-	HyI = std::vector<double>(NumberOfDiscreteFrequencies);
-	HzR = std::vector<double>(NumberOfDiscreteFrequencies);
-	HzI = std::vector<double>(NumberOfDiscreteFrequencies);
-
-	HxR_spline = std::vector<double>(NumberOfDiscreteFrequencies);
-	HxI_spline = std::vector<double>(NumberOfDiscreteFrequencies);
-	HyR_spline = std::vector<double>(NumberOfDiscreteFrequencies);
-	HyI_spline = std::vector<double>(NumberOfDiscreteFrequencies);
-	HzR_spline = std::vector<double>(NumberOfDiscreteFrequencies);
-	HzI_spline = std::vector<double>(NumberOfDiscreteFrequencies);
-
-	size_t ns = NumberOfSplinedFrequencies;
-	h2_spline = std::vector<double>(ns);
-	a_spline = std::vector<double>(ns);
-	b_spline = std::vector<double>(ns);
-	klo_spline = std::vector<size_t>(ns);
-	khi_spline = std::vector<size_t>(ns);
-	a3ma_spline = std::vector<double>(ns);
-	b3mb_spline = std::vector<double>(ns);
+	HxR = std::vector<double>(D.NumberOfDiscreteFrequencies);
+	HxI = std::vector<double>(D.NumberOfDiscreteFrequencies);
+	HyR = std::vector<double>(D.NumberOfDiscreteFrequencies);
+	HyI = std::vector<double>(D.NumberOfDiscreteFrequencies);
+	HzR = std::vector<double>(D.NumberOfDiscreteFrequencies);
+	HzI = std::vector<double>(D.NumberOfDiscreteFrequencies);
+
+	HxR_spline = std::vector<double>(D.NumberOfDiscreteFrequencies);
+	HxI_spline = std::vector<double>(D.NumberOfDiscreteFrequencies);
+	HyR_spline = std::vector<double>(D.NumberOfDiscreteFrequencies);
+	HyI_spline = std::vector<double>(D.NumberOfDiscreteFrequencies);
+	HzR_spline = std::vector<double>(D.NumberOfDiscreteFrequencies);
+	HzI_spline = std::vector<double>(D.NumberOfDiscreteFrequencies);
+
+	size_t ns = D.NumberOfSplinedFrequencies;
 
 	X_splined = std::vector<cdouble>(ns);
 	Y_splined = std::vector<cdouble>(ns);
 	Z_splined = std::vector<cdouble>(ns);
 
-	setup_splineinterp(DiscreteFrequenciesLog10, SplinedFrequencieslog10);
-
-	Earth.setfrequencies(DiscreteFrequencies);
+	Earth.setfrequencies(D.DiscreteFrequencies);
 }
-void cTDEmSystem::spline(const std::vector<double>& x, const std::vector<double>& y, double yp1, double ypn, std::vector<double>& y2)
+void cTDEmSystemDescription::spline(const std::vector<double>& x, const std::vector<double>& y, double yp1, double ypn, std::vector<double>& y2)
 {
 	double p, qn, sig, un;
 
@@ -211,8 +235,17 @@ void cTDEmSystem::spline(const std::vector<double>& x, const std::vector<double>
 	//	if (k == 0)break;
 	//}
 }
-void cTDEmSystem::setup_splineinterp(const std::vector<double>& xn, const std::vector<double>& xi)
+void cTDEmSystemDescription::setup_splineinterp(const std::vector<double>& xn, const std::vector<double>& xi)
 {
+	size_t ns = NumberOfSplinedFrequencies;
+	h2_spline = std::vector<double>(ns);
+	a_spline = std::vector<double>(ns);
+	b_spline = std::vector<double>(ns);
+	klo_spline = std::vector<size_t>(ns);
+	khi_spline = std::vector<size_t>(ns);
+	a3ma_spline = std::vector<double>(ns);
+	b3mb_spline = std::vector<double>(ns);
+
 	size_t n = xn.size();
 	for (size_t fi = 0; fi < NumberOfSplinedFrequencies; fi++){
 		size_t klo = 0;
@@ -245,30 +278,30 @@ void cTDEmSystem::setup_splineinterp(const std::vector<double>& xn, const std::v
 void cTDEmSystem::spline_interp()
 {
 	//y=a*ya[klo]+b*ya[khi]+((a*a*a-a)*y2a[klo]+(b*b*b-b)*y2a[khi])*(h*h)/6.0;			
-	for (size_t k = 0; k < NumberOfSplinedFrequencies; k++){
-		const double& a = a_spline[k];
-		const double& b = b_spline[k];
-		const double& a3 = a3ma_spline[k];
-		const double& b3 = b3mb_spline[k];
-		const size_t& klo = klo_spline[k];
-		const size_t& khi = khi_spline[k];
-		const double& scale = (h2_spline[k]) / 6.0;
-
-		if (XScale != 0.0){
+	for (size_t k = 0; k < D.NumberOfSplinedFrequencies; k++){
+		const double& a = D.a_spline[k];
+		const double& b = D.b_spline[k];
+		const double& a3 = D.a3ma_spline[k];
+		const double& b3 = D.b3mb_spline[k];
+		const size_t& klo = D.klo_spline[k];
+		const size_t& khi = D.khi_spline[k];
+		const double& scale = (D.h2_spline[k]) / 6.0;
+
+		if (D.XScale != 0.0){
 			double rv, iv;
 			rv = (a*HxR[klo] + b*HxR[khi] + scale * (a3*HxR_spline[klo] + b3*HxR_spline[khi])),
 			iv = (a*HxI[klo] + b*HxI[khi] + scale * (a3*HxI_spline[klo] + b3*HxI_spline[khi]));
 			X_splined[k] = cdouble(rv, iv);
 		}
 
-		if (YScale != 0.0){
+		if (D.YScale != 0.0){
 			double rv, iv;
 			rv = (a*HyR[klo] + b*HyR[khi] + scale * (a3*HyR_spline[klo] + b3*HyR_spline[khi]));
 			iv = (a*HyI[klo] + b*HyI[khi] + scale * (a3*HyI_spline[klo] + b3*HyI_spline[khi]));
 			Y_splined[k] = cdouble(rv, iv);
 		}
 
-		if (ZScale != 0.0){
+		if (D.ZScale != 0.0){
 			double rv, iv;
 			rv = (a*HzR[klo] + b*HzR[khi] + scale * (a3*HzR_spline[klo] + b3*HzR_spline[khi]));
 			iv = (a*HzI[klo] + b*HzI[khi] + scale * (a3*HzI_spline[klo] + b3*HzI_spline[khi]));
@@ -314,22 +347,24 @@ void cTDEmSystem::setgeometry(const double tx_height, const double tx_roll, cons
 }
 void cTDEmSystem::setupcomputations()
 {
-	for (size_t fi = 0; fi < NumberOfDiscreteFrequencies; fi++){
+	PROFILE_SCOPE(profiler::FORWARD_SETUP);
+	for (size_t fi = 0; fi < D.NumberOfDiscreteFrequencies; fi++){
 		Earth.setfrequencyabscissalayers(fi);
 	}
 }
 void cTDEmSystem::setprimaryfields()
 {
+	PROFILE_SCOPE(profiler::FORWARD_PRIMARY);
 	Earth.setprimaryfields();
 	PrimaryX = Earth.Fields.t.p.x;
 	PrimaryY = Earth.Fields.t.p.y;
 	PrimaryZ = Earth.Fields.t.p.z;
 
-	if (OutputType == OT_DBDT){
+	if (D.OutputType == OT_DBDT){
 		//Must convert to dB/dt. This happens implicitly for the secondary via the waveform.
-		PrimaryX *= TX_PeakdIdT;
-		PrimaryY *= TX_PeakdIdT;
-		PrimaryZ *= TX_PeakdIdT;
+		PrimaryX *= D.TX_PeakdIdT;
+		PrimaryY *= D.TX_PeakdIdT;
+		PrimaryZ *= D.TX_PeakdIdT;
 	}
 
 	if (RX_pitch != 0.0 || RX_roll != 0.0){
@@ -340,111 +375,148 @@ void cTDEmSystem::setprimaryfields()
 		PrimaryZ = rotatedfield.z;
 	}
 			
-	PrimaryX *= XScale;
-	PrimaryY *= YScale;
-	PrimaryZ *= ZScale;
+	PrimaryX *= D.XScale;
+	PrimaryY *= D.YScale;
+	PrimaryZ *= D.ZScale;
 
 }
 cVec cTDEmSystem::rotatetoreceiverorientation(cVec v)
+{
+	return cTDEmSystemDescription::rotatetoreceiverorientation(v, RX_roll, RX_pitch);
+}
+cVec cTDEmSystemDescription::rotatetoreceiverorientation(cVec v, const double rx_roll, const double rx_pitch)
 {
 	//Rotating in opposite sense because we are rotating the axes
-	if (RX_roll != 0.0) v = v.rotate(-RX_roll, xaxis);
-	if (RX_pitch != 0.0) v = v.rotate(-RX_pitch, yaxis);
+	if (rx_roll != 0.0) v = v.rotate(-rx_roll, cVec(1.0, 0.0, 0.0));
+	if (rx_pitch != 0.0) v = v.rotate(-rx_pitch, cVec(0.0, 1.0, 0.0));
 	return v;
 }
 void cTDEmSystem::setsecondaryfields()
 {
-	//Computation for discrete frequencies 	
-	for (size_t fi = 0; fi < NumberOfDiscreteFrequencies; fi++){
-		Earth.dointegrals(fi);
-		Earth.setsecondaryfields(fi);
-		const cdouble& x = Earth.Fields.t.s.x;
-		const cdouble& y = Earth.Fields.t.s.y;
-		const cdouble& z = Earth.Fields.t.s.z;
-		cVec vr = cVec(x.real(), y.real(), z.real());
-		cVec vi = cVec(x.imag(), y.imag(), z.imag());
-
-		vr = rotatetoreceiverorientation(vr);
-		vi = rotatetoreceiverorientation(vi);
+	//Computation for discrete frequencies, timed over the whole loop
+	{
+		PROFILE_SCOPE(profiler::FORWARD_INTEGRALS);
+		for (size_t fi = 0; fi < D.NumberOfDiscreteFrequencies; fi++){
+			Earth.dointegrals(fi);
+			Earth.setsecondaryfields(fi);
+			const cdouble& x = Earth.Fields.t.s.x;
+			const cdouble& y = Earth.Fields.t.s.y;
+			const cdouble& z = Earth.Fields.t.s.z;
+			cVec vr = cVec(x.real(), y.real(), z.real());
+			cVec vi = cVec(x.imag(), y.imag(), z.imag());
+
+			vr = rotatetoreceiverorientation(vr);
+			vi = rotatetoreceiverorientation(vi);
+
+			HxR[fi] = vr.x;
+			HxI[fi] = vi.x;
+			HyR[fi] = vr.y;
+			HyI[fi] = vi.y;
+			HzR[fi] = vr.z;
+			HzI[fi] = vi.z;
+		}
+	}
 
-		HxR[fi] = vr.x;
-		HxI[fi] = vi.x;
-		HyR[fi] = vr.y;
-		HyI[fi] = vi.y;
-		HzR[fi] = vr.z;
-		HzI[fi] = vi.z;
+	transformsecondaryfields();
+}
+void cTDEmSystem::transformsecondaryfields()
+{
+	if (UseLinearOperator){
+		applylinearoperators();
+		return;
 	}
 
 	//Spline discreet frequencies		
-	if (XScale != 0.0){
-		spline(DiscreteFrequenciesLog10, HxR, 1e-30, 1e-30, HxR_spline);
-		spline(DiscreteFrequenciesLog10, HxI, 1e-30, 1e-30, HxI_spline);
-	}
-	if (YScale != 0.0){
-		spline(DiscreteFrequenciesLog10, HyR, 1e-30, 1e-30, HyR_spline);
-		spline(DiscreteFrequenciesLog10, HyI, 1e-30, 1e-30, HyI_spline);
-	}
-	if (ZScale != 0.0){
-		spline(DiscreteFrequenciesLog10, HzR, 1e-30, 1e-30, HzR_spline);
-		spline(DiscreteFrequenciesLog10, HzI, 1e-30, 1e-30, HzI_spline);
-	}
+	{
+		PROFILE_SCOPE(profiler::FORWARD_SPLINE);
+		if (D.XScale != 0.0){
+			spline(D.DiscreteFrequenciesLog10, HxR, 1e-30, 1e-30, HxR_spline);
+			spline(D.DiscreteFrequenciesLog10, HxI, 1e-30, 1e-30, HxI_spline);
+		}
+		if (D.YScale != 0.0){
+			spline(D.DiscreteFrequenciesLog10, HyR, 1e-30, 1e-30, HyR_spline);
+			spline(D.DiscreteFrequenciesLog10, HyI, 1e-30, 1e-30, HyI_spline);
+		}
+		if (D.ZScale != 0.0){
+			spline(D.DiscreteFrequenciesLog10, HzR, 1e-30, 1e-30, HzR_spline);
+			spline(D.DiscreteFrequenciesLog10, HzI, 1e-30, 1e-30, HzI_spline);
+		}
 
-	//Interpolate 	
-	spline_interp();
+		//Interpolate 	
+		spline_interp();
+	}
 	
 	if (SaveDiagnosticFiles){
 		write_discretefrequencies("diag_discretefrequencies.txt");
 		write_splinedfrequencies("diag_splinedfrequencies.txt");
-		write_frequencydomainwaveform("diag_frequencydomainwaveform.txt");
+		D.write_frequencydomainwaveform("diag_frequencydomainwaveform.txt");
 	}
 
 	//Filter - splining only every second value (even index) of the Waveform filter is always zero	
-	if (XScale != 0.0){
+	if (D.XScale != 0.0){
 		size_t n = 0;
-		FFTWork = Transfer;
-		for (size_t k = 1; k < NumberOfFFTFrequencies; k += 2){
+		std::copy(D.Transfer.begin(), D.Transfer.begin() + D.NumberOfFFTFrequencies, FFTWork.begin());
+		for (size_t k = 1; k < D.NumberOfFFTFrequencies; k += 2){
 			FFTWork[k] *= X_splined[n];			
 			n++;
 		}
 		//Inverse FFT		
-		fftw_execute(fftwplan_backward);		
-		computewindow((double*)FFTWork.data(), X);
+		{
+			PROFILE_SCOPE(profiler::FORWARD_FFT);
+			fftw_execute(fftwplan_backward);
+		}
+		{
+			PROFILE_SCOPE(profiler::FORWARD_WINDOW);
+			computewindow((double*)FFTWork.data(), X);
+		}
 		if (SaveDiagnosticFiles){
 			write_timesseries("diag_xtimeseries.txt");
 		}
-		X *= XScale;
+		X *= D.XScale;
 	}
 
-	if (YScale != 0.0){
+	if (D.YScale != 0.0){
 		size_t n = 0;
-		FFTWork = Transfer;
-		for (size_t k = 1; k < NumberOfFFTFrequencies; k += 2){
+		std::copy(D.Transfer.begin(), D.Transfer.begin() + D.NumberOfFFTFrequencies, FFTWork.begin());
+		for (size_t k = 1; k < D.NumberOfFFTFrequencies; k += 2){
 			FFTWork[k] = Y_splined[n];
 			n++;
 		}
 		//Inverse FFT		
-		fftw_execute(fftwplan_backward);		
-		computewindow((double*)FFTWork.data(), Y);
+		{
+			PROFILE_SCOPE(profiler::FORWARD_FFT);
+			fftw_execute(fftwplan_backward);
+		}
+		{
+			PROFILE_SCOPE(profiler::FORWARD_WINDOW);
+			computewindow((double*)FFTWork.data(), Y);
+		}
 		if (SaveDiagnosticFiles){
 			write_timesseries("diag_ytimeseries.txt");
 		}
-		Y *= YScale;
+		Y *= D.YScale;
 	}
 
-	if (ZScale != 0.0){
+	if (D.ZScale != 0.0){
 		size_t n = 0;
-		FFTWork = Transfer;
-		for (size_t k = 1; k < NumberOfFFTFrequencies; k += 2){
+		std::copy(D.Transfer.begin(), D.Transfer.begin() + D.NumberOfFFTFrequencies, FFTWork.begin());
+		for (size_t k = 1; k < D.NumberOfFFTFrequencies; k += 2){
 			FFTWork[k] *= Z_splined[n];
 			n++;
 		}		
 		//Inverse FFT				
-		fftw_execute(fftwplan_backward);		
-		computewindow((double*)FFTWork.data(), Z);
+		{
+			PROFILE_SCOPE(profiler::FORWARD_FFT);
+			fftw_execute(fftwplan_backward);
+		}
+		{
+			PROFILE_SCOPE(profiler::FORWARD_WINDOW);
+			computewindow((double*)FFTWork.data(), Z);
+		}
 		if (SaveDiagnosticFiles){
 			write_timesseries("diag_ztimeseries.txt");
 		}
-		Z *= ZScale;
+		Z *= D.ZScale;
 	}
 
 	if (SaveDiagnosticFiles){
@@ -453,14 +525,102 @@ void cTDEmSystem::setsecondaryfields()
 
 }
 
-void cTDEmSystem::initialise_windows()
+void cTDEmSystem::applylinearoperators()
+{
+	PROFILE_SCOPE(profiler::FORWARD_OPERATOR);
+	if (D.XScale != 0.0){
+		D.applyoperator(D.XOperator, HxR.data(), HxI.data(), X);
+	}
+	if (D.YScale != 0.0){
+		D.applyoperator(D.YOperator, HyR.data(), HyI.data(), Y);
+	}
+	if (D.ZScale != 0.0){
+		D.applyoperator(D.ZOperator, HzR.data(), HzI.data(), Z);
+	}
+}
+
+void cTDEmSystemDescription::setup_linearoperators()
+{
+	const size_t nf = NumberOfDiscreteFrequencies;
+	const size_t nh = 2 * nf;
+	const double scale[3] = { XScale, YScale, ZScale };
+	std::vector<double>* op[3] = { &XOperator, &YOperator, &ZOperator };
+	for (size_t c = 0; c < 3; c++){
+		op[c]->assign(NumberOfWindows*nh, 0.0);
+	}
+
+	std::vector<cdouble> work(NumberOfFFTFrequencies);
+	fftw_plan plan;
+	{
+		std::lock_guard<std::mutex> lock(fftwplanner_mutex);
+		plan = fftw_plan_dft_c2r_1d((int)SamplesPerWaveform, (fftw_complex*)work.data(), (double*)work.data(), FFTW_ESTIMATE);
+	}
+
+	//Push a unit field at each discrete frequency, real then imaginary, through the same
+	//steps as cTDEmSystem::transformsecondaryfields to get the operator a column at a time
+	std::vector<double> y(nf, 0.0);
+	std::vector<double> y2(nf);
+	std::vector<double> splined(NumberOfSplinedFrequencies);
+	std::vector<double> W(NumberOfWindows);
+	for (size_t j = 0; j < nf; j++){
+		y[j] = 1.0;
+		spline(DiscreteFrequenciesLog10, y, 1e-30, 1e-30, y2);
+		for (size_t k = 0; k < NumberOfSplinedFrequencies; k++){
+			const size_t klo = klo_spline[k];
+			const size_t khi = khi_spline[k];
+			splined[k] = a_spline[k] * y[klo] + b_spline[k] * y[khi] + (h2_spline[k] / 6.0) * (a3ma_spline[k] * y2[klo] + b3mb_spline[k] * y2[khi]);
+		}
+		y[j] = 0.0;
+
+		for (size_t part = 0; part < 2; part++){
+			const cdouble unit = (part == 0) ? cdouble(1.0, 0.0) : cdouble(0.0, 1.0);
+			for (size_t c = 0; c < 3; c++){
+				if (scale[c] == 0.0) continue;
+
+				//Even bins of the Transfer are zero by construction
+				std::fill(work.begin(), work.end(), cdouble(0.0, 0.0));
+				size_t n = 0;
+				for (size_t k = 1; k < NumberOfFFTFrequencies; k += 2){
+					//Y replaces rather than filters by the Transfer, as in transformsecondaryfields
+					if (c == 1) work[k] = splined[n] * unit;
+					else work[k] = Transfer[k] * (splined[n] * unit);
+					n++;
+				}
+				fftw_execute(plan);
+				computewindow((double*)work.data(), W);
+				for (size_t w = 0; w < NumberOfWindows; w++){
+					(*op[c])[w*nh + part*nf + j] = W[w] * scale[c];
+				}
+			}
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(fftwplanner_mutex);
+	fftw_destroy_plan(plan);
+}
+
+void cTDEmSystemDescription::applyoperator(const std::vector<double>& op, const double* real, const double* imag, std::vector<double>& W) const
+{
+	const size_t nf = NumberOfDiscreteFrequencies;
+	if (W.size() < NumberOfWindows){
+		W.resize(NumberOfWindows);
+	}
+	for (size_t w = 0; w < NumberOfWindows; w++){
+		const double* opr = &op[w * 2 * nf];
+		const double* opi = opr + nf;
+		double sum = 0.0;
+		for (size_t fi = 0; fi < nf; fi++){
+			sum += opr[fi] * real[fi] + opi[fi] * imag[fi];
+		}
+		W[w] = sum;
+	}
+}
+
+void cTDEmSystemDescription::initialise_windows()
 {
 	NumberOfWindows = (size_t)STM.getintvalue("Receiver.NumberOfWindows");
 
 	WinSpec.resize(NumberOfWindows);
-	X.resize(NumberOfWindows);
-	Y.resize(NumberOfWindows);
-	Z.resize(NumberOfWindows);
 
 	//Read window times
 	dmatrix wt = STM.getdoublematrix("Receiver.WindowTimes");
@@ -491,7 +651,7 @@ void cTDEmSystem::initialise_windows()
 	}
 }
 
-void cTDEmSystem::initialise_windows_area()
+void cTDEmSystemDescription::initialise_windows_area()
 {
 	double tlow, thigh, t, tp, tn, tleft, tright;
 
@@ -545,7 +705,7 @@ void cTDEmSystem::initialise_windows_area()
 	}
 }
 
-void cTDEmSystem::initialise_windows_boxcar()
+void cTDEmSystemDescription::initialise_windows_boxcar()
 {
 	double eps = 1.0e-7;		
 	for (size_t w = 0; w < NumberOfWindows; w++){
@@ -584,7 +744,7 @@ void cTDEmSystem::initialise_windows_boxcar()
 	}
 }
 
-void cTDEmSystem::initialise_windows_lineartaper()
+void cTDEmSystemDescription::initialise_windows_lineartaper()
 {
 	double eps = 1.0e-7;
 	for (size_t w = 0; w < NumberOfWindows; w++){
@@ -633,7 +793,7 @@ void cTDEmSystem::initialise_windows_lineartaper()
 	}
 }
 
-void cTDEmSystem::computewindow(const double* timeseries, std::vector<double>& W)
+void cTDEmSystemDescription::computewindow(const double* timeseries, std::vector<double>& W) const
 {
         if (W.size() < NumberOfWindows) {
 	        W.resize(NumberOfWindows);
@@ -650,7 +810,7 @@ void cTDEmSystem::printwindows()
 {
 	printf("Primary   %15.8lf%15.8lf%15.8lf\n\n", PrimaryX, PrimaryY, PrimaryZ);
 	printf("Window#             X               Y               Z\n");
-	for (size_t w = 0; w < NumberOfWindows; w++){
+	for (size_t w = 0; w < D.NumberOfWindows; w++){
 		printf("%2lu        %15.8lf%15.8lf%15.8lf\n", w + 1, X[w], Y[w], Z[w]);
 	}
 }
@@ -660,13 +820,13 @@ void cTDEmSystem::write_windows(const std::string& path)
 	FILE* fp = fileopen(path, "w");
 	//printf("Primary   %15.8lf%15.8lf%15.8lf\n\n",PrimaryX,PrimaryY,PrimaryZ);
 	//printf("Window#             X               Y               Z\n");
-	for (size_t w = 0; w < NumberOfWindows; w++){
-		fprintf(fp, "%2lu\t%20e\t%20e\t%15e%15e%15e\n", w + 1, WinSpec[w].TimeLow, WinSpec[w].TimeHigh, X[w], Y[w], Z[w]);
+	for (size_t w = 0; w < D.NumberOfWindows; w++){
+		fprintf(fp, "%2lu\t%20e\t%20e\t%15e%15e%15e\n", w + 1, D.WinSpec[w].TimeLow, D.WinSpec[w].TimeHigh, X[w], Y[w], Z[w]);
 	}
 	fclose(fp);
 }
 
-void cTDEmSystem::write_timedomainwaveform(const std::string& path)
+void cTDEmSystemDescription::write_timedomainwaveform(const std::string& path) const
 {
 	FILE* fp = fileopen(path, "w");
 	for (size_t i = 0; i < SamplesPerWaveform; i++){
@@ -675,7 +835,7 @@ void cTDEmSystem::write_timedomainwaveform(const std::string& path)
 	fclose(fp);
 }
 
-void cTDEmSystem::write_frequencydomainwaveform(const std::string& path)
+void cTDEmSystemDescription::write_frequencydomainwaveform(const std::string& path) const
 {
 	FILE* fp = fileopen(path, "w");
 	for (size_t i = 0; i < NumberOfFFTFrequencies; i++){
@@ -687,8 +847,8 @@ void cTDEmSystem::write_frequencydomainwaveform(const std::string& path)
 void cTDEmSystem::write_discretefrequencies(const std::string& path)
 {
 	FILE* fp = fileopen(path, "w");
-	for (size_t i = 0; i < NumberOfDiscreteFrequencies; i++){
-		fprintf(fp, "%15le\t%15le\t%15le\t%15le\t%15le\t%15le\t%15le\n", DiscreteFrequencies[i], HxR[i], HxI[i], HyR[i], HyI[i], HzR[i], HzI[i]);
+	for (size_t i = 0; i < D.NumberOfDiscreteFrequencies; i++){
+		fprintf(fp, "%15le\t%15le\t%15le\t%15le\t%15le\t%15le\t%15le\n", D.DiscreteFrequencies[i], HxR[i], HxI[i], HyR[i], HyI[i], HzR[i], HzI[i]);
 	}
 	fclose(fp);
 }
@@ -696,8 +856,8 @@ void cTDEmSystem::write_discretefrequencies(const std::string& path)
 void cTDEmSystem::write_splinedfrequencies(const std::string& path)
 {
 	FILE* fp = fileopen(path, "w");
-	for (size_t i = 0; i < NumberOfSplinedFrequencies; i++){
-		double f = pow10(SplinedFrequencieslog10[i]);
+	for (size_t i = 0; i < D.NumberOfSplinedFrequencies; i++){
+		double f = pow10(D.SplinedFrequencieslog10[i]);
 		fprintf(fp, "%15le\t%15le\t%15le\t%15le\t%15le\t%15le\t%15le\n", f, X_splined[i].real(), X_splined[i].imag(), Y_splined[i].real(), Y_splined[i].imag(), Z_splined[i].real(), Z_splined[i].imag());
 	}
 	fclose(fp);
@@ -706,8 +866,8 @@ void cTDEmSystem::write_splinedfrequencies(const std::string& path)
 void cTDEmSystem::write_frequencyseries(const std::string& path)
 {
 	FILE* fp = fileopen(path, "w");
-	for (size_t i = 0; i < NumberOfFFTFrequencies; i++){
-		fprintf(fp, "%15le\t%15le\t%15le\n", fft_frequency[i], FFTWork[i].real(), FFTWork[i].imag());
+	for (size_t i = 0; i < D.NumberOfFFTFrequencies; i++){
+		fprintf(fp, "%15le\t%15le\t%15le\n", D.fft_frequency[i], FFTWork[i].real(), FFTWork[i].imag());
 	}
 	fclose(fp);
 }
@@ -716,8 +876,8 @@ void cTDEmSystem::write_timesseries(const std::string& path)
 {
 	FILE* fp = fileopen(path, "w");
 	double* ts = (double*)&(FFTWork[0]);
-	for (size_t i = 0; i < SamplesPerWaveform; i++){
-		fprintf(fp, "%20.10le\t%20.10le\n", WaveformTime[i], ts[i]);
+	for (size_t i = 0; i < D.SamplesPerWaveform; i++){
+		fprintf(fp, "%20.10le\t%20.10le\n", D.WaveformTime[i], ts[i]);
 	}
 	fclose(fp);
 }
@@ -734,6 +894,89 @@ void cTDEmSystem::forwardmodel(const std::vector<double>& conductivity, const st
 	setsecondaryfields();
 }
 
+void cTDEmSystem::forwardmodel_jacobian(const cTDEmGeometry& G, const cEarth1D& E, cTDEmResponse& R, std::vector<double>& JX, std::vector<double>& JY, std::vector<double>& JZ)
+{
+	forwardmodel(G, E, R);
+
+	const size_t nl = Earth.NumLayers;
+	const size_t nf = D.NumberOfDiscreteFrequencies;
+	const size_t nw = D.NumberOfWindows;
+
+	JX.assign(nw*nl, 0.0);
+	JY.assign(nw*nl, 0.0);
+	JZ.assign(nw*nl, 0.0);
+
+	//Frequency domain derivatives for every layer, indexed li*nf + fi
+	std::vector<double> dHxR(nl*nf), dHxI(nl*nf);
+	std::vector<double> dHyR(nl*nf), dHyI(nl*nf);
+	std::vector<double> dHzR(nl*nf), dHzI(nl*nf);
+
+	Earth.calculation_type = CT_CONDUCTIVITYDERIVATIVE;
+	{
+		PROFILE_SCOPE(profiler::FORWARD_INTEGRALS);
+		for (size_t fi = 0; fi < nf; fi++){
+			Earth.dointegrals_conductivityderivatives(fi);
+			HankelTransforms& H = Earth.Hankel[fi];
+			for (size_t li = 0; li < nl; li++){
+				H.I0.dC = Earth.dCI0[li];
+				H.I1.dC = Earth.dCI1[li];
+				H.I2.dC = Earth.dCI2[li];
+				Earth.setsecondaryfields(fi);
+				const cdouble& x = Earth.Fields.t.s.x;
+				const cdouble& y = Earth.Fields.t.s.y;
+				const cdouble& z = Earth.Fields.t.s.z;
+				cVec vr = rotatetoreceiverorientation(cVec(x.real(), y.real(), z.real()));
+				cVec vi = rotatetoreceiverorientation(cVec(x.imag(), y.imag(), z.imag()));
+				
+				const size_t k = li*nf + fi;
+				dHxR[k] = vr.x;
+				dHxI[k] = vi.x;
+				dHyR[k] = vr.y;
+				dHyI[k] = vi.y;
+				dHzR[k] = vr.z;
+				dHzI[k] = vi.z;
+			}
+		}
+	}
+	Earth.calculation_type = CT_FORWARDMODEL;
+
+	//The time domain transform is linear so applies to the derivatives as is
+	const bool savediagnostics = SaveDiagnosticFiles;
+	SaveDiagnosticFiles = false;
+	for (size_t li = 0; li < nl; li++){
+		const size_t k = li*nf;
+		if (UseLinearOperator){
+			PROFILE_SCOPE(profiler::FORWARD_OPERATOR);
+			if (D.XScale != 0.0) D.applyoperator(D.XOperator, &dHxR[k], &dHxI[k], X);
+			if (D.YScale != 0.0) D.applyoperator(D.YOperator, &dHyR[k], &dHyI[k], Y);
+			if (D.ZScale != 0.0) D.applyoperator(D.ZOperator, &dHzR[k], &dHzI[k], Z);
+		}
+		else{
+			std::copy(dHxR.begin() + k, dHxR.begin() + k + nf, HxR.begin());
+			std::copy(dHxI.begin() + k, dHxI.begin() + k + nf, HxI.begin());
+			std::copy(dHyR.begin() + k, dHyR.begin() + k + nf, HyR.begin());
+			std::copy(dHyI.begin() + k, dHyI.begin() + k + nf, HyI.begin());
+			std::copy(dHzR.begin() + k, dHzR.begin() + k + nf, HzR.begin());
+			std::copy(dHzI.begin() + k, dHzI.begin() + k + nf, HzI.begin());
+			transformsecondaryfields();
+		}
+
+		//Chain rule to natural log conductivity
+		const double c = Earth.Layer[li].Conductivity;
+		for (size_t w = 0; w < nw; w++){
+			if (D.XScale != 0.0) JX[w*nl + li] = X[w] * c;
+			if (D.YScale != 0.0) JY[w*nl + li] = Y[w] * c;
+			if (D.ZScale != 0.0) JZ[w*nl + li] = Z[w] * c;
+		}
+	}
+	SaveDiagnosticFiles = savediagnostics;
+
+	//Leave the forward responses as they were
+	X = R.SX;
+	Y = R.SY;
+	Z = R.SZ;
+}
+
 void cTDEmSystem::drx_pitch(double xb, double zb, double p, double& dxbdp, double& dzbdp)
 {
 	//xi = (  xb*cosp  + zb*sinp);Inertial
@@ -806,7 +1049,7 @@ void  cTDEmSystem::drx_roll(const std::vector<double>& yb, const std::vector<dou
 
 }
 
-void cTDEmSystem::readsystemdescriptorfile(std::string systemdescriptorfile)
+void cTDEmSystemDescription::readsystemdescriptorfile(std::string systemdescriptorfile)
 {
 	STM = cBlock(systemdescriptorfile);
 	SystemName = STM.getstringvalue("Name");
@@ -881,9 +1124,9 @@ void cTDEmSystem::readsystemdescriptorfile(std::string systemdescriptorfile)
 
 	initialise_windows();
 	
-	Earth.ModellingLoopRadius = STM.getdoublevalue("ForwardModelling.ModellingLoopRadius");
-	if (Earth.ModellingLoopRadius == cBlock::ud_double()){
-		Earth.ModellingLoopRadius = 0.0;
+	ModellingLoopRadius = STM.getdoublevalue("ForwardModelling.ModellingLoopRadius");
+	if (ModellingLoopRadius == cBlock::ud_double()){
+		ModellingLoopRadius = 0.0;
 	}
 
 	std::string ot = STM.getstringvalue("ForwardModelling.OutputType");
@@ -902,7 +1145,7 @@ void cTDEmSystem::readsystemdescriptorfile(std::string systemdescriptorfile)
 		warningmessage("cTDEmSystem::readsystemdescriptorfile: It is wise to use at least 5 frequencies per decade\n");
 	}
 
-	Earth.NumAbscissa = (size_t)STM.getintvalue("ForwardModelling.NumberOfAbsiccaInHankelTransformEvaluation");
+	NumAbscissa = (size_t)STM.getintvalue("ForwardModelling.NumberOfAbsiccaInHankelTransformEvaluation");
 
 	std::string n = STM.getstringvalue("ForwardModelling.SecondaryFieldNormalisation");
 	if (strcasecmp(n, "None")==0){
@@ -919,12 +1162,15 @@ void cTDEmSystem::readsystemdescriptorfile(std::string systemdescriptorfile)
 	}
 	
 	SaveDiagnosticFiles = STM.getboolvalue("ForwardModelling.SaveDiagnosticFiles");
+	if (STM.getvalue("ForwardModelling.LinearOperator", LinearOperator) == false){
+		LinearOperator = true;
+	}
 	
 	if (WaveformTime.size() <= 2 || WaveformTime.size() != T_Waveform.size()){
 		errormessage("cTDEmSystem::readsystemdescriptorfile(): The number of WaveformTime values must match number of WaveformCurrent/WaveformReceived values and also be more than two\n");
 	}
 
-	if (Earth.NumAbscissa < 17){
+	if (NumAbscissa < 17){
 		warningmessage("cTDEmSystem::readsystemdescriptorfile(): It is wise to use at least 17 Absicca for integrating the Hankel Transforms");
 	}
 
@@ -933,15 +1179,16 @@ void cTDEmSystem::readsystemdescriptorfile(std::string systemdescriptorfile)
 	systeminitialise();
 };
 
-void cTDEmSystem::systeminitialise()
+void cTDEmSystemDescription::systeminitialise()
 {
 	createwaveform();
 	setupdiscretefrequencies();
-	setup_splines();
-	setup_scaling();	
+	setup_splineinterp(DiscreteFrequenciesLog10, SplinedFrequencieslog10);
+	setup_scaling();
+	setup_linearoperators();	
 }
 
-double cTDEmSystem::compute_peak_didt()
+double cTDEmSystemDescription::compute_peak_didt()
 {
 	double maxdidt = 0.0;
 	for (size_t i = 1; i < WaveformCurrent.size(); i++){
@@ -954,7 +1201,7 @@ double cTDEmSystem::compute_peak_didt()
 	return maxdidt;
 }
 
-void cTDEmSystem::setup_scaling(){
+void cTDEmSystemDescription::setup_scaling(){
 
 	TX_PeakdIdT = compute_peak_didt();
 	double txscale = MUZERO*TX_LoopArea*TX_NumberOfTurns*TX_PeakCurrent;
@@ -972,8 +1219,23 @@ void cTDEmSystem::setup_scaling(){
 			errormessage("cTDEmSystem::setup_ppm_normalisation(): Must define a ReferenceGeometry for PPM or PPMPEAKTOPEAK normalisation\n");
 		}
 		NormalizationGeometry = cTDEmGeometry(b);
-		setgeometry(NormalizationGeometry);
-		setprimaryfields();
+
+		//Primary field at the reference geometry, as cTDEmSystem::setprimaryfields
+		const cTDEmGeometry& g = NormalizationGeometry;
+		LE earth;
+		earth.calculation_type = CT_FORWARDMODEL;
+		earth.ModellingLoopRadius = ModellingLoopRadius;
+		earth.setgeometry(earth.pitchrolldipole(g.tx_pitch, g.tx_roll), g.tx_height, g.txrx_dx, g.txrx_dy, g.tx_height + g.txrx_dz);
+		earth.setprimaryfields();
+
+		cVec p = cVec(earth.Fields.t.p.x, earth.Fields.t.p.y, earth.Fields.t.p.z);
+		if (OutputType == OT_DBDT){
+			p = p * TX_PeakdIdT;
+		}
+		p = rotatetoreceiverorientation(p, g.rx_roll, g.rx_pitch);
+		double PrimaryX = p.x * XScale;
+		double PrimaryY = p.y * YScale;
+		double PrimaryZ = p.z * ZScale;
 
 		double s = 1.0;
 		if (Normalisation == NT_PPM)  s *= 1.0e6;
@@ -994,7 +1256,7 @@ void cTDEmSystem::setup_scaling(){
 		
 }
 
-void cTDEmSystem::setupdiscretefrequencies()
+void cTDEmSystemDescription::setupdiscretefrequencies()
 {
 	double lf1 = log10(BaseFrequency);
 	double lf2 = log10(SampleFrequency / 2);
@@ -1019,7 +1281,7 @@ void cTDEmSystem::setupdiscretefrequencies()
 	}
 }
 
-void cTDEmSystem::digitisewaveform(const dmatrix& wp, std::vector<double>& t, std::vector<double>& v)
+void cTDEmSystemDescription::digitisewaveform(const dmatrix& wp, std::vector<double>& t, std::vector<double>& v)
 {
 	double hp = 0.5 / BaseFrequency;
 	SampleInterval = 1.0 / SampleFrequency;
@@ -1080,7 +1342,7 @@ void cTDEmSystem::digitisewaveform(const dmatrix& wp, std::vector<double>& t, st
 	}
 }
 
-dmatrix cTDEmSystem::readwaveformfile(const std::string& filename)
+dmatrix cTDEmSystemDescription::readwaveformfile(const std::string& filename)
 {
 	FILE* fp = fileopen(filename, "r");
 	if (fp == NULL){
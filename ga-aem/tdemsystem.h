@@ -11,6 +11,7 @@ Author: Ross C. Brodie, Geoscience Australia.
 #define _tdemsystem_H
 
 #include <complex>
+#include <memory>
 #include "fftw3.h"
 #include "general_utils.h"
 #include "geometry3d.h"
@@ -129,56 +130,27 @@ struct WindowSpecification{
 
 
 //---------------------------------------------------------------------------
-class cTDEmSystem{
-
-private:
-	std::vector<double> HxR;
-	std::vector<double> HxI;
-	std::vector<double> HyR;
-	std::vector<double> HyI;
-	std::vector<double> HzR;
-	std::vector<double> HzI;
-	std::vector<double> HxR_spline;
-	std::vector<double> HxI_spline;
-	std::vector<double> HyR_spline;
-	std::vector<double> HyI_spline;
-	std::vector<double> HzR_spline;
-	std::vector<double> HzI_spline;
+//Everything that follows from the system descriptor file alone (waveform, windows,
+//transfer function, discrete and splined frequencies, spline interpolation weights and
+//output scaling). It is built once and never modified afterwards, so any number of
+//cTDEmSystem instances on any number of threads can share one through a shared_ptr.
+class cTDEmSystemDescription{
 
-	std::vector<double> h2_spline;
-	std::vector<double> a_spline;
-	std::vector<double> b_spline;
-	std::vector<size_t> klo_spline;
-	std::vector<size_t> khi_spline;
-	std::vector<double> a3ma_spline;
-	std::vector<double> b3mb_spline;
-
-	std::vector<cdouble> X_splined;
-	std::vector<cdouble> Y_splined;
-	std::vector<cdouble> Z_splined;
- 
 public:
 
-  cTDEmSystem();
-  cTDEmSystem(std::string systemdescriptorfile);
-  ~cTDEmSystem();
-  void initialise();
+  cTDEmSystemDescription(std::string systemdescriptorfile);
 
   std::string SystemName;
   std::string SystemType;  
-  LE Earth;
   cBlock STM;
   bool SaveDiagnosticFiles;
-      
-  cVec xaxis;
-  cVec yaxis;
-  cVec zaxis;
 
   eOutputType OutputType;
   eNormalizationType Normalisation;
   
   size_t NumberOfWindows;
   std::string WindowWeightingScheme;
+  std::vector<WindowSpecification> WinSpec;
 
   double BaseFrequency;
   double BasePeriod;
@@ -196,9 +168,7 @@ public:
   std::vector<double>  T_Waveform;
   std::vector<cdouble> F_Waveform;
   std::vector<cdouble> Transfer;
-  std::vector<cdouble> FFTWork;
   std::vector<double>  fft_frequency;    
-  fftw_plan fftwplan_backward;  
 	  
   size_t FrequenciesPerDecade;
   size_t NumberOfDiscreteFrequencies;  
@@ -209,12 +179,117 @@ public:
   double FrequencyLog10Spacing;  
   std::vector<double> LowPassFilterCutoffFrequency;
   std::vector<double> LowPassFilterOrder;
-  std::vector<double> SplinedFrequencieslog10;;
+  std::vector<double> SplinedFrequencieslog10;
+
+  //Cubic spline weights from the discrete to the splined frequencies
+  std::vector<double> h2_spline;
+  std::vector<double> a_spline;
+  std::vector<double> b_spline;
+  std::vector<size_t> klo_spline;
+  std::vector<size_t> khi_spline;
+  std::vector<double> a3ma_spline;
+  std::vector<double> b3mb_spline;
+
+  //Everything after the discrete frequency fields (spline, interpolation, transfer
+  //function, inverse FFT and windowing) is linear in the fields and fixed by the STM, so
+  //it is also kept as one NumberOfWindows x 2*NumberOfDiscreteFrequencies matrix per
+  //component, row major by window with the real parts ahead of the imaginary parts.
+  //ForwardModelling.LinearOperator = no in the STM falls back to the FFT path.
+  bool LinearOperator;
+  std::vector<double> XOperator;
+  std::vector<double> YOperator;
+  std::vector<double> ZOperator;
+
+  double ModellingLoopRadius;
+  size_t NumAbscissa;
 
   double TX_LoopArea;
   double TX_NumberOfTurns;
   double TX_PeakCurrent;
   double TX_PeakdIdT;
+
+  cTDEmGeometry NormalizationGeometry;
+  double XScale;
+  double YScale;
+  double ZScale;
+
+  void readsystemdescriptorfile(std::string systemdescriptorfile);
+  void systeminitialise();
+  double compute_peak_didt();
+  void setup_scaling();
+  void createwaveform();
+  void setupdiscretefrequencies();
+  void setup_splineinterp(const std::vector<double>& xn, const std::vector<double>& xi);  
+  double calculate_fft_frequency(size_t index) const;
+  void setup_linearoperators();
+  void applyoperator(const std::vector<double>& op, const double* real, const double* imag, std::vector<double>& W) const;
+  static void spline(const std::vector<double>& x, const std::vector<double>& y, double yp1, double ypn, std::vector<double>& y2);
+
+  void initialise_windows();
+  void initialise_windows_area();
+  void initialise_windows_boxcar();
+  void initialise_windows_lineartaper();
+  void computewindow(const double* timeseries, std::vector<double>& W) const;
+
+  dmatrix readwaveformfile(const std::string& filename);
+  void digitisewaveform(const dmatrix& w, std::vector<double>& t, std::vector<double>& v);	  
+
+  void write_timedomainwaveform(const std::string& path) const;
+  void write_frequencydomainwaveform(const std::string& path) const;
+
+  static cVec rotatetoreceiverorientation(cVec v, const double rx_roll, const double rx_pitch);
+};
+
+//---------------------------------------------------------------------------
+//The forward modelling workspace: the layered earth, frequency domain fields, spline,
+//FFT buffers and plan, and the outputs. Instances are not thread safe but are cheap to
+//create from a shared description, so give each thread its own.
+class cTDEmSystem{
+
+private:
+	std::shared_ptr<const cTDEmSystemDescription> Description;
+	const cTDEmSystemDescription& D;
+
+	std::vector<double> HxR;
+	std::vector<double> HxI;
+	std::vector<double> HyR;
+	std::vector<double> HyI;
+	std::vector<double> HzR;
+	std::vector<double> HzI;
+	std::vector<double> HxR_spline;
+	std::vector<double> HxI_spline;
+	std::vector<double> HyR_spline;
+	std::vector<double> HyI_spline;
+	std::vector<double> HzR_spline;
+	std::vector<double> HzI_spline;
+
+	std::vector<cdouble> X_splined;
+	std::vector<cdouble> Y_splined;
+	std::vector<cdouble> Z_splined;
+ 
+public:
+
+  cTDEmSystem(std::string systemdescriptorfile);
+  cTDEmSystem(std::shared_ptr<const cTDEmSystemDescription> description);
+  cTDEmSystem(const cTDEmSystem&) = delete;
+  cTDEmSystem& operator=(const cTDEmSystem&) = delete;
+  ~cTDEmSystem();
+  void initialise();
+
+  const cTDEmSystemDescription& description() const { return D; }
+  std::shared_ptr<const cTDEmSystemDescription> shared_description() const { return Description; }
+
+  LE Earth;
+  bool SaveDiagnosticFiles;
+  bool UseLinearOperator;
+      
+  cVec xaxis;
+  cVec yaxis;
+  cVec zaxis;
+
+  std::vector<cdouble> FFTWork;
+  fftw_plan fftwplan_backward;  
+
   double TX_height;
   double TX_pitch;
   double TX_roll;
@@ -224,11 +299,6 @@ public:
   double RX_roll;  
   cVec TX_RX_separation;
 
-  cTDEmGeometry NormalizationGeometry;
-  double XScale;
-  double YScale;
-  double ZScale;
-
   std::vector<double> X; //Secondary X field
   std::vector<double> Y; //Secondary Y field 
   std::vector<double> Z; //Secondary Z field 
@@ -236,35 +306,22 @@ public:
   double PrimaryY;  //Primary Y field
   double PrimaryZ;  //Primary Z field
       
-  void readsystemdescriptorfile(std::string systemdescriptorfile);
-  void systeminitialise();
   void forwardmodel(const std::vector<double>& conductivity, const std::vector<double>& thickness, const cTDEmGeometry& geometry);
   void setconductivitythickness(const std::vector<double>& conductivity, const std::vector<double>& thickness);
 
-  double compute_peak_didt();
-  void setup_scaling();
-  void createwaveform();
-  void setupdiscretefrequencies();
-  double calculate_fft_frequency(size_t index);
   void setgeometry(const cTDEmGeometry& G);
   void setgeometry(const double tx_height, const double tx_roll, const double tx_pitch, const double tx_yaw, const double txrx_dx, const double txrx_dy, const double txrx_dz, const double rx_roll, const double rx_pitch, const double rx_yaw);
   void setupcomputations();					
   void setprimaryfields();
   void setsecondaryfields();
+  void transformsecondaryfields();
+  void applylinearoperators();
   void inversefft(){fftw_execute(fftwplan_backward);}
       
-  void initialise_windows();
-  void initialise_windows_area();
-  void initialise_windows_boxcar();
-  void initialise_windows_lineartaper();
-
-  void computewindow(const double* timeseries, std::vector<double>& W);
-  std::vector<WindowSpecification> WinSpec;
+  void computewindow(const double* timeseries, std::vector<double>& W){ D.computewindow(timeseries, W); }
 
   void printwindows();
   void write_windows(const std::string& path);
-  void write_timedomainwaveform(const std::string& path);
-  void write_frequencydomainwaveform(const std::string& path);
   void write_discretefrequencies(const std::string& path);
   void write_splinedfrequencies(const std::string& path);
   void write_frequencyseries(const std::string& path);
@@ -285,17 +342,20 @@ public:
   }
      
   void setup_splines();
-  void spline(const std::vector<double>& x, const std::vector<double>& y, double yp1, double ypn, std::vector<double>& y2);
-  void setup_splineinterp(const std::vector<double>& xn, const std::vector<double>& xi);  
+  void spline(const std::vector<double>& x, const std::vector<double>& y, double yp1, double ypn, std::vector<double>& y2){ cTDEmSystemDescription::spline(x, y, yp1, ypn, y2); }
   void spline_interp();  
   cVec rotatetoreceiverorientation(cVec v);  
-  dmatrix readwaveformfile(const std::string& filename);
-  void digitisewaveform(const dmatrix& w, std::vector<double>& t, std::vector<double>& v);	  
   void drx_pitch(const double xb, const double zb, const double p, double& dxbdp, double& dzbdp);
   void drx_roll(const double yb, const double zb, const double r, double& dybdr, double& dzbdr);
   void drx_pitch(const std::vector<double>& xb, const std::vector<double>& zb, const double p, std::vector<double>& dxbdp, std::vector<double>& dzbdp);
   void drx_roll( const std::vector<double>& yb, const std::vector<double>& zb, const double r, std::vector<double>& dybdr, std::vector<double>& dzbdr);
   void forwardmodel(const cTDEmGeometry& G, const cEarth1D& E, cTDEmResponse& R);
+
+  //Forward model as above plus the Jacobian of the secondary fields with respect to the
+  //natural log conductivity of each layer, JX/JY/JZ are NumberOfWindows x NumLayers (row
+  //major by window) and zero for components with zero scale. The forward model propogation
+  //matrices are reused and the integrals for all layers share one pass over the abscissae.
+  void forwardmodel_jacobian(const cTDEmGeometry& G, const cEarth1D& E, cTDEmResponse& R, std::vector<double>& JX, std::vector<double>& JY, std::vector<double>& JZ);
 };
 ////////////////////////////////////////////////////////////////////////////
 
@@ -24,10 +24,17 @@
 //
 //
 
+#include <algorithm>
+
+#include <limits.h>
+
 #include "aemexception.hpp"
 #include "aemobservations.hpp"
 
 #include "global.hpp"
+#include "checkpoint.hpp"
+#include "linearisation.hpp"
+#include "profiler.hpp"
 
 extern "C" {
   #include "hnk_cartesian_nonsquare.h"
@@ -39,27 +46,63 @@ extern "C" {
 
 const int CHAIN_STEPS = 1000000;
 
+static aemobservations *load_observations(const char *filename, bool posteriork, MPI_Comm broadcast_communicator);
+static aemobservations *load_observations_broadcast(const char *filename, MPI_Comm communicator);
+
 int global_coordtoindex(void *user, int i, int j, int k, int depth)
 {
-  wavetree2d_sub_t *wt = (wavetree2d_sub_t*)user;
+  Global *global = (Global*)user;
 
-  return wavetree2d_sub_from_2dindices(wt, i, j);
+  return wavetree2d_sub_from_2dindices(global->wt, i, j);
 }
 
 int global_indextocoord(void *user, int index, int *i, int *j, int *k, int *depth)
 {
-  wavetree2d_sub_t *wt = (wavetree2d_sub_t*)user;
+  Global *global = (Global*)user;
 
-  if (wavetree2d_sub_2dindices(wt, index, i, j) < 0) {
+  if (index < 0 || index >= global->ncoeff) {
     return -1;
   }
 
+  const coefficient_index &c = global->coefficients[index];
+  *i = c.ii;
+  *j = c.ij;
   *k = 0;
-  *depth = wavetree2d_sub_depthofindex(wt, index);
+  *depth = c.depth;
   return 0;
 }
 
 Global::Global(const char *filename,
+	       const std::vector<std::string> &stm_files,
+	       const char *initial_model,
+	       const char *prior_file,
+	       int _degreex,
+	       int _degreey,
+	       double _depth,
+	       const std::vector<std::string> &hierarchical_files,
+	       int seed,
+	       int _kmax,
+	       bool _posteriork,
+	       int hwavelet,
+	       int vwavelet,
+	       MPI_Comm broadcast_communicator) :
+  Global(load_observations(filename, _posteriork, broadcast_communicator),
+	 stm_files,
+	 initial_model,
+	 prior_file,
+	 _degreex,
+	 _degreey,
+	 _depth,
+	 hierarchical_files,
+	 seed,
+	 _kmax,
+	 _posteriork,
+	 hwavelet,
+	 vwavelet)
+{
+}
+
+Global::Global(aemobservations *_observations,
 	       const std::vector<std::string> &stm_files,
 	       const char *initial_model,
 	       const char *prior_file,
@@ -79,9 +122,11 @@ Global::Global(const char *filename,
   ch(nullptr),
   hnk(nullptr),
   proposal(nullptr),
+  proposal_seed(seed),
   degreex(_degreex),
   degreey(_degreey),
-  observations(nullptr),
+  forwardmodel_count(0),
+  observations(_observations),
   image(nullptr),
   model(nullptr),
   workspace(nullptr),
@@ -102,8 +147,11 @@ Global::Global(const char *filename,
   size(-1),
   ncoeff(-1),
   lambda_scale(1.0),
+  hierarchical_exponent(0.0),
+  hierarchical_statistics_valid(false),
   current_likelihood(-1.0),
   coeff_hist(nullptr),
+  screen(nullptr),
   random(seed),
   posteriork(_posteriork),
   communicator(MPI_COMM_NULL),
@@ -113,7 +161,9 @@ Global::Global(const char *filename,
   column_offsets(nullptr),
   column_sizes(nullptr),
   residual_offsets(nullptr),
-  residual_sizes(nullptr)
+  residual_sizes(nullptr),
+  partitioned(false),
+  residual_base(0)
 {
   if (degreex < 0 || degreex >= 16 ||
       degreey < 0 || degreey >= 16) {
@@ -125,10 +175,9 @@ Global::Global(const char *filename,
   }
 
   if (!posteriork) {
-    //
-    // Load observations
-    //
-    observations = new aemobservations(filename);
+    if (observations == nullptr) {
+      throw AEMEXCEPTION("No observations\n");
+    }
 
     //
     // Load stm files
@@ -138,10 +187,10 @@ Global::Global(const char *filename,
 
       forwardmodel.push_back(p);
 
-      double *centre_time = new double[p->WinSpec.size()];
+      double *centre_time = new double[p->description().WinSpec.size()];
 
       int t = 0;
-      for (auto &w : p->WinSpec) {
+      for (auto &w : p->description().WinSpec) {
 	centre_time[t] = (w.TimeLow + w.TimeHigh)/2.0;
 	t ++;
       }
@@ -151,10 +200,10 @@ Global::Global(const char *filename,
       //
       // Create covariance information
       //
-      cov_count.push_back(p->WinSpec.size());
-      cov_delta.push_back(new double[p->WinSpec.size()]);
-      cov_mu.push_back(new double[p->WinSpec.size()]);
-      cov_sigma.push_back(new double[p->WinSpec.size() * p->WinSpec.size()]);
+      cov_count.push_back(p->description().WinSpec.size());
+      cov_delta.push_back(new double[p->description().WinSpec.size()]);
+      cov_mu.push_back(new double[p->description().WinSpec.size()]);
+      cov_sigma.push_back(new double[p->description().WinSpec.size() * p->description().WinSpec.size()]);
       
     }
 
@@ -166,6 +215,23 @@ Global::Global(const char *filename,
       
       lambda.push_back(m);
     }
+
+    //
+    // Check whether the cached statistics form of the hierarchical
+    // likelihood can be used
+    //
+    if (lambda.size() > 0) {
+      hierarchical_exponent = lambda[0]->scale_exponent();
+      for (auto &l : lambda) {
+	if (l->scale_exponent() != hierarchical_exponent) {
+	  hierarchical_exponent = 0.0;
+	}
+      }
+
+      hierarchical_sum_squares.resize(lambda.size(), 0.0);
+      hierarchical_log_normalization.resize(lambda.size(), 0.0);
+      hierarchical_count.resize(lambda.size(), 0.0);
+    }
     
     if (forwardmodel.size() != observations->points[0].responses.size()) {
       throw AEMEXCEPTION("Mismatch in STM and responses size: %d != %d\n",
@@ -184,9 +250,39 @@ Global::Global(const char *filename,
   size = wavetree2d_sub_get_size(wt);
   ncoeff = wavetree2d_sub_get_ncoeff(wt);
   treemaxdepth = wavetree2d_sub_maxdepth(wt);
+  value_proposal_scale.resize(treemaxdepth + 1, 1.0);
 
   INFO("Image: %d x %d\n", width, height);
 
+  //
+  // Coefficient index table
+  //
+  coefficients.resize(ncoeff);
+  for (int i = 0; i < ncoeff; i ++) {
+    coefficient_index &c = coefficients[i];
+    
+    if (wavetree2d_sub_2dindices(wt, i, &c.ii, &c.ij) < 0) {
+      throw AEMEXCEPTION("Failed to get 2d indices\n");
+    }
+
+    c.depth = wavetree2d_sub_depthofindex(wt, i);
+    c.parent = (i == 0) ? -1 : wavetree2d_sub_parent_index(wt, i);
+    c.column_min = -1;
+    c.column_max = -1;
+    c.vmin = 0.0;
+    c.vmax = 0.0;
+  }
+
+  hwaveletf = wavelet_inverse_function_from_id(hwavelet);
+  if (hwaveletf == nullptr) {
+    throw AEMEXCEPTION("Invalid horizontal wavelet %d\n", hwavelet);
+  }
+
+  vwaveletf = wavelet_inverse_function_from_id(vwavelet);
+  if (vwaveletf == nullptr) {
+    throw AEMEXCEPTION("Invalid vertical wavelet %d\n", vwavelet);
+  }
+
   if (!posteriork) {
     if ((int)observations->points.size() != width) {
       throw AEMEXCEPTION("Image size mismatch to observations: %d != %d\n",
@@ -206,19 +302,9 @@ Global::Global(const char *filename,
     int ntotal = observations->total_response_datapoints();
     INFO("Data: %d total points\n", ntotal);
 
-    residual_size = ntotal;
-    residual = new double[residual_size];
-    mean_residual = new double[residual_size];
-    last_valid_residual = new double[residual_size];
-    residual_normed = new double[residual_size];
-    mean_residual_normed = new double[residual_size];
-    last_valid_residual_normed = new double [residual_size];
+    residuals_per_column = ntotal/image->columns;
 
-    residuals_per_column = residual_size/image->columns;
-
-    residual_hist = new int[residual_size * residual_hist_bins];
-
-    reset_residuals();
+    allocate_residuals(0, ntotal);
   }
   
   if (initial_model == NULL) {
@@ -264,7 +350,7 @@ Global::Global(const char *filename,
   coeff_hist = coefficient_histogram_create(ncoeff, 100, -1.0, 1.0,
 					    global_coordtoindex,
 					    global_indextocoord,
-					    wt);
+					    this);
   if (coeff_hist == NULL) {
     throw AEMEXCEPTION("Failed to create coefficient histogram\n");
   }
@@ -277,50 +363,109 @@ Global::Global(const char *filename,
     if (proposal == NULL) {
       throw AEMEXCEPTION("Failed to load proposal file\n");
     }
+    proposal_file = prior_file;
     
     for (int i = 0; i < ncoeff; i ++) {
-      int depth = wavetree2d_sub_depthofindex(wt, i);
-      
-      int ii, ij;
-      if (wavetree2d_sub_2dindices(wt, i, &ii, &ij) < 0) {
-	throw AEMEXCEPTION("Failed to get 2d indices\n");
-      }
+      coefficient_index &c = coefficients[i];
       
-      double vmin, vmax;
       if (wavetree_pp_prior_range2d(proposal,
-				    ii,
-				    ij,
-				    depth,
+				    c.ii,
+				    c.ij,
+				    c.depth,
 				    treemaxdepth,
 				    0.0,
-				    &vmin,
-				    &vmax) < 0) {
+				    &c.vmin,
+				    &c.vmax) < 0) {
 	throw AEMEXCEPTION("Failed to get coefficient range\n");
       }
       
       if (coefficient_histogram_set_range(coeff_hist, 
 					  i,
-					  vmin,
-					  vmax) < 0) {
+					  c.vmin,
+					  c.vmax) < 0) {
 	throw AEMEXCEPTION("Failed to set coefficient histogram range\n");
       }
     }
   }
     
-  hwaveletf = wavelet_inverse_function_from_id(hwavelet);
-  if (hwaveletf == nullptr) {
-    throw AEMEXCEPTION("Invalid horizontal wavelet %d\n", hwavelet);
-  }
+}
 
-  vwaveletf = wavelet_inverse_function_from_id(vwavelet);
-  if (vwaveletf == nullptr) {
-    throw AEMEXCEPTION("Invalid vertical wavelet %d\n", vwavelet);
-  }
+Global::~Global()
+{
+}
 
+void
+Global::initialize_screening(double max_drift)
+{
+  delete screen;
+  screen = new linearisation(*this, max_drift);
 }
 
-Global::~Global()
+void
+Global::freeze_screening()
 {
+  if (screen != nullptr) {
+    screen->freeze();
+  }
+}
+
+void
+Global::column_support(int index, int &lo, int &hi)
+{
+  coefficient_index &c = coefficients[index];
+  
+  if (c.column_min < 0) {
+
+    //
+    // Inverse transform of a unit coefficient, this only depends on the
+    // wavelet bases so is done once per coefficient.
+    //
+    int workspacesize = width;
+    if (height > width) {
+      workspacesize = height;
+    }
+    
+    std::vector<double> impulse(size, 0.0);
+    std::vector<double> impulse_workspace(workspacesize);
+    
+    impulse[c.ij * width + c.ii] = 1.0;
+
+    if (generic_lift_inverse2d(impulse.data(),
+			       width,
+			       height,
+			       width,
+			       impulse_workspace.data(),
+			       hwaveletf,
+			       vwaveletf,
+			       1) < 0) {
+      throw AEMEXCEPTION("Failed to do inverse transform on impulse\n");
+    }
+
+    int l = width;
+    int h = -1;
+    for (int j = 0; j < height; j ++) {
+      for (int i = 0; i < width; i ++) {
+	if (impulse[j * width + i] != 0.0) {
+	  if (i < l) {
+	    l = i;
+	  }
+	  if (i > h) {
+	    h = i;
+	  }
+	}
+      }
+    }
+
+    if (h < 0) {
+      throw AEMEXCEPTION("Empty support for coefficient %d\n", index);
+    }
+
+    c.column_min = l;
+    c.column_max = h;
+  }
+
+  lo = c.column_min;
+  hi = c.column_max;
 }
 
 double
@@ -351,15 +496,18 @@ Global::likelihood(double &log_normalization)
     //
     // Inverse wavelet transform
     //
-    if (generic_lift_inverse2d(image->conductivity,
-			       width,
-			       height,
-			       width,
-			       workspace,
-			       hwaveletf,
-			       vwaveletf,
-			       1) < 0) {
-      throw AEMEXCEPTION("Failed to do inverse transform on coefficients\n");
+    {
+      PROFILE_SCOPE(profiler::WAVELET);
+      if (generic_lift_inverse2d(image->conductivity,
+				 width,
+				 height,
+				 width,
+				 workspace,
+				 hwaveletf,
+				 vwaveletf,
+				 1) < 0) {
+	throw AEMEXCEPTION("Failed to do inverse transform on coefficients\n");
+      }
     }
 
     double sum = 0.0;
@@ -406,6 +554,7 @@ Global::likelihood(double &log_normalization)
 	f->forwardmodel(geometry,
 			earth1d,
 			response);
+	forwardmodel_count ++;
 	
 	switch (r.d) {
 	case aemresponse::DIRECTION_X:
@@ -495,12 +644,39 @@ Global::hierarchical_likelihood(double proposed_lambda_scale,
       accept();
     }
 
+    if (hierarchical_exponent > 0.0) {
+      if (!hierarchical_statistics_valid) {
+	update_hierarchical_statistics();
+      }
+      return hierarchical_likelihood_scaled(proposed_lambda_scale, log_normalization);
+    }
+
+    return hierarchical_likelihood_columns(0,
+					   image->columns,
+					   proposed_lambda_scale,
+					   log_normalization);
+
+  } else {
+    return 1.0;
+  }
+}
+
+double
+Global::hierarchical_likelihood_columns(int column_offset,
+					int column_size,
+					double proposed_lambda_scale,
+					double &log_normalization)
+{
+  log_normalization = 0.0;
+
+  if (!posteriork) {
+
     double sum = 0.0;
     int residual_offset;
   
-    for (int i = 0; i < image->columns; i ++) {
+    for (int mi = 0, i = column_offset; mi < column_size; mi ++, i ++) {
       
-      residual_offset = i * residuals_per_column;
+      residual_offset = i * residuals_per_column - residual_base;
       aempoint &p = observations->points[i];
       
       for (int k = 0; k < (int)forwardmodel.size(); k ++) {
@@ -528,7 +704,7 @@ Global::hierarchical_likelihood(double proposed_lambda_scale,
 }
 
 void
-Global::initialize_mpi(MPI_Comm _communicator, double _temperature)
+Global::initialize_mpi(MPI_Comm _communicator, double _temperature, bool _partitioned)
 {
   communicator = _communicator;
 
@@ -572,6 +748,20 @@ Global::initialize_mpi(MPI_Comm _communicator, double _temperature)
   }
 
   temperature = _temperature;
+
+  partitioned = _partitioned;
+  if (partitioned && !posteriork) {
+    //
+    // Drop everything outside of our own columns
+    //
+    observations->retain(column_offsets[mpi_rank], column_sizes[mpi_rank]);
+    allocate_residuals(residual_offsets[mpi_rank], residual_sizes[mpi_rank]);
+
+    INFO("Partitioned: columns %d - %d, %d residuals",
+	 column_offsets[mpi_rank],
+	 column_offsets[mpi_rank] + column_sizes[mpi_rank] - 1,
+	 residual_size);
+  }
 }
 
 double
@@ -581,6 +771,81 @@ Global::likelihood_mpi(double &log_normalization)
     throw AEMEXCEPTION("MPI Parameters unset\n");
   }
   
+  if (!posteriork) {
+
+    double local_log_normalization;
+    double sum = likelihood_mpi_partial(local_log_normalization);
+
+    double total;
+    
+    {
+      PROFILE_SCOPE(profiler::MPI_REDUCE);
+      if (MPI_Reduce(&local_log_normalization, &total, 1, MPI_DOUBLE, MPI_SUM, 0, communicator) != MPI_SUCCESS) {
+	throw AEMEXCEPTION("Likelihood failed in reducing\n");
+      }
+    }
+    {
+      PROFILE_SCOPE(profiler::MPI_BCAST);
+      if (MPI_Bcast(&total, 1, MPI_DOUBLE, 0, communicator) != MPI_SUCCESS) {
+	throw AEMEXCEPTION("Likelihood failed in broadcast\n");
+      }
+    }
+
+    log_normalization = total;
+    
+    {
+      PROFILE_SCOPE(profiler::MPI_REDUCE);
+      if (MPI_Reduce(&sum, &total, 1, MPI_DOUBLE, MPI_SUM, 0, communicator) != MPI_SUCCESS) {
+	throw AEMEXCEPTION("Likelihood failed in reducing\n");
+      }
+    }
+    {
+      PROFILE_SCOPE(profiler::MPI_BCAST);
+      if (MPI_Bcast(&total, 1, MPI_DOUBLE, 0, communicator) != MPI_SUCCESS) {
+	throw AEMEXCEPTION("Likelihood failed in broadcast\n");
+      }
+    }
+
+
+    if (!partitioned) {
+      PROFILE_SCOPE(profiler::MPI_ALLGATHER);
+      MPI_Allgatherv(residual + residual_offsets[mpi_rank],
+		     residual_sizes[mpi_rank],
+		     MPI_DOUBLE,
+		     residual,
+		     residual_sizes,
+		     residual_offsets,
+		     MPI_DOUBLE,
+		     communicator);
+      
+      MPI_Allgatherv(residual_normed + residual_offsets[mpi_rank],
+		     residual_sizes[mpi_rank],
+		     MPI_DOUBLE,
+		     residual_normed,
+		     residual_sizes,
+		     residual_offsets,
+		     MPI_DOUBLE,
+		     communicator);
+    }
+
+    return total;
+    
+  } else {
+    log_normalization = 0.0;
+    
+    return 1.0;
+  }
+}
+
+double
+Global::likelihood_mpi_partial(double &local_log_normalization)
+{
+  if (communicator == MPI_COMM_NULL || mpi_rank < 0 || mpi_size < 0) {
+    throw AEMEXCEPTION("MPI Parameters unset\n");
+  }
+
+  local_log_normalization = 0.0;
+  
   if (!posteriork) {
     
     cEarth1D earth1d;
@@ -606,170 +871,442 @@ Global::likelihood_mpi(double &log_normalization)
     //
     // Inverse wavelet transform
     //
-    if (generic_lift_inverse2d(image->conductivity,
-			       width,
-			       height,
-			       width,
-			       workspace,
-			       hwaveletf,
-			       vwaveletf,
-			       1) < 0) {
-      throw AEMEXCEPTION("Failed to do inverse transform on coefficients\n");
+    {
+      PROFILE_SCOPE(profiler::WAVELET);
+      if (generic_lift_inverse2d(image->conductivity,
+				 width,
+				 height,
+				 width,
+				 workspace,
+				 hwaveletf,
+				 vwaveletf,
+				 1) < 0) {
+	throw AEMEXCEPTION("Failed to do inverse transform on coefficients\n");
+      }
     }
 
     double sum = 0.0;
-    double local_log_normalization = 0.0;
     int residual_offset;
     
     for (int mi = 0, i = column_offsets[mpi_rank]; mi < column_sizes[mpi_rank]; mi ++, i ++) {
 
-      residual_offset = i * residuals_per_column;
-      
-      aempoint &p = observations->points[i];
+      residual_offset = i * residuals_per_column - residual_base;
 
-      //
-      // Construct geometry
-      //
-      cTDEmGeometry geometry(p.tx_height,
-			     p.tx_roll,
-			     p.tx_pitch,
-			     p.tx_yaw,
-			     p.txrx_dx,
-			     p.txrx_dy,
-			     p.txrx_dz,
-			     p.rx_roll,
-			     p.rx_pitch,
-			     p.rx_yaw);
-      //
-      // Copy image column to earth model, our model is in log of conductivity so here we use exp
-      //
-      for (int j = 0; j < image->rows; j ++) {
-	earth1d.conductivity[j] = exp(image->conductivity[j * image->columns + i]);
+      sum += column_likelihood(i,
+			       image->conductivity,
+			       earth1d,
+			       residual + residual_offset,
+			       residual_normed + residual_offset,
+			       local_log_normalization);
+    }
+
+    return sum;
+    
+  } else {
+    return 0.0;
+  }
+}
+
+double
+Global::column_likelihood(int i,
+			  const double *conductivity,
+			  cEarth1D &earth1d,
+			  double *column_residual,
+			  double *column_residual_normed,
+			  double &log_normalization,
+			  const std::vector<cTDEmSystem*> *systems,
+			  double *system_likelihood)
+{
+  int residual_offset = 0;
+  
+  aempoint &p = observations->points[i];
+
+  //
+  // Construct geometry
+  //
+  cTDEmGeometry geometry(p.tx_height,
+			 p.tx_roll,
+			 p.tx_pitch,
+			 p.tx_yaw,
+			 p.txrx_dx,
+			 p.txrx_dy,
+			 p.txrx_dz,
+			 p.rx_roll,
+			 p.rx_pitch,
+			 p.rx_yaw);
+  //
+  // Copy image column to earth model, our model is in log of conductivity so here we use exp
+  //
+  for (int j = 0; j < image->rows; j ++) {
+    earth1d.conductivity[j] = exp(conductivity[j * image->columns + i]);
+  }
+  
+  const std::vector<cTDEmSystem*> &models = (systems == nullptr) ? forwardmodel : *systems;
+  
+  double point_sum = 0.0;
+  for (int k = 0; k < (int)models.size(); k ++) {
+    
+    cTDEmSystem *f = models[k];
+    hierarchicalmodel *h = lambda[k];
+    double *time = forwardmodel_time[k];
+    const aemresponse &r = p.responses[k];
+    
+    cTDEmResponse response;
+    double system_sum = 0.0;
+    
+    f->forwardmodel(geometry,
+		    earth1d,
+		    response);
+    forwardmodel_count ++;
+    
+    switch (r.d) {
+    case aemresponse::DIRECTION_X:
+      if (r.response.size() != response.SX.size()) {
+	throw AEMEXCEPTION("Size mismatch in X response\n");
+      }
+      for (int l = 0; l < (int)response.SX.size(); l ++) {
+	column_residual[residual_offset + l] = r.response[l] - response.SX[l];
       }
+      system_sum =
+	h->nll(r.response,
+	       time,
+	       column_residual + residual_offset,
+	       lambda_scale,
+	       column_residual_normed + residual_offset,
+	       log_normalization);
+
+      residual_offset += response.SX.size();
+      break;
       
-      double point_sum = 0.0;
-      for (int k = 0; k < (int)forwardmodel.size(); k ++) {
-	
-	cTDEmSystem *f = forwardmodel[k];
-	hierarchicalmodel *h = lambda[k];
-	double *time = forwardmodel_time[k];
-	const aemresponse &r = p.responses[k];
-	
-	cTDEmResponse response;
-	
-	f->forwardmodel(geometry,
-			earth1d,
-			response);
-	
-	switch (r.d) {
-	case aemresponse::DIRECTION_X:
-	  if (r.response.size() != response.SX.size()) {
-	    throw AEMEXCEPTION("Size mismatch in X response\n");
-	  }
-	  for (int l = 0; l < (int)response.SX.size(); l ++) {
-	    residual[residual_offset + l] = r.response[l] - response.SX[l];
-	  }
-	  point_sum +=
-	    h->nll(r.response,
-		   time,
-		   residual + residual_offset,
-		   lambda_scale,
-		   residual_normed + residual_offset,
-		   local_log_normalization);
+    case aemresponse::DIRECTION_Y:
+      if (r.response.size() != response.SY.size()) {
+	throw AEMEXCEPTION("Size mismatch in Y response\n");
+      }
+      for (int l = 0; l < (int)response.SY.size(); l ++) {
+	column_residual[residual_offset + l] = r.response[l] - response.SY[l];
+      }
+      system_sum =
+	h->nll(r.response,
+	       time,
+	       column_residual + residual_offset,
+	       lambda_scale,
+	       column_residual_normed + residual_offset,
+	       log_normalization);
+
+      residual_offset += response.SY.size();
+      break;
+      
+    case aemresponse::DIRECTION_Z:
+      if (r.response.size() != response.SZ.size()) {
+	throw AEMEXCEPTION("Size mismatch in Z response (%d != %d)\n", (int)r.response.size(), (int)response.SZ.size());
+      }
+      for (int l = 0; l < (int)response.SY.size(); l ++) {
+	column_residual[residual_offset + l] = r.response[l] - response.SZ[l];
+      }
+      system_sum =
+	h->nll(r.response,
+	       time,
+	       column_residual + residual_offset,
+	       lambda_scale,
+	       column_residual_normed + residual_offset,
+	       log_normalization);
+
+      residual_offset += response.SZ.size();
+      break;
+      
+    default:
+      throw AEMEXCEPTION("Unhandled direction\n");
+    }
 
-	  residual_offset += response.SX.size();
-	  break;
-	  
-	case aemresponse::DIRECTION_Y:
-	  if (r.response.size() != response.SY.size()) {
-	    throw AEMEXCEPTION("Size mismatch in Y response\n");
-	  }
-	  for (int l = 0; l < (int)response.SY.size(); l ++) {
-	    residual[residual_offset + l] = r.response[l] - response.SY[l];
-	  }
-	  point_sum +=
-	    h->nll(r.response,
-		   time,
-		   residual + residual_offset,
-		   lambda_scale,
-		   residual_normed + residual_offset,
-		   local_log_normalization);
+    point_sum += system_sum;
+    if (system_likelihood != nullptr) {
+      system_likelihood[k] += system_sum;
+    }
+  }
 
-	  residual_offset += response.SY.size();
-	  break;
-	  
-	case aemresponse::DIRECTION_Z:
-	  if (r.response.size() != response.SZ.size()) {
-	    throw AEMEXCEPTION("Size mismatch in Z response (%d != %d)\n", (int)r.response.size(), (int)response.SZ.size());
-	  }
-	  for (int l = 0; l < (int)response.SY.size(); l ++) {
-	    residual[residual_offset + l] = r.response[l] - response.SZ[l];
-	  }
-	  point_sum +=
-	    h->nll(r.response,
-		   time,
-		   residual + residual_offset,
-		   lambda_scale,
-		   residual_normed + residual_offset,
-		   local_log_normalization);
+  return point_sum;
+}
 
-	  residual_offset += response.SZ.size();
-	  break;
-	  
-	default:
-	  throw AEMEXCEPTION("Unhandled direction\n");
-	}
-	
-	
-      }
+void
+Global::column_jacobian(int i,
+			const double *conductivity,
+			cEarth1D &earth1d,
+			double *column_residual,
+			double *column_jacobian)
+{
+  int residual_offset = 0;
+  int nlayers = image->rows;
+  
+  aempoint &p = observations->points[i];
+
+  cTDEmGeometry geometry(p.tx_height,
+			 p.tx_roll,
+			 p.tx_pitch,
+			 p.tx_yaw,
+			 p.txrx_dx,
+			 p.txrx_dy,
+			 p.txrx_dz,
+			 p.rx_roll,
+			 p.rx_pitch,
+			 p.rx_yaw);
+
+  for (int j = 0; j < nlayers; j ++) {
+    earth1d.conductivity[j] = exp(conductivity[j * image->columns + i]);
+  }
+
+  std::vector<double> JX, JY, JZ;
+  
+  for (int k = 0; k < (int)forwardmodel.size(); k ++) {
+    
+    cTDEmSystem *f = forwardmodel[k];
+    const aemresponse &r = p.responses[k];
+    
+    cTDEmResponse response;
+    
+    f->forwardmodel_jacobian(geometry,
+			     earth1d,
+			     response,
+			     JX,
+			     JY,
+			     JZ);
+    forwardmodel_count ++;
+
+    const std::vector<double> *predicted;
+    const std::vector<double> *jacobian;
+    
+    switch (r.d) {
+    case aemresponse::DIRECTION_X:
+      predicted = &response.SX;
+      jacobian = &JX;
+      break;
       
-      sum += point_sum;
-	
+    case aemresponse::DIRECTION_Y:
+      predicted = &response.SY;
+      jacobian = &JY;
+      break;
+      
+    case aemresponse::DIRECTION_Z:
+      predicted = &response.SZ;
+      jacobian = &JZ;
+      break;
+      
+    default:
+      throw AEMEXCEPTION("Unhandled direction\n");
     }
 
-    double total;
-    
-    if (MPI_Reduce(&local_log_normalization, &total, 1, MPI_DOUBLE, MPI_SUM, 0, communicator) != MPI_SUCCESS) {
-      throw AEMEXCEPTION("Likelihood failed in reducing\n");
+    int n = (int)predicted->size();
+    if ((int)r.response.size() != n) {
+      throw AEMEXCEPTION("Size mismatch in response (%d != %d)\n", (int)r.response.size(), n);
     }
-    if (MPI_Bcast(&total, 1, MPI_DOUBLE, 0, communicator) != MPI_SUCCESS) {
-      throw AEMEXCEPTION("Likelihood failed in broadcast\n");
+    
+    for (int l = 0; l < n; l ++) {
+      column_residual[residual_offset + l] = r.response[l] - (*predicted)[l];
     }
 
-    log_normalization = total;
+    std::copy(jacobian->begin(),
+	      jacobian->begin() + n * nlayers,
+	      column_jacobian + residual_offset * nlayers);
+
+    residual_offset += n;
+  }
+}
+
+double
+Global::column_nll(int i,
+		   const double *column_residual,
+		   double *column_residual_normed,
+		   double &log_normalization)
+{
+  int residual_offset = 0;
+  
+  aempoint &p = observations->points[i];
+
+  double point_sum = 0.0;
+  for (int k = 0; k < (int)forwardmodel.size(); k ++) {
+    const aemresponse &r = p.responses[k];
     
-    if (MPI_Reduce(&sum, &total, 1, MPI_DOUBLE, MPI_SUM, 0, communicator) != MPI_SUCCESS) {
-      throw AEMEXCEPTION("Likelihood failed in reducing\n");
+    point_sum +=
+      lambda[k]->nll(r.response,
+		     forwardmodel_time[k],
+		     column_residual + residual_offset,
+		     lambda_scale,
+		     column_residual_normed + residual_offset,
+		     log_normalization);
+
+    residual_offset += r.response.size();
+  }
+
+  return point_sum;
+}
+
+double
+Global::column_likelihood_gradient(int i,
+				   const double *conductivity,
+				   cEarth1D &earth1d,
+				   double *column_residual,
+				   double *column_residual_normed,
+				   double &log_normalization,
+				   double *gradient)
+{
+  int nlayers = image->rows;
+  
+  std::vector<double> jacobian(residuals_per_column * nlayers);
+  
+  column_jacobian(i, conductivity, earth1d, column_residual, jacobian.data());
+
+  double point_sum = column_nll(i, column_residual, column_residual_normed, log_normalization);
+  
+  for (int j = 0; j < nlayers; j ++) {
+    gradient[j] = 0.0;
+  }
+
+  int residual_offset = 0;
+  std::vector<double> residual_gradient;
+  
+  aempoint &p = observations->points[i];
+  for (int k = 0; k < (int)forwardmodel.size(); k ++) {
+    const aemresponse &r = p.responses[k];
+    int n = (int)r.response.size();
+
+    residual_gradient.resize(n);
+    lambda[k]->nll_gradient(r.response,
+			    forwardmodel_time[k],
+			    lambda_scale,
+			    column_residual_normed + residual_offset,
+			    residual_gradient.data());
+
+    //
+    // Residuals are observed - predicted
+    //
+    for (int l = 0; l < n; l ++) {
+      const double *row = jacobian.data() + (residual_offset + l) * nlayers;
+      for (int j = 0; j < nlayers; j ++) {
+	gradient[j] -= residual_gradient[l] * row[j];
+      }
+    }
+
+    residual_offset += n;
+  }
+
+  return point_sum;
+}
+
+void
+Global::coefficient_gradient(int ncoefficients, const int *indices, double *gradient)
+{
+  for (int c = 0; c < ncoefficients; c ++) {
+    gradient[c] = 0.0;
+  }
+  
+  if (posteriork) {
+    return;
+  }
+
+  if (partitioned) {
+    throw AEMEXCEPTION("Coefficient gradient requires unpartitioned observations\n");
+  }
+
+  int workspacesize = width;
+  if (height > width) {
+    workspacesize = height;
+  }
+  std::vector<double> gradient_workspace(workspacesize);
+
+  //
+  // Current model image
+  //
+  std::vector<double> conductivity(size, 0.0);
+  if (wavetree2d_sub_map_to_array(wt, conductivity.data(), size) < 0) {
+    throw AEMEXCEPTION("Failed to map model to array\n");
+  }
+
+  {
+    PROFILE_SCOPE(profiler::WAVELET);
+    if (generic_lift_inverse2d(conductivity.data(),
+			       width,
+			       height,
+			       width,
+			       gradient_workspace.data(),
+			       hwaveletf,
+			       vwaveletf,
+			       1) < 0) {
+      throw AEMEXCEPTION("Failed to do inverse transform on coefficients\n");
     }
-    if (MPI_Bcast(&total, 1, MPI_DOUBLE, 0, communicator) != MPI_SUCCESS) {
-      throw AEMEXCEPTION("Likelihood failed in broadcast\n");
+  }
+
+  //
+  // Layer gradients for the columns in the union of the supports
+  //
+  std::vector<int> support_lo(ncoefficients);
+  std::vector<int> support_hi(ncoefficients);
+  std::vector<bool> column_required(width, false);
+  
+  for (int c = 0; c < ncoefficients; c ++) {
+    column_support(indices[c], support_lo[c], support_hi[c]);
+    for (int i = support_lo[c]; i <= support_hi[c]; i ++) {
+      column_required[i] = true;
     }
+  }
 
+  cEarth1D earth1d;
+  earth1d.conductivity.resize(image->rows);
+  earth1d.thickness.resize(image->rows - 1);
+  for (int j = 0; j < (image->rows - 1); j ++) {
+    earth1d.thickness[j] = image->layer_thickness[j];
+  }
 
-    MPI_Allgatherv(residual + residual_offsets[mpi_rank],
-		   residual_sizes[mpi_rank],
-		   MPI_DOUBLE,
-		   residual,
-		   residual_sizes,
-		   residual_offsets,
-		   MPI_DOUBLE,
-		   communicator);
+  std::vector<double> column_residual(residuals_per_column);
+  std::vector<double> column_residual_normed(residuals_per_column);
+  std::vector<double> column_gradient(image->rows);
+  std::vector<double> image_gradient(size, 0.0);
 
-    MPI_Allgatherv(residual_normed + residual_offsets[mpi_rank],
-		   residual_sizes[mpi_rank],
-		   MPI_DOUBLE,
-		   residual_normed,
-		   residual_sizes,
-		   residual_offsets,
-		   MPI_DOUBLE,
-		   communicator);
+  for (int i = 0; i < width; i ++) {
+    if (column_required[i]) {
+      double log_normalization = 0.0;
+      
+      (void)column_likelihood_gradient(i,
+				       conductivity.data(),
+				       earth1d,
+				       column_residual.data(),
+				       column_residual_normed.data(),
+				       log_normalization,
+				       column_gradient.data());
+      
+      for (int j = 0; j < image->rows; j ++) {
+	image_gradient[j * width + i] = column_gradient[j];
+      }
+    }
+  }
 
-    return total;
-    
-  } else {
-    log_normalization = 0.0;
-    
-    return 1.0;
+  //
+  // Project onto each coefficient's basis function
+  //
+  std::vector<double> impulse(size);
+  for (int c = 0; c < ncoefficients; c ++) {
+    const coefficient_index &ci = coefficients[indices[c]];
+
+    std::fill(impulse.begin(), impulse.end(), 0.0);
+    impulse[ci.ij * width + ci.ii] = 1.0;
+
+    if (generic_lift_inverse2d(impulse.data(),
+			       width,
+			       height,
+			       width,
+			       gradient_workspace.data(),
+			       hwaveletf,
+			       vwaveletf,
+			       1) < 0) {
+      throw AEMEXCEPTION("Failed to do inverse transform on impulse\n");
+    }
+
+    double g = 0.0;
+    for (int j = 0; j < height; j ++) {
+      for (int i = support_lo[c]; i <= support_hi[c]; i ++) {
+	g += impulse[j * width + i] * image_gradient[j * width + i];
+      }
+    }
+
+    gradient[c] = g;
   }
 }
 
@@ -781,27 +1318,152 @@ Global::hierarchical_likelihood_mpi(double proposed_lambda_scale,
 
   log_normalization = 0.0;
 
+  if (posteriork) {
+    return 1.0;
+  }
+
   if (!residuals_valid) {
     double x;
     like = likelihood_mpi(x);
     accept();
   }
+
+  if (hierarchical_exponent > 0.0) {
+    if (!hierarchical_statistics_valid) {
+      update_hierarchical_statistics();
+    }
+    return hierarchical_likelihood_scaled(proposed_lambda_scale, log_normalization);
+  }
   
   //
-  // 
-  //
-  // Since this is just a sum over residuals, just compute on root node and broadcast.
+  // Each process renormalises the residuals of its own columns and the
+  // partial sums are combined. As with likelihood_mpi_partial only the
+  // local section of the normed residuals is updated.
   //
-  if (mpi_rank == 0) {
-    like = hierarchical_likelihood(proposed_lambda_scale, log_normalization);
+  double local[2];
+  double total[2];
+  
+  local[0] = hierarchical_likelihood_columns(column_offsets[mpi_rank],
+					     column_sizes[mpi_rank],
+					     proposed_lambda_scale,
+					     local[1]);
+  
+  {
+    PROFILE_SCOPE(profiler::MPI_REDUCE);
+    if (MPI_Allreduce(local, total, 2, MPI_DOUBLE, MPI_SUM, communicator) != MPI_SUCCESS) {
+      throw AEMEXCEPTION("Hierarchical likelihood failed in reducing\n");
+    }
   }
   
-  MPI_Bcast(&like, 1, MPI_DOUBLE, 0, communicator);
-  MPI_Bcast(&log_normalization, 1, MPI_DOUBLE, 0, communicator);
+  like = total[0];
+  log_normalization = total[1];
 
   return like;
 }
 
+void
+Global::update_hierarchical_statistics()
+{
+  int nsystems = (int)lambda.size();
+  std::vector<double> local(3 * nsystems, 0.0);
+  std::vector<double> scratch(residuals_per_column);
+  
+  int column_offset = 0;
+  int column_size = image->columns;
+  if (communicator != MPI_COMM_NULL) {
+    column_offset = column_offsets[mpi_rank];
+    column_size = column_sizes[mpi_rank];
+  }
+
+  for (int mi = 0, i = column_offset; mi < column_size; mi ++, i ++) {
+
+    int residual_offset = i * residuals_per_column - residual_base;
+    aempoint &p = observations->points[i];
+
+    for (int k = 0; k < nsystems; k ++) {
+
+      const aemresponse &r = p.responses[k];
+      double log_normalization = 0.0;
+
+      //
+      // At lambda = 1 the nll is half the sum of squared normed residuals
+      //
+      local[3 * k] += 2.0 * lambda[k]->nll(r.response,
+					   forwardmodel_time[k],
+					   last_valid_residual + residual_offset,
+					   1.0,
+					   scratch.data(),
+					   log_normalization);
+      local[3 * k + 1] += log_normalization;
+      local[3 * k + 2] += (double)r.response.size();
+
+      residual_offset += r.response.size();
+    }
+  }
+
+  std::vector<double> total(3 * nsystems);
+  if (communicator != MPI_COMM_NULL) {
+    if (MPI_Allreduce(local.data(), total.data(), 3 * nsystems, MPI_DOUBLE, MPI_SUM, communicator) != MPI_SUCCESS) {
+      throw AEMEXCEPTION("Failed to reduce hierarchical statistics\n");
+    }
+  } else {
+    total = local;
+  }
+
+  for (int k = 0; k < nsystems; k ++) {
+    hierarchical_sum_squares[k] = total[3 * k];
+    hierarchical_log_normalization[k] = total[3 * k + 1];
+    hierarchical_count[k] = total[3 * k + 2];
+  }
+
+  hierarchical_statistics_valid = true;
+}
+
+double
+Global::hierarchical_likelihood_scaled(double proposed_lambda_scale,
+				       double &log_normalization)
+{
+  double sum = 0.0;
+  double log_lambda = log(proposed_lambda_scale);
+  double ss_scale = pow(proposed_lambda_scale, -2.0 * hierarchical_exponent);
+
+  log_normalization = 0.0;
+  for (int k = 0; k < (int)lambda.size(); k ++) {
+    sum += 0.5 * hierarchical_sum_squares[k] * ss_scale;
+    log_normalization +=
+      hierarchical_log_normalization[k] +
+      hierarchical_count[k] * hierarchical_exponent * log_lambda;
+  }
+
+  return sum;
+}
+
+void
+Global::allocate_residuals(int base, int size)
+{
+  delete [] residual;
+  delete [] mean_residual;
+  delete [] last_valid_residual;
+  delete [] residual_normed;
+  delete [] mean_residual_normed;
+  delete [] last_valid_residual_normed;
+  delete [] residual_hist;
+
+  residual_base = base;
+  residual_size = size;
+  
+  residual = new double[residual_size];
+  mean_residual = new double[residual_size];
+  last_valid_residual = new double[residual_size];
+  residual_normed = new double[residual_size];
+  mean_residual_normed = new double[residual_size];
+  last_valid_residual_normed = new double [residual_size];
+
+  residual_hist = new int[(size_t)residual_size * residual_hist_bins];
+
+  reset_residuals();
+}
+
 void
 Global::reset_residuals()
 {
@@ -816,7 +1478,7 @@ Global::reset_residuals()
     last_valid_residual_normed[i] = 0.0;
 
     for (int j = 0; j < residual_hist_bins; j ++) {
-      residual_hist[i * residual_hist_bins + j] = 0;
+      residual_hist[(size_t)i * residual_hist_bins + j] = 0;
     }
   }
 
@@ -843,10 +1505,24 @@ Global::invalidate_residuals()
   residuals_valid = false;
 }
 
+void
+Global::validate_residuals()
+{
+  if (!posteriork && !residuals_valid) {
+    if (communicator != MPI_COMM_NULL) {
+      current_likelihood = likelihood_mpi(current_log_normalization);
+    } else {
+      current_likelihood = likelihood(current_log_normalization);
+    }
+    accept();
+  }
+}
+
 void
 Global::accept()
 {
   residuals_valid = true;
+  hierarchical_statistics_valid = false;
   if (!posteriork) {
     for (int i = 0; i < residual_size; i ++) {
       last_valid_residual[i] = residual[i];
@@ -859,8 +1535,15 @@ Global::accept()
 }
 
 void
-Global::accept_hierarchical()
+Global::accept_hierarchical(double old_lambda_scale)
 {
+  if (!posteriork && hierarchical_exponent > 0.0) {
+    double scale = pow(old_lambda_scale/lambda_scale, hierarchical_exponent);
+    for (int i = 0; i < residual_size; i ++) {
+      residual_normed[i] *= scale;
+      last_valid_residual_normed[i] *= scale;
+    }
+  }
 }
 
 void
@@ -889,7 +1572,7 @@ Global::update_residual_mean()
 
     int hi = (int)((last_valid_residual_normed[i] - residual_hist_min)/(residual_hist_max - residual_hist_min) * (double)residual_hist_bins);
     if (hi >= 0 && hi < residual_hist_bins) {
-      residual_hist[i * residual_hist_bins + hi] ++;
+      residual_hist[(size_t)i * residual_hist_bins + hi] ++;
     }
   }
 }
@@ -899,7 +1582,8 @@ Global::update_residual_covariance()
 {
   double *p = last_valid_residual;
 
-  for (int k = 0; k < (int)(observations->points.size()); k ++) {
+  int npoints = residual_size/residuals_per_column;
+  for (int k = 0; k < npoints; k ++) {
 
     cov_n ++;
     
@@ -957,7 +1641,7 @@ Global::save_residual_histogram(const char *filename) const
   fprintf(fp, "%d %d %f %f\n", residual_size, residual_hist_bins, residual_hist_min, residual_hist_max);
   for (int i = 0; i < residual_size; i ++) {
     for (int j = 0; j < residual_hist_bins; j ++) {
-      fprintf(fp, "%d ", residual_hist[i * residual_hist_bins + j]);
+      fprintf(fp, "%d ", residual_hist[(size_t)i * residual_hist_bins + j]);
     }
     fprintf(fp, "\n");
   }
@@ -1001,6 +1685,123 @@ Global::save_residual_covariance(const char *filename) const
   return true;
 }
 
+void
+Global::gather_residuals()
+{
+  if (!partitioned || posteriork) {
+    return;
+  }
+
+  int total = image->columns * residuals_per_column;
+
+  double **arrays[6] = {
+    &residual,
+    &mean_residual,
+    &last_valid_residual,
+    &residual_normed,
+    &mean_residual_normed,
+    &last_valid_residual_normed
+  };
+
+  for (int i = 0; i < 6; i ++) {
+    double *full = nullptr;
+    if (mpi_rank == 0) {
+      full = new double[total];
+    }
+
+    if (MPI_Gatherv(*arrays[i], residual_size, MPI_DOUBLE,
+		    full, residual_sizes, residual_offsets, MPI_DOUBLE,
+		    0, communicator) != MPI_SUCCESS) {
+      throw AEMEXCEPTION("Failed to gather residuals\n");
+    }
+
+    if (mpi_rank == 0) {
+      delete [] *arrays[i];
+      *arrays[i] = full;
+    }
+  }
+
+  //
+  // The histogram is gathered in rows of residual_hist_bins so that the
+  // counts and offsets are in residuals and cannot overflow an int.
+  //
+  MPI_Datatype hist_row;
+  if (MPI_Type_contiguous(residual_hist_bins, MPI_INT, &hist_row) != MPI_SUCCESS ||
+      MPI_Type_commit(&hist_row) != MPI_SUCCESS) {
+    throw AEMEXCEPTION("Failed to create residual histogram type\n");
+  }
+  
+  int *full_hist = nullptr;
+  if (mpi_rank == 0) {
+    full_hist = new int[(size_t)total * residual_hist_bins];
+  }
+  if (MPI_Gatherv(residual_hist, residual_size, hist_row,
+		  full_hist, residual_sizes, residual_offsets, hist_row,
+		  0, communicator) != MPI_SUCCESS) {
+    throw AEMEXCEPTION("Failed to gather residual histogram\n");
+  }
+  MPI_Type_free(&hist_row);
+
+  //
+  // Merge the per process covariance estimates, each is the population
+  // covariance of its own columns so combine the means and second moments
+  // weighted by counts.
+  //
+  std::vector<int> counts(mpi_size);
+  if (MPI_Gather(&cov_n, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, communicator) != MPI_SUCCESS) {
+    throw AEMEXCEPTION("Failed to gather covariance counts\n");
+  }
+
+  int n = 0;
+  for (auto c : counts) {
+    n += c;
+  }
+  
+  for (int i = 0; i < (int)cov_count.size(); i ++) {
+    int N = cov_count[i];
+
+    std::vector<double> all_mu(N * mpi_size);
+    std::vector<double> all_sigma(N * N * mpi_size);
+
+    if (MPI_Gather(cov_mu[i], N, MPI_DOUBLE, all_mu.data(), N, MPI_DOUBLE, 0, communicator) != MPI_SUCCESS ||
+	MPI_Gather(cov_sigma[i], N * N, MPI_DOUBLE, all_sigma.data(), N * N, MPI_DOUBLE, 0, communicator) != MPI_SUCCESS) {
+      throw AEMEXCEPTION("Failed to gather covariance\n");
+    }
+
+    if (mpi_rank == 0 && n > 0) {
+
+      for (int j = 0; j < N; j ++) {
+	cov_mu[i][j] = 0.0;
+	for (int r = 0; r < mpi_size; r ++) {
+	  cov_mu[i][j] += (double)counts[r] * all_mu[r * N + j];
+	}
+	cov_mu[i][j] /= (double)n;
+      }
+
+      for (int j = 0; j < N; j ++) {
+	for (int l = j; l < N; l ++) {
+	  double m2 = 0.0;
+	  for (int r = 0; r < mpi_size; r ++) {
+	    m2 += (double)counts[r] * (all_sigma[r * N * N + j * N + l] +
+				       (all_mu[r * N + j] - cov_mu[i][j]) *
+				       (all_mu[r * N + l] - cov_mu[i][l]));
+	  }
+	  cov_sigma[i][j * N + l] = m2/(double)n;
+	}
+      }
+    }
+  }
+
+  if (mpi_rank == 0) {
+    delete [] residual_hist;
+    residual_hist = full_hist;
+
+    residual_base = 0;
+    residual_size = total;
+    cov_n = n;
+  }
+}
+
 generic_lift_inverse1d_step_t
 Global::wavelet_inverse_function_from_id(int id)
 {
@@ -1054,3 +1855,216 @@ Global::wavelet_forward_function_from_id(int id)
     return nullptr;
   }
 }
+
+double
+Global::value_proposal_temperature(int depth) const
+{
+  return temperature * value_proposal_scale[depth];
+}
+
+void
+Global::reseed_proposal(int seed)
+{
+  if (proposal == nullptr) {
+    return;
+  }
+
+  double prior_scale;
+  wavetree_pp_setscale(proposal, 0.0, &prior_scale);
+  
+  wavetree_pp_t *new_proposal = wavetree_pp_load(proposal_file.c_str(), seed, coeff_hist);
+  if (new_proposal == NULL) {
+    throw AEMEXCEPTION("Failed to reload proposal file\n");
+  }
+
+  if (wavetree_pp_setscale(new_proposal, prior_scale, NULL) < 0) {
+    throw AEMEXCEPTION("Failed to set prior scale\n");
+  }
+
+  wavetree_pp_destroy(proposal);
+  proposal = new_proposal;
+  proposal_seed = seed;
+}
+
+void
+Global::save_state(checkpoint &cp)
+{
+  cp.section("global");
+
+  int buffer_size = ncoeff * 3 * sizeof(double);
+  char *buffer = new char[buffer_size];
+  int length = wavetree2d_sub_encode(wt, buffer, buffer_size);
+  if (length < 0) {
+    throw AEMEXCEPTION("Failed to encode wavetree\n");
+  }
+  cp.write_array(buffer, length);
+  delete [] buffer;
+
+  double prior_scale = 0.0;
+  if (proposal != nullptr) {
+    wavetree_pp_setscale(proposal, 0.0, &prior_scale);
+  }
+  
+  cp.write(current_likelihood);
+  cp.write(current_log_normalization);
+  cp.write(lambda_scale);
+  cp.write(temperature);
+  cp.write(prior_scale);
+  cp.write(proposal_seed);
+  cp.write_vector(value_proposal_scale);
+
+  random.save_state(cp);
+
+  if (!posteriork) {
+    cp.section("residuals");
+    
+    cp.write(residuals_valid);
+    cp.write(mean_residual_n);
+    cp.write_array(residual, residual_size);
+    cp.write_array(mean_residual, residual_size);
+    cp.write_array(last_valid_residual, residual_size);
+    cp.write_array(residual_normed, residual_size);
+    cp.write_array(mean_residual_normed, residual_size);
+    cp.write_array(last_valid_residual_normed, residual_size);
+    cp.write_array(residual_hist, (size_t)residual_size * residual_hist_bins);
+
+    cp.write(cov_n);
+    for (int i = 0; i < (int)cov_count.size(); i ++) {
+      int N = cov_count[i];
+      cp.write_array(cov_delta[i], N);
+      cp.write_array(cov_mu[i], N);
+      cp.write_array(cov_sigma[i], N * N);
+    }
+  }
+}
+
+void
+Global::load_state(checkpoint &cp)
+{
+  cp.section("global");
+
+  hierarchical_statistics_valid = false;
+
+  int buffer_size = ncoeff * 3 * sizeof(double);
+  char *buffer = new char[buffer_size];
+  int length = (int)cp.read_array_bounded(buffer, buffer_size);
+  if (wavetree2d_sub_decode(wt, buffer, length) < 0) {
+    delete [] buffer;
+    throw AEMEXCEPTION("Failed to decode wavetree\n");
+  }
+  delete [] buffer;
+
+  double prior_scale;
+  int seed;
+  
+  cp.read(current_likelihood);
+  cp.read(current_log_normalization);
+  cp.read(lambda_scale);
+  cp.read(temperature);
+  cp.read(prior_scale);
+  cp.read(seed);
+  cp.read_vector(value_proposal_scale);
+
+  if (proposal != nullptr) {
+    if (wavetree_pp_setscale(proposal, prior_scale, NULL) < 0) {
+      throw AEMEXCEPTION("Failed to set prior scale\n");
+    }
+    reseed_proposal(seed);
+  }
+
+  random.load_state(cp);
+
+  if (!posteriork) {
+    cp.section("residuals");
+    
+    cp.read(residuals_valid);
+    cp.read(mean_residual_n);
+    cp.read_array(residual, residual_size);
+    cp.read_array(mean_residual, residual_size);
+    cp.read_array(last_valid_residual, residual_size);
+    cp.read_array(residual_normed, residual_size);
+    cp.read_array(mean_residual_normed, residual_size);
+    cp.read_array(last_valid_residual_normed, residual_size);
+    cp.read_array(residual_hist, (size_t)residual_size * residual_hist_bins);
+
+    cp.read(cov_n);
+    for (int i = 0; i < (int)cov_count.size(); i ++) {
+      int N = cov_count[i];
+      cp.read_array(cov_delta[i], N);
+      cp.read_array(cov_mu[i], N);
+      cp.read_array(cov_sigma[i], N * N);
+    }
+  }
+}
+
+static aemobservations *load_observations(const char *filename, bool posteriork, MPI_Comm broadcast_communicator)
+{
+  if (posteriork) {
+    return nullptr;
+  }
+  
+  if (broadcast_communicator == MPI_COMM_NULL) {
+    return new aemobservations(filename);
+  } else {
+    return load_observations_broadcast(filename, broadcast_communicator);
+  }
+}
+
+static aemobservations *load_observations_broadcast(const char *filename, MPI_Comm communicator)
+{
+  int rank;
+  
+  MPI_Comm_rank(communicator, &rank);
+
+  //
+  // The first process parses the observations and broadcasts them packed,
+  // each process then unpacks its own copy.
+  //
+  aemobservations *observations = nullptr;
+  std::vector<double> buffer;
+  long long n = 0;
+  
+  if (rank == 0) {
+    try {
+      observations = new aemobservations(filename);
+      observations->pack(buffer);
+      n = buffer.size();
+      if (n > INT_MAX) {
+	ERROR("packed observations too large to broadcast: %lld\n", n);
+	delete observations;
+	observations = nullptr;
+	n = -1;
+      }
+    } catch (aemexception &e) {
+      //
+      // The size is broadcast as -1 so that the other processes fail with
+      // us rather than wait on the data.
+      //
+      delete observations;
+      observations = nullptr;
+      n = -1;
+    }
+  }
+
+  if (MPI_Bcast(&n, 1, MPI_LONG_LONG, 0, communicator) != MPI_SUCCESS) {
+    throw AEMEXCEPTION("Failed to broadcast observations size\n");
+  }
+
+  if (n < 0) {
+    throw AEMEXCEPTION("Failed to load observations from %s\n", filename);
+  }
+
+  buffer.resize(n);
+  if (MPI_Bcast(buffer.data(), (int)n, MPI_DOUBLE, 0, communicator) != MPI_SUCCESS) {
+    throw AEMEXCEPTION("Failed to broadcast observations\n");
+  }
+
+  if (rank != 0) {
+    observations = new aemobservations();
+    if (!observations->unpack(buffer.data(), n)) {
+      throw AEMEXCEPTION("Failed to unpack observations\n");
+    }
+  }
+
+  return observations;
+}
@@ -28,6 +28,7 @@
 #ifndef global_hpp
 #define global_hpp
 
+#include <atomic>
 #include <vector>
 #include <string>
 #include <set>
@@ -59,6 +60,27 @@ extern "C" {
 
 extern const double DEFAULT_CONDUCTIVITY;
 
+class checkpoint;
+class linearisation;
+
+//
+// Per coefficient indices and prior range computed once so that the
+// proposals don't repeatedly translate coefficient indices. The prior range
+// is for a zero parent coefficient and only set when a prior is loaded. The
+// column support is the range of image columns changed by the coefficient
+// and is filled on first use (column_min < 0 until then).
+//
+struct coefficient_index {
+  int ii;
+  int ij;
+  int depth;
+  int parent;
+  int column_min;
+  int column_max;
+  double vmin;
+  double vmax;
+};
+
 class Global {
 public:
 
@@ -72,7 +94,33 @@ public:
     WAVELET_MAX = 5
   };
 
+  //
+  // If broadcast_communicator is set, the observation file is parsed once
+  // on its first process and broadcast to the others. This only saves
+  // parsing time: every process holds its own copy of the observations and
+  // still reads the STM files and noise models itself.
+  //
   Global(const char *filename,
+	 const std::vector<std::string> &stm_files,
+	 const char *initial_model,
+	 const char *prior_file,
+	 int degreex,
+	 int degreey,
+	 double depth,
+	 const std::vector<std::string> &hierarchical_files,
+	 int seed,
+	 int kmax,
+	 bool posteriork,
+	 int hwavelet,
+	 int vwavelet,
+	 MPI_Comm broadcast_communicator = MPI_COMM_NULL);
+
+  //
+  // As above with observations already constructed in memory (eg a
+  // synthetic survey), which are then owned by the Global. Observations
+  // may be nullptr if posteriork is set.
+  //
+  Global(aemobservations *observations,
 	 const std::vector<std::string> &stm_files,
 	 const char *initial_model,
 	 const char *prior_file,
@@ -92,22 +140,155 @@ public:
   double hierarchical_likelihood(double proposed_lambda_scale,
 				 double &log_hierarchical_normalization);
 
-  void initialize_mpi(MPI_Comm communicator, double temperature = 1.0);
+  //
+  // The hierarchical likelihood summed over a range of columns only, the
+  // residuals must be valid.
+  //
+  double hierarchical_likelihood_columns(int column_offset,
+					 int column_size,
+					 double proposed_lambda_scale,
+					 double &log_hierarchical_normalization);
+
+  //
+  // If partitioned is set, each process only keeps the observations and
+  // residuals for its own columns and residuals are no longer shared
+  // between the processes of a chain.
+  //
+  void initialize_mpi(MPI_Comm communicator, double temperature = 1.0, bool partitioned = false);
+
+  //
+  // Enable screening of birth and value proposals with linearised forward
+  // models before the full likelihood, see linearisation.hpp.
+  //
+  void initialize_screening(double max_drift);
+
+  //
+  // Fix the screening linearisations about the current model for the rest
+  // of the run. Does nothing if screening is disabled or already frozen.
+  //
+  void freeze_screening();
 
   double likelihood_mpi(double &log_normalization);
 
+  //
+  // The range of image columns affected by a coefficient, computed from
+  // the inverse transform of a unit coefficient on first use and cached.
+  //
+  void column_support(int index, int &lo, int &hi);
+
+  //
+  // The local part of likelihood_mpi without any communication, ie the
+  // likelihood and log normalization summed over this process's columns
+  // only. Only the local section of the residuals is updated.
+  //
+  double likelihood_mpi_partial(double &local_log_normalization);
+
+  //
+  // Negative log likelihood of a single column of a conductivity image with
+  // the given layer structure, the residuals for the column are written to
+  // column_residual and column_residual_normed. Alternative forward model
+  // instances can be given (eg one set per thread), and if system_likelihood
+  // is set the likelihood of each system is added to it.
+  //
+  double column_likelihood(int column,
+			   const double *conductivity,
+			   cEarth1D &earth1d,
+			   double *column_residual,
+			   double *column_residual_normed,
+			   double &log_normalization,
+			   const std::vector<cTDEmSystem*> *systems = nullptr,
+			   double *system_likelihood = nullptr);
+
+  //
+  // Residuals of a single column for the default forward models and the
+  // Jacobian of the predictions with respect to the log conductivity of each
+  // layer, ie column_jacobian is residuals_per_column x image->rows with
+  // rows in the same order as the residuals.
+  //
+  void column_jacobian(int column,
+		       const double *conductivity,
+		       cEarth1D &earth1d,
+		       double *column_residual,
+		       double *column_jacobian);
+
+  //
+  // Negative log likelihood of a single column from its residuals
+  //
+  double column_nll(int column,
+		    const double *column_residual,
+		    double *column_residual_normed,
+		    double &log_normalization);
+
+  //
+  // As column_likelihood with the default forward models, also writing the
+  // gradient of the column's negative log likelihood with respect to the log
+  // conductivity of each layer (image->rows values) to gradient.
+  //
+  double column_likelihood_gradient(int column,
+				    const double *conductivity,
+				    cEarth1D &earth1d,
+				    double *column_residual,
+				    double *column_residual_normed,
+				    double &log_normalization,
+				    double *gradient);
+
+  //
+  // Gradient of the negative log likelihood of the current model with
+  // respect to a set of wavelet coefficients. The inverse transform is
+  // linear so each is the image gradient projected onto the coefficient's
+  // basis function, and only the columns within the supports of the
+  // coefficients are evaluated. Requires the observations for all columns
+  // (ie not partitioned).
+  //
+  void coefficient_gradient(int ncoefficients, const int *indices, double *gradient);
+
   double hierarchical_likelihood_mpi(double proposed_lambda_scale,
 				     double &log_hierarchical_normalization);
 
+  //
+  // When every noise model is a pure scaling in lambda with a common
+  // exponent (hierarchical_exponent > 0), the hierarchical likelihood only
+  // depends on the sum of squared normed residuals and the log
+  // normalization at lambda = 1 for each system. These are cached and
+  // recomputed after the residuals change, so that each proposed lambda
+  // costs O(number of systems).
+  //
+  void update_hierarchical_statistics();
+
+  double hierarchical_likelihood_scaled(double proposed_lambda_scale,
+					double &log_hierarchical_normalization);
+
   void resample(MPI_Comm temperature_communicator, double resample_temperature);
 
+  void allocate_residuals(int base, int size);
+
   void reset_residuals();
 
+  //
+  // Collect the residual statistics of a partitioned chain onto its first
+  // process for output. This is collective over the chain and is only
+  // intended to be called once sampling has finished.
+  //
+  void gather_residuals();
+
   void invalidate_residuals();
 
+  //
+  // Recompute the likelihood and residuals of the current model if they
+  // have been invalidated (eg by a PT exchange or resample), so that the
+  // last valid residuals describe the current model. Collective over the
+  // chain communicator if set.
+  //
+  void validate_residuals();
+
   void accept();
 
-  void accept_hierarchical();
+  //
+  // Called after lambda_scale has changed from old_lambda_scale. The scaled
+  // hierarchical likelihood does not touch the normed residuals so they are
+  // rescaled here to the new lambda.
+  //
+  void accept_hierarchical(double old_lambda_scale);
 
   void reject();
 
@@ -125,6 +306,24 @@ public:
 
   bool save_residual_histogram(const char *filename) const;
   bool save_residual_covariance(const char *filename) const;
+
+  //
+  // Checkpoint/restart of the chain state (model, likelihood, scales, random
+  // state and residual accumulators). The prior proposal keeps its own
+  // generator inside wavetreepp which cannot be saved, so it is reseeded from
+  // our generator at each checkpoint and the seed stored instead.
+  //
+  void reseed_proposal(int seed);
+
+  //
+  // The temperature passed to the value proposal for a given depth, this is
+  // the chain temperature multiplied by the (possibly adapted) per depth
+  // scaling of the value proposal width.
+  //
+  double value_proposal_temperature(int depth) const;
+  
+  void save_state(checkpoint &cp);
+  void load_state(checkpoint &cp);
   
   static generic_lift_inverse1d_step_t wavelet_inverse_function_from_id(int id);
   static generic_lift_forward1d_step_t wavelet_forward_function_from_id(int id);
@@ -140,12 +339,21 @@ public:
 
   hnk_t *hnk;
   wavetree_pp_t *proposal;
+  std::string proposal_file;
+  int proposal_seed;
+  std::vector<double> value_proposal_scale;
 
   int degreex;
   int degreey;
 
   std::vector<cTDEmSystem*> forwardmodel;
   std::vector<double*> forwardmodel_time;
+
+  //
+  // Number of forward model evaluations (one system for one column) made
+  // by this process, used for benchmarking.
+  //
+  std::atomic<long long> forwardmodel_count;
   
   aemobservations *observations;
   aemimage *image;
@@ -177,14 +385,24 @@ public:
   int size;
   int ncoeff;
 
+  std::vector<coefficient_index> coefficients;
+
   std::vector<hierarchicalmodel*> lambda;
   double lambda_scale;
+
+  double hierarchical_exponent;
+  bool hierarchical_statistics_valid;
+  std::vector<double> hierarchical_sum_squares;
+  std::vector<double> hierarchical_log_normalization;
+  std::vector<double> hierarchical_count;
   
   double current_likelihood;
   double current_log_normalization;
 
   coefficient_histogram_t *coeff_hist;
 
+  linearisation *screen;
+
   Rng random;
   bool posteriork;
 
@@ -201,6 +419,9 @@ public:
   int *residual_offsets;
   int *residual_sizes;
 
+  bool partitioned;
+  int residual_base;
+
   int cov_n;
   std::vector<int> cov_count;
   std::vector<double*> cov_delta;
@@ -89,10 +89,10 @@ GlobalPixel::GlobalPixel(const char *filename,
     
     forwardmodel.push_back(p);
 
-    double *centre_time = new double[p->WinSpec.size()];
+    double *centre_time = new double[p->description().WinSpec.size()];
 
     int t = 0;
-    for (auto &w : p->WinSpec) {
+    for (auto &w : p->description().WinSpec) {
       centre_time[t] = (w.TimeLow + w.TimeHigh)/2.0;
       t ++;
     }
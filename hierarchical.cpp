@@ -31,10 +31,13 @@ extern "C" {
 #include "hierarchical.hpp"
 
 #include "aemutil.hpp"
+#include "checkpoint.hpp"
+#include "profiler.hpp"
 
-Hierarchical::Hierarchical(Global &_global, double _sigma) :
+Hierarchical::Hierarchical(Global &_global, double _sigma, bool _gibbs) :
   global(_global),
   sigma(_sigma),
+  gibbs(_gibbs),
   propose(0),
   accept(0),
   communicator(MPI_COMM_NULL),
@@ -50,6 +53,10 @@ Hierarchical::~Hierarchical()
 int
 Hierarchical::step()
 {
+  if (gibbs && global.hierarchical_exponent > 0.0 && !global.posteriork) {
+    return step_gibbs();
+  }
+  
   propose ++;
 
   double value = 0.0;
@@ -100,7 +107,9 @@ Hierarchical::step()
       //
 
       accept ++;
+      double old_value = global.lambda_scale;
       global.lambda_scale = value;
+      global.accept_hierarchical(old_value);
       global.current_likelihood = proposed_likelihood;
       global.current_log_normalization = proposed_log_normalization;
 
@@ -124,6 +133,78 @@ Hierarchical::step()
   return 0;
 }
 
+int
+Hierarchical::step_gibbs()
+{
+  double old_value = global.lambda_scale;
+  double value = old_value;
+  int valid_proposal = 1;
+  double proposed_likelihood;
+  double proposed_log_normalization;
+
+  //
+  // Ensures the cached statistics are current
+  //
+  if (compute_likelihood(old_value, proposed_likelihood, proposed_log_normalization) < 0) {
+    return -1;
+  }
+
+  if (primary()) {
+
+    double S = 0.0;
+    double N = 0.0;
+    for (int k = 0; k < (int)global.lambda.size(); k ++) {
+      S += global.hierarchical_sum_squares[k];
+      N += global.hierarchical_count[k];
+    }
+
+    if (S > 0.0) {
+      //
+      // With noise proportional to lambda^p and the Jeffreys prior
+      // p(lambda) = 1/lambda used by step, u = lambda^-2p also has prior
+      // 1/u and given the residuals is Gamma(N/2T, rate S/2T)
+      //
+      double T = global.temperature;
+      double u = global.random.gamma(0.5 * N/T, 2.0 * T/S);
+      
+      value = pow(u, -1.0/(2.0 * global.hierarchical_exponent));
+    } else {
+      valid_proposal = 0;
+    }
+  }
+
+  if (communicate_value(valid_proposal, value) < 0) {
+    return -1;
+  }
+
+  memset(&last_step, 0, sizeof(chain_history_change_t));
+  
+  last_step.header.type = CH_HIERARCHICAL;
+  last_step.perturbation.hierarchical.old_value = old_value;
+  last_step.perturbation.hierarchical.new_value = value;
+
+  if (!valid_proposal) {
+    return 0;
+  }
+  
+  propose ++;
+  
+  if (compute_likelihood(value, proposed_likelihood, proposed_log_normalization) < 0) {
+    return -1;
+  }
+
+  accept ++;
+  global.lambda_scale = value;
+  global.accept_hierarchical(old_value);
+  global.current_likelihood = proposed_likelihood;
+  global.current_log_normalization = proposed_log_normalization;
+  
+  last_step.header.accepted = 1;
+  last_step.header.hierarchical = global.lambda_scale;
+
+  return 1;
+}
+
 std::string
 Hierarchical::write_short_stats()
 {
@@ -177,11 +258,16 @@ Hierarchical::choose_value(double &value,
     valid_proposal = 1;
 
     //
-    // Jeffreys prior on lambda
+    // The prior on lambda is the Jeffreys prior p(lambda) = 1/lambda, as
+    // for the Gibbs step. The random walk is in log lambda so the proposal
+    // density in lambda has the Hastings ratio lambda'/lambda, which
+    // cancels the prior ratio lambda/lambda'. Both terms are kept so that
+    // the acceptance targets the same posterior as step_gibbs.
     //
-    log_value_prior_ratio = log(old_value) - log(value);
+    double log_prior_ratio = log(old_value) - log(value);
+    double log_proposal_ratio = log(value) - log(old_value);
     
-      
+    log_value_prior_ratio = log_prior_ratio + log_proposal_ratio;
   }
 
   return 0;
@@ -193,6 +279,7 @@ Hierarchical::communicate_value(int &valid_proposal,
 				double &value)
 {
   if (communicator != MPI_COMM_NULL) {
+    PROFILE_SCOPE(profiler::MPI_BCAST);
 
     if (MPI_Bcast(&valid_proposal, 1, MPI_INT, 0, communicator) != MPI_SUCCESS) {
       throw AEMEXCEPTION("Failed to broadcast valid proposal\n");
@@ -260,6 +347,7 @@ Hierarchical::communicate_acceptance(bool &accept_proposal)
 {
   
   if (communicator != MPI_COMM_NULL) {
+    PROFILE_SCOPE(profiler::MPI_BCAST);
 
     int ta;
 
@@ -279,3 +367,19 @@ Hierarchical::communicate_acceptance(bool &accept_proposal)
 
   return 0;
 }
+
+void
+Hierarchical::save_state(checkpoint &cp)
+{
+  cp.section("hierarchical");
+  cp.write(propose);
+  cp.write(accept);
+}
+
+void
+Hierarchical::load_state(checkpoint &cp)
+{
+  cp.section("hierarchical");
+  cp.read(propose);
+  cp.read(accept);
+}
@@ -39,7 +39,13 @@ extern "C" {
 class Hierarchical {
 public:
 
-  Hierarchical(Global &global, double sigma);
+  //
+  // The noise scale lambda has the Jeffreys prior p(lambda) = 1/lambda.
+  // With gibbs set, lambda is drawn directly from its conditional when the
+  // noise models allow it (see Global::hierarchical_exponent) instead of
+  // with a random walk.
+  //
+  Hierarchical(Global &global, double sigma, bool gibbs = false);
   ~Hierarchical();
 
   int step();
@@ -48,12 +54,16 @@ public:
 
   std::string write_long_stats();
 
+  void save_state(checkpoint &cp);
+  void load_state(checkpoint &cp);
+
   void initialize_mpi(MPI_Comm communicator);
 
   void get_last_step(chain_history_change_t *last_step);
 
   Global &global;
   double sigma;
+  bool gibbs;
 
   int propose;
   int accept;
@@ -68,6 +78,8 @@ private:
 
   bool primary() const;
 
+  int step_gibbs();
+
   int choose_value(double &value,
 		   double &value_prior_ratio,
 		   int &valid_proposal);
@@ -30,6 +30,7 @@
 #include "aemexception.hpp"
 
 #include "hierarchicalmodel.hpp"
+#include "profiler.hpp"
 
 extern "C" {
   #include "slog.h"
@@ -51,6 +52,26 @@ hierarchicalmodel::~hierarchicalmodel()
 {
 }
 
+double
+hierarchicalmodel::scale_exponent() const
+{
+  return 0.0;
+}
+
+void
+hierarchicalmodel::nll_gradient(const std::vector<double> &observed_response,
+				const double *time,
+				double lambda_scale,
+				const double *residuals_normed,
+				double *gradient)
+{
+  int i = 0;
+  for (auto &r : observed_response) {
+    gradient[i] = residuals_normed[i]/noise(r, time[i], lambda_scale);
+    i ++;
+  }
+}
+
 hierarchicalmodel *
 hierarchicalmodel::load(const char *filename)
 {
@@ -146,6 +167,8 @@ independentgaussianhierarchicalmodel::nll(const std::vector<double> &observed_re
 					  double *residuals_normed,
 					  double &log_normalization)
 {
+  PROFILE_SCOPE(profiler::NLL);
+
   int i = 0;
   double sum = 0.0;
   
@@ -164,6 +187,12 @@ independentgaussianhierarchicalmodel::nll(const std::vector<double> &observed_re
   return sum;
 }
 
+double
+independentgaussianhierarchicalmodel::scale_exponent() const
+{
+  return 1.0;
+}
+
 hierarchicalmodel *
 independentgaussianhierarchicalmodel::read(FILE *fp)
 {
@@ -255,6 +284,8 @@ hyperbolichierarchicalmodel::nll(const std::vector<double> &observed_response,
 				 double *residuals_normed,
 				 double &log_normalization)
 {
+  PROFILE_SCOPE(profiler::NLL);
+
   int i = 0;
   double sum = 0.0;
   
@@ -381,6 +412,8 @@ brodiehierarchicalmodel::nll(const std::vector<double> &observed_response,
 			     double *residuals_normed,
 			     double &log_normalization)
 {
+  PROFILE_SCOPE(profiler::NLL);
+
   int i = 0;
   double sum = 0.0;
   
@@ -462,12 +495,17 @@ brodiehierarchicalmodel::read(FILE *fp)
 covariancehierarchicalmodel::covariancehierarchicalmodel() :
   size(-1),
   w(nullptr),
-  v(nullptr)
+  v(nullptr),
+  whiten(nullptr),
+  half_log_det(0.0)
 {
 }
 
 covariancehierarchicalmodel::~covariancehierarchicalmodel()
 {
+  delete [] w;
+  delete [] v;
+  delete [] whiten;
 }
 
 int
@@ -504,31 +542,78 @@ covariancehierarchicalmodel::nll(const std::vector<double> &observed_response,
 				 double *residuals_normed,
 				 double &log_normalization)
 {
+  PROFILE_SCOPE(profiler::NLL);
+
   double sum = 0.0;
-  double norm = 0.0;
 
   if (size != (int)observed_response.size()) {
     throw AEMEXCEPTION("Size mismatch");
   }
 
+  //
+  // The lambda scale only enters as a scalar factor on the whitened
+  // residuals and the log determinant.
+  //
+  double inv_sqrt_lambda = 1.0/sqrt(lambda_scale);
+
   for (int i = 0; i < size; i ++) {
-    residuals_normed[i] = 0.0;
+    const double *row = whiten + i * size;
+    double r = 0.0;
 
     for (int j = 0; j < size; j ++) {
-      residuals_normed[i] += (residuals[j] * v[j * size + i])/sqrt(lambda_scale * w[i]);
+      r += residuals[j] * row[j];
     }
 
-    norm += 0.5 * log(lambda_scale * w[i]);
+    residuals_normed[i] = r * inv_sqrt_lambda;
 
     sum += residuals_normed[i] * residuals_normed[i] * 0.5;
-	   
   }
 
-  log_normalization += norm;
+  log_normalization += 0.5 * (double)size * log(lambda_scale) + half_log_det;
 
   return sum;
 }
 
+void
+covariancehierarchicalmodel::nll_gradient(const std::vector<double> &observed_response,
+					  const double *time,
+					  double lambda_scale,
+					  const double *residuals_normed,
+					  double *gradient)
+{
+  if (size != (int)observed_response.size()) {
+    throw AEMEXCEPTION("Size mismatch");
+  }
+
+  //
+  // The normed residuals are W r/sqrt(lambda) so the gradient is
+  // W^T (normed residuals)/sqrt(lambda)
+  //
+  double inv_sqrt_lambda = 1.0/sqrt(lambda_scale);
+
+  for (int j = 0; j < size; j ++) {
+    gradient[j] = 0.0;
+  }
+  
+  for (int i = 0; i < size; i ++) {
+    const double *row = whiten + i * size;
+    double r = residuals_normed[i] * inv_sqrt_lambda;
+
+    for (int j = 0; j < size; j ++) {
+      gradient[j] += r * row[j];
+    }
+  }
+}
+
+double
+covariancehierarchicalmodel::scale_exponent() const
+{
+  //
+  // lambda scales the covariance
+  //
+  return 0.5;
+}
+
 hierarchicalmodel *
 covariancehierarchicalmodel::read(FILE *fp)
 {
@@ -569,5 +654,21 @@ covariancehierarchicalmodel::read(FILE *fp)
     }
   }
 
+  //
+  // Precompute the whitening operator: the transposed eigenvectors scaled by
+  // 1/sqrt(w) so that each row is contiguous, and the log determinant.
+  //
+  m->whiten = new double[size * size];
+  m->half_log_det = 0.0;
+  for (int i = 0; i < size; i ++) {
+    double s = 1.0/sqrt(m->w[i]);
+    
+    for (int j = 0; j < size; j ++) {
+      m->whiten[i * size + j] = m->v[j * size + i] * s;
+    }
+
+    m->half_log_det += 0.5 * log(m->w[i]);
+  }
+
   return m;
 }
@@ -55,6 +55,24 @@ public:
 		     double lambda_scale,
 		     double *residuals_normed,
 		     double &log_normalization) = 0;
+
+  //
+  // If the noise standard deviation is proportional to lambda_scale^p this
+  // returns p, otherwise 0. For such models the nll for any lambda_scale
+  // follows from the nll and log normalization at lambda_scale = 1.
+  //
+  virtual double scale_exponent() const;
+
+  //
+  // Gradient of the nll with respect to the residuals, using the normed
+  // residuals from nll with the same arguments. The default is for
+  // independent noise given by noise().
+  //
+  virtual void nll_gradient(const std::vector<double> &observed_response,
+			    const double *time,
+			    double lambda_scale,
+			    const double *residuals_normed,
+			    double *gradient);
   
   static hierarchicalmodel *load(const char *filename);
 
@@ -89,6 +107,8 @@ public:
 		     double *residuals_normed,
 		     double &log_normalization);  
 
+  virtual double scale_exponent() const;
+
   static hierarchicalmodel *read(FILE *fp);
 
 private:
@@ -188,6 +208,14 @@ public:
 		     double *residuals_normed,
 		     double &log_normalization);  
 
+  virtual double scale_exponent() const;
+
+  virtual void nll_gradient(const std::vector<double> &observed_response,
+			    const double *time,
+			    double lambda_scale,
+			    const double *residuals_normed,
+			    double *gradient);
+
   static hierarchicalmodel *read(FILE *fp);
 
 private:
@@ -195,6 +223,9 @@ private:
   int size;
   double *w;
   double *v;
+
+  double *whiten;
+  double half_log_det;
   
 };
     
@@ -37,6 +37,8 @@ extern "C" {
 
 #include "aemexception.hpp"
 #include "aemutil.hpp"
+#include "checkpoint.hpp"
+#include "profiler.hpp"
 
 HierarchicalPrior::HierarchicalPrior(Global &_global, double _sigma) :
   global(_global),
@@ -220,6 +222,7 @@ HierarchicalPrior::communicate_value(int &valid_proposal,
 					  double &value)
 {
   if (communicator != MPI_COMM_NULL) {
+    PROFILE_SCOPE(profiler::MPI_BCAST);
 
     if (MPI_Bcast(&valid_proposal, 1, MPI_INT, 0, communicator) != MPI_SUCCESS) {
       throw AEMEXCEPTION("Failed to broadcast valid proposal\n");
@@ -267,6 +270,7 @@ HierarchicalPrior::communicate_acceptance(bool &accept_proposal)
 {
   
   if (communicator != MPI_COMM_NULL) {
+    PROFILE_SCOPE(profiler::MPI_BCAST);
 
     int ta;
 
@@ -286,3 +290,19 @@ HierarchicalPrior::communicate_acceptance(bool &accept_proposal)
 
   return 0;
 }
+
+void
+HierarchicalPrior::save_state(checkpoint &cp)
+{
+  cp.section("hierarchicalprior");
+  cp.write(propose);
+  cp.write(accept);
+}
+
+void
+HierarchicalPrior::load_state(checkpoint &cp)
+{
+  cp.section("hierarchicalprior");
+  cp.read(propose);
+  cp.read(accept);
+}
@@ -48,6 +48,9 @@ public:
 
   std::string write_long_stats();
 
+  void save_state(checkpoint &cp);
+  void load_state(checkpoint &cp);
+
   void initialize_mpi(MPI_Comm communicator);
 
   void get_last_step(chain_history_change_t *last_step);
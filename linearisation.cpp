@@ -0,0 +1,238 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "linearisation.hpp"
+
+#include "aemexception.hpp"
+#include "profiler.hpp"
+
+linearisation::linearisation(Global &_global, double _max_drift) :
+  evaluations(0),
+  relinearisations(0),
+  global(_global),
+  max_drift(_max_drift),
+  frozen(false),
+  rows(-1),
+  columns(-1),
+  residuals_per_column(-1)
+{
+  if (global.posteriork) {
+    throw AEMEXCEPTION("Screening requires observations\n");
+  }
+
+  if (max_drift <= 0.0) {
+    throw AEMEXCEPTION("Invalid screening drift: %f\n", max_drift);
+  }
+  
+  rows = global.image->rows;
+  columns = global.image->columns;
+  residuals_per_column = global.residuals_per_column;
+
+  valid.resize(columns, false);
+  m0.resize(columns * rows);
+  r0.resize(columns * residuals_per_column);
+  J0.resize((size_t)columns * residuals_per_column * rows);
+
+  int workspacesize = global.width;
+  if (global.height > workspacesize) {
+    workspacesize = global.height;
+  }
+
+  proposed.resize(global.size);
+  basis.resize(global.size);
+  workspace.resize(workspacesize);
+  current_residual.resize(residuals_per_column);
+  proposed_residual.resize(residuals_per_column);
+  residual_normed.resize(residuals_per_column);
+
+  earth1d.conductivity.resize(rows);
+  earth1d.thickness.resize(rows - 1);
+  for (int j = 0; j < (rows - 1); j ++) {
+    earth1d.thickness[j] = global.image->layer_thickness[j];
+  }
+}
+
+linearisation::~linearisation()
+{
+}
+
+double
+linearisation::delta_likelihood(int index, double delta)
+{
+  evaluations ++;
+
+  //
+  // Proposed model image
+  //
+  map_model();
+
+  //
+  // Change in the image is delta times the coefficient's basis function
+  //
+  const coefficient_index &c = global.coefficients[index];
+  
+  std::fill(basis.begin(), basis.end(), 0.0);
+  basis[c.ij * global.width + c.ii] = delta;
+  
+  if (generic_lift_inverse2d(basis.data(),
+			     global.width,
+			     global.height,
+			     global.width,
+			     workspace.data(),
+			     global.hwaveletf,
+			     global.vwaveletf,
+			     1) < 0) {
+    throw AEMEXCEPTION("Failed to do inverse transform on basis\n");
+  }
+
+  int lo, hi;
+  global.column_support(index, lo, hi);
+  
+  double sum = 0.0;
+  for (int i = lo; i <= hi; i ++) {
+
+    //
+    // Re-linearise about the current model if it has drifted
+    //
+    bool drifted = !valid[i];
+    for (int j = 0; j < rows && !drifted && !frozen; j ++) {
+      int k = j * columns + i;
+      if (fabs(proposed[k] - basis[k] - m0[i * rows + j]) > max_drift) {
+	drifted = true;
+      }
+    }
+
+    if (drifted) {
+      for (int j = 0; j < rows; j ++) {
+	int k = j * columns + i;
+	basis[k] = proposed[k] - basis[k];
+      }
+      
+      relinearise(i, basis.data());
+
+      //
+      // Restore the basis function for this column
+      //
+      for (int j = 0; j < rows; j ++) {
+	int k = j * columns + i;
+	basis[k] = proposed[k] - basis[k];
+      }
+    }
+
+    //
+    // Linearised residuals of the current and proposed models
+    //
+    const double *m = m0.data() + i * rows;
+    const double *r = r0.data() + i * residuals_per_column;
+    const double *J = J0.data() + (size_t)i * residuals_per_column * rows;
+    
+    for (int l = 0; l < residuals_per_column; l ++) {
+      const double *row = J + l * rows;
+      double dcurrent = 0.0;
+      double dproposed = 0.0;
+      
+      for (int j = 0; j < rows; j ++) {
+	int k = j * columns + i;
+	double dm = proposed[k] - m[j];
+	dproposed += row[j] * dm;
+	dcurrent += row[j] * (dm - basis[k]);
+      }
+
+      current_residual[l] = r[l] - dcurrent;
+      proposed_residual[l] = r[l] - dproposed;
+    }
+
+    sum += column_nll(i, proposed_residual.data()) - column_nll(i, current_residual.data());
+  }
+
+  return sum;
+}
+
+void
+linearisation::freeze()
+{
+  if (frozen) {
+    return;
+  }
+
+  map_model();
+  for (int i = 0; i < columns; i ++) {
+    relinearise(i, proposed.data());
+  }
+
+  frozen = true;
+}
+
+void
+linearisation::map_model()
+{
+  std::fill(proposed.begin(), proposed.end(), 0.0);
+  if (wavetree2d_sub_map_to_array(global.wt, proposed.data(), global.size) < 0) {
+    throw AEMEXCEPTION("Failed to map model to array\n");
+  }
+
+  PROFILE_SCOPE(profiler::WAVELET);
+  if (generic_lift_inverse2d(proposed.data(),
+			     global.width,
+			     global.height,
+			     global.width,
+			     workspace.data(),
+			     global.hwaveletf,
+			     global.vwaveletf,
+			     1) < 0) {
+    throw AEMEXCEPTION("Failed to do inverse transform on coefficients\n");
+  }
+}
+
+void
+linearisation::relinearise(int column, const double *conductivity)
+{
+  relinearisations ++;
+  
+  global.column_jacobian(column,
+			 conductivity,
+			 earth1d,
+			 r0.data() + column * residuals_per_column,
+			 J0.data() + (size_t)column * residuals_per_column * rows);
+
+  for (int j = 0; j < rows; j ++) {
+    m0[column * rows + j] = conductivity[j * columns + column];
+  }
+
+  valid[column] = true;
+}
+
+double
+linearisation::column_nll(int column, const double *residual)
+{
+  double log_normalization = 0.0;
+  return global.column_nll(column, residual, residual_normed.data(), log_normalization);
+}
@@ -0,0 +1,107 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#pragma once
+#ifndef linearisation_hpp
+#define linearisation_hpp
+
+#include <vector>
+
+#include "global.hpp"
+
+//
+// Per column linearisations of the forward models used to screen proposals
+// before the full likelihood (delayed acceptance, Christen and Fox 2005).
+// For column i the approximate negative log likelihood of a model x is
+//
+//   L*_i(x) = nll(r0_i - J0_i (m_i(x) - m0_i))
+//
+// where m0_i, r0_i and J0_i are the log conductivity, residuals and Jacobian
+// of the column when it was last linearised. Until freeze is called a
+// column is linearised again about the current model when any layer has
+// drifted more than max_drift (in log conductivity) from m0_i. The
+// approximation then depends on the state of the chain, so the second stage
+// ratio is only exact once the linearisations are frozen and this adaptive
+// phase should be treated as burn in.
+//
+class linearisation {
+public:
+
+  linearisation(Global &global, double max_drift);
+  ~linearisation();
+
+  //
+  // The approximate change in negative log likelihood L*(x') - L*(x), where
+  // x' is the model in the wavetree (ie including a pending perturbation)
+  // and x differs from x' by -delta in the coefficient index. Only the
+  // columns in the support of the coefficient contribute.
+  //
+  double delta_likelihood(int index, double delta);
+
+  //
+  // Linearise every column about the current model (with no pending
+  // perturbation) and keep these linearisations from now on. Does nothing
+  // if already frozen.
+  //
+  void freeze();
+
+  int evaluations;
+  int relinearisations;
+  
+private:
+
+  void map_model();
+
+  void relinearise(int column, const double *conductivity);
+
+  double column_nll(int column, const double *residual);
+
+  Global &global;
+  double max_drift;
+  bool frozen;
+
+  int rows;
+  int columns;
+  int residuals_per_column;
+
+  std::vector<bool> valid;
+  std::vector<double> m0;
+  std::vector<double> r0;
+  std::vector<double> J0;
+
+  std::vector<double> proposed;
+  std::vector<double> basis;
+  std::vector<double> workspace;
+  std::vector<double> current_residual;
+  std::vector<double> proposed_residual;
+  std::vector<double> residual_normed;
+
+  cEarth1D earth1d;
+  
+};
+
+#endif // linearisation_hpp
@@ -32,6 +32,7 @@
 #include "rng.hpp"
 
 #include "aemobservations.hpp"
+#include "synthetic.hpp"
 
 static char short_options[] = "N:e:E:p:P:r:R:x:X:z:Z:S:o:h";
 static struct option long_options[] = {
@@ -54,16 +55,6 @@ static struct option long_options[] = {
   {0, 0, 0, 0}
 };
 
-static double random_walk_init(Rng &random,
-			       double mu,
-			       double sigma);
-
-static double random_walk_step(Rng &random,
-			       double x0,
-			       double mu,
-			       double sigma,
-			       double scale = 10.0);
-
 static bool ispositivepower2(int i);
 
 static void usage(const char *pname);
@@ -75,55 +66,18 @@ int main(int argc, char *argv[])
   
   int N;
   
-  double height_mean;
-  double height_std;
-
-  double pitch_mean;
-  double pitch_std;
-
-  double roll_mean;
-  double roll_std;
-
-  double dx_mean;
-  double dx_std;
-
-  double dz_mean;
-  double dz_std;
+  syntheticpath path;
 
   int seed;
 
   char *output_file;
   
   //
-  // State
-  //
-  double height;
-  double roll;
-  double pitch;
-  double dx;
-  double dz;
-
-  //
-  // Defaults
+  // Defaults (see syntheticpath for the flight path)
   //
 
   N = 1024;
 
-  height_mean = 100.0;
-  height_std = 5.0;
-
-  roll_mean = 0.0;
-  roll_std = 2.0;
-
-  pitch_mean = 0.0;
-  pitch_std = 1.0;
-
-  dx_mean = -100.0;
-  dx_std = 2.0;
-
-  dz_mean = -40.0;
-  dz_std = 2.5;
-
   seed = 983;
 
   output_file = nullptr;
@@ -147,60 +101,60 @@ int main(int argc, char *argv[])
       break;
       
     case 'e':
-      height_mean = atof(optarg);
+      path.height_mean = atof(optarg);
       break;
 
     case 'E':
-      height_std = atof(optarg);
-      if (height_std < 0.0) {
+      path.height_std = atof(optarg);
+      if (path.height_std < 0.0) {
 	fprintf(stderr, "error: height std must be 0 or greater\n");
 	return -1;
       }
       break;
 
     case 'p':
-      pitch_mean = atof(optarg);
+      path.pitch_mean = atof(optarg);
       break;
 
     case 'P':
-      pitch_std = atof(optarg);
-      if (pitch_std < 0.0) {
+      path.pitch_std = atof(optarg);
+      if (path.pitch_std < 0.0) {
 	fprintf(stderr, "error: pitch std must be 0 or greater\n");
 	return -1;
       }
       break;
 
     case 'r':
-      roll_mean = atof(optarg);
+      path.roll_mean = atof(optarg);
       break;
 
     case 'R':
-      roll_std = atof(optarg);
-      if (roll_std < 0.0) {
+      path.roll_std = atof(optarg);
+      if (path.roll_std < 0.0) {
 	fprintf(stderr, "error: roll std must be 0 or greater\n");
 	return -1;
       }
       break;
 
     case 'x':
-      dx_mean = atof(optarg);
+      path.dx_mean = atof(optarg);
       break;
 
     case 'X':
-      dx_std = atof(optarg);
-      if (dx_std < 0.0) {
+      path.dx_std = atof(optarg);
+      if (path.dx_std < 0.0) {
 	fprintf(stderr, "error: dx std must be 0 or greater\n");
 	return -1;
       }
       break;
       
     case 'z':
-      dz_mean = atof(optarg);
+      path.dz_mean = atof(optarg);
       break;
 
     case 'Z':
-      dz_std = atof(optarg);
-      if (dz_std < 0.0) {
+      path.dz_std = atof(optarg);
+      if (path.dz_std < 0.0) {
 	fprintf(stderr, "error: dz std must be 0 or greater\n");
 	return -1;
       }
@@ -229,33 +183,7 @@ int main(int argc, char *argv[])
   Rng random(seed);
   aemobservations obs;
 
-  if (height_std == 0.0) {
-    height = height_mean;
-  } else {
-    height = height_mean + random.normal(height_std);
-  }
-
-  height = random_walk_init(random, height_mean, height_std);
-  
-  roll = random_walk_init(random, roll_mean, roll_std);
-  pitch = random_walk_init(random, pitch_mean,pitch_std);
-  dx = random_walk_init(random, dx_mean, dx_std);
-  dz = random_walk_init(random, dz_mean, dz_std);
-
-  for (int i = 0; i < N; i ++) {
-
-    obs.points.push_back(aempoint(height,
-				  roll, pitch, 0.0,
-				  dx, 0.0, dz,
-				  roll, pitch, 0.0));
-
-    height = random_walk_step(random, height, height_mean, height_std);
-    roll = random_walk_step(random, roll, roll_mean, roll_std);
-    pitch = random_walk_step(random, pitch, pitch_mean, pitch_std);
-    dx = random_walk_step(random, dx, dx_mean, dx_std);
-    dz = random_walk_step(random, dz, dx_mean, dz_std);
-
-  }
+  synthetic_flightpath(obs, N, path, random);
 
   if (!obs.save(output_file)) {
     fprintf(stderr, "error: failed to save output file\n");
@@ -265,38 +193,6 @@ int main(int argc, char *argv[])
   return 0;
 }
 
-static double random_walk_init(Rng &random,
-			       double mu,
-			       double sigma)
-{
-  if (sigma > 0.0) {
-    return mu + random.normal(sigma);
-  } else {
-    return mu;
-  }
-}
-
-static double random_walk_step(Rng &random,
-			       double x0,
-			       double mu,
-			       double sigma,
-			       double scale)
-{
-  if (sigma > 0.0) {
-    double x = x0 + random.normal(sigma/scale);
-    double u = log(random.uniform());
-    
-    while (u > ((x0 - mu)*(x0 - mu)/(2.0 * sigma * sigma) - (x - mu)*(x - mu)/(2.0 * sigma * sigma))) {
-      x = x0 + random.normal(sigma/scale);
-      u = log(random.uniform());
-    }
-
-    return x;
-  } else {
-    return x0;
-  }
-}
-
 static bool ispositivepower2(int i)
 {
   if (i <= 0) {
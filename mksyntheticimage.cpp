@@ -34,6 +34,7 @@
 #include "rng.hpp"
 
 #include "aemimage.hpp"
+#include "synthetic.hpp"
 
 #include "constants.hpp"
 
@@ -56,40 +57,6 @@ static struct option long_options[] = {
   {0, 0, 0, 0}
 };
 
-typedef aemimage *(*mkimage_t)(int, int, double, double, double);
-
-static aemimage *mkconstantimage(int hsamples,
-				 int dsamples,
-				 double depth,
-				 double background_conductivity,
-				 double conductivity);
-
-static aemimage *mkdettmerimage(int hsamples,
-				int dsamples,
-				double depth,
-				double background_conductivity,
-				double conductivity);
-
-static aemimage *mkdettmerpatternimage(int hsamples,
-				       int dsamples,
-				       double depth,
-				       double background_conductivity,
-				       double conductivity);
-
-static struct _imagetable {
-  std::string name;
-  mkimage_t mkimage;
-} imagetable[] = {
-
-  {"constant", mkconstantimage},
-
-  {"dettmer", mkdettmerimage},
-
-  {"dettmerpattern", mkdettmerpatternimage},
-
-  {"", 0}
-};
-
 static bool ispositivepower2(int i);
 
 static void usage(const char *pname);
@@ -198,8 +165,8 @@ int main(int argc, char *argv[])
 
     case 'l':
       fprintf(stderr, "Available models:\n");
-      for (int i = 0; imagetable[i].name.length() != 0; i ++) {
-	printf("  %s\n", imagetable[i].name.c_str());
+      for (auto &n : synthetic_image_names()) {
+	printf("  %s\n", n.c_str());
       }
       return -1;
 	
@@ -222,22 +189,9 @@ int main(int argc, char *argv[])
   }
 
   
-  mkimage_t mkimage = nullptr;
-  for (int i = 0; imagetable[i].name.length() != 0; i ++) {
-    if (imagetable[i].name == model_name) {
-      mkimage = imagetable[i].mkimage;
-      break;
-    }
-  }
-
-  if (mkimage == nullptr) {
-    fprintf(stderr, "error: no model name %s\n", model_name);
-    return -1;
-  }
-
-  aemimage *image = mkimage(hsamples, dsamples, depth, background_conductivity, conductivity);
+  aemimage *image = synthetic_image(model_name, hsamples, dsamples, depth, background_conductivity, conductivity);
   if (image == nullptr) {
-    fprintf(stderr, "error: failed to create image\n");
+    fprintf(stderr, "error: no model name %s\n", model_name);
     return -1;
   }
 
@@ -269,87 +223,6 @@ static bool ispositivepower2(int i)
   }
 }
 
-static aemimage *mkconstantimage(int hsamples,
-				 int dsamples,
-				 double depth,
-				 double background_conductivity,
-				 double conductivity)
-{
-  return new aemimage(dsamples, hsamples, depth, background_conductivity);
-}
-
-static aemimage *mkdettmerimage(int hsamples,
-				int dsamples,
-				double depth,
-				double background_conductivity,
-				double conductivity)
-{
-  aemimage *image = new aemimage(dsamples, hsamples, depth, 0.0);
-
-  int vscale = dsamples/8;
-  int hscale = hsamples/8;
-
-  for (int j = 0; j < dsamples; j ++) {
-
-    int jj = j/vscale;
-
-    for (int i = 0; i < hsamples; i ++) {
-
-      int ii = i/hscale;
-
-      double c = background_conductivity;
-
-      if (ii >= 4 && ii <= 6 &&
-	  jj >= 4 && jj <= 6) {
-	c = conductivity;
-      }
-
-      image->conductivity[j * hsamples + i] = c;
-    }
-  }
-
-  return image;
-}
-
-static aemimage *mkdettmerpatternimage(int hsamples,
-				       int dsamples,
-				       double depth,
-				       double background_conductivity,
-				       double conductivity)
-{
-  aemimage *image = new aemimage(dsamples, hsamples, depth, 0.0);
-
-  int vscale = dsamples/16;
-  int hscale = hsamples/16;
-
-  for (int j = 0; j < dsamples; j ++) {
-
-    int jj = j/vscale;
-
-    for (int i = 0; i < hsamples; i ++) {
-
-      int ii = i/hscale;
-
-      double c = background_conductivity;
-
-      if (ii >= 8 && ii <= 13 &&
-	  jj >= 8 && jj <= 13) {
-
-	if (ii == 8 || ii == 13 ||
-	    jj == 8 || jj == 13) {
-	  c = conductivity;
-	} else if (ii == jj || (ii == 12 && jj == 11) || (ii == 11 && jj == 12)) {
-	  c = conductivity;
-	}
-      }
-
-      image->conductivity[j * hsamples + i] = c;
-    }
-  }
-
-  return image;
-}
-
 static void usage(const char *pname)
 {
   fprintf(stderr,
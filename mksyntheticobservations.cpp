@@ -26,20 +26,25 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <getopt.h>
 
+#include <mpi.h>
+
 #include "aemobservations.hpp"
 #include "aemimage.hpp"
 #include "hierarchicalmodel.hpp"
 #include "aemutil.hpp"
+#include "workerpool.hpp"
+#include "synthetic.hpp"
 
 #include "rng.hpp"
 
 #include "tdemsystem.h"
 #include "general_types.h"
 
-static char short_options[] = "i:I:S:o:O:N:s:h";
+static char short_options[] = "i:I:S:o:O:N:s:c:M:j:bh";
 
 static struct option long_options[] = {
   {"input-image", required_argument, 0, 'i'},
@@ -51,15 +56,25 @@ static struct option long_options[] = {
 
   {"noise", required_argument, 0, 'N'},
   {"seed", required_argument, 0, 's'},
+
+  {"components", required_argument, 0, 'c'},
+  {"realisations", required_argument, 0, 'M'},
+  {"threads", required_argument, 0, 'j'},
+  {"binary", no_argument, 0, 'b'},
   
   {"help", no_argument, 0, 'h'},
   {0, 0, 0, 0}
 };
 
-
-
 static void usage(const char *pname);
 
+static bool save_observations(const aemobservations &obs, const char *filename, bool binary);
+
+static int gather_responses(aemobservations &obs,
+			    int column_offset,
+			    int column_size,
+			    int mpi_rank,
+			    int mpi_size);
   
 int main(int argc, char *argv[])
 {
@@ -77,6 +92,14 @@ int main(int argc, char *argv[])
 
   int seed;
 
+  std::vector<aemresponse::direction_t> components;
+  int realisations;
+  int threads;
+  bool binary;
+
+  int mpi_size;
+  int mpi_rank;
+
   //
   // Defaults
   //
@@ -87,7 +110,10 @@ int main(int argc, char *argv[])
   output_true = nullptr;
 
   seed = 983;
-  
+
+  realisations = 1;
+  threads = 1;
+  binary = false;
   
   while (true) {
 
@@ -126,6 +152,49 @@ int main(int argc, char *argv[])
       seed = atoi(optarg);
       break;
 
+    case 'c':
+      components.clear();
+      for (const char *p = optarg; *p != '\0'; p ++) {
+	switch (*p) {
+	case 'x':
+	case 'X':
+	  components.push_back(aemresponse::DIRECTION_X);
+	  break;
+	case 'y':
+	case 'Y':
+	  components.push_back(aemresponse::DIRECTION_Y);
+	  break;
+	case 'z':
+	case 'Z':
+	  components.push_back(aemresponse::DIRECTION_Z);
+	  break;
+	default:
+	  fprintf(stderr, "error: invalid component '%c'\n", *p);
+	  return -1;
+	}
+      }
+      break;
+
+    case 'M':
+      realisations = atoi(optarg);
+      if (realisations < 1) {
+	fprintf(stderr, "error: realisations must be 1 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'j':
+      threads = atoi(optarg);
+      if (threads < 0) {
+	fprintf(stderr, "error: threads must be 0 (all cores) or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'b':
+      binary = true;
+      break;
+
     case 'h':
     default:
       usage(argv[0]);
@@ -157,36 +226,68 @@ int main(int argc, char *argv[])
     fprintf(stderr, "error: required output file parameter missing\n");
     return -1;
   }
-      
-  aemobservations obs(input_path);
+
+  if (components.size() == 0) {
+    components.push_back(aemresponse::DIRECTION_Z);
+  }
+
+  //
+  // The inversion expects one response per system
+  //
+  if (components.size() != 1 && components.size() != input_stm.size()) {
+    fprintf(stderr, "error: components must be a single component or one per stm\n");
+    return -1;
+  }
+
+  //
+  // From here on errors abort all processes
+  //
+  MPI_Init(&argc, &argv);
+  MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+  MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+
+  aemobservations obs;
+  try {
+    obs = aemobservations(input_path);
+  } catch (aemexception &e) {
+    fprintf(stderr, "error: failed to load flight path\n");
+    MPI_Abort(MPI_COMM_WORLD, -1);
+  }
 
   aemimage image;
   if (!image.load(input_image)) {
     fprintf(stderr, "error: failed to load image file\n");
-    return -1;
+    MPI_Abort(MPI_COMM_WORLD, -1);
   }
 
   if (image.columns != (int)obs.points.size()) {
     fprintf(stderr, "error: mismatch between image columns and number of observations: %d %d\n",
 	    image.columns,
 	    (int)obs.points.size());
-    return -1;
+    MPI_Abort(MPI_COMM_WORLD, -1);
   }
-	    
 
-  std::vector<cTDEmSystem*> forwardmodel;
+  workerpool pool(threads);
+
+  //
+  // cTDEmSystem keeps working state so each worker has its own instances,
+  // all sharing the one system description read from each STM
+  //
+  std::vector<std::vector<cTDEmSystem*>> forwardmodel(pool.size());
   std::vector<double*> forwardmodel_time;
   
   for (auto &s : input_stm) {
 
-    cTDEmSystem *p = new cTDEmSystem(s);
-
-    forwardmodel.push_back(p);
+    forwardmodel[0].push_back(new cTDEmSystem(s));
+    cTDEmSystem *p = forwardmodel[0].back();
+    for (int w = 1; w < pool.size(); w ++) {
+      forwardmodel[w].push_back(new cTDEmSystem(p->shared_description()));
+    }
 
-    double *centre_time = new double[p->WinSpec.size()];
+    double *centre_time = new double[p->description().WinSpec.size()];
 
     int t = 0;
-    for (auto &w : p->WinSpec) {
+    for (auto &w : p->description().WinSpec) {
       centre_time[t] = (w.TimeLow + w.TimeHigh)/2.0;
       t ++;
     }
@@ -202,120 +303,152 @@ int main(int argc, char *argv[])
     hierarchicalmodel *h = hierarchicalmodel::load(s.c_str());
     if (h == nullptr) {
       fprintf(stderr, "error: failed to load hierarchical noise model\n");
-      return -1;
+      MPI_Abort(MPI_COMM_WORLD, -1);
     }
 
     noise.push_back(h);
   }
-  
-  cEarth1D earth1d;
 
-  earth1d.conductivity.resize(image.rows);
-  earth1d.thickness.resize(image.rows - 1);
+  //
+  // Each process computes a contiguous range of columns
+  //
+  int column_offset = 0;
+  int column_size = 0;
+  {
+    int columns = image.columns;
+    for (int r = 0; r <= mpi_rank; r ++) {
+      column_offset += column_size;
+      column_size = columns/(mpi_size - r);
+      columns -= column_size;
+    }
+  }
+
+  printf("  Computing %d columns from %d with %d threads\n", column_size, column_offset, pool.size());
 
-  for (int i = 0; i < (image.rows - 1); i ++) {
-    earth1d.thickness[i] = image.layer_thickness[i];
+  int result = synthetic_responses(obs, image, forwardmodel, components, pool, column_offset, column_size);
+  
+  if (result < 0) {
+    fprintf(stderr, "error: failed to compute forward models\n");
+    MPI_Abort(MPI_COMM_WORLD, -1);
   }
 
-  std::vector<aempoint>::iterator i;
-  int j;
-  for (i = obs.points.begin(), j = 0; i != obs.points.end(); i ++, j ++) {
-    printf("  Computing %6d\n", j);
-    
-    //
-    // Set conductivity from image, thicknesses already set outside of loop
-    //
-    for (int k = 0; k < image.rows; k ++) {
-      earth1d.conductivity[k] = image.conductivity[k * image.columns + j];
+  if (mpi_size > 1) {
+    if (gather_responses(obs, column_offset, column_size, mpi_rank, mpi_size) < 0) {
+      fprintf(stderr, "error: failed to gather responses\n");
+      MPI_Abort(MPI_COMM_WORLD, -1);
     }
+  }
+
+  printf("  Done\n");
 
+  if (mpi_rank == 0) {
+    
     //
-    // Reset observations X, Z
+    // Output true observations is required
     //
-    aempoint &p = *i;
+    if (output_true) {
+      
+      if (!save_observations(obs, output_true, binary)) {
+	fprintf(stderr, "error: failed to save true observations\n");
+	MPI_Abort(MPI_COMM_WORLD, -1);
+      }
+    }
 
     //
-    // Construct geometry
+    // Add the noise for each realisation to a copy of the true responses
     //
-    cTDEmGeometry geometry(p.tx_height,
-			   p.tx_roll,
-			   p.tx_pitch,
-			   p.tx_yaw,
-			   p.txrx_dx,
-			   p.txrx_dy,
-			   p.txrx_dz,
-			   p.rx_roll,
-			   p.rx_pitch,
-			   p.rx_yaw);
-
-    for (auto &f: forwardmodel) {
-
-      cTDEmResponse response;
+    Rng random(seed);
     
-      f->forwardmodel(geometry, earth1d, response);
+    for (int m = 0; m < realisations; m ++) {
 
-      //
-      // Add in the response
-      //
-      aemresponse r(aemresponse::DIRECTION_Z);
+      aemobservations noisy(obs);
 
-      for (auto &i: response.SZ) {
-	r.response.push_back(i);
-      }
+      synthetic_noise(noisy, noise, forwardmodel_time, random);
 
-      p.responses.push_back(r);
+      std::string filename = output_file;
+      if (realisations > 1) {
+	filename = mkfilenamerank(nullptr, output_file, m);
+      }
+      
+      if (!save_observations(noisy, filename.c_str(), binary)) {
+	fprintf(stderr, "error: failed to save noisy observations\n");
+	MPI_Abort(MPI_COMM_WORLD, -1);
+      }
     }
   }
 
-  printf("  Done\n");
+  MPI_Finalize();
 
-  //
-  // Output true observations is required
-  //
-  if (output_true) {
+  return 0;
+}
 
-    if (!obs.save(output_true)) {
-      fprintf(stderr, "error: failed to save true observations\n");
-      return -1;
-    }
+static bool save_observations(const aemobservations &obs, const char *filename, bool binary)
+{
+  if (binary) {
+    return obs.save_binary(filename);
+  } else {
+    return obs.save(filename);
   }
+}
 
+static int gather_responses(aemobservations &obs,
+			    int column_offset,
+			    int column_size,
+			    int mpi_rank,
+			    int mpi_size)
+{
   //
-  // Add the noise
+  // Pack our columns and collect them on the root
   //
-  Rng random(seed);
-    
-  for (auto &a: obs.points) {
+  aemobservations local;
+  local.points.assign(obs.points.begin() + column_offset,
+		      obs.points.begin() + column_offset + column_size);
 
-    int ni = 0;
-    
-    for (auto &r: a.responses) {
+  std::vector<double> buffer;
+  local.pack(buffer);
 
-      hierarchicalmodel *noisemodel = noise[ni];
-      double *time = forwardmodel_time[ni];
-      int di = 0;
+  int n = (int)buffer.size();
+  std::vector<int> sizes(mpi_size);
+  std::vector<int> offsets(mpi_size);
+  
+  if (MPI_Gather(&n, 1, MPI_INT, sizes.data(), 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS) {
+    return -1;
+  }
+
+  int total = 0;
+  for (int r = 0; r < mpi_size; r ++) {
+    offsets[r] = total;
+    total += sizes[r];
+  }
 
-      for (auto &d: r.response) {
-	double t = time[di];
+  std::vector<double> all(mpi_rank == 0 ? total : 0);
+  
+  if (MPI_Gatherv(buffer.data(), n, MPI_DOUBLE,
+		  all.data(), sizes.data(), offsets.data(), MPI_DOUBLE,
+		  0, MPI_COMM_WORLD) != MPI_SUCCESS) {
+    return -1;
+  }
 
-	double sigma = noisemodel->noise(d, t, 1.0);
-	d = d + random.normal(sigma);
-	di ++;
+  if (mpi_rank == 0) {
+    int j = 0;
+    
+    for (int r = 0; r < mpi_size; r ++) {
+      aemobservations part;
+      
+      if (!part.unpack(all.data() + offsets[r], sizes[r])) {
+	return -1;
       }
 
-      ni ++;
+      for (auto &p : part.points) {
+	obs.points[j].responses = p.responses;
+	j ++;
+      }
     }
   }
 
-  if (!obs.save(output_file)) {
-    fprintf(stderr, "error: failed to save noisy observations\n");
-    return -1;
-  }
-
   return 0;
 }
 
-
 static void usage(const char *pname)
 {
   fprintf(stderr,
@@ -332,9 +465,13 @@ static void usage(const char *pname)
 	  " -n|--noise <float>                 Std dev of Gaussian noise\n"
 	  " -s|--seed <int>                    Random seed\n"
 	  "\n"
+	  " -c|--components <xyz>              Response component, either one for all stm's or one\n"
+	  "                                    per stm in order (default z)\n"
+	  " -M|--realisations <int>            No. of noise realisations (suffixed output files)\n"
+	  " -j|--threads <int>                 No. worker threads (0 = all cores)\n"
+	  " -b|--binary                        Write binary observations\n"
+	  "\n"
 	  " -h|--help                          Usage information\n"
 	  "\n",
 	  pname);
 }
-
-  
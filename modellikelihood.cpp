@@ -31,8 +31,12 @@
 #include <getopt.h>
 
 #include "global.hpp"
+#include "workerpool.hpp"
+#include "aemutil.hpp"
 
 extern "C" {
+#include "chain_history.h"
+  
 #include "cdf97_lift.h"
 #include "cdf97_lift_periodic.h"
 #include "haar_lift.h"
@@ -43,7 +47,7 @@ extern "C" {
 #include "wavetree2d_sub.h"
 }
 
-static char short_options[] = "i:o:s:D:d:l:w:W:H:L:nh";
+static char short_options[] = "i:o:s:D:d:l:w:W:H:L:m:c:t:j:O:nh";
 static struct option long_options[] = {
   {"input", required_argument, 0, 'i'},
   {"observations", required_argument, 0, 'o'},
@@ -61,12 +65,51 @@ static struct option long_options[] = {
 
   {"lambda", required_argument, 0, 'L'},
 
+  {"model-list", required_argument, 0, 'm'},
+  {"chain-history", required_argument, 0, 'c'},
+  {"thin", required_argument, 0, 't'},
+  {"threads", required_argument, 0, 'j'},
+  {"output", required_argument, 0, 'O'},
+
   {"help", no_argument, 0, 'h'},
   {0, 0, 0, 0}
 };
 
 static void usage(const char *pname);
 
+struct batch_model {
+  std::string name;
+  std::vector<double> image;
+};
+
+struct replay_data {
+  Global *global;
+  int thin;
+  int counter;
+  std::vector<batch_model> *models;
+};
+
+static int model_to_image(Global &global, std::vector<double> &image);
+
+static int load_model_list(Global &global,
+			   const char *filename,
+			   std::vector<batch_model> &models);
+
+static int load_chain_history(Global &global,
+			      const char *filename,
+			      int thin,
+			      std::vector<batch_model> &models);
+
+static int replay_process(int stepi,
+			  void *user,
+			  const chain_history_change_t *step,
+			  const multiset_int_double_t *S_v);
+
+static int evaluate_batch(Global &global,
+			  const std::vector<batch_model> &models,
+			  int threads,
+			  const char *output);
+
 int main(int argc, char *argv[])
 {
   int c;
@@ -86,6 +129,12 @@ int main(int argc, char *argv[])
 
   double lambda_scale;
 
+  char *model_list;
+  char *chain_history;
+  int thin;
+  int threads;
+  char *output;
+
   //
   // Defaults
   //
@@ -103,6 +152,12 @@ int main(int argc, char *argv[])
 
   lambda_scale = 1.0;
 
+  model_list = nullptr;
+  chain_history = nullptr;
+  thin = 1;
+  threads = 0;
+  output = nullptr;
+
   //
   // Command line parameters
   //
@@ -159,6 +214,34 @@ int main(int argc, char *argv[])
     case 'L':
       lambda_scale = atof(optarg);
       break;
+
+    case 'm':
+      model_list = optarg;
+      break;
+
+    case 'c':
+      chain_history = optarg;
+      break;
+
+    case 't':
+      thin = atoi(optarg);
+      if (thin < 1) {
+	fprintf(stderr, "error: thin must be 1 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'j':
+      threads = atoi(optarg);
+      if (threads < 0) {
+	fprintf(stderr, "error: threads must be 0 (all cores) or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'O':
+      output = optarg;
+      break;
       
     case 'w':
       wavelet_v = atoi(optarg);
@@ -220,6 +303,25 @@ int main(int argc, char *argv[])
 
   global.lambda_scale = lambda_scale;
 
+  if (model_list != nullptr || chain_history != nullptr) {
+    //
+    // Batch mode
+    //
+    std::vector<batch_model> models;
+
+    if (model_list != nullptr &&
+	load_model_list(global, model_list, models) < 0) {
+      return -1;
+    }
+
+    if (chain_history != nullptr &&
+	load_chain_history(global, chain_history, thin, models) < 0) {
+      return -1;
+    }
+
+    return evaluate_batch(global, models, threads, output);
+  }
+
   double log_normalization;
   double like = global.likelihood(log_normalization);
   printf("Likelihood: %g (%g)\n", like, log_normalization);
@@ -246,7 +348,285 @@ usage(const char *pname)
 	  "\n"
 	  "-H|--hierarhical <filename>    Hierachical model filename (one for each stm)\n"
 	  "\n"
+	  "-m|--model-list <filename>     Batch mode: file with a model filename per line\n"
+	  "-c|--chain-history <filename>  Batch mode: models from a chain history\n"
+	  "-t|--thin <int>                Only use every ith chain history model\n"
+	  "-j|--threads <int>             No. worker threads (0 = all cores)\n"
+	  "-O|--output <filename>         Batch summary table (default stdout)\n"
+	  "\n"
 	  "-h|--help                      Usage\n"
 	  "\n",
 	  pname);
 }
+
+static int model_to_image(Global &global, std::vector<double> &image)
+{
+  image.assign(global.size, 0.0);
+  
+  if (wavetree2d_sub_map_to_array(global.wt, image.data(), global.size) < 0) {
+    fprintf(stderr, "error: failed to map model to array\n");
+    return -1;
+  }
+
+  if (generic_lift_inverse2d(image.data(),
+			     global.width,
+			     global.height,
+			     global.width,
+			     global.workspace,
+			     global.hwaveletf,
+			     global.vwaveletf,
+			     1) < 0) {
+    fprintf(stderr, "error: failed to do inverse transform on coefficients\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int load_model_list(Global &global,
+			   const char *filename,
+			   std::vector<batch_model> &models)
+{
+  FILE *fp = fopen(filename, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to open model list %s\n", filename);
+    return -1;
+  }
+
+  char line[1024];
+  while (fgets(line, sizeof(line) - 1, fp) != NULL) {
+
+    // Strip trailing whitespace
+    int i = strlen(line) - 1;
+    while (i >= 0 && isspace(line[i])) {
+      line[i] = '\0';
+      i --;
+    }
+
+    if (line[0] == '\0') {
+      continue;
+    }
+
+    if (wavetree2d_sub_load_promote(global.wt, line) < 0) {
+      fprintf(stderr, "error: failed to load model %s\n", line);
+      return -1;
+    }
+
+    batch_model m;
+    m.name = line;
+    if (model_to_image(global, m.image) < 0) {
+      return -1;
+    }
+
+    models.push_back(m);
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+static int load_chain_history(Global &global,
+			      const char *filename,
+			      int thin,
+			      std::vector<batch_model> &models)
+{
+  chain_history_t *ch = chain_history_create(1000000);
+  if (ch == NULL) {
+    fprintf(stderr, "error: failed to create chain history\n");
+    return -1;
+  }
+
+  multiset_int_double_t *S_v = multiset_int_double_create();
+  if (S_v == NULL) {
+    fprintf(stderr, "error: failed to create multiset\n");
+    return -1;
+  }
+
+  FILE *fp = fopen(filename, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to open chain history %s\n", filename);
+    return -1;
+  }
+
+  struct replay_data data;
+  data.global = &global;
+  data.thin = thin;
+  data.counter = 0;
+  data.models = &models;
+  
+  while (!feof(fp)) {
+
+    if (chain_history_read(ch,
+			   (ch_read_t)fread,
+			   fp) < 0) {
+      if (feof(fp)) {
+	break;
+      }
+      
+      fprintf(stderr, "error: failed to read chain history\n");
+      return -1;
+    }
+
+    if (chain_history_replay(ch,
+			     S_v,
+			     (chain_history_replay_function_t)replay_process,
+			     &data) < 0) {
+      fprintf(stderr, "error: failed to replay\n");
+      return -1;
+    }
+  }
+
+  fclose(fp);
+  chain_history_destroy(ch);
+  multiset_int_double_destroy(S_v);
+
+  return 0;
+}
+
+static int replay_process(int stepi,
+			  void *user,
+			  const chain_history_change_t *step,
+			  const multiset_int_double_t *S_v)
+{
+  struct replay_data *d = (struct replay_data *)user;
+
+  if ((d->counter % d->thin) == 0) {
+
+    if (wavetree2d_sub_set_from_S_v(d->global->wt, S_v) < 0) {
+      fprintf(stderr, "error: failed to set wavetree\n");
+      return -1;
+    }
+
+    batch_model m;
+    m.name = mkformatstring("step-%d", d->counter);
+    if (model_to_image(*(d->global), m.image) < 0) {
+      return -1;
+    }
+    
+    d->models->push_back(m);
+  }
+
+  d->counter ++;
+  
+  return 0;
+}
+
+static int evaluate_batch(Global &global,
+			  const std::vector<batch_model> &models,
+			  int threads,
+			  const char *output)
+{
+  workerpool pool(threads);
+
+  int nmodels = (int)models.size();
+  int nsystems = (int)global.forwardmodel.size();
+  int columns = global.image->columns;
+
+  printf("Evaluating %d models with %d threads\n", nmodels, pool.size());
+
+  //
+  // The forward models are not thread safe so each worker gets its own
+  // (the first uses the global ones, the rest share their system
+  // descriptions), and its own accumulators and scratch
+  //
+  std::vector<std::vector<cTDEmSystem*>> systems(pool.size());
+  std::vector<std::vector<double>> nll(pool.size());
+  std::vector<std::vector<double>> log_normalization(pool.size());
+  std::vector<std::vector<double>> residual(pool.size());
+  std::vector<std::vector<double>> residual_normed(pool.size());
+  std::vector<cEarth1D> earth1d(pool.size());
+
+  for (int w = 0; w < pool.size(); w ++) {
+    if (w == 0) {
+      systems[w] = global.forwardmodel;
+    } else {
+      for (auto &f : global.forwardmodel) {
+	systems[w].push_back(new cTDEmSystem(f->shared_description()));
+      }
+    }
+
+    nll[w].resize(nmodels * nsystems, 0.0);
+    log_normalization[w].resize(nmodels, 0.0);
+    residual[w].resize(global.residuals_per_column);
+    residual_normed[w].resize(global.residuals_per_column);
+
+    earth1d[w].conductivity.resize(global.image->rows);
+    earth1d[w].thickness.resize(global.image->rows - 1);
+    for (int i = 0; i < (global.image->rows - 1); i ++) {
+      earth1d[w].thickness[i] = global.image->layer_thickness[i];
+    }
+  }
+
+  int result = pool.run(nmodels * columns, [&](int worker, int item) -> int {
+      int m = item / columns;
+      int i = item % columns;
+
+      try {
+	(void)global.column_likelihood(i,
+				       models[m].image.data(),
+				       earth1d[worker],
+				       residual[worker].data(),
+				       residual_normed[worker].data(),
+				       log_normalization[worker][m],
+				       &systems[worker],
+				       nll[worker].data() + m * nsystems);
+      } catch (aemexception &e) {
+	return -1;
+      }
+      
+      return 0;
+    });
+
+  if (result < 0) {
+    fprintf(stderr, "error: failed to evaluate models\n");
+    return -1;
+  }
+
+  FILE *fp = stdout;
+  if (output != nullptr) {
+    fp = fopen(output, "w");
+    if (fp == NULL) {
+      fprintf(stderr, "error: failed to create output file\n");
+      return -1;
+    }
+  }
+
+  fprintf(fp, "# model");
+  for (int k = 0; k < nsystems; k ++) {
+    fprintf(fp, " nll%d", k);
+  }
+  fprintf(fp, " nll log_normalization\n");
+  
+  for (int m = 0; m < nmodels; m ++) {
+
+    double total = 0.0;
+    double lognorm = 0.0;
+    
+    fprintf(fp, "%s", models[m].name.c_str());
+    for (int k = 0; k < nsystems; k ++) {
+      double s = 0.0;
+      for (int w = 0; w < pool.size(); w ++) {
+	s += nll[w][m * nsystems + k];
+      }
+      fprintf(fp, " %.9g", s);
+      total += s;
+    }
+
+    for (int w = 0; w < pool.size(); w ++) {
+      lognorm += log_normalization[w][m];
+    }
+    fprintf(fp, " %.9g %.9g\n", total, lognorm);
+  }
+
+  if (output != nullptr) {
+    fclose(fp);
+  }
+
+  for (int w = 1; w < pool.size(); w ++) {
+    for (auto &s : systems[w]) {
+      delete s;
+    }
+  }
+
+  return 0;
+}
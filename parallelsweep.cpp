@@ -0,0 +1,666 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+extern "C" {
+#include "slog.h"
+};
+
+#include "parallelsweep.hpp"
+
+#include "aemutil.hpp"
+#include "checkpoint.hpp"
+#include "profiler.hpp"
+
+ParallelSweep::ParallelSweep(Global &_global, int _maxcoefficients) :
+  global(_global),
+  maxcoefficients(_maxcoefficients),
+  sweeps(0),
+  propose(0),
+  accept(0),
+  propose_depth(new int[global.treemaxdepth + 1]),
+  accept_depth(new int[global.treemaxdepth + 1]),
+  communicator(MPI_COMM_NULL),
+  mpi_size(-1),
+  mpi_rank(-1),
+  max_support(0),
+  current_image(nullptr),
+  proposed_image(nullptr),
+  proposed_residual(nullptr),
+  proposed_residual_normed(nullptr),
+  current_residual_normed(nullptr),
+  column_candidate(nullptr),
+  candidate_valid(new int[_maxcoefficients]),
+  candidate_idx(new int[_maxcoefficients]),
+  candidate_depth(new int[_maxcoefficients]),
+  candidate_lo(new int[_maxcoefficients]),
+  candidate_hi(new int[_maxcoefficients]),
+  candidate_accept(new int[_maxcoefficients]),
+  candidate_value(new double[_maxcoefficients]),
+  candidate_prior_ratio(new double[_maxcoefficients]),
+  candidate_likelihood(new double[4 * _maxcoefficients])
+{
+  if (maxcoefficients < 1) {
+    throw AEMEXCEPTION("Invalid no. of sweep coefficients: %d\n", maxcoefficients);
+  }
+  
+  for (int i = 0; i <= global.treemaxdepth; i ++) {
+    propose_depth[i] = 0;
+    accept_depth[i] = 0;
+  }
+
+  //
+  // Only coefficients narrow enough that the requested number could fit
+  // side by side across the image are used.
+  //
+  max_support = global.width/maxcoefficients;
+  if (max_support < 1) {
+    max_support = 1;
+  }
+
+  current_image = new double[global.size];
+  proposed_image = new double[global.size];
+  column_candidate = new int[global.width];
+
+  if (!global.posteriork) {
+    proposed_residual = new double[global.residual_size];
+    proposed_residual_normed = new double[global.residual_size];
+    current_residual_normed = new double[global.residual_size];
+  }
+}
+
+ParallelSweep::~ParallelSweep()
+{
+  delete [] propose_depth;
+  delete [] accept_depth;
+
+  delete [] current_image;
+  delete [] proposed_image;
+  delete [] column_candidate;
+  
+  delete [] proposed_residual;
+  delete [] proposed_residual_normed;
+  delete [] current_residual_normed;
+
+  delete [] candidate_valid;
+  delete [] candidate_idx;
+  delete [] candidate_depth;
+  delete [] candidate_lo;
+  delete [] candidate_hi;
+  delete [] candidate_accept;
+  delete [] candidate_value;
+  delete [] candidate_prior_ratio;
+  delete [] candidate_likelihood;
+}
+
+int
+ParallelSweep::step()
+{
+  int ncandidates = 0;
+
+  sweeps ++;
+  steps.clear();
+
+  if (choose_coefficients(ncandidates) < 0) {
+    return -1;
+  }
+
+  if (communicate_coefficients(ncandidates) < 0) {
+    return -1;
+  }
+
+  int naccepted = 0;
+  
+  if (ncandidates > 0) {
+
+    for (int i = 0; i < ncandidates; i ++) {
+      propose ++;
+      propose_depth[candidate_depth[i]] ++;
+    }
+
+    //
+    // The current model's residuals are taken from the last accepted
+    // model, so after an exchange or resample they must be rebuilt first.
+    //
+    global.validate_residuals();
+    
+    if (compute_likelihoods(ncandidates) < 0) {
+      return -1;
+    }
+
+    if (compute_acceptance(ncandidates) < 0) {
+      return -1;
+    }
+
+    if (communicate_acceptance(ncandidates) < 0) {
+      return -1;
+    }
+
+    naccepted = commit(ncandidates);
+    if (naccepted < 0) {
+      return -1;
+    }
+  }
+
+  if (steps.empty()) {
+    //
+    // A sweep with nothing accepted is still one sample of the chain
+    //
+    chain_history_change_t step;
+    
+    memset(&step, 0, sizeof(chain_history_change_t));
+    step.header.type = CH_NOCHANGE;
+    steps.push_back(step);
+  }
+
+  return naccepted;
+}
+
+std::string
+ParallelSweep::write_short_stats()
+{
+  return mkformatstring("Sweep %6d/%6d %7.3f",
+			accept,
+			propose,
+			propose == 0 ? 0.0 : 100.0*(double)accept/(double)propose);
+}
+
+std::string
+ParallelSweep::write_long_stats()
+{
+  std::string s = mkformatstring("Sweep: %6d %6d %7.3f:",
+				 sweeps,
+				 propose,
+				 propose == 0 ? 0.0 : 100.0*(double)accept/(double)propose);
+
+  for (int i = 0; i <= global.treemaxdepth; i ++) {
+    s = s + mkformatstring("%7.3f ",
+			   propose_depth[i] == 0 ? 0.0 : 100.0*(double)accept_depth[i]/(double)propose_depth[i]);
+  }
+
+  return s;
+}
+
+void
+ParallelSweep::save_state(checkpoint &cp)
+{
+  cp.section("sweep");
+  cp.write(sweeps);
+  cp.write(propose);
+  cp.write(accept);
+  cp.write_array(propose_depth, global.treemaxdepth + 1);
+  cp.write_array(accept_depth, global.treemaxdepth + 1);
+}
+
+void
+ParallelSweep::load_state(checkpoint &cp)
+{
+  cp.section("sweep");
+  cp.read(sweeps);
+  cp.read(propose);
+  cp.read(accept);
+  cp.read_array(propose_depth, global.treemaxdepth + 1);
+  cp.read_array(accept_depth, global.treemaxdepth + 1);
+}
+
+void
+ParallelSweep::initialize_mpi(MPI_Comm _communicator)
+{
+  MPI_Comm_dup(_communicator, &communicator);
+
+  if (MPI_Comm_size(communicator, &mpi_size) != MPI_SUCCESS) {
+    throw AEMEXCEPTION("MPI Failure\n");
+  }
+  if (MPI_Comm_rank(communicator, &mpi_rank) != MPI_SUCCESS) {
+    throw AEMEXCEPTION("MPI Failure\n");
+  }
+
+  if (global.partitioned && !global.posteriork) {
+    //
+    // Only our own columns' residuals are stored
+    //
+    delete [] proposed_residual;
+    delete [] proposed_residual_normed;
+    delete [] current_residual_normed;
+    
+    proposed_residual = new double[global.residual_size];
+    proposed_residual_normed = new double[global.residual_size];
+    current_residual_normed = new double[global.residual_size];
+  }
+}
+
+int
+ParallelSweep::get_step_count() const
+{
+  return (int)steps.size();
+}
+
+void
+ParallelSweep::get_step(int i, chain_history_change_t *step)
+{
+  *step = steps[i];
+}
+
+bool
+ParallelSweep::primary() const
+{
+  return (communicator == MPI_COMM_NULL || mpi_rank == 0);
+}
+
+int
+ParallelSweep::choose_coefficients(int &ncandidates)
+{
+  ncandidates = 0;
+  
+  if (primary()) {
+
+    int attempts = 4 * maxcoefficients;
+    
+    for (int a = 0; a < attempts && ncandidates < maxcoefficients; a ++) {
+
+      int depth;
+      int idx;
+      double choose_prob;
+      int lo, hi;
+      
+      if (wavetree2d_sub_choose_value_global(global.wt,
+					     global.random.uniform(),
+					     global.treemaxdepth,
+					     &depth,
+					     &idx,
+					     &choose_prob) < 0) {
+	ERROR("failed to choose global value\n");
+	return -1;
+      }
+
+      global.column_support(idx, lo, hi);
+      if ((hi - lo + 1) > max_support) {
+	continue;
+      }
+
+      bool overlaps = false;
+      for (int i = 0; i < ncandidates; i ++) {
+	if (lo <= candidate_hi[i] && candidate_lo[i] <= hi) {
+	  overlaps = true;
+	  break;
+	}
+      }
+      if (overlaps) {
+	continue;
+      }
+
+      int k = ncandidates;
+      int ii, ij;
+      
+      candidate_idx[k] = idx;
+      candidate_depth[k] = depth;
+      candidate_lo[k] = lo;
+      candidate_hi[k] = hi;
+      
+      if (wavetree2d_sub_get_coeff(global.wt, idx, &candidate_value[k]) < 0) {
+	ERROR("failed to get coefficient value\n");
+	return -1;
+      }
+    
+      ii = global.coefficients[idx].ii;
+      ij = global.coefficients[idx].ij;
+    
+      if (coefficient_histogram_propose_value(global.coeff_hist, idx) < 0) {
+	ERROR("failed to update histogram for value proposal\n");
+	return -1;
+      }
+    
+      if (wavetree_pp_value_init(global.proposal) < 0) {
+	ERROR("failed to initialize value proposal\n");
+	return -1;
+      }
+
+      candidate_prior_ratio[k] = 1.0;
+      if (wavetree_pp_propose_value2d(global.proposal, 
+				      ii, ij, 
+				      depth, 
+				      global.maxdepth, 
+				      0.0,
+				      global.value_proposal_temperature(depth),
+				      &candidate_value[k],
+				      &candidate_prior_ratio[k]) < 0) {
+	ERROR("failed to perturb value\n");
+	return -1;
+      }
+  
+      int prior_errors = wavetree_pp_value_error_count(global.proposal);
+      if (prior_errors < 0) {
+	ERROR("failed to check errors\n");
+	return -1;
+      }
+    
+      candidate_valid[k] = (prior_errors == 0);
+      
+      ncandidates ++;
+    }
+  }
+
+  return 0;
+}
+
+int
+ParallelSweep::communicate_coefficients(int &ncandidates)
+{
+  if (communicator != MPI_COMM_NULL) {
+    PROFILE_SCOPE(profiler::MPI_BCAST);
+
+    if (MPI_Bcast(&ncandidates, 1, MPI_INT, 0, communicator) != MPI_SUCCESS) {
+      throw AEMEXCEPTION("Failed to broadcast no. candidates\n");
+    }
+
+    if (ncandidates > 0) {
+      if (MPI_Bcast(candidate_valid, ncandidates, MPI_INT, 0, communicator) != MPI_SUCCESS) {
+	throw AEMEXCEPTION("Failed to broadcast valid candidates\n");
+      }
+      if (MPI_Bcast(candidate_idx, ncandidates, MPI_INT, 0, communicator) != MPI_SUCCESS) {
+	throw AEMEXCEPTION("Failed to broadcast candidate indices\n");
+      }
+      if (MPI_Bcast(candidate_depth, ncandidates, MPI_INT, 0, communicator) != MPI_SUCCESS) {
+	throw AEMEXCEPTION("Failed to broadcast candidate depths\n");
+      }
+      if (MPI_Bcast(candidate_lo, ncandidates, MPI_INT, 0, communicator) != MPI_SUCCESS) {
+	throw AEMEXCEPTION("Failed to broadcast candidate supports\n");
+      }
+      if (MPI_Bcast(candidate_hi, ncandidates, MPI_INT, 0, communicator) != MPI_SUCCESS) {
+	throw AEMEXCEPTION("Failed to broadcast candidate supports\n");
+      }
+      if (MPI_Bcast(candidate_value, ncandidates, MPI_DOUBLE, 0, communicator) != MPI_SUCCESS) {
+	throw AEMEXCEPTION("Failed to broadcast candidate values\n");
+      }
+    }
+  }
+
+  return 0;
+}
+
+int
+ParallelSweep::compute_likelihoods(int ncandidates)
+{
+  for (int i = 0; i < 4 * ncandidates; i ++) {
+    candidate_likelihood[i] = 0.0;
+  }
+
+  if (global.posteriork) {
+    return 0;
+  }
+
+  //
+  // Proposed image, with disjoint supports each column differs from the
+  // current model by at most one coefficient. The current model's column
+  // likelihoods come from its cached residuals so only the proposed image
+  // is transformed and solved.
+  //
+  memset(current_image, 0, sizeof(double) * global.size);
+  if (wavetree2d_sub_map_to_array(global.wt, current_image, global.size) < 0) {
+    ERROR("failed to map model to array\n");
+    return -1;
+  }
+
+  memcpy(proposed_image, current_image, sizeof(double) * global.size);
+  for (int k = 0; k < ncandidates; k ++) {
+    if (candidate_valid[k]) {
+      proposed_image[candidate_idx[k]] = candidate_value[k];
+    }
+  }
+
+  {
+    PROFILE_SCOPE(profiler::WAVELET);
+    if (generic_lift_inverse2d(proposed_image,
+			       global.width,
+			       global.height,
+			       global.width,
+			       global.workspace,
+			       global.hwaveletf,
+			       global.vwaveletf,
+			       1) < 0) {
+      ERROR("failed to do inverse transform on coefficients\n");
+      return -1;
+    }
+  }
+
+  for (int i = 0; i < global.width; i ++) {
+    column_candidate[i] = -1;
+  }
+  for (int k = 0; k < ncandidates; k ++) {
+    if (candidate_valid[k]) {
+      for (int i = candidate_lo[k]; i <= candidate_hi[k]; i ++) {
+	column_candidate[i] = k;
+      }
+    }
+  }
+
+  cEarth1D earth1d;
+
+  earth1d.conductivity.resize(global.image->rows);
+  earth1d.thickness.resize(global.image->rows - 1);
+  for (int i = 0; i < (global.image->rows - 1); i ++) {
+    earth1d.thickness[i] = global.image->layer_thickness[i];
+  }
+
+  int column_offset = 0;
+  int column_size = global.image->columns;
+  if (communicator != MPI_COMM_NULL) {
+    column_offset = global.column_offsets[global.mpi_rank];
+    column_size = global.column_sizes[global.mpi_rank];
+  }
+
+  for (int mi = 0, i = column_offset; mi < column_size; mi ++, i ++) {
+
+    int k = column_candidate[i];
+    if (k >= 0) {
+      int residual_offset = i * global.residuals_per_column - global.residual_base;
+
+      candidate_likelihood[4 * k + 0] += global.column_nll(i,
+							   global.last_valid_residual + residual_offset,
+							   current_residual_normed + residual_offset,
+							   candidate_likelihood[4 * k + 2]);
+      
+      candidate_likelihood[4 * k + 1] += global.column_likelihood(i,
+								  proposed_image,
+								  earth1d,
+								  proposed_residual + residual_offset,
+								  proposed_residual_normed + residual_offset,
+								  candidate_likelihood[4 * k + 3]);
+    }
+  }
+
+  if (communicator != MPI_COMM_NULL) {
+    PROFILE_SCOPE(profiler::MPI_REDUCE);
+    if (MPI_Allreduce(MPI_IN_PLACE,
+		      candidate_likelihood,
+		      4 * ncandidates,
+		      MPI_DOUBLE,
+		      MPI_SUM,
+		      communicator) != MPI_SUCCESS) {
+      throw AEMEXCEPTION("Failed to reduce sweep likelihoods\n");
+    }
+  }
+  
+  return 0;
+}
+
+int
+ParallelSweep::compute_acceptance(int ncandidates)
+{
+  if (primary()) {
+
+    for (int k = 0; k < ncandidates; k ++) {
+
+      candidate_accept[k] = 0;
+      
+      if (candidate_valid[k]) {
+
+	double u = log(global.random.uniform());
+	
+	double alpha = log(candidate_prior_ratio[k]) +
+	  (candidate_likelihood[4 * k + 0] - candidate_likelihood[4 * k + 1])/global.temperature;
+	
+	if (coefficient_histogram_sample_value_alpha(global.coeff_hist, candidate_idx[k], exp(alpha)) < 0) {
+	  ERROR("failed to sample alpha\n");
+	  return -1;
+	}
+	
+	candidate_accept[k] = (u < alpha);
+      }
+    }
+  }
+
+  return 0;
+}
+
+int
+ParallelSweep::communicate_acceptance(int ncandidates)
+{
+  if (communicator != MPI_COMM_NULL) {
+    PROFILE_SCOPE(profiler::MPI_BCAST);
+    if (MPI_Bcast(candidate_accept, ncandidates, MPI_INT, 0, communicator) != MPI_SUCCESS) {
+      throw AEMEXCEPTION("Failed to broadcast accepted\n");
+    }
+  }
+
+  return 0;
+}
+
+int
+ParallelSweep::commit(int ncandidates)
+{
+  int naccepted = 0;
+  
+  for (int k = 0; k < ncandidates; k ++) {
+
+    if (candidate_accept[k]) {
+
+      if (wavetree2d_sub_propose_value(global.wt,
+				       candidate_idx[k],
+				       candidate_depth[k],
+				       candidate_value[k]) < 0) {
+	ERROR("failed to propose value\n");
+	return -1;
+      }
+
+      if (wavetree2d_sub_commit(global.wt) < 0) {
+	ERROR("failed to commit value\n");
+	return -1;
+      }
+
+      chain_history_change_t step;
+      if (wavetree2d_sub_get_last_perturbation(global.wt, &step) < 0) {
+	ERROR("failed to get last perturbation\n");
+	return -1;
+      }
+      steps.push_back(step);
+      
+      if (coefficient_histogram_accept_value(global.coeff_hist, candidate_idx[k], candidate_value[k]) < 0) {
+        ERROR("failed to update histogram for value acceptance\n");
+        return -1;
+      }
+
+      global.current_likelihood += candidate_likelihood[4 * k + 1] - candidate_likelihood[4 * k + 0];
+      global.current_log_normalization += candidate_likelihood[4 * k + 3] - candidate_likelihood[4 * k + 2];
+
+      accept ++;
+      accept_depth[candidate_depth[k]] ++;
+      naccepted ++;
+      
+    } else if (candidate_valid[k]) {
+
+      if (coefficient_histogram_reject_value(global.coeff_hist, candidate_idx[k], candidate_value[k]) < 0) {
+        ERROR("failed to update histogram for value rejection\n");
+        return -1;
+      }
+    }
+  }
+
+  if (naccepted > 0 && !global.posteriork) {
+
+    //
+    // Rebuild the residuals from the last valid ones with the accepted
+    // columns replaced.
+    //
+    int column_offset = 0;
+    int column_size = global.image->columns;
+    if (communicator != MPI_COMM_NULL) {
+      column_offset = global.column_offsets[global.mpi_rank];
+      column_size = global.column_sizes[global.mpi_rank];
+    }
+
+    for (int mi = 0, i = column_offset; mi < column_size; mi ++, i ++) {
+
+      int k = column_candidate[i];
+      int residual_offset = i * global.residuals_per_column - global.residual_base;
+      
+      if (k >= 0 && candidate_accept[k]) {
+	memcpy(global.residual + residual_offset,
+	       proposed_residual + residual_offset,
+	       sizeof(double) * global.residuals_per_column);
+	memcpy(global.residual_normed + residual_offset,
+	       proposed_residual_normed + residual_offset,
+	       sizeof(double) * global.residuals_per_column);
+      } else {
+	memcpy(global.residual + residual_offset,
+	       global.last_valid_residual + residual_offset,
+	       sizeof(double) * global.residuals_per_column);
+	memcpy(global.residual_normed + residual_offset,
+	       global.last_valid_residual_normed + residual_offset,
+	       sizeof(double) * global.residuals_per_column);
+      }
+    }
+
+    if (communicator != MPI_COMM_NULL && !global.partitioned) {
+      PROFILE_SCOPE(profiler::MPI_ALLGATHER);
+      MPI_Allgatherv(global.residual + global.residual_offsets[global.mpi_rank],
+		     global.residual_sizes[global.mpi_rank],
+		     MPI_DOUBLE,
+		     global.residual,
+		     global.residual_sizes,
+		     global.residual_offsets,
+		     MPI_DOUBLE,
+		     communicator);
+      
+      MPI_Allgatherv(global.residual_normed + global.residual_offsets[global.mpi_rank],
+		     global.residual_sizes[global.mpi_rank],
+		     MPI_DOUBLE,
+		     global.residual_normed,
+		     global.residual_sizes,
+		     global.residual_offsets,
+		     MPI_DOUBLE,
+		     communicator);
+    }
+  }
+
+  if (naccepted > 0) {
+    global.accept();
+  } else {
+    global.reject();
+  }
+
+  return naccepted;
+}
@@ -0,0 +1,125 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#pragma once
+#ifndef parallelsweep_hpp
+#define parallelsweep_hpp
+
+#include <vector>
+
+#include <mpi.h>
+
+#include "global.hpp"
+
+extern "C" {
+  #include "chain_history.h"
+};
+
+//
+// Value updates of a set of coefficients whose column supports in the image
+// do not overlap. Since the likelihood is a sum over columns, each update
+// only changes the likelihood of its own columns and so all of the proposals
+// can be evaluated in a single forward modelling pass and accepted or
+// rejected independently of each other.
+//
+class ParallelSweep {
+public:
+
+  ParallelSweep(Global &global, int maxcoefficients);
+  ~ParallelSweep();
+
+  int step();
+
+  std::string write_short_stats();
+
+  std::string write_long_stats();
+
+  void save_state(checkpoint &cp);
+  void load_state(checkpoint &cp);
+
+  void initialize_mpi(MPI_Comm communicator);
+
+  //
+  // The accepted value changes of the last step for the chain history, or
+  // a single no change record if nothing was accepted
+  //
+  int get_step_count() const;
+  void get_step(int i, chain_history_change_t *step);
+
+  Global &global;
+  int maxcoefficients;
+
+  int sweeps;
+  int propose;
+  int accept;
+
+  int *propose_depth;
+  int *accept_depth;
+
+  MPI_Comm communicator;
+  int mpi_size;
+  int mpi_rank;
+
+private:
+
+  bool primary() const;
+
+  int choose_coefficients(int &ncandidates);
+
+  int communicate_coefficients(int &ncandidates);
+
+  int compute_likelihoods(int ncandidates);
+
+  int compute_acceptance(int ncandidates);
+
+  int communicate_acceptance(int ncandidates);
+
+  int commit(int ncandidates);
+
+  int max_support;
+
+  double *current_image;
+  double *proposed_image;
+  double *proposed_residual;
+  double *proposed_residual_normed;
+  double *current_residual_normed;
+  int *column_candidate;
+
+  int *candidate_valid;
+  int *candidate_idx;
+  int *candidate_depth;
+  int *candidate_lo;
+  int *candidate_hi;
+  int *candidate_accept;
+  double *candidate_value;
+  double *candidate_prior_ratio;
+  double *candidate_likelihood;
+
+  std::vector<chain_history_change_t> steps;
+};
+
+#endif // parallelsweep_hpp
@@ -0,0 +1,452 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#include <string.h>
+
+#include "posteriortiles.hpp"
+
+static const char MAGIC[8] = "AEMTILE";
+
+static const int TILE_HEADER = 4;
+
+posteriortiles::posteriortiles() :
+  width(0),
+  height(0),
+  tilesize(0),
+  bins(0),
+  vmin(0.0),
+  vmax(0.0),
+  fp(NULL)
+{
+}
+
+posteriortiles::~posteriortiles()
+{
+  if (fp != NULL) {
+    fclose(fp);
+  }
+}
+
+int
+posteriortiles::ntiles_x() const
+{
+  return (width + tilesize - 1)/tilesize;
+}
+
+int
+posteriortiles::ntiles_y() const
+{
+  return (height + tilesize - 1)/tilesize;
+}
+
+int
+posteriortiles::tile_width(int tx) const
+{
+  int w = width - tx * tilesize;
+  if (w > tilesize) {
+    return tilesize;
+  }
+  return w;
+}
+
+int
+posteriortiles::tile_height(int ty) const
+{
+  int h = height - ty * tilesize;
+  if (h > tilesize) {
+    return tilesize;
+  }
+  return h;
+}
+
+int
+posteriortiles::product_index(const char *name) const
+{
+  for (int i = 0; i < (int)products.size(); i ++) {
+    if (products[i] == name) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+off_t
+posteriortiles::header_size() const
+{
+  return sizeof(MAGIC) + 6 * sizeof(int) + 2 * sizeof(double) + products.size() * NAME_LENGTH;
+}
+
+void
+posteriortiles::compute_offsets()
+{
+  off_t offset = header_size();
+  
+  offsets.clear();
+  for (int ty = 0; ty < ntiles_y(); ty ++) {
+    for (int tx = 0; tx < ntiles_x(); tx ++) {
+      
+      offsets.push_back(offset);
+
+      off_t npixels = tile_width(tx) * tile_height(ty);
+      offset += TILE_HEADER * sizeof(int) +
+	npixels * (products.size() * sizeof(double) + bins * sizeof(int));
+    }
+  }
+}
+
+posteriortilewriter::posteriortilewriter()
+{
+}
+
+posteriortilewriter::~posteriortilewriter()
+{
+  close();
+}
+
+bool
+posteriortilewriter::open(const char *filename,
+			  int _width,
+			  int _height,
+			  int _tilesize,
+			  const std::vector<std::string> &_products,
+			  int _bins,
+			  double _vmin,
+			  double _vmax)
+{
+  if (_width <= 0 || _height <= 0 || _tilesize <= 0 || _bins < 0) {
+    return false;
+  }
+  
+  width = _width;
+  height = _height;
+  tilesize = _tilesize;
+  products = _products;
+  bins = _bins;
+  vmin = _vmin;
+  vmax = _vmax;
+
+  fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    return false;
+  }
+
+  int nproducts = products.size();
+  int version = VERSION;
+  
+  if (fwrite(MAGIC, sizeof(MAGIC), 1, fp) != 1 ||
+      fwrite(&version, sizeof(int), 1, fp) != 1 ||
+      fwrite(&width, sizeof(int), 1, fp) != 1 ||
+      fwrite(&height, sizeof(int), 1, fp) != 1 ||
+      fwrite(&tilesize, sizeof(int), 1, fp) != 1 ||
+      fwrite(&nproducts, sizeof(int), 1, fp) != 1 ||
+      fwrite(&bins, sizeof(int), 1, fp) != 1 ||
+      fwrite(&vmin, sizeof(double), 1, fp) != 1 ||
+      fwrite(&vmax, sizeof(double), 1, fp) != 1) {
+    return false;
+  }
+
+  for (auto &p : products) {
+    char name[NAME_LENGTH];
+    memset(name, 0, NAME_LENGTH);
+    strncpy(name, p.c_str(), NAME_LENGTH - 1);
+    if (fwrite(name, NAME_LENGTH, 1, fp) != 1) {
+      return false;
+    }
+  }
+
+  compute_offsets();
+  
+  return true;
+}
+
+bool
+posteriortilewriter::write(pixel_t pixel)
+{
+  if (fp == NULL) {
+    return false;
+  }
+
+  int nproducts = products.size();
+  int npixels = tilesize * tilesize;
+  
+  std::vector<double> pixelvalues(nproducts);
+  std::vector<double> values(nproducts * npixels);
+  std::vector<int> hist(bins * npixels + 1);
+
+  for (int ty = 0; ty < ntiles_y(); ty ++) {
+    for (int tx = 0; tx < ntiles_x(); tx ++) {
+
+      int header[TILE_HEADER] = {tx, ty, tile_width(tx), tile_height(ty)};
+      int tw = header[2];
+      int th = header[3];
+      
+      for (int j = 0; j < th; j ++) {
+	for (int i = 0; i < tw; i ++) {
+
+	  int k = j * tw + i;
+	  
+	  pixel((ty * tilesize + j) * width + tx * tilesize + i,
+		pixelvalues.data(),
+		hist.data() + k * bins);
+
+	  for (int p = 0; p < nproducts; p ++) {
+	    values[p * tw * th + k] = pixelvalues[p];
+	  }
+	}
+      }
+
+      if (fwrite(header, sizeof(int), TILE_HEADER, fp) != TILE_HEADER ||
+	  fwrite(values.data(), sizeof(double), nproducts * tw * th, fp) != (size_t)(nproducts * tw * th)) {
+	return false;
+      }
+
+      if (bins > 0) {
+	if (fwrite(hist.data(), sizeof(int), bins * tw * th, fp) != (size_t)(bins * tw * th)) {
+	  return false;
+	}
+      }
+    }
+  }
+
+  return true;
+}
+
+bool
+posteriortilewriter::close()
+{
+  if (fp != NULL) {
+    int r = fclose(fp);
+    fp = NULL;
+    return r == 0;
+  }
+
+  return true;
+}
+
+posteriortilereader::posteriortilereader()
+{
+}
+
+posteriortilereader::~posteriortilereader()
+{
+  close();
+}
+
+bool
+posteriortilereader::open(const char *filename)
+{
+  char magic[sizeof(MAGIC)];
+  int version;
+  int nproducts;
+  
+  fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    return false;
+  }
+
+  if (fread(magic, sizeof(MAGIC), 1, fp) != 1 ||
+      memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+    fprintf(stderr, "posteriortilereader::open: %s is not a tiled posterior file\n", filename);
+    return false;
+  }
+
+  if (fread(&version, sizeof(int), 1, fp) != 1 ||
+      version != VERSION) {
+    fprintf(stderr, "posteriortilereader::open: unsupported version\n");
+    return false;
+  }
+  
+  if (fread(&width, sizeof(int), 1, fp) != 1 ||
+      fread(&height, sizeof(int), 1, fp) != 1 ||
+      fread(&tilesize, sizeof(int), 1, fp) != 1 ||
+      fread(&nproducts, sizeof(int), 1, fp) != 1 ||
+      fread(&bins, sizeof(int), 1, fp) != 1 ||
+      fread(&vmin, sizeof(double), 1, fp) != 1 ||
+      fread(&vmax, sizeof(double), 1, fp) != 1) {
+    return false;
+  }
+
+  if (width <= 0 || height <= 0 || tilesize <= 0 || nproducts < 0 || bins < 0) {
+    fprintf(stderr, "posteriortilereader::open: invalid header\n");
+    return false;
+  }
+
+  products.clear();
+  for (int i = 0; i < nproducts; i ++) {
+    char name[NAME_LENGTH];
+    if (fread(name, NAME_LENGTH, 1, fp) != 1) {
+      return false;
+    }
+    name[NAME_LENGTH - 1] = '\0';
+    products.push_back(name);
+  }
+
+  compute_offsets();
+  
+  return true;
+}
+
+bool
+posteriortilereader::read_tile_product(int tx, int ty, int product, double *values)
+{
+  if (fp == NULL || product < 0 || product >= (int)products.size()) {
+    return false;
+  }
+
+  int header[TILE_HEADER];
+  int tw = tile_width(tx);
+  int th = tile_height(ty);
+  off_t offset = offsets[ty * ntiles_x() + tx];
+  
+  if (fseeko(fp, offset, SEEK_SET) < 0 ||
+      fread(header, sizeof(int), TILE_HEADER, fp) != TILE_HEADER) {
+    return false;
+  }
+
+  if (header[0] != tx || header[1] != ty || header[2] != tw || header[3] != th) {
+    fprintf(stderr, "posteriortilereader::read_tile_product: tile header mismatch\n");
+    return false;
+  }
+
+  offset += TILE_HEADER * sizeof(int) + (off_t)product * tw * th * sizeof(double);
+  if (fseeko(fp, offset, SEEK_SET) < 0 ||
+      fread(values, sizeof(double), tw * th, fp) != (size_t)(tw * th)) {
+    return false;
+  }
+
+  return true;
+}
+
+bool
+posteriortilereader::read_tile_histogram(int tx, int ty, int *hist)
+{
+  if (fp == NULL || bins == 0) {
+    return false;
+  }
+
+  int tw = tile_width(tx);
+  int th = tile_height(ty);
+  off_t offset = offsets[ty * ntiles_x() + tx] +
+    TILE_HEADER * sizeof(int) + (off_t)products.size() * tw * th * sizeof(double);
+  
+  if (fseeko(fp, offset, SEEK_SET) < 0 ||
+      fread(hist, sizeof(int), bins * tw * th, fp) != (size_t)(bins * tw * th)) {
+    return false;
+  }
+
+  return true;
+}
+
+bool
+posteriortilereader::export_text(int product, FILE *fp_out)
+{
+  //
+  // Assemble one row of tiles at a time
+  //
+  std::vector<double> band(tilesize * width);
+  std::vector<double> tile(tilesize * tilesize);
+
+  for (int ty = 0; ty < ntiles_y(); ty ++) {
+
+    int th = tile_height(ty);
+    
+    for (int tx = 0; tx < ntiles_x(); tx ++) {
+
+      int tw = tile_width(tx);
+      
+      if (!read_tile_product(tx, ty, product, tile.data())) {
+	return false;
+      }
+
+      for (int j = 0; j < th; j ++) {
+	memcpy(band.data() + j * width + tx * tilesize, tile.data() + j * tw, sizeof(double) * tw);
+      }
+    }
+
+    for (int j = 0; j < th; j ++) {
+      for (int i = 0; i < width; i ++) {
+	fprintf(fp_out, "%10.6f ", band[j * width + i]);
+      }
+      fprintf(fp_out, "\n");
+    }
+  }
+
+  return true;
+}
+
+bool
+posteriortilereader::export_histogram_text(FILE *fp_out)
+{
+  if (bins == 0) {
+    return false;
+  }
+  
+  std::vector<int> band(tilesize * width * bins);
+  std::vector<int> tile(tilesize * tilesize * bins);
+
+  fprintf(fp_out, "%d %d\n", width * height, bins);
+  fprintf(fp_out, "%.6f %.6f\n", vmin, vmax);
+  
+  for (int ty = 0; ty < ntiles_y(); ty ++) {
+
+    int th = tile_height(ty);
+    
+    for (int tx = 0; tx < ntiles_x(); tx ++) {
+
+      int tw = tile_width(tx);
+      
+      if (!read_tile_histogram(tx, ty, tile.data())) {
+	return false;
+      }
+
+      for (int j = 0; j < th; j ++) {
+	memcpy(band.data() + (j * width + tx * tilesize) * bins,
+	       tile.data() + j * tw * bins,
+	       sizeof(int) * tw * bins);
+      }
+    }
+
+    for (int j = 0; j < th * width; j ++) {
+      for (int i = 0; i < bins; i ++) {
+	fprintf(fp_out, "%d ", band[j * bins + i]);
+      }
+      fprintf(fp_out, "\n");
+    }
+  }
+
+  return true;
+}
+
+void
+posteriortilereader::close()
+{
+  if (fp != NULL) {
+    fclose(fp);
+    fp = NULL;
+  }
+}
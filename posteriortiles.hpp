@@ -0,0 +1,140 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#pragma once
+#ifndef posteriortiles_hpp
+#define posteriortiles_hpp
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+//
+// Binary tiled storage of posterior image products (mean, variance, ... and
+// optionally the per pixel histograms). The image is split into square tiles
+// (clipped at the right/bottom edges) that are written in row major tile
+// order, each with a small header, so that the writer only needs to hold one
+// tile of products at a time and a reader can seek directly to any tile.
+//
+// Layout (native byte order):
+//
+//   header : char magic[8], int version, width, height, tilesize, nproducts,
+//            bins, double vmin, vmax, char name[nproducts][NAME_LENGTH]
+//   tile   : int tx, ty, tw, th
+//            double product[nproducts][th][tw]
+//            int hist[th][tw][bins]                (only if bins > 0)
+//
+class posteriortiles {
+public:
+
+  static const int VERSION = 1;
+  static const int NAME_LENGTH = 32;
+  
+  posteriortiles();
+  ~posteriortiles();
+
+  int width;
+  int height;
+  int tilesize;
+  int bins;
+  double vmin;
+  double vmax;
+
+  std::vector<std::string> products;
+
+  int ntiles_x() const;
+  int ntiles_y() const;
+
+  int tile_width(int tx) const;
+  int tile_height(int ty) const;
+
+  int product_index(const char *name) const;
+
+protected:
+
+  void compute_offsets();
+
+  off_t header_size() const;
+  
+  FILE *fp;
+  std::vector<off_t> offsets;
+  
+};
+
+class posteriortilewriter : public posteriortiles {
+public:
+
+  //
+  // Called for each pixel (index into the row major image) to fill in the
+  // product values (in the order given to open) and, if bins > 0, the
+  // histogram.
+  //
+  typedef std::function<void(int index, double *values, int *hist)> pixel_t;
+  
+  posteriortilewriter();
+  ~posteriortilewriter();
+
+  bool open(const char *filename,
+	    int width,
+	    int height,
+	    int tilesize,
+	    const std::vector<std::string> &products,
+	    int bins,
+	    double vmin,
+	    double vmax);
+
+  bool write(pixel_t pixel);
+
+  bool close();
+
+};
+
+class posteriortilereader : public posteriortiles {
+public:
+
+  posteriortilereader();
+  ~posteriortilereader();
+
+  bool open(const char *filename);
+
+  bool read_tile_product(int tx, int ty, int product, double *values);
+  bool read_tile_histogram(int tx, int ty, int *hist);
+
+  //
+  // Text export in the same layout as the postprocess_mean outputs
+  //
+  bool export_text(int product, FILE *fp_out);
+  bool export_histogram_text(FILE *fp_out);
+
+  void close();
+
+};
+
+#endif // posteriortiles_hpp
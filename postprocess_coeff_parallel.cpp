@@ -0,0 +1,734 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <getopt.h>
+#include <glob.h>
+
+extern "C" {
+#include "chain_history.h"
+
+#include "slog.h"
+};
+
+#include "global.hpp"
+
+#include "aemutil.hpp"
+#include "workerpool.hpp"
+
+#include <map>
+
+//
+// Threaded driver combining postprocess_coeff_history and postprocess_coeff_marginal
+// over a set of chain history files. Each worker keeps its own accumulators which
+// are merged once all files are processed.
+//
+
+struct cid {
+  int depth;
+  int index;
+
+  cid(int d, int i) :
+    depth(d),
+    index(i)
+  {
+  }
+
+  friend bool operator<(const cid &a, const cid &b)
+  {
+    if (a.depth == b.depth) {
+      return a.index < b.index;
+    } else {
+      return a.depth < b.depth;
+    }
+  }
+};
+
+struct coefficient_counter {
+
+  coefficient_counter() :
+    pv(0),
+    av(0),
+    pb(0),
+    ab(0),
+    pd(0),
+    ad(0),
+    meann(0),
+    mean(0.0),
+    var(0.0)
+  {
+  }
+
+  void update_mean(double v)
+  {
+    meann ++;
+    double delta = v - mean;
+    mean += delta/(double)(meann);
+    var += delta * (v - mean);
+  }
+
+  void merge(const coefficient_counter &rhs)
+  {
+    pv += rhs.pv;
+    av += rhs.av;
+    pb += rhs.pb;
+    ab += rhs.ab;
+    pd += rhs.pd;
+    ad += rhs.ad;
+
+    int n = meann + rhs.meann;
+    if (n > 0) {
+      double delta = rhs.mean - mean;
+      mean += delta * (double)rhs.meann/(double)n;
+      var += rhs.var + delta * delta * (double)meann * (double)rhs.meann/(double)n;
+      meann = n;
+    }
+  }
+
+  int pv;
+  int av;
+
+  int pb;
+  int ab;
+
+  int pd;
+  int ad;
+
+  int meann;
+  double mean;
+  double var;
+};
+
+struct user_data {
+  int thincounter;
+  int thin;
+  int skip;
+  
+  int counter;
+
+  int degree_max;
+  int ncoeff;
+
+  int *hist;
+  int bins;
+  double vmin;
+  double vmax;
+
+  std::map<cid, coefficient_counter> coefficients;
+  std::vector<coefficient_counter> depth_acceptance;
+
+  void initialize(int _thin, int _skip, int _degree_max, int _ncoeff, int _bins, double _vmin, double _vmax)
+  {
+    thincounter = 0;
+    thin = _thin;
+    skip = _skip;
+    counter = 0;
+
+    degree_max = _degree_max;
+    ncoeff = _ncoeff;
+
+    bins = _bins;
+    vmin = _vmin;
+    vmax = _vmax;
+
+    hist = new int[ncoeff * bins];
+    memset(hist, 0, sizeof(int) * ncoeff * bins);
+
+    depth_acceptance.resize(degree_max + 1);
+  }
+
+  void merge(const user_data &rhs)
+  {
+    counter += rhs.counter;
+
+    for (int i = 0; i < ncoeff * bins; i ++) {
+      hist[i] += rhs.hist[i];
+    }
+
+    for (auto &c : rhs.coefficients) {
+      coefficients[c.first].merge(c.second);
+    }
+
+    for (int i = 0; i <= degree_max; i ++) {
+      depth_acceptance[i].merge(rhs.depth_acceptance[i]);
+    }
+  }
+};
+
+static int process_file(const char *filename, int maxsteps, struct user_data *data);
+
+static int process(int i,
+		   void *user,
+		   const chain_history_change_t *step,
+		   const multiset_int_double_t *S_v);
+
+static int histogram_index(double v, double vmin, double vmax, int bins);
+
+static double safepercent(int p, int a);
+static double safesigma(const coefficient_counter &c);
+
+static char short_options[] = "d:l:i:o:g:a:t:s:b:z:Z:S:j:h";
+static struct option long_options[] = {
+  {"degree-depth", required_argument, 0, 'd'},
+  {"degree-lateral", required_argument, 0, 'l'},
+
+  {"input", required_argument, 0, 'i'},
+  {"output", required_argument, 0, 'o'},
+  {"marginal", required_argument, 0, 'g'},
+  {"acceptance", required_argument, 0, 'a'},
+
+  {"thin", required_argument, 0, 't'},
+  {"skip", required_argument, 0, 's'},
+
+  {"bins", required_argument, 0, 'b'},
+  {"vmin", required_argument, 0, 'z'},
+  {"vmax", required_argument, 0, 'Z'},
+
+  {"maxsteps", required_argument, 0, 'S'},
+
+  {"threads", required_argument, 0, 'j'},
+
+  {"help", no_argument, 0, 'h'},
+  {0, 0, 0, 0}
+};
+
+static void usage(const char *pname);
+
+int main(int argc, char *argv[])
+{
+  int c;
+  int option_index;
+  
+  std::vector<std::string> input_pattern;
+  
+  char *output_file;
+  char *marginal_file;
+  char *acceptance_file;
+
+  int degree_depth;
+  int degree_lateral;
+
+  int thin;
+  int skip;
+  int maxsteps;
+
+  int bins;
+  double vmin;
+  double vmax;
+
+  int threads;
+
+  FILE *fp_out;
+
+  /*
+   * Default values
+   */
+  fp_out = NULL;
+  degree_depth = 5;
+  degree_lateral = 8;
+  
+  output_file = NULL;
+  marginal_file = NULL;
+  acceptance_file = NULL;
+
+  bins = 1000;
+  vmin = -3.0;
+  vmax = 3.0;
+  
+  thin = 0;
+  skip = 0;
+
+  maxsteps = 1000000;
+
+  threads = 0;
+  
+  while (1) {
+    c = getopt_long(argc, argv, short_options, long_options, &option_index);
+    if (c == -1) {
+      break;
+    }
+
+    switch(c) {
+    case 'd':
+      degree_depth = atoi(optarg);
+      if (degree_depth < 1) {
+	fprintf(stderr, "error: invalid degree\n");
+	return -1;
+      }
+      break;
+
+    case 'l':
+      degree_lateral = atoi(optarg);
+      if (degree_lateral < 1) {
+	fprintf(stderr, "error: invalid lateral degree\n");
+	return -1;
+      }
+      break;
+
+    case 'i':
+      input_pattern.push_back(optarg);
+      break;
+
+    case 'o':
+      output_file = optarg;
+      break;
+
+    case 'g':
+      marginal_file = optarg;
+      break;
+
+    case 'a':
+      acceptance_file = optarg;
+      break;
+
+    case 't':
+      thin = atoi(optarg);
+      break;
+
+    case 's':
+      skip = atoi(optarg);
+      break;
+      
+    case 'b':
+      bins = atoi(optarg);
+      if (bins < 1) {
+	fprintf(stderr, "error: bins must be 1 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'z':
+      vmin = atof(optarg);
+      break;
+
+    case 'Z':
+      vmax = atof(optarg);
+      break;
+
+    case 'S':
+      maxsteps = atoi(optarg);
+      if (maxsteps < 1000) {
+	fprintf(stderr, "error: maxsteps should be 1000 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'j':
+      threads = atoi(optarg);
+      if (threads < 0) {
+	fprintf(stderr, "error: threads must be 0 (all cores) or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'h':
+    default:
+      usage(argv[0]);
+      return -1;
+      
+    }
+  }
+
+  if (input_pattern.size() == 0) {
+    fprintf(stderr, "error: required parameter input file missing\n");
+    return -1;
+  }
+
+  if (output_file == NULL && marginal_file == NULL && acceptance_file == NULL) {
+    fprintf(stderr, "error: at least one output file required\n");
+    return -1;
+  }
+
+  //
+  // Expand the input patterns, eg "ch.dat-*"
+  //
+  std::vector<std::string> input_file;
+  for (auto &pattern : input_pattern) {
+    glob_t g;
+    if (glob(pattern.c_str(), 0, NULL, &g) != 0) {
+      fprintf(stderr, "error: no files matching %s\n", pattern.c_str());
+      return -1;
+    }
+
+    for (int i = 0; i < (int)g.gl_pathc; i ++) {
+      input_file.push_back(g.gl_pathv[i]);
+    }
+    
+    globfree(&g);
+  }
+
+  wavetree2d_sub_t *wt = wavetree2d_sub_create(degree_lateral, degree_depth, 0.0);
+  if (wt == nullptr) {
+    fprintf(stderr, "error: failed to create wavetree\n");
+    return -1;
+  }
+
+  int ncoeff = wavetree2d_sub_get_ncoeff(wt);
+  int degree_max = wavetree2d_sub_maxdepth(wt);
+  wavetree2d_sub_destroy(wt);
+
+  workerpool pool(threads);
+
+  printf("Processing %d files with %d threads\n", (int)input_file.size(), pool.size());
+
+  std::vector<struct user_data> data(pool.size());
+  for (auto &d : data) {
+    d.initialize(thin, skip, degree_max, ncoeff, bins, vmin, vmax);
+  }
+
+  if (pool.run(input_file.size(), [&](int worker, int item) {
+	return process_file(input_file[item].c_str(), maxsteps, &data[worker]);
+      }) < 0) {
+    fprintf(stderr, "error: failed to process chain histories\n");
+    return -1;
+  }
+
+  for (int i = 1; i < (int)data.size(); i ++) {
+    data[0].merge(data[i]);
+  }
+
+  struct user_data &total = data[0];
+  printf("%d records\n", total.counter);
+
+  if (output_file != NULL) {
+    fp_out = fopen(output_file, "w");
+    if (fp_out == NULL) {
+      fprintf(stderr, "error: failed to create coefficient history file\n");
+      return -1;
+    }
+
+    for (auto &cc : total.coefficients) {
+      fprintf(fp_out, "%3d %5d B %5d %7.3f D %5d %7.3f V %5d %7.3f mu %10.6f sigma %10.6f N %5d\n",
+	      cc.first.depth, cc.first.index,
+	      cc.second.pb, safepercent(cc.second.pb, cc.second.ab),
+	      cc.second.pd, safepercent(cc.second.pd, cc.second.ad),
+	      cc.second.pv, safepercent(cc.second.pv, cc.second.av),
+	      cc.second.mean,
+	      safesigma(cc.second),
+	      cc.second.meann);
+    }
+
+    fclose(fp_out);
+  }
+
+  if (marginal_file != NULL) {
+    fp_out = fopen(marginal_file, "w");
+    if (fp_out == NULL) {
+      fprintf(stderr, "error: failed to open histogram file\n");
+      return -1;
+    }
+    
+    fprintf(fp_out, "%d %d\n", total.ncoeff, total.bins);
+    fprintf(fp_out, "%.6f %.6f\n", total.vmin, total.vmax);
+    
+    for (int j = 0; j < total.ncoeff; j ++) {
+      for (int i = 0; i < total.bins; i ++) {
+	
+	fprintf(fp_out, "%d ", total.hist[j * total.bins + i]);
+	
+      }
+      fprintf(fp_out, "\n");
+    }
+    
+    fclose(fp_out);
+  }
+
+  if (acceptance_file != NULL) {
+    fp_out = fopen(acceptance_file, "w");
+    if (fp_out == NULL) {
+      fprintf(stderr, "error: failed to open acceptance file\n");
+      return -1;
+    }
+
+    for (int i = 0; i <= total.degree_max; i ++) {
+      coefficient_counter &cc = total.depth_acceptance[i];
+      fprintf(fp_out, "%3d B %8d %7.3f D %8d %7.3f V %8d %7.3f\n",
+	      i,
+	      cc.pb, safepercent(cc.pb, cc.ab),
+	      cc.pd, safepercent(cc.pd, cc.ad),
+	      cc.pv, safepercent(cc.pv, cc.av));
+    }
+
+    fclose(fp_out);
+  }
+
+  for (auto &d : data) {
+    delete [] d.hist;
+  }
+  
+  return 0;
+}
+
+static int process_file(const char *filename, int maxsteps, struct user_data *data)
+{
+  //
+  // Runs on worker threads so every path releases what it allocated
+  //
+  chain_history_t *ch = chain_history_create(maxsteps);
+  multiset_int_double_t *S_v = multiset_int_double_create();
+  FILE *fp_in = NULL;
+  int status = 0;
+
+  if (ch == NULL) {
+    fprintf(stderr, "error: failed to create chain history\n");
+    status = -1;
+  } else if (S_v == NULL) {
+    fprintf(stderr, "error: failed to create multiset\n");
+    status = -1;
+  } else {
+    fp_in = fopen(filename, "r");
+    if (fp_in == NULL) {
+      fprintf(stderr, "error: failed to open input file %s\n", filename);
+      status = -1;
+    }
+  }
+
+  //
+  // Skip/thin apply from the start of each chain
+  //
+  data->thincounter = 0;
+  
+  while (status == 0 && !feof(fp_in)) {
+    
+    if (chain_history_read(ch,
+			   (ch_read_t)fread,
+			   fp_in) < 0) {
+      if (feof(fp_in)) {
+	break;
+      }
+      
+      fprintf(stderr, "error: failed to read chain history %s\n", filename);
+      status = -1;
+      break;
+    }
+    
+    if (chain_history_replay(ch,
+			     S_v,
+			     (chain_history_replay_function_t)process,
+			     data) < 0) {
+      fprintf(stderr, "error: failed to replay %s\n", filename);
+      status = -1;
+      break;
+    }
+  }
+
+  if (fp_in != NULL) {
+    fclose(fp_in);
+  }
+  if (ch != NULL) {
+    chain_history_destroy(ch);
+  }
+  if (S_v != NULL) {
+    multiset_int_double_destroy(S_v);
+  }
+
+  if (status == 0) {
+    printf("Loaded: %s\n", filename);
+  }
+
+  return status;
+}
+
+static int process(int stepi,
+		   void *user,
+		   const chain_history_change_t *step,
+		   const multiset_int_double_t *S_v)
+{
+  struct user_data *d = (struct user_data *)user;
+
+  coefficient_counter *cc;
+  coefficient_counter *dc;
+  
+  if ((d->thincounter >= d->skip) && (d->thin <= 1 || (d->thincounter % d->thin) == 0)) {
+
+    d->counter ++;
+
+    //
+    // Marginal histograms of current model
+    //
+    for (int depth = 0; depth <= d->degree_max; depth ++) {
+
+      int c = multiset_int_double_depth_count(S_v, depth);
+      for (int i = 0; i < c; i ++) {
+	int index;
+	double value;
+	
+	if (multiset_int_double_nth_element(S_v, depth, i, &index, &value) < 0) {
+	  ERROR("Failed to get nth element");
+	  return -1;
+	}
+
+	int hi = histogram_index(value, d->vmin, d->vmax, d->bins);
+	d->hist[index * d->bins + hi] ++;
+      }
+    }
+
+    //
+    // Per coefficient and per depth acceptance
+    //
+    switch (step->header.type) {
+    case CH_INITIALISE:
+      {
+	int depth = 0;
+	int count = multiset_int_double_depth_count(S_v, depth);
+	while (count > 0) {
+	  for (int i = 0; i < count; i ++) {
+
+	    int idx;
+	    double value;
+	      
+	    if (multiset_int_double_nth_element(S_v, depth, i, &idx, &value) < 0) {
+	      ERROR("Failed to get nth element");
+	      return -1;
+	    }
+
+	    d->coefficients[cid(depth, idx)].update_mean(value);
+	  }
+	  
+	  depth ++;
+	  count = multiset_int_double_depth_count(S_v, depth);
+	}
+      }
+      break;
+
+    case CH_BIRTH:
+      cc = &(d->coefficients[cid(step->perturbation.birth.node_depth,
+				 step->perturbation.birth.node_id)]);
+      dc = &(d->depth_acceptance[step->perturbation.birth.node_depth]);
+
+      cc->pb ++;
+      dc->pb ++;
+      if (step->header.accepted) {
+	cc->ab ++;
+	dc->ab ++;
+	cc->update_mean(step->perturbation.birth.new_value);
+      }
+      break;
+      
+    case CH_DEATH:
+      cc = &(d->coefficients[cid(step->perturbation.death.node_depth,
+				 step->perturbation.death.node_id)]);
+      dc = &(d->depth_acceptance[step->perturbation.death.node_depth]);
+
+      cc->pd ++;
+      dc->pd ++;
+      if (step->header.accepted) {
+	cc->ad ++;
+	dc->ad ++;
+      }
+      break;
+
+    case CH_VALUE:
+      cc = &(d->coefficients[cid(step->perturbation.value.node_depth,
+				 step->perturbation.value.node_id)]);
+      dc = &(d->depth_acceptance[step->perturbation.value.node_depth]);
+      
+      cc->pv ++;
+      dc->pv ++;
+      if (step->header.accepted) {
+	cc->av ++;
+	dc->av ++;
+	cc->update_mean(step->perturbation.value.new_value);
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+  d->thincounter ++;
+  
+  return 0;
+}
+
+static int histogram_index(double v, double vmin, double vmax, int bins)
+{
+  int i;
+  
+  i = (int)((double)bins * (v - vmin)/(vmax - vmin));
+
+  if (i < 0) {
+    return 0;
+  }
+
+  if (i > (bins - 1)) {
+    return bins - 1;
+  }
+
+  return i;
+}
+
+static double safepercent(int p, int a)
+{
+  if (p == 0) {
+    return 0.0;
+  }
+  return 100.0 * (double)a/(double)p;
+}
+
+static double safesigma(const coefficient_counter &c)
+{
+  if (c.meann < 2) {
+    return 0.0;
+  } else {
+    return sqrt(c.var/(double)(c.meann - 1));
+  }
+}
+
+static void usage(const char *pname)
+{
+  fprintf(stderr,
+	  "usage: %s [options]\n"
+	  "where options is one or more of:\n"
+	  "\n"
+	  " -d|--degree-depth <int>    Number of layers as power of 2\n"
+	  " -l|--degree-lateral <int>  Number of horizontal samples as power of 2\n"
+	  "\n"
+	  " -i|--input <pattern>             Input ch file(s), eg \"ch.dat-*\" (may be more than 1)\n"
+	  " -o|--output <file>               Output coefficient history statistics\n"
+	  " -g|--marginal <file>             Output histograms for all coefficients\n"
+	  " -a|--acceptance <file>           Output per depth acceptance rates\n"
+	  "\n"
+	  " -t|--thin <int>                  Only processing every ith sample\n"
+	  " -s|--skip <int>                  Skip n samples from beginning of each chain\n"
+	  "\n"
+	  " -b|--bins <int>                  No. histogram bins\n"
+	  " -z|--vmin <float>                Lower range for histogram\n"
+	  " -Z|--vmax <float>                Upper range for histogram\n"
+	  "\n"
+	  " -S|--maxsteps <int>              Chain history max steps\n"
+	  "\n"
+	  " -j|--threads <int>               No. worker threads (0 = all cores)\n"
+	  "\n"
+	  " -h|--help            Show usage\n"
+	  "\n",
+	  pname);
+}
@@ -45,6 +45,8 @@ extern "C" {
 };
 
 #include "global.hpp"
+#include "quantilesketch.hpp"
+#include "posteriortiles.hpp"
 
 struct user_data {
   int thincounter;
@@ -66,6 +68,9 @@ struct user_data {
   double vmin;
   double vmax;
 
+  quantilesketch *sketch;
+  int *sketch_hist;
+
   double *model;
   double *workspace;
 
@@ -93,7 +98,14 @@ static double head_from_histogram(int *hist, double vmin, double vmax, int bins,
 static double tail_from_histogram(int *hist, double vmin, double vmax, int bins, int drop);
 static double hpd_from_histogram(int *hist, double vmin, double vmax, int bins, double hpd_interval, double &hpd_min, double &hpd_max);
 
-static char short_options[] = "d:l:i:o:v:D:t:s:m:M:c:C:g:p:P:Q:b:z:Z:S:w:W:Lh";
+static double pixel_mode(struct user_data &d, int i);
+static double pixel_median(struct user_data &d, int i);
+static double pixel_credible_min(struct user_data &d, int i, int drop);
+static double pixel_credible_max(struct user_data &d, int i, int drop);
+static double pixel_hpd(struct user_data &d, int i, double &hpd_min, double &hpd_max);
+static int *pixel_histogram(struct user_data &d, int i);
+
+static char short_options[] = "d:l:i:o:v:D:t:s:m:M:c:C:g:p:P:Q:b:z:Z:q:T:k:HS:w:W:Lh";
 static struct option long_options[] = {
   {"degree-depth", required_argument, 0, 'd'},
   {"degree-lateral", required_argument, 0, 'l'},
@@ -118,6 +130,11 @@ static struct option long_options[] = {
   {"bins", required_argument, 0, 'b'},
   {"vmin", required_argument, 0, 'z'},
   {"vmax", required_argument, 0, 'Z'},
+  {"sketch", required_argument, 0, 'q'},
+
+  {"tiled", required_argument, 0, 'T'},
+  {"tile-size", required_argument, 0, 'k'},
+  {"tile-histograms", no_argument, 0, 'H'},
 
   {"maxsteps", required_argument, 0, 'S'},
 
@@ -163,6 +180,11 @@ int main(int argc, char *argv[])
   int bins;
   double vmin;
   double vmax;
+  double sketch;
+
+  char *tiled_file;
+  int tilesize;
+  bool tile_histograms;
 
   FILE *fp_in;
   FILE *fp_out;
@@ -206,6 +228,11 @@ int main(int argc, char *argv[])
   bins = 1000;
   vmin = 2.0;
   vmax = 4.0;
+  sketch = 0.0;
+
+  tiled_file = NULL;
+  tilesize = 64;
+  tile_histograms = false;
   
   thin = 0;
   skip = 0;
@@ -314,6 +341,30 @@ int main(int argc, char *argv[])
       vmax = atof(optarg);
       break;
 
+    case 'q':
+      sketch = atof(optarg);
+      if (sketch < 1.0) {
+	fprintf(stderr, "error: sketch compression must be 1 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'T':
+      tiled_file = optarg;
+      break;
+
+    case 'k':
+      tilesize = atoi(optarg);
+      if (tilesize < 1) {
+	fprintf(stderr, "error: tile size must be 1 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'H':
+      tile_histograms = true;
+      break;
+
     case 'S':
       maxsteps = atoi(optarg);
       if (maxsteps < 1000) {
@@ -355,7 +406,7 @@ int main(int argc, char *argv[])
     return -1;
   }
 
-  if (output_file == NULL) {
+  if (output_file == NULL && tiled_file == NULL) {
     fprintf(stderr, "error: required parameter output file missing\n");
     return -1;
   }
@@ -390,10 +441,24 @@ int main(int argc, char *argv[])
   data.bins = bins;
   data.vmin = vmin;
   data.vmax = vmax;
-  data.hist =new int*[data.size];
-  for (i = 0; i < data.size; i ++) {
-    data.hist[i] = new int[data.bins];
-    memset(data.hist[i], 0, sizeof(int) * data.bins);
+  if (sketch > 0.0) {
+    //
+    // Quantile sketches replace the per pixel histograms
+    //
+    data.hist = nullptr;
+    data.sketch = new quantilesketch[data.size];
+    for (i = 0; i < data.size; i ++) {
+      data.sketch[i].set_compression(sketch);
+    }
+    data.sketch_hist = new int[data.bins];
+  } else {
+    data.hist = new int*[data.size];
+    for (i = 0; i < data.size; i ++) {
+      data.hist[i] = new int[data.bins];
+      memset(data.hist[i], 0, sizeof(int) * data.bins);
+    }
+    data.sketch = nullptr;
+    data.sketch_hist = nullptr;
   }
   
   data.variance = new double[data.size];
@@ -454,21 +519,23 @@ int main(int argc, char *argv[])
   /*
    * Mean output
    */
-  fp_out = fopen(output_file, "w");
-  if (fp_out == NULL) {
-    fprintf(stderr, "error: failed to open mean file\n");
-    return -1;
-  }
-
-  for (j = 0; j < data.height; j ++) {
-    for (i = 0; i < data.width; i ++) {
-      fprintf(fp_out, "%10.6f ", data.mean[j*data.width + i]);
+  if (output_file != NULL) {
+    fp_out = fopen(output_file, "w");
+    if (fp_out == NULL) {
+      fprintf(stderr, "error: failed to open mean file\n");
+      return -1;
+    }
+    
+    for (j = 0; j < data.height; j ++) {
+      for (i = 0; i < data.width; i ++) {
+	fprintf(fp_out, "%10.6f ", data.mean[j*data.width + i]);
+      }
+      fprintf(fp_out, "\n");
     }
-    fprintf(fp_out, "\n");
+    
+    fclose(fp_out);
   }
 
-  fclose(fp_out);
-
   for (i = 0; i < data.size; i ++) {
     data.variance[i] /= (double)(data.counter - 1);
   }
@@ -525,8 +592,7 @@ int main(int argc, char *argv[])
 
     for (j = 0; j < data.height; j ++) {
       for (i = 0; i < data.width; i ++) {
-	fprintf(fp_out, "%10.6f ", mode_from_histogram(data.hist[j*data.width + i],
-						       data.vmin, data.vmax, data.bins));
+	fprintf(fp_out, "%10.6f ", pixel_mode(data, j*data.width + i));
       }
       fprintf(fp_out, "\n");
     }
@@ -546,8 +612,7 @@ int main(int argc, char *argv[])
 
     for (j = 0; j < data.height; j ++) {
       for (i = 0; i < data.width; i ++) {
-	fprintf(fp_out, "%10.6f ", median_from_histogram(data.hist[j*data.width + i],
-							 data.vmin, data.vmax, data.bins));
+	fprintf(fp_out, "%10.6f ", pixel_median(data, j*data.width + i));
       }
       fprintf(fp_out, "\n");
     }
@@ -559,6 +624,47 @@ int main(int argc, char *argv[])
    * Credible Min
    */
   credible_drop = (int)(((double)data.counter * (1.0 - CREDIBLE_INTERVAL))/2.0);
+
+  /*
+   * Binary tiled output of all products, computed and written one tile at a time
+   */
+  if (tiled_file != NULL) {
+    posteriortilewriter tiles;
+    std::vector<std::string> products = {
+      "mean", "variance", "stddev", "mode", "median",
+      "credible_min", "credible_max", "hpd_min", "hpd_max", "hpd_range"
+    };
+
+    if (!tiles.open(tiled_file,
+		    data.width,
+		    data.height,
+		    tilesize,
+		    products,
+		    tile_histograms ? data.bins : 0,
+		    data.vmin,
+		    data.vmax)) {
+      fprintf(stderr, "error: failed to create tiled output file\n");
+      return -1;
+    }
+
+    if (!tiles.write([&](int k, double *values, int *hist) {
+	  values[0] = data.mean[k];
+	  values[1] = data.variance[k];
+	  values[2] = sqrt(data.variance[k]);
+	  values[3] = pixel_mode(data, k);
+	  values[4] = pixel_median(data, k);
+	  values[5] = pixel_credible_min(data, k, credible_drop);
+	  values[6] = pixel_credible_max(data, k, credible_drop);
+	  values[9] = pixel_hpd(data, k, values[7], values[8]);
+
+	  if (tile_histograms) {
+	    memcpy(hist, pixel_histogram(data, k), sizeof(int) * data.bins);
+	  }
+	}) || !tiles.close()) {
+      fprintf(stderr, "error: failed to write tiled output file\n");
+      return -1;
+    }
+  }
   
   if (credible_min != NULL) {
     fp_out = fopen(credible_min, "w");
@@ -569,9 +675,7 @@ int main(int argc, char *argv[])
 
     for (j = 0; j < data.height; j ++) {
       for (i = 0; i < data.width; i ++) {
-	fprintf(fp_out, "%10.6f ", head_from_histogram(data.hist[j*data.width + i],
-						       data.vmin, data.vmax, data.bins,
-						       credible_drop));
+	fprintf(fp_out, "%10.6f ", pixel_credible_min(data, j*data.width + i, credible_drop));
       }
       fprintf(fp_out, "\n");
     }
@@ -591,9 +695,7 @@ int main(int argc, char *argv[])
 
     for (j = 0; j < data.height; j ++) {
       for (i = 0; i < data.width; i ++) {
-	fprintf(fp_out, "%10.6f ", tail_from_histogram(data.hist[j*data.width + i],
-						       data.vmin, data.vmax, data.bins,
-						       credible_drop));
+	fprintf(fp_out, "%10.6f ", pixel_credible_max(data, j*data.width + i, credible_drop));
       }
       fprintf(fp_out, "\n");
     }
@@ -612,9 +714,10 @@ int main(int argc, char *argv[])
     fprintf(fp_out, "%.6f %.6f\n", data.vmin, data.vmax);
 
     for (j = 0; j < data.size; j ++) {
+      int *hist = pixel_histogram(data, j);
       for (i = 0; i < data.bins; i ++) {
 
-	fprintf(fp_out, "%d ", data.hist[j][i]);
+	fprintf(fp_out, "%d ", hist[i]);
 
       }
       fprintf(fp_out, "\n");
@@ -657,10 +760,7 @@ int main(int argc, char *argv[])
       for (i = 0; i < data.width; i ++) {
 	double hmin, hmax;
 
-	double hrange = hpd_from_histogram(data.hist[j*data.width + i],
-					   data.vmin, data.vmax, data.bins,
-					   CREDIBLE_INTERVAL,
-					   hmin, hmax);
+	double hrange = pixel_hpd(data, j*data.width + i, hmin, hmax);
 
 	if (fpr != NULL) {
 	  fprintf(fpr, "%10.6f ", hrange);
@@ -708,6 +808,8 @@ int main(int argc, char *argv[])
   delete [] data.variance;
   delete [] data.model;
   delete [] data.workspace;
+  delete [] data.sketch;
+  delete [] data.sketch_hist;
   
   return 0;
 }
@@ -769,10 +871,16 @@ static int process(int stepi,
     /*
      * Update the histogram
      */
-    for (i = 0; i < d->size; i ++) {
-      hi = histogram_index(d->model[i], d->vmin, d->vmax, d->bins);
-
-      d->hist[i][hi] ++;
+    if (d->sketch != nullptr) {
+      for (i = 0; i < d->size; i ++) {
+	d->sketch[i].add(d->model[i]);
+      }
+    } else {
+      for (i = 0; i < d->size; i ++) {
+	hi = histogram_index(d->model[i], d->vmin, d->vmax, d->bins);
+	
+	d->hist[i][hi] ++;
+      }
     }
   }
   d->thincounter ++;
@@ -937,6 +1045,61 @@ static double hpd_from_histogram(int *hist, double vmin, double vmax, int bins,
   return minwidth;
 }
 
+static double pixel_mode(struct user_data &d, int i)
+{
+  if (d.sketch != nullptr) {
+    return d.sketch[i].mode();
+  }
+
+  return mode_from_histogram(d.hist[i], d.vmin, d.vmax, d.bins);
+}
+
+static double pixel_median(struct user_data &d, int i)
+{
+  if (d.sketch != nullptr) {
+    return d.sketch[i].quantile(0.5);
+  }
+
+  return median_from_histogram(d.hist[i], d.vmin, d.vmax, d.bins);
+}
+
+static double pixel_credible_min(struct user_data &d, int i, int drop)
+{
+  if (d.sketch != nullptr) {
+    return d.sketch[i].quantile((1.0 - CREDIBLE_INTERVAL)/2.0);
+  }
+
+  return head_from_histogram(d.hist[i], d.vmin, d.vmax, d.bins, drop);
+}
+
+static double pixel_credible_max(struct user_data &d, int i, int drop)
+{
+  if (d.sketch != nullptr) {
+    return d.sketch[i].quantile(1.0 - (1.0 - CREDIBLE_INTERVAL)/2.0);
+  }
+
+  return tail_from_histogram(d.hist[i], d.vmin, d.vmax, d.bins, drop);
+}
+
+static double pixel_hpd(struct user_data &d, int i, double &hpd_min, double &hpd_max)
+{
+  if (d.sketch != nullptr) {
+    return d.sketch[i].hpd(CREDIBLE_INTERVAL, hpd_min, hpd_max);
+  }
+
+  return hpd_from_histogram(d.hist[i], d.vmin, d.vmax, d.bins, CREDIBLE_INTERVAL, hpd_min, hpd_max);
+}
+
+static int *pixel_histogram(struct user_data &d, int i)
+{
+  if (d.sketch != nullptr) {
+    d.sketch[i].histogram(d.sketch_hist, d.vmin, d.vmax, d.bins);
+    return d.sketch_hist;
+  }
+
+  return d.hist[i];
+}
+
 static void usage(const char *pname)
 {
   fprintf(stderr,
@@ -963,6 +1126,12 @@ static void usage(const char *pname)
 	  " -b|--bins <int>                  No. histogram bins\n"
 	  " -z|--vmin <float>                Lower range for histogram\n"
 	  " -Z|--vmax <float>                Upper range for histogram\n"
+	  " -q|--sketch <float>              Use quantile sketches with given compression\n"
+	  "                                  instead of histograms for mode/median/credible/hpd\n"
+	  "\n"
+	  " -T|--tiled <file>                Output all products to a binary tiled file\n"
+	  " -k|--tile-size <int>             Tile size in pixels (default 64)\n"
+	  " -H|--tile-histograms             Include per pixel histograms in the tiled file\n"
 	  "\n"
 	  " -S|--maxsteps <int>              Chain history max steps\n"
 	  "\n"
@@ -45,6 +45,7 @@ extern "C" {
 };
 
 #include "global.hpp"
+#include "quantilesketch.hpp"
 
 #include "aemutil.hpp"
 
@@ -64,10 +65,14 @@ struct user_data {
   double *variance;
 
   int **hist;
+  int *hist_data;
   int bins;
   double vmin;
   double vmax;
 
+  quantilesketch *sketch;
+  int *sketch_hist;
+
   double max;
   double min;
   
@@ -98,7 +103,33 @@ static double head_from_histogram(int *hist, double vmin, double vmax, int bins,
 static double tail_from_histogram(int *hist, double vmin, double vmax, int bins, int drop);
 static double hpd_from_histogram(int *hist, double vmin, double vmax, int bins, double hpd_interval, double &hpd_min, double &hpd_max);
 
-static char short_options[] = "d:l:i:o:v:D:t:s:m:M:c:C:g:p:P:Q:b:z:Z:S:w:W:Lh";
+static double pixel_mode(struct user_data &d, int i);
+static double pixel_median(struct user_data &d, int i);
+static double pixel_credible_min(struct user_data &d, int i, int drop);
+static double pixel_credible_max(struct user_data &d, int i, int drop);
+static double pixel_hpd(struct user_data &d, int i, double &hpd_min, double &hpd_max);
+static int *pixel_histogram(struct user_data &d, int i);
+
+static int reduce_sketches(quantilesketch *sketch, int n, int rank, int size, MPI_Comm communicator);
+
+static int reduce_histograms(int *hist, int n, int rank, MPI_Comm communicator);
+
+struct moments {
+  double n;
+  double mean;
+  double m2;
+};
+
+static void moments_merge(void *in, void *inout, int *len, MPI_Datatype *datatype);
+
+static int next_chain(MPI_Win counter_window);
+
+//
+// Max. no. of histogram counts reduced per collective
+//
+static const int HIST_REDUCE_CHUNK = 4*1024*1024;
+
+static char short_options[] = "d:l:i:o:v:D:t:s:m:M:c:C:g:p:P:Q:b:z:Z:q:n:S:w:W:Lh";
 static struct option long_options[] = {
   {"degree-depth", required_argument, 0, 'd'},
   {"degree-lateral", required_argument, 0, 'l'},
@@ -123,6 +154,9 @@ static struct option long_options[] = {
    {"bins", required_argument, 0, 'b'},
   {"vmin", required_argument, 0, 'z'},
   {"vmax", required_argument, 0, 'Z'},
+  {"sketch", required_argument, 0, 'q'},
+
+  {"nchains", required_argument, 0, 'n'},
 
   {"maxsteps", required_argument, 0, 'S'},
 
@@ -169,6 +203,7 @@ int main(int argc, char *argv[])
   int bins;
   double vmin;
   double vmax;
+  double sketch;
 
   FILE *fp_in;
   FILE *fp_out;
@@ -187,6 +222,7 @@ int main(int argc, char *argv[])
   bool logimage;
 
   int processesperchain;
+  int nchains;
   
   int mpi_size;
   int mpi_rank;
@@ -221,6 +257,7 @@ int main(int argc, char *argv[])
   bins = 1000;
   vmin = 2.0;
   vmax = 4.0;
+  sketch = 0.0;
   
   thin = 0;
   skip = 0;
@@ -233,6 +270,7 @@ int main(int argc, char *argv[])
   logimage = false;
 
   processesperchain = 1;
+  nchains = 0;
   
   vmin = 0.001;
   vmax = 1.0;
@@ -332,6 +370,22 @@ int main(int argc, char *argv[])
       vmax = atof(optarg);
       break;
 
+    case 'q':
+      sketch = atof(optarg);
+      if (sketch < 1.0) {
+	fprintf(stderr, "error: sketch compression must be 1 or greater\n");
+	return -1;
+      }
+      break;
+
+    case 'n':
+      nchains = atoi(optarg);
+      if (nchains < 1) {
+	fprintf(stderr, "error: no. chains must be 1 or greater\n");
+	return -1;
+      }
+      break;
+
     case 'S':
       maxsteps = atoi(optarg);
       if (maxsteps < 1000) {
@@ -412,10 +466,30 @@ int main(int argc, char *argv[])
   data.min = 1e9;
   data.max = -1e9;
   
-  data.hist =new int*[data.size];
-  for (i = 0; i < data.size; i ++) {
-    data.hist[i] = new int[data.bins];
-    memset(data.hist[i], 0, sizeof(int) * data.bins);
+  if (sketch > 0.0) {
+    //
+    // Quantile sketches replace the per pixel histograms
+    //
+    data.hist = nullptr;
+    data.hist_data = nullptr;
+    data.sketch = new quantilesketch[data.size];
+    for (i = 0; i < data.size; i ++) {
+      data.sketch[i].set_compression(sketch);
+    }
+    data.sketch_hist = new int[data.bins];
+  } else {
+    //
+    // Histograms are stored contiguously so that they can be reduced in
+    // large chunks
+    //
+    data.hist_data = new int[data.size * data.bins];
+    memset(data.hist_data, 0, sizeof(int) * data.size * data.bins);
+    data.hist = new int*[data.size];
+    for (i = 0; i < data.size; i ++) {
+      data.hist[i] = data.hist_data + i * data.bins;
+    }
+    data.sketch = nullptr;
+    data.sketch_hist = nullptr;
   }
   
   data.variance = new double[data.size];
@@ -437,42 +511,80 @@ int main(int argc, char *argv[])
     return -1;
   }
 
-  for (auto &infile: input_file) {
-    std::string chfile = mkfilenamerank(nullptr, infile.c_str(), mpi_rank * processesperchain);
-    fp_in = fopen(chfile.c_str(), "r");
-    if (fp_in == NULL) {
-      fprintf(stderr, "error: failed to open input file: %s\n", chfile.c_str());
+  if (nchains == 0) {
+    nchains = mpi_size;
+  }
+
+  //
+  // Chains are assigned dynamically through a shared counter on rank 0 so that
+  // unequal chain lengths don't leave ranks idle.
+  //
+  int chain_counter = 0;
+  MPI_Win counter_window;
+  if (MPI_Win_create(&chain_counter,
+		     mpi_rank == 0 ? sizeof(int) : 0,
+		     sizeof(int),
+		     MPI_INFO_NULL,
+		     MPI_COMM_WORLD,
+		     &counter_window) != MPI_SUCCESS) {
+    fprintf(stderr, "error: failed to create chain counter window\n");
+    return -1;
+  }
+  MPI_Win_lock_all(0, counter_window);
+  
+  int chain;
+  while ((chain = next_chain(counter_window)) < nchains) {
+
+    if (chain < 0) {
+      fprintf(stderr, "error: failed to get next chain\n");
       return -1;
     }
-    printf("Loaded: %s\n", chfile.c_str());
+
+    //
+    // Skip/thin apply from the start of each chain
+    //
+    data.thincounter = 0;
     
-    /*
-     * Process the chain history
-     */
-    while (!feof(fp_in)) {
-      
-      if (chain_history_read(ch,
-			     (ch_read_t)fread,
-			     fp_in) < 0) {
-	if (feof(fp_in)) {
-	  break;
-	}
-	
-	fprintf(stderr, "error: failed to read chain history\n");
+    for (auto &infile: input_file) {
+      std::string chfile = mkfilenamerank(nullptr, infile.c_str(), chain * processesperchain);
+      fp_in = fopen(chfile.c_str(), "r");
+      if (fp_in == NULL) {
+	fprintf(stderr, "error: failed to open input file: %s\n", chfile.c_str());
 	return -1;
       }
+      printf("Loaded: %s\n", chfile.c_str());
       
-      if (chain_history_replay(ch,
-			       S_v,
-			       (chain_history_replay_function_t)process,
-			       &data) < 0) {
-	fprintf(stderr, "error: failed to replay\n");
-	return -1;
+      /*
+       * Process the chain history
+       */
+      while (!feof(fp_in)) {
+	
+	if (chain_history_read(ch,
+			       (ch_read_t)fread,
+			       fp_in) < 0) {
+	  if (feof(fp_in)) {
+	    break;
+	  }
+	  
+	  fprintf(stderr, "error: failed to read chain history\n");
+	  return -1;
+	}
+	
+	if (chain_history_replay(ch,
+				 S_v,
+				 (chain_history_replay_function_t)process,
+				 &data) < 0) {
+	  fprintf(stderr, "error: failed to replay\n");
+	  return -1;
+	}
       }
+      printf("%d records\n", data.counter);
+      fclose(fp_in);
     }
-    printf("%d records\n", data.counter);
-    fclose(fp_in);
   }
+
+  MPI_Win_unlock_all(counter_window);
+  MPI_Win_free(&counter_window);
     
   MPI_Barrier(MPI_COMM_WORLD);
   
@@ -486,21 +598,46 @@ int main(int argc, char *argv[])
   }
 
   /*
-   * Mean output
+   * Combine per rank moments with the pairwise Welford update
    */
+  MPI_Datatype moments_type;
+  MPI_Op moments_op;
+  
+  MPI_Type_contiguous(3, MPI_DOUBLE, &moments_type);
+  MPI_Type_commit(&moments_type);
+  MPI_Op_create(moments_merge, 1, &moments_op);
 
+  struct moments *local_moments = new struct moments[data.size];
+  struct moments *total_moments = new struct moments[data.size];
   for (i = 0; i < data.size; i ++) {
-    data.variance[i] /= (double)(data.counter - 1);
-    data.variance[i] += (data.mean[i] * data.mean[i]);
+    local_moments[i].n = (double)data.counter;
+    local_moments[i].mean = data.mean[i];
+    local_moments[i].m2 = data.variance[i];
   }
 
-  MPI_Reduce(data.mean, data.workspace, data.size, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  if (MPI_Reduce(local_moments, total_moments, data.size, moments_type, moments_op, 0, MPI_COMM_WORLD) != MPI_SUCCESS) {
+    fprintf(stderr, "error: failed to reduce moments\n");
+    return -1;
+  }
+
+  MPI_Op_free(&moments_op);
+  MPI_Type_free(&moments_type);
 
+  int total_counter = 0;
+  
   if (mpi_rank == 0) {
-    for (int i = 0; i < data.size; i ++) {
-      data.mean[i] = data.workspace[i]/(double)mpi_size;
-    }
+
+    total_counter = (int)total_moments[0].n;
+    printf("%d total records\n", total_counter);
     
+    for (i = 0; i < data.size; i ++) {
+      data.mean[i] = total_moments[i].mean;
+      data.variance[i] = total_moments[i].m2/(total_moments[i].n - 1.0);
+    }
+
+    /*
+     * Mean output
+     */
     fp_out = fopen(output_file, "w");
     if (fp_out == NULL) {
       fprintf(stderr, "error: failed to open mean file\n");
@@ -514,18 +651,10 @@ int main(int argc, char *argv[])
       fprintf(fp_out, "\n");
     }
     fclose(fp_out);
-  }
-
-  MPI_Reduce(data.variance, data.workspace, data.size, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-
-  if (mpi_rank == 0) {
+    
     /*
      * Variance output
      */
-    for (i = 0; i < data.size; i ++) {
-      data.variance[i] = data.workspace[i]/(double)mpi_size - data.mean[i]*data.mean[i];
-    }
-
     if (variance_file != NULL) {
       fp_out = fopen(variance_file, "w");
       if (fp_out == NULL) {
@@ -564,13 +693,15 @@ int main(int argc, char *argv[])
     }
   }
 
-  if (mpi_rank == 0) {
-    for (i = 0; i < data.size; i ++) {
-      MPI_Reduce(MPI_IN_PLACE, data.hist[i], data.bins, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+  if (data.sketch != nullptr) {
+    if (reduce_sketches(data.sketch, data.size, mpi_rank, mpi_size, MPI_COMM_WORLD) < 0) {
+      fprintf(stderr, "error: failed to reduce quantile sketches\n");
+      return -1;
     }
   } else {
-    for (i = 0; i < data.size; i ++) {
-      MPI_Reduce(data.hist[i], NULL, data.bins, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (reduce_histograms(data.hist_data, data.size * data.bins, mpi_rank, MPI_COMM_WORLD) < 0) {
+      fprintf(stderr, "error: failed to reduce histograms\n");
+      return -1;
     }
   }
 
@@ -588,8 +719,7 @@ int main(int argc, char *argv[])
       
       for (j = 0; j < data.height; j ++) {
 	for (i = 0; i < data.width; i ++) {
-	  fprintf(fp_out, "%10.6f ", mode_from_histogram(data.hist[j*data.width + i],
-							 data.vmin, data.vmax, data.bins));
+	  fprintf(fp_out, "%10.6f ", pixel_mode(data, j*data.width + i));
 	}
 	fprintf(fp_out, "\n");
       }
@@ -609,8 +739,7 @@ int main(int argc, char *argv[])
       
       for (j = 0; j < data.height; j ++) {
 	for (i = 0; i < data.width; i ++) {
-	  fprintf(fp_out, "%10.6f ", median_from_histogram(data.hist[j*data.width + i],
-							   data.vmin, data.vmax, data.bins));
+	  fprintf(fp_out, "%10.6f ", pixel_median(data, j*data.width + i));
 	}
 	fprintf(fp_out, "\n");
       }
@@ -621,7 +750,7 @@ int main(int argc, char *argv[])
     /*
      * Credible Min
      */
-    credible_drop = (int)(((double)data.counter * mpi_size * (1.0 - CREDIBLE_INTERVAL))/2.0);
+    credible_drop = (int)(((double)total_counter * (1.0 - CREDIBLE_INTERVAL))/2.0);
     
     if (credible_min != NULL) {
       fp_out = fopen(credible_min, "w");
@@ -632,9 +761,7 @@ int main(int argc, char *argv[])
       
       for (j = 0; j < data.height; j ++) {
 	for (i = 0; i < data.width; i ++) {
-	  fprintf(fp_out, "%10.6f ", head_from_histogram(data.hist[j*data.width + i],
-							 data.vmin, data.vmax, data.bins,
-							 credible_drop));
+	  fprintf(fp_out, "%10.6f ", pixel_credible_min(data, j*data.width + i, credible_drop));
 	}
 	fprintf(fp_out, "\n");
       }
@@ -654,9 +781,7 @@ int main(int argc, char *argv[])
       
       for (j = 0; j < data.height; j ++) {
 	for (i = 0; i < data.width; i ++) {
-	  fprintf(fp_out, "%10.6f ", tail_from_histogram(data.hist[j*data.width + i],
-							 data.vmin, data.vmax, data.bins,
-							 credible_drop));
+	  fprintf(fp_out, "%10.6f ", pixel_credible_max(data, j*data.width + i, credible_drop));
 	}
 	fprintf(fp_out, "\n");
       }
@@ -675,9 +800,10 @@ int main(int argc, char *argv[])
       fprintf(fp_out, "%.6f %.6f\n", data.vmin, data.vmax);
       
       for (j = 0; j < data.size; j ++) {
+	int *hist = pixel_histogram(data, j);
 	for (i = 0; i < data.bins; i ++) {
 	  
-	  fprintf(fp_out, "%d ", data.hist[j][i]);
+	  fprintf(fp_out, "%d ", hist[i]);
 	  
 	}
 	fprintf(fp_out, "\n");
@@ -720,10 +846,7 @@ int main(int argc, char *argv[])
 	for (i = 0; i < data.width; i ++) {
 	  double hmin, hmax;
 	  
-	  double hrange = hpd_from_histogram(data.hist[j*data.width + i],
-					     data.vmin, data.vmax, data.bins,
-					     CREDIBLE_INTERVAL,
-					     hmin, hmax);
+	  double hrange = pixel_hpd(data, j*data.width + i, hmin, hmax);
 	  
 	  if (fpr != NULL) {
 	    fprintf(fpr, "%10.6f ", hrange);
@@ -772,6 +895,12 @@ int main(int argc, char *argv[])
   delete [] data.variance;
   delete [] data.model;
   delete [] data.workspace;
+  delete [] data.sketch;
+  delete [] data.hist;
+  delete [] data.hist_data;
+  delete [] local_moments;
+  delete [] total_moments;
+  delete [] data.sketch_hist;
 
   MPI_Finalize();
   
@@ -842,10 +971,16 @@ static int process(int stepi,
     /*
      * Update the histogram
      */
-    for (i = 0; i < d->size; i ++) {
-      hi = histogram_index(d->model[i], d->vmin, d->vmax, d->bins);
-
-      d->hist[i][hi] ++;
+    if (d->sketch != nullptr) {
+      for (i = 0; i < d->size; i ++) {
+	d->sketch[i].add(d->model[i]);
+      }
+    } else {
+      for (i = 0; i < d->size; i ++) {
+	hi = histogram_index(d->model[i], d->vmin, d->vmax, d->bins);
+	
+	d->hist[i][hi] ++;
+      }
     }
   }
   d->thincounter ++;
@@ -1011,6 +1146,173 @@ static double hpd_from_histogram(int *hist, double vmin, double vmax, int bins,
   return minwidth;
 }
 
+static double pixel_mode(struct user_data &d, int i)
+{
+  if (d.sketch != nullptr) {
+    return d.sketch[i].mode();
+  }
+
+  return mode_from_histogram(d.hist[i], d.vmin, d.vmax, d.bins);
+}
+
+static double pixel_median(struct user_data &d, int i)
+{
+  if (d.sketch != nullptr) {
+    return d.sketch[i].quantile(0.5);
+  }
+
+  return median_from_histogram(d.hist[i], d.vmin, d.vmax, d.bins);
+}
+
+static double pixel_credible_min(struct user_data &d, int i, int drop)
+{
+  if (d.sketch != nullptr) {
+    return d.sketch[i].quantile((1.0 - CREDIBLE_INTERVAL)/2.0);
+  }
+
+  return head_from_histogram(d.hist[i], d.vmin, d.vmax, d.bins, drop);
+}
+
+static double pixel_credible_max(struct user_data &d, int i, int drop)
+{
+  if (d.sketch != nullptr) {
+    return d.sketch[i].quantile(1.0 - (1.0 - CREDIBLE_INTERVAL)/2.0);
+  }
+
+  return tail_from_histogram(d.hist[i], d.vmin, d.vmax, d.bins, drop);
+}
+
+static double pixel_hpd(struct user_data &d, int i, double &hpd_min, double &hpd_max)
+{
+  if (d.sketch != nullptr) {
+    return d.sketch[i].hpd(CREDIBLE_INTERVAL, hpd_min, hpd_max);
+  }
+
+  return hpd_from_histogram(d.hist[i], d.vmin, d.vmax, d.bins, CREDIBLE_INTERVAL, hpd_min, hpd_max);
+}
+
+static int *pixel_histogram(struct user_data &d, int i)
+{
+  if (d.sketch != nullptr) {
+    d.sketch[i].histogram(d.sketch_hist, d.vmin, d.vmax, d.bins);
+    return d.sketch_hist;
+  }
+
+  return d.hist[i];
+}
+
+static int reduce_sketches(quantilesketch *sketch, int n, int rank, int size, MPI_Comm communicator)
+{
+  //
+  // Binary tree reduction of packed sketches to rank 0, at each level odd
+  // multiples of the stride send to their partner which merges.
+  //
+  std::vector<double> buffer;
+  
+  for (int stride = 1; stride < size; stride *= 2) {
+
+    if (rank % (2 * stride) == stride) {
+
+      int packed = 0;
+      for (int i = 0; i < n; i ++) {
+	packed += sketch[i].packed_size();
+      }
+
+      buffer.resize(packed);
+      int offset = 0;
+      for (int i = 0; i < n; i ++) {
+	offset += sketch[i].pack(buffer.data() + offset);
+      }
+
+      if (MPI_Send(&packed, 1, MPI_INT, rank - stride, 0, communicator) != MPI_SUCCESS) {
+	return -1;
+      }
+      if (MPI_Send(buffer.data(), packed, MPI_DOUBLE, rank - stride, 1, communicator) != MPI_SUCCESS) {
+	return -1;
+      }
+
+      break;
+      
+    } else if (rank % (2 * stride) == 0 && (rank + stride) < size) {
+
+      int packed;
+      if (MPI_Recv(&packed, 1, MPI_INT, rank + stride, 0, communicator, MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+	return -1;
+      }
+
+      buffer.resize(packed);
+      if (MPI_Recv(buffer.data(), packed, MPI_DOUBLE, rank + stride, 1, communicator, MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+	return -1;
+      }
+
+      quantilesketch remote;
+      int offset = 0;
+      for (int i = 0; i < n; i ++) {
+	offset += remote.unpack(buffer.data() + offset);
+	sketch[i].merge(remote);
+      }
+      
+    }
+  }
+
+  return 0;
+}
+
+static int reduce_histograms(int *hist, int n, int rank, MPI_Comm communicator)
+{
+  for (int offset = 0; offset < n; offset += HIST_REDUCE_CHUNK) {
+    int count = n - offset;
+    if (count > HIST_REDUCE_CHUNK) {
+      count = HIST_REDUCE_CHUNK;
+    }
+
+    if (rank == 0) {
+      if (MPI_Reduce(MPI_IN_PLACE, hist + offset, count, MPI_INT, MPI_SUM, 0, communicator) != MPI_SUCCESS) {
+	return -1;
+      }
+    } else {
+      if (MPI_Reduce(hist + offset, NULL, count, MPI_INT, MPI_SUM, 0, communicator) != MPI_SUCCESS) {
+	return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static void moments_merge(void *_in, void *_inout, int *len, MPI_Datatype *datatype)
+{
+  struct moments *in = (struct moments *)_in;
+  struct moments *inout = (struct moments *)_inout;
+
+  for (int i = 0; i < *len; i ++) {
+    double n = in[i].n + inout[i].n;
+    if (n > 0.0) {
+      double delta = in[i].mean - inout[i].mean;
+
+      inout[i].mean += delta * in[i].n/n;
+      inout[i].m2 += in[i].m2 + delta * delta * in[i].n * inout[i].n/n;
+      inout[i].n = n;
+    }
+  }
+}
+
+static int next_chain(MPI_Win counter_window)
+{
+  int one = 1;
+  int chain;
+  
+  if (MPI_Fetch_and_op(&one, &chain, MPI_INT, 0, 0, MPI_SUM, counter_window) != MPI_SUCCESS) {
+    return -1;
+  }
+
+  if (MPI_Win_flush(0, counter_window) != MPI_SUCCESS) {
+    return -1;
+  }
+
+  return chain;
+}
+
 static void usage(const char *pname)
 {
   fprintf(stderr,
@@ -1041,6 +1343,10 @@ static void usage(const char *pname)
 	  " -b|--bins <int>                  No. histogram bins\n"
 	  " -z|--vmin <float>                Lower range for histogram\n"
 	  " -Z|--vmax <float>                Upper range for histogram\n"
+	  " -q|--sketch <float>              Use quantile sketches with given compression\n"
+	  "                                  instead of histograms for mode/median/credible/hpd\n"
+	  "\n"
+	  " -n|--nchains <int>               No. of chain files (default one per process)\n"
 	  "\n"
 	  " -S|--maxsteps <int>              Chain history max steps\n"
 	  "\n"
@@ -33,6 +33,7 @@
 
 #include "global.hpp"
 #include "chainhistory_pixel.hpp"
+#include "quantilesketch.hpp"
 
 static const double CREDIBLE_INTERVAL = 0.95;
 
@@ -43,7 +44,7 @@ static double median_from_histogram(int *hist, double vmin, double vmax, int bin
 static double head_from_histogram(int *hist, double vmin, double vmax, int bins, int drop);
 static double tail_from_histogram(int *hist, double vmin, double vmax, int bins, int drop);
 
-static char short_options[] = "d:l:i:o:v:D:t:s:m:M:c:C:g:b:z:Z:Lh";
+static char short_options[] = "d:l:i:o:v:D:t:s:m:M:c:C:g:b:z:Z:q:Lh";
 static struct option long_options[] = {
   {"input", required_argument, 0, 'i'},
   {"output", required_argument, 0, 'o'},
@@ -61,6 +62,7 @@ static struct option long_options[] = {
   {"bins", required_argument, 0, 'b'},
   {"vmin", required_argument, 0, 'z'},
   {"vmax", required_argument, 0, 'Z'},
+  {"sketch", required_argument, 0, 'q'},
 
   {"log", no_argument, 0, 'L'},
 
@@ -95,6 +97,7 @@ int main(int argc, char *argv[])
   int bins;
   double vmin;
   double vmax;
+  double sketch_compression;
 
   FILE *fp_out;
 
@@ -122,6 +125,7 @@ int main(int argc, char *argv[])
   bins = 1000;
   vmin = 2.0;
   vmax = 4.0;
+  sketch_compression = 0.0;
 
   logimage = false;
   vmin = 0.001;
@@ -213,6 +217,14 @@ int main(int argc, char *argv[])
       vmax = atof(optarg);
       break;
 
+    case 'q':
+      sketch_compression = atof(optarg);
+      if (sketch_compression < 1.0) {
+	fprintf(stderr, "error: sketch compression must be 1 or greater\n");
+	return -1;
+      }
+      break;
+
     case 'L':
       logimage = true;
       break;
@@ -263,8 +275,22 @@ int main(int argc, char *argv[])
   double *variance = new double[width * height];
   memset(variance, 0, sizeof(double) * width * height);
 
-  int *hist = new int[width * height * bins];
-  memset(hist, 0, sizeof(int) * width * height * bins);
+  int *hist = nullptr;
+  quantilesketch *sketch = nullptr;
+  if (sketch_compression > 0.0) {
+    //
+    // Quantile sketches replace the per pixel histograms, the histogram
+    // output is then regenerated one pixel at a time.
+    //
+    sketch = new quantilesketch[size];
+    for (int j = 0; j < size; j ++) {
+      sketch[j].set_compression(sketch_compression);
+    }
+    hist = new int[bins];
+  } else {
+    hist = new int[width * height * bins];
+    memset(hist, 0, sizeof(int) * width * height * bins);
+  }
 
   int i = 0;
   int counter = 0;
@@ -296,10 +322,16 @@ int main(int argc, char *argv[])
 	/*
 	 * Update the histogram
 	 */
-	for (int j = 0; j < size; j ++) {
-	  int hi = histogram_index(image[j], vmin, vmax, bins);
-	  
-	  hist[j * bins + hi] ++;
+	if (sketch != nullptr) {
+	  for (int j = 0; j < size; j ++) {
+	    sketch[j].add(image[j]);
+	  }
+	} else {
+	  for (int j = 0; j < size; j ++) {
+	    int hi = histogram_index(image[j], vmin, vmax, bins);
+	    
+	    hist[j * bins + hi] ++;
+	  }
 	}
       }
     }
@@ -381,8 +413,12 @@ int main(int argc, char *argv[])
 
     for (int j = 0; j < height; j ++) {
       for (int i = 0; i < width; i ++) {
-	fprintf(fp_out, "%10.6f ", mode_from_histogram(hist + (j*width + i) * bins,
-						       vmin, vmax, bins));
+	if (sketch != nullptr) {
+	  fprintf(fp_out, "%10.6f ", sketch[j*width + i].mode());
+	} else {
+	  fprintf(fp_out, "%10.6f ", mode_from_histogram(hist + (j*width + i) * bins,
+							 vmin, vmax, bins));
+	}
       }
       fprintf(fp_out, "\n");
     }
@@ -402,8 +438,12 @@ int main(int argc, char *argv[])
 
     for (int j = 0; j < height; j ++) {
       for (int i = 0; i < width; i ++) {
-	fprintf(fp_out, "%10.6f ", median_from_histogram(hist + (j*width + i) * bins,
-							 vmin, vmax, bins));
+	if (sketch != nullptr) {
+	  fprintf(fp_out, "%10.6f ", sketch[j*width + i].quantile(0.5));
+	} else {
+	  fprintf(fp_out, "%10.6f ", median_from_histogram(hist + (j*width + i) * bins,
+							   vmin, vmax, bins));
+	}
       }
       fprintf(fp_out, "\n");
     }
@@ -425,9 +465,13 @@ int main(int argc, char *argv[])
 
     for (int j = 0; j < height; j ++) {
       for (int i = 0; i < width; i ++) {
-	fprintf(fp_out, "%10.6f ", head_from_histogram(hist + (j*width + i) * bins,
-						       vmin, vmax, bins,
-						       credible_drop));
+	if (sketch != nullptr) {
+	  fprintf(fp_out, "%10.6f ", sketch[j*width + i].quantile((1.0 - CREDIBLE_INTERVAL)/2.0));
+	} else {
+	  fprintf(fp_out, "%10.6f ", head_from_histogram(hist + (j*width + i) * bins,
+							 vmin, vmax, bins,
+							 credible_drop));
+	}
       }
       fprintf(fp_out, "\n");
     }
@@ -447,9 +491,13 @@ int main(int argc, char *argv[])
 
     for (int j = 0; j < height; j ++) {
       for (int i = 0; i < width; i ++) {
-	fprintf(fp_out, "%10.6f ", tail_from_histogram(hist + (j*width + i) * bins,
-						       vmin, vmax, bins,
-						       credible_drop));
+	if (sketch != nullptr) {
+	  fprintf(fp_out, "%10.6f ", sketch[j*width + i].quantile(1.0 - (1.0 - CREDIBLE_INTERVAL)/2.0));
+	} else {
+	  fprintf(fp_out, "%10.6f ", tail_from_histogram(hist + (j*width + i) * bins,
+							 vmin, vmax, bins,
+							 credible_drop));
+	}
       }
       fprintf(fp_out, "\n");
     }
@@ -468,9 +516,17 @@ int main(int argc, char *argv[])
     fprintf(fp_out, "%.6f %.6f\n", vmin, vmax);
 
     for (int j = 0; j < size; j ++) {
+      int *h;
+      if (sketch != nullptr) {
+	sketch[j].histogram(hist, vmin, vmax, bins);
+	h = hist;
+      } else {
+	h = hist + j * bins;
+      }
+      
       for (int i = 0; i < bins; i ++) {
 
-	fprintf(fp_out, "%d ", hist[j * bins + i]);
+	fprintf(fp_out, "%d ", h[i]);
 
       }
       fprintf(fp_out, "\n");
@@ -610,6 +666,8 @@ static void usage(const char *pname)
 	  " -b|--bins <int>                  No. histogram bins\n"
 	  " -z|--vmin <float>                Lower range for histogram\n"
 	  " -Z|--vmax <float>                Upper range for histogram\n"
+	  " -q|--sketch <float>              Use quantile sketches with given compression\n"
+	  "                                  instead of histograms for mode/median/credible\n"
 	  "\n"
 	  " -L|--log                         Chain is in log space (exp to invert)\n"
 	  "\n"
@@ -0,0 +1,218 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>
+
+#include "posteriortiles.hpp"
+
+static char short_options[] = "i:p:o:g:a:Lh";
+static struct option long_options[] = {
+  {"input", required_argument, 0, 'i'},
+  {"product", required_argument, 0, 'p'},
+  {"output", required_argument, 0, 'o'},
+  {"histogram", required_argument, 0, 'g'},
+  {"all", required_argument, 0, 'a'},
+  {"list", no_argument, 0, 'L'},
+
+  {"help", no_argument, 0, 'h'},
+  {0, 0, 0, 0}
+};
+
+static void usage(const char *pname);
+
+static int export_product(posteriortilereader &tiles, int product, const char *filename);
+
+int main(int argc, char *argv[])
+{
+  int c;
+  int option_index;
+
+  char *input_file;
+  char *product;
+  char *output_file;
+  char *histogram_file;
+  char *all_prefix;
+  bool list;
+
+  posteriortilereader tiles;
+
+  input_file = NULL;
+  product = NULL;
+  output_file = NULL;
+  histogram_file = NULL;
+  all_prefix = NULL;
+  list = false;
+  
+  while (1) {
+    c = getopt_long(argc, argv, short_options, long_options, &option_index);
+    if (c == -1) {
+      break;
+    }
+
+    switch(c) {
+    case 'i':
+      input_file = optarg;
+      break;
+
+    case 'p':
+      product = optarg;
+      break;
+
+    case 'o':
+      output_file = optarg;
+      break;
+
+    case 'g':
+      histogram_file = optarg;
+      break;
+
+    case 'a':
+      all_prefix = optarg;
+      break;
+
+    case 'L':
+      list = true;
+      break;
+
+    case 'h':
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if (input_file == NULL) {
+    fprintf(stderr, "error: required parameter input file missing\n");
+    return -1;
+  }
+
+  if (!tiles.open(input_file)) {
+    fprintf(stderr, "error: failed to open tiled file %s\n", input_file);
+    return -1;
+  }
+
+  if (list) {
+    printf("Image: %d x %d\n", tiles.width, tiles.height);
+    printf("Tiles: %d x %d (%d)\n", tiles.ntiles_x(), tiles.ntiles_y(), tiles.tilesize);
+    if (tiles.bins > 0) {
+      printf("Histograms: %d bins %.6f %.6f\n", tiles.bins, tiles.vmin, tiles.vmax);
+    } else {
+      printf("Histograms: none\n");
+    }
+    for (auto &p : tiles.products) {
+      printf("  %s\n", p.c_str());
+    }
+  }
+
+  if (product != NULL) {
+    int pi = tiles.product_index(product);
+    if (pi < 0) {
+      fprintf(stderr, "error: no product %s in %s\n", product, input_file);
+      return -1;
+    }
+
+    if (output_file == NULL) {
+      fprintf(stderr, "error: output file required for product export\n");
+      return -1;
+    }
+
+    if (export_product(tiles, pi, output_file) < 0) {
+      return -1;
+    }
+  }
+
+  if (all_prefix != NULL) {
+    for (int pi = 0; pi < (int)tiles.products.size(); pi ++) {
+      std::string filename = std::string(all_prefix) + tiles.products[pi] + ".txt";
+      if (export_product(tiles, pi, filename.c_str()) < 0) {
+	return -1;
+      }
+    }
+  }
+
+  if (histogram_file != NULL) {
+    if (tiles.bins == 0) {
+      fprintf(stderr, "error: %s contains no histograms\n", input_file);
+      return -1;
+    }
+    
+    FILE *fp = fopen(histogram_file, "w");
+    if (fp == NULL) {
+      fprintf(stderr, "error: failed to create histogram file\n");
+      return -1;
+    }
+
+    if (!tiles.export_histogram_text(fp)) {
+      fprintf(stderr, "error: failed to export histograms\n");
+      return -1;
+    }
+
+    fclose(fp);
+  }
+
+  return 0;
+}
+
+static int export_product(posteriortilereader &tiles, int product, const char *filename)
+{
+  FILE *fp = fopen(filename, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to create output file %s\n", filename);
+    return -1;
+  }
+
+  if (!tiles.export_text(product, fp)) {
+    fprintf(stderr, "error: failed to export %s\n", tiles.products[product].c_str());
+    return -1;
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+static void usage(const char *pname)
+{
+  fprintf(stderr,
+	  "usage: %s [options]\n"
+	  "where options is one or more of:\n"
+	  "\n"
+	  " -i|--input <file>                Input tiled file (from postprocess_mean -T)\n"
+	  " -L|--list                        List image size and products\n"
+	  "\n"
+	  " -p|--product <name>              Product to export (eg mean, stddev, median)\n"
+	  " -o|--output <file>               Output text image for product\n"
+	  " -a|--all <prefix>                Export all products to <prefix><name>.txt\n"
+	  " -g|--histogram <file>            Output histogram text file\n"
+	  "\n"
+	  " -h|--help            Show usage\n"
+	  "\n",
+	  pname);
+}
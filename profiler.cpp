@@ -0,0 +1,185 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#include <stdio.h>
+
+#include <mutex>
+#include <vector>
+
+#include "profiler.hpp"
+
+#include "aemexception.hpp"
+
+extern "C" {
+  #include "slog.h"
+};
+
+static const char *timer_names[profiler::NTIMERS] = {
+  "wavelet",
+  "forward_setup",
+  "forward_primary",
+  "forward_integrals",
+  "forward_spline",
+  "forward_fft",
+  "forward_window",
+  "forward_operator",
+  "nll",
+  "mpi_reduce",
+  "mpi_bcast",
+  "mpi_allgather",
+  "ptexchange",
+  "resample",
+  "chain_history",
+  "checkpoint"
+};
+
+const char *
+profiler::name(int id)
+{
+  if (id < 0 || id >= NTIMERS) {
+    return "unknown";
+  }
+
+  return timer_names[id];
+}
+
+#ifdef AEM_PROFILE
+
+//
+// Timers of every thread that has used a timer, only locked when a thread
+// first registers and when merging
+//
+static std::mutex registry_mutex;
+static std::vector<profiler::timer*> registry;
+
+profiler::timer *
+profiler::register_thread()
+{
+  timer *timers = new timer[NTIMERS]();
+  
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  registry.push_back(timers);
+  
+  return timers;
+}
+
+void
+profiler::merge(timer *merged)
+{
+  for (int i = 0; i < NTIMERS; i ++) {
+    merged[i] = timer();
+  }
+
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for (auto t : registry) {
+    for (int i = 0; i < NTIMERS; i ++) {
+      merged[i].count += t[i].count;
+      merged[i].total += t[i].total;
+      if (t[i].max > merged[i].max) {
+	merged[i].max = t[i].max;
+      }
+      for (int j = 0; j < BINS; j ++) {
+	merged[i].histogram[j] += t[i].histogram[j];
+      }
+    }
+  }
+}
+
+int
+profiler::save(const char *filename)
+{
+  FILE *fp = fopen(filename, "w");
+  if (fp == NULL) {
+    ERROR("Failed to create profile file %s", filename);
+    return -1;
+  }
+
+  timer timers[NTIMERS];
+  merge(timers);
+
+  fprintf(fp, "# name count total max mean histogram[%d] (bins from %g s, doubling)\n", BINS, BIN_BASE);
+  for (int i = 0; i < NTIMERS; i ++) {
+    timer &p = timers[i];
+    fprintf(fp, "%s %lld %.9g %.9g %.9g",
+	    name(i),
+	    p.count,
+	    p.total,
+	    p.max,
+	    p.count > 0 ? p.total/(double)p.count : 0.0);
+    for (int j = 0; j < BINS; j ++) {
+      fprintf(fp, " %lld", p.histogram[j]);
+    }
+    fprintf(fp, "\n");
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+std::string
+profiler::summary(MPI_Comm communicator)
+{
+  double local[NTIMERS];
+  double total[NTIMERS];
+
+  timer timers[NTIMERS];
+  merge(timers);
+  for (int i = 0; i < NTIMERS; i ++) {
+    local[i] = timers[i].total;
+  }
+
+  if (MPI_Allreduce(local, total, NTIMERS, MPI_DOUBLE, MPI_MAX, communicator) != MPI_SUCCESS) {
+    throw AEMEXCEPTION("Failed to reduce profile timers\n");
+  }
+
+  std::string s = "Profile (max s):";
+  char buffer[256];
+  for (int i = 0; i < NTIMERS; i ++) {
+    if (total[i] > 0.0) {
+      snprintf(buffer, sizeof(buffer), " %s %.3f", name(i), total[i]);
+      s += buffer;
+    }
+  }
+
+  return s;
+}
+
+#else
+
+int
+profiler::save(const char *filename)
+{
+  return 0;
+}
+
+std::string
+profiler::summary(MPI_Comm communicator)
+{
+  return std::string();
+}
+
+#endif // AEM_PROFILE
@@ -0,0 +1,188 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#pragma once
+#ifndef profiler_hpp
+#define profiler_hpp
+
+//
+// Lightweight scoped timers for the hot paths of the sampler. The timers are
+// only compiled in when AEM_PROFILE is defined (see the Makefiles), otherwise
+// PROFILE_SCOPE expands to nothing and there is no runtime cost.
+//
+// Each timer accumulates a count, total and maximum duration and a histogram
+// of durations in power of two bins from 100ns. Each thread accumulates into
+// its own timers without locking, so timers may be used from worker threads
+// and from the ga-aem library; save and summary merge the timers of all
+// threads and should be called while no other thread is timing.
+//
+
+#ifdef AEM_PROFILE
+
+#include <chrono>
+
+#endif // AEM_PROFILE
+
+#include <string>
+
+#include <mpi.h>
+
+class profiler {
+public:
+
+  enum {
+    WAVELET = 0,
+    FORWARD_SETUP,
+    FORWARD_PRIMARY,
+    FORWARD_INTEGRALS,
+    FORWARD_SPLINE,
+    FORWARD_FFT,
+    FORWARD_WINDOW,
+    FORWARD_OPERATOR,
+    NLL,
+    MPI_REDUCE,
+    MPI_BCAST,
+    MPI_ALLGATHER,
+    PTEXCHANGE,
+    RESAMPLE,
+    CHAIN_HISTORY,
+    CHECKPOINT,
+    NTIMERS
+  };
+
+  static const int BINS = 32;
+  static constexpr double BIN_BASE = 1.0e-7;
+
+#ifdef AEM_PROFILE
+  static const bool enabled = true;
+#else
+  static const bool enabled = false;
+#endif
+
+  struct timer {
+    long long count;
+    double total;
+    double max;
+    long long histogram[BINS];
+  };
+
+  static const char *name(int id);
+
+  //
+  // Write the accumulated timers of this process to a text file, one line per
+  // timer with the histogram counts. Returns -1 on error. Does nothing if the
+  // timers are compiled out.
+  //
+  static int save(const char *filename);
+
+  //
+  // Collective over communicator: returns a one line summary of the maximum
+  // total time per timer over the processes of the communicator. Returns an
+  // empty string without communicating if the timers are compiled out.
+  //
+  static std::string summary(MPI_Comm communicator);
+
+#ifdef AEM_PROFILE
+
+  static void add(int id, double seconds)
+  {
+    int bin = 0;
+    double t = BIN_BASE;
+    while (bin < (BINS - 1) && seconds >= 2.0 * t) {
+      t *= 2.0;
+      bin ++;
+    }
+
+    timer &p = thread_timers()[id];
+    p.count ++;
+    p.total += seconds;
+    if (seconds > p.max) {
+      p.max = seconds;
+    }
+    p.histogram[bin] ++;
+  }
+
+  //
+  // The timers of the calling thread. They are allocated on first use and
+  // kept for the life of the process so that the times of finished worker
+  // threads are still merged.
+  //
+  static timer *thread_timers()
+  {
+    static thread_local timer *timers = nullptr;
+    if (timers == nullptr) {
+      timers = register_thread();
+    }
+    return timers;
+  }
+
+  static timer *register_thread();
+
+  //
+  // Sums the timers of all threads into merged[NTIMERS]
+  //
+  static void merge(timer *merged);
+
+#endif // AEM_PROFILE
+
+};
+
+#ifdef AEM_PROFILE
+
+class profiletimer {
+public:
+
+  profiletimer(int _id) :
+    id(_id),
+    start(std::chrono::steady_clock::now())
+  {
+  }
+
+  ~profiletimer()
+  {
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    profiler::add(id, d.count());
+  }
+
+private:
+
+  int id;
+  std::chrono::steady_clock::time_point start;
+
+};
+
+#define PROFILE_CONCAT_(a, b) a ## b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(id) profiletimer PROFILE_CONCAT(profile_timer_, __LINE__)(id)
+
+#else
+
+#define PROFILE_SCOPE(id)
+
+#endif // AEM_PROFILE
+
+#endif // profiler_hpp
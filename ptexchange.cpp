@@ -24,11 +24,15 @@
 //
 //
 
+#include <stdlib.h>
+
 extern "C" {
   #include "slog.h"
 };
 
 #include "aemutil.hpp"
+#include "checkpoint.hpp"
+#include "profiler.hpp"
 
 #include "ptexchange.hpp"
 
@@ -78,6 +82,8 @@ PTExchange::~PTExchange()
 int
 PTExchange::step()
 {
+  PROFILE_SCOPE(profiler::PTEXCHANGE);
+
   if (global_communicator == MPI_COMM_NULL) {
     return -1;
   }
@@ -217,6 +223,23 @@ PTExchange::step()
      			 (((partner_logprior + partner_likelihood + partner_log_normalization) -
 			   (current_logprior + global.current_likelihood + global.current_log_normalization))/partner_temperature));
 
+    //
+    // Track exchange rates between adjacent temperatures (counted once per pair)
+    //
+    if (send && pair_propose.size() > 0) {
+      int temp_id = temperature_rank/chainspertemperature;
+      int partner_temp_id = partner/chainspertemperature;
+      
+      if (abs(temp_id - partner_temp_id) == 1) {
+	int pi = temp_id < partner_temp_id ? temp_id : partner_temp_id;
+	
+	pair_propose[pi] ++;
+	if (ptaccept) {
+	  pair_accept[pi] ++;
+	}
+      }
+    }
+    
     // INFO("Accept: %d %f %d<->%d (%f %f %f) (%f %f %f)\n", (int)ptaccept, u, temperature_rank, partner,
     // 	 current_logprior, global.current_likelihood, global.current_log_normalization,
     // 	 partner_logprior, partner_likelihood, partner_log_normalization);
@@ -412,6 +435,47 @@ PTExchange::step()
 }
 
 
+void
+PTExchange::adapt_temperatures(TemperatureLadder &ladder)
+{
+  double temperature = 0.0;
+  
+  if (chain_rank == 0) {
+
+    int npairs = pair_propose.size();
+    if (npairs > 0) {
+      std::vector<int> total_propose(npairs);
+      std::vector<int> total_accept(npairs);
+      
+      if (MPI_Allreduce(pair_propose.data(), total_propose.data(), npairs, MPI_INT, MPI_SUM, temperature_communicator) != MPI_SUCCESS) {
+	throw AEMEXCEPTION("Failed to reduce exchange proposals\n");
+      }
+
+      if (MPI_Allreduce(pair_accept.data(), total_accept.data(), npairs, MPI_INT, MPI_SUM, temperature_communicator) != MPI_SUCCESS) {
+	throw AEMEXCEPTION("Failed to reduce exchange acceptances\n");
+      }
+
+      //
+      // Every chain sees the same totals so the ladders stay identical
+      //
+      ladder.adapt(total_propose.data(), total_accept.data());
+
+      for (int i = 0; i < npairs; i ++) {
+	pair_propose[i] = 0;
+	pair_accept[i] = 0;
+      }
+    }
+
+    temperature = ladder.temperature(temperature_rank/chainspertemperature);
+  }
+
+  if (MPI_Bcast(&temperature, 1, MPI_DOUBLE, 0, chain_communicator) != MPI_SUCCESS) {
+    throw AEMEXCEPTION("Failed to broadcast temperature\n");
+  }
+
+  global.temperature = temperature;
+}
+
 std::string
 PTExchange::write_short_stats()
 {
@@ -477,6 +541,11 @@ PTExchange::initialize_mpi(MPI_Comm _global_communicator,
     
     ptpairs = new int[temperature_size];
     transposed_ptpairs = new int[temperature_size];
+
+    if (ntemperatures > 1) {
+      pair_propose.resize(ntemperatures - 1, 0);
+      pair_accept.resize(ntemperatures - 1, 0);
+    }
   }
 
   
@@ -499,3 +568,23 @@ PTExchange::initialize_mpi(MPI_Comm _global_communicator,
 }
 
   
+
+void
+PTExchange::save_state(checkpoint &cp)
+{
+  cp.section("ptexchange");
+  cp.write(propose);
+  cp.write(accept);
+  cp.write_vector(pair_propose);
+  cp.write_vector(pair_accept);
+}
+
+void
+PTExchange::load_state(checkpoint &cp)
+{
+  cp.section("ptexchange");
+  cp.read(propose);
+  cp.read(accept);
+  cp.read_vector(pair_propose);
+  cp.read_vector(pair_accept);
+}
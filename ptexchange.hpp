@@ -29,6 +29,7 @@
 #define ptexchange_hpp
 
 #include "global.hpp"
+#include "temperatureladder.hpp"
 #include <mpi.h>
 
 class PTExchange {
@@ -43,11 +44,21 @@ public:
 
   std::string write_long_stats();
 
+  void save_state(checkpoint &cp);
+  void load_state(checkpoint &cp);
+
   void initialize_mpi(MPI_Comm global_communicator,
 		      MPI_Comm temperature_communicator,
 		      MPI_Comm chain_communicator,
 		      int ntemperatures);
 
+  //
+  // Update the ladder from the adjacent temperature exchange rates seen since
+  // the last call and set this chain's temperature from it. Must be called by
+  // all processes.
+  //
+  void adapt_temperatures(TemperatureLadder &ladder);
+
   Global &global;
 
   int propose;
@@ -73,6 +84,9 @@ private:
 
   int *ptpairs;
   int *transposed_ptpairs;
+
+  std::vector<int> pair_propose;
+  std::vector<int> pair_accept;
   
   int partner;
   bool send;
@@ -0,0 +1,463 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "quantilesketch.hpp"
+
+#include "aemexception.hpp"
+
+static const double DEFAULT_COMPRESSION = 100.0;
+
+//
+// No. samples buffered before compressing as a multiple of the compression,
+// kept at one so the buffer is no larger than the centroid arrays
+//
+static const int BUFFER_FACTOR = 1;
+
+//
+// No. of steps in the brute force search for the hpd interval
+//
+static const int HPD_STEPS = 200;
+
+quantilesketch::quantilesketch() :
+  compression(DEFAULT_COMPRESSION),
+  weight_total(0.0),
+  vmin(0.0),
+  vmax(0.0)
+{
+}
+
+quantilesketch::quantilesketch(double _compression) :
+  compression(_compression),
+  weight_total(0.0),
+  vmin(0.0),
+  vmax(0.0)
+{
+  if (compression < 1.0) {
+    throw AEMEXCEPTION("Compression must be 1 or greater\n");
+  }
+}
+
+quantilesketch::~quantilesketch()
+{
+}
+
+void
+quantilesketch::set_compression(double _compression)
+{
+  if (_compression < 1.0) {
+    throw AEMEXCEPTION("Compression must be 1 or greater\n");
+  }
+
+  if (weight_total > 0.0 || buffer.size() > 0) {
+    throw AEMEXCEPTION("Compression must be set before adding samples\n");
+  }
+
+  compression = _compression;
+}
+
+void
+quantilesketch::add(double v)
+{
+  if (weight_total == 0.0 && buffer.size() == 0) {
+    vmin = v;
+    vmax = v;
+  } else {
+    if (v < vmin) {
+      vmin = v;
+    }
+    if (v > vmax) {
+      vmax = v;
+    }
+  }
+  
+  if (buffer.capacity() == 0) {
+    buffer.reserve(BUFFER_FACTOR * (int)compression);
+  }
+  buffer.push_back(v);
+
+  if ((int)buffer.size() >= BUFFER_FACTOR * (int)compression) {
+    compress();
+  }
+}
+
+void
+quantilesketch::merge(const quantilesketch &rhs)
+{
+  if (rhs.weight_total == 0.0 && rhs.buffer.size() == 0) {
+    return;
+  }
+
+  if (weight_total == 0.0 && buffer.size() == 0) {
+    vmin = rhs.vmin;
+    vmax = rhs.vmax;
+  } else {
+    if (rhs.vmin < vmin) {
+      vmin = rhs.vmin;
+    }
+    if (rhs.vmax > vmax) {
+      vmax = rhs.vmax;
+    }
+  }
+
+  std::vector<std::pair<double, double>> incoming;
+  incoming.reserve(rhs.mean.size() + rhs.buffer.size());
+
+  for (int i = 0; i < (int)rhs.mean.size(); i ++) {
+    incoming.push_back(std::pair<double, double>(rhs.mean[i], rhs.weight[i]));
+  }
+  for (auto &v : rhs.buffer) {
+    incoming.push_back(std::pair<double, double>(v, 1.0));
+  }
+
+  rebuild(incoming);
+}
+
+void
+quantilesketch::compress()
+{
+  if (buffer.size() > 0) {
+    std::vector<std::pair<double, double>> incoming;
+    rebuild(incoming);
+  }
+}
+
+void
+quantilesketch::rebuild(std::vector<std::pair<double, double>> &all)
+{
+  //
+  // Combine existing centroids, buffered values and incoming centroids then
+  // greedily merge adjacent centroids while the scale function increment
+  // stays within one.
+  //
+  for (int i = 0; i < (int)mean.size(); i ++) {
+    all.push_back(std::pair<double, double>(mean[i], weight[i]));
+  }
+  for (auto &v : buffer) {
+    all.push_back(std::pair<double, double>(v, 1.0));
+  }
+
+  buffer.clear();
+  mean.clear();
+  weight.clear();
+
+  if (all.size() == 0) {
+    weight_total = 0.0;
+    return;
+  }
+
+  std::sort(all.begin(), all.end());
+
+  weight_total = 0.0;
+  for (auto &c : all) {
+    weight_total += c.second;
+  }
+
+  double wsofar = 0.0;
+  double cmean = all[0].first;
+  double cweight = all[0].second;
+  double klimit = k_scale(0.0) + 1.0;
+  
+  for (int i = 1; i < (int)all.size(); i ++) {
+
+    double q = (wsofar + cweight + all[i].second)/weight_total;
+    
+    if (k_scale(q) <= klimit) {
+      
+      cweight += all[i].second;
+      cmean += (all[i].first - cmean) * all[i].second/cweight;
+      
+    } else {
+      
+      mean.push_back(cmean);
+      weight.push_back(cweight);
+      wsofar += cweight;
+      klimit = k_scale(wsofar/weight_total) + 1.0;
+      
+      cmean = all[i].first;
+      cweight = all[i].second;
+    }
+  }
+
+  mean.push_back(cmean);
+  weight.push_back(cweight);
+}
+
+double
+quantilesketch::total() const
+{
+  return weight_total + (double)buffer.size();
+}
+
+double
+quantilesketch::quantile(double q)
+{
+  compress();
+
+  int n = mean.size();
+  if (n == 0) {
+    return 0.0;
+  }
+
+  if (n == 1) {
+    return mean[0];
+  }
+
+  if (q <= 0.0) {
+    return vmin;
+  }
+
+  if (q >= 1.0) {
+    return vmax;
+  }
+
+  double target = q * weight_total;
+
+  //
+  // Centroids are considered centred at their cumulative mid-point, with the
+  // extremes interpolating to the observed min/max.
+  //
+  double t = weight[0]/2.0;
+  if (target < t) {
+    return vmin + (mean[0] - vmin) * target/t;
+  }
+
+  for (int i = 0; i < (n - 1); i ++) {
+    double dt = (weight[i] + weight[i + 1])/2.0;
+    if (target < t + dt) {
+      return mean[i] + (mean[i + 1] - mean[i]) * (target - t)/dt;
+    }
+    t += dt;
+  }
+
+  double dt = weight[n - 1]/2.0;
+  return mean[n - 1] + (vmax - mean[n - 1]) * (target - t)/dt;
+}
+
+double
+quantilesketch::cdf(double x)
+{
+  compress();
+
+  int n = mean.size();
+  if (n == 0) {
+    return 0.0;
+  }
+
+  if (x < vmin) {
+    return 0.0;
+  }
+
+  if (x >= vmax) {
+    return 1.0;
+  }
+
+  double t = weight[0]/2.0;
+  if (x < mean[0]) {
+    if (mean[0] > vmin) {
+      return t * (x - vmin)/(mean[0] - vmin)/weight_total;
+    }
+    return 0.0;
+  }
+
+  for (int i = 0; i < (n - 1); i ++) {
+    double dt = (weight[i] + weight[i + 1])/2.0;
+    if (x < mean[i + 1]) {
+      if (mean[i + 1] > mean[i]) {
+	return (t + dt * (x - mean[i])/(mean[i + 1] - mean[i]))/weight_total;
+      }
+      return (t + dt)/weight_total;
+    }
+    t += dt;
+  }
+
+  double dt = weight[n - 1]/2.0;
+  if (vmax > mean[n - 1]) {
+    return (t + dt * (x - mean[n - 1])/(vmax - mean[n - 1]))/weight_total;
+  }
+  return 1.0;
+}
+
+double
+quantilesketch::mode()
+{
+  compress();
+
+  int n = mean.size();
+  if (n == 0) {
+    return 0.0;
+  }
+
+  //
+  // Density at each centroid is approximated by its weight over the half
+  // distance to its neighbours.
+  //
+  double maxdensity = -1.0;
+  double m = mean[0];
+  
+  for (int i = 0; i < n; i ++) {
+    double left = (i == 0) ? vmin : mean[i - 1];
+    double right = (i == (n - 1)) ? vmax : mean[i + 1];
+    double width = (right - left)/2.0;
+
+    if (width <= 0.0) {
+      return mean[i];
+    }
+
+    double density = weight[i]/width;
+    if (density > maxdensity) {
+      maxdensity = density;
+      m = mean[i];
+    }
+  }
+
+  return m;
+}
+
+double
+quantilesketch::hpd(double interval, double &hpd_min, double &hpd_max)
+{
+  compress();
+
+  hpd_min = vmin;
+  hpd_max = vmax;
+  double minwidth = vmax - vmin;
+
+  for (int i = 0; i <= HPD_STEPS; i ++) {
+    double q = (1.0 - interval) * (double)i/(double)HPD_STEPS;
+
+    double left = quantile(q);
+    double right = quantile(q + interval);
+
+    if (right - left < minwidth) {
+      minwidth = right - left;
+      hpd_min = left;
+      hpd_max = right;
+    }
+  }
+
+  return minwidth;
+}
+
+void
+quantilesketch::histogram(int *hist, double hmin, double hmax, int bins)
+{
+  compress();
+
+  double c = 0.0;
+  double last = 0.0;
+  
+  for (int i = 0; i < bins; i ++) {
+    double edge = hmin + (double)(i + 1)/(double)bins * (hmax - hmin);
+    double next;
+
+    if (i == (bins - 1)) {
+      //
+      // Last bin includes all values above the range as in the histogram
+      // indexing.
+      //
+      next = weight_total;
+    } else {
+      next = cdf(edge) * weight_total;
+    }
+
+    c += next - last;
+    hist[i] = (int)(c + 0.5);
+    c -= (double)hist[i];
+    last = next;
+  }
+}
+
+int
+quantilesketch::packed_size()
+{
+  compress();
+  return 3 + 2 * mean.size();
+}
+
+int
+quantilesketch::pack(double *p)
+{
+  compress();
+
+  int n = mean.size();
+  
+  p[0] = (double)n;
+  p[1] = vmin;
+  p[2] = vmax;
+
+  for (int i = 0; i < n; i ++) {
+    p[3 + 2*i] = mean[i];
+    p[3 + 2*i + 1] = weight[i];
+  }
+
+  return 3 + 2*n;
+}
+
+int
+quantilesketch::unpack(const double *p)
+{
+  int n = (int)p[0];
+  if (n < 0) {
+    throw AEMEXCEPTION("Invalid packed sketch size %d\n", n);
+  }
+  
+  buffer.clear();
+  
+  vmin = p[1];
+  vmax = p[2];
+
+  mean.resize(n);
+  weight.resize(n);
+  weight_total = 0.0;
+  for (int i = 0; i < n; i ++) {
+    mean[i] = p[3 + 2*i];
+    weight[i] = p[3 + 2*i + 1];
+    weight_total += weight[i];
+  }
+
+  return 3 + 2*n;
+}
+
+double
+quantilesketch::k_scale(double q) const
+{
+  //
+  // Arcsine scale function giving finer resolution in the tails where the
+  // credible interval bounds are estimated.
+  //
+  if (q <= 0.0) {
+    return -compression/4.0;
+  }
+  if (q >= 1.0) {
+    return compression/4.0;
+  }
+  return compression/(2.0 * M_PI) * asin(2.0 * q - 1.0);
+}
@@ -0,0 +1,108 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+#pragma once
+#ifndef quantilesketch_hpp
+#define quantilesketch_hpp
+
+#include <vector>
+#include <utility>
+
+//
+// A mergeable streaming quantile sketch (merging t-digest). Samples are
+// buffered and periodically compressed into weighted centroids with the
+// centroid size bounded by the compression parameter, so memory scales with
+// the accuracy target rather than with a fixed histogram bin count. Sketches
+// from different chains/processes can be combined with merge or by exchanging
+// the packed representation.
+//
+// Per sketch memory is bounded by the compression c: at most c centroids
+// (about 0.65c in practice) of a mean and weight each, plus a buffer of c
+// samples, i.e. at most 3c doubles. At the default c = 100 that is 2.4 KB,
+// typically about 1.7 KB, against 4 KB for a 1000 bin int histogram.
+//
+class quantilesketch {
+public:
+
+  quantilesketch();
+  quantilesketch(double compression);
+  ~quantilesketch();
+
+  //
+  // For sketches default constructed in arrays, must be 1 or greater and
+  // set before any samples are added.
+  //
+  void set_compression(double compression);
+
+  void add(double v);
+
+  void merge(const quantilesketch &rhs);
+
+  void compress();
+
+  double total() const;
+
+  double quantile(double q);
+
+  double cdf(double x);
+
+  double mode();
+
+  double hpd(double interval, double &hpd_min, double &hpd_max);
+
+  //
+  // Approximate histogram from the sketch (counts rounded to nearest integer)
+  // for compatibility with histogram based outputs.
+  //
+  void histogram(int *hist, double vmin, double vmax, int bins);
+
+  //
+  // Packed representation is:
+  //   ncentroids vmin vmax mean_0 weight_0 ... mean_n-1 weight_n-1
+  //
+  int packed_size();
+  int pack(double *buffer);
+  int unpack(const double *buffer);
+
+private:
+
+  double compression;
+
+  std::vector<double> mean;
+  std::vector<double> weight;
+  std::vector<double> buffer;
+
+  double weight_total;
+  double vmin;
+  double vmax;
+
+  void rebuild(std::vector<std::pair<double, double>> &all);
+
+  double k_scale(double q) const;
+  
+};
+
+#endif // quantilesketch_hpp
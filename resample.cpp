@@ -31,6 +31,8 @@ extern "C" {
 };
 
 #include "aemutil.hpp"
+#include "checkpoint.hpp"
+#include "profiler.hpp"
 
 Resample::Resample(Global &_global) :
   global(_global),
@@ -76,6 +78,8 @@ Resample::~Resample()
 int
 Resample::step(double resample_temperature)
 {
+  PROFILE_SCOPE(profiler::RESAMPLE);
+
   if (global_communicator == MPI_COMM_NULL) {
     ERROR("MPI Unitialized");
     return -1;
@@ -359,4 +363,22 @@ Resample::initialize_mpi(MPI_Comm _global_communicator,
   recv_buffer = new char[recv_buffer_size];
 }
 
+void
+Resample::save_state(checkpoint &cp)
+{
+  cp.section("resample");
+  cp.write(resamplings);
+  cp.write(reselected);
+  cp.write(propagated);
+  cp.write(replaced);
+}
 
+void
+Resample::load_state(checkpoint &cp)
+{
+  cp.section("resample");
+  cp.read(resamplings);
+  cp.read(reselected);
+  cp.read(propagated);
+  cp.read(replaced);
+}
@@ -44,6 +44,9 @@ public:
 
   std::string write_long_stats();
 
+  void save_state(checkpoint &cp);
+  void load_state(checkpoint &cp);
+
   void initialize_mpi(MPI_Comm global_communicator,
 		      MPI_Comm temperature_communicator,
 		      MPI_Comm chain_communicator);
@@ -25,6 +25,8 @@
 //
 
 #include "rng.hpp"
+#include "checkpoint.hpp"
+#include "aemexception.hpp"
 
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
@@ -137,3 +139,21 @@ Rng::pdf_normal(double x, double mean, double sigma)
 {
   return gsl_ran_gaussian_pdf(x - mean, sigma);
 }
+
+void
+Rng::save_state(checkpoint &cp)
+{
+  cp.section("rng");
+  if (gsl_rng_fwrite(cp.file(), pimpl->rng) != 0) {
+    throw AEMEXCEPTION("Failed to write random state\n");
+  }
+}
+
+void
+Rng::load_state(checkpoint &cp)
+{
+  cp.section("rng");
+  if (gsl_rng_fread(cp.file(), pimpl->rng) != 0) {
+    throw AEMEXCEPTION("Failed to read random state\n");
+  }
+}
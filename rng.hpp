@@ -30,6 +30,8 @@
 
 #include <memory>
 
+class checkpoint;
+
 //
 // A simple wrapper around gsl random number generator
 //
@@ -60,6 +62,12 @@ public:
   //
   static double pdf_normal(double x, double mean, double sigma);
 
+  //
+  // Generator state for checkpoint/restart
+  //
+  void save_state(checkpoint &cp);
+  void load_state(checkpoint &cp);
+
 private:
 
   class impl;
@@ -0,0 +1,371 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#include <math.h>
+
+#include "synthetic.hpp"
+
+#include "general_types.h"
+
+typedef aemimage *(*mkimage_t)(int, int, double, double, double);
+
+static aemimage *mkconstantimage(int hsamples,
+				 int dsamples,
+				 double depth,
+				 double background_conductivity,
+				 double conductivity);
+
+static aemimage *mkdettmerimage(int hsamples,
+				int dsamples,
+				double depth,
+				double background_conductivity,
+				double conductivity);
+
+static aemimage *mkdettmerpatternimage(int hsamples,
+				       int dsamples,
+				       double depth,
+				       double background_conductivity,
+				       double conductivity);
+
+static struct _imagetable {
+  std::string name;
+  mkimage_t mkimage;
+} imagetable[] = {
+
+  {"constant", mkconstantimage},
+
+  {"dettmer", mkdettmerimage},
+
+  {"dettmerpattern", mkdettmerpatternimage},
+
+  {"", 0}
+};
+
+static double random_walk_init(Rng &random,
+			       double mu,
+			       double sigma);
+
+static double random_walk_step(Rng &random,
+			       double x0,
+			       double mu,
+			       double sigma,
+			       double scale = 10.0);
+
+aemimage *synthetic_image(const char *name,
+			  int hsamples,
+			  int dsamples,
+			  double depth,
+			  double background_conductivity,
+			  double conductivity)
+{
+  for (int i = 0; imagetable[i].name.length() != 0; i ++) {
+    if (imagetable[i].name == name) {
+      return imagetable[i].mkimage(hsamples, dsamples, depth, background_conductivity, conductivity);
+    }
+  }
+
+  return nullptr;
+}
+
+std::vector<std::string> synthetic_image_names()
+{
+  std::vector<std::string> names;
+
+  for (int i = 0; imagetable[i].name.length() != 0; i ++) {
+    names.push_back(imagetable[i].name);
+  }
+
+  return names;
+}
+
+syntheticpath::syntheticpath() :
+  height_mean(100.0),
+  height_std(5.0),
+  pitch_mean(0.0),
+  pitch_std(1.0),
+  roll_mean(0.0),
+  roll_std(2.0),
+  dx_mean(-100.0),
+  dx_std(2.0),
+  dz_mean(-40.0),
+  dz_std(2.5)
+{
+}
+
+void synthetic_flightpath(aemobservations &obs,
+			  int nsamples,
+			  const syntheticpath &path,
+			  Rng &random)
+{
+  double height;
+  double roll;
+  double pitch;
+  double dx;
+  double dz;
+
+  if (path.height_std == 0.0) {
+    height = path.height_mean;
+  } else {
+    height = path.height_mean + random.normal(path.height_std);
+  }
+
+  height = random_walk_init(random, path.height_mean, path.height_std);
+  
+  roll = random_walk_init(random, path.roll_mean, path.roll_std);
+  pitch = random_walk_init(random, path.pitch_mean, path.pitch_std);
+  dx = random_walk_init(random, path.dx_mean, path.dx_std);
+  dz = random_walk_init(random, path.dz_mean, path.dz_std);
+
+  for (int i = 0; i < nsamples; i ++) {
+
+    obs.points.push_back(aempoint(height,
+				  roll, pitch, 0.0,
+				  dx, 0.0, dz,
+				  roll, pitch, 0.0));
+
+    height = random_walk_step(random, height, path.height_mean, path.height_std);
+    roll = random_walk_step(random, roll, path.roll_mean, path.roll_std);
+    pitch = random_walk_step(random, pitch, path.pitch_mean, path.pitch_std);
+    dx = random_walk_step(random, dx, path.dx_mean, path.dx_std);
+    dz = random_walk_step(random, dz, path.dx_mean, path.dz_std);
+
+  }
+}
+
+int synthetic_responses(aemobservations &obs,
+			const aemimage &image,
+			std::vector<std::vector<cTDEmSystem*>> &forwardmodel,
+			const std::vector<aemresponse::direction_t> &components,
+			workerpool &pool,
+			int column_offset,
+			int column_size)
+{
+  return pool.run(column_size, [&](int worker, int item) -> int {
+      int j = column_offset + item;
+      
+      cEarth1D earth1d;
+
+      earth1d.conductivity.resize(image.rows);
+      earth1d.thickness.resize(image.rows - 1);
+
+      for (int k = 0; k < (image.rows - 1); k ++) {
+	earth1d.thickness[k] = image.layer_thickness[k];
+      }
+    
+      //
+      // Set conductivity from image
+      //
+      for (int k = 0; k < image.rows; k ++) {
+	earth1d.conductivity[k] = image.conductivity[k * image.columns + j];
+      }
+
+      aempoint &p = obs.points[j];
+
+      //
+      // Construct geometry
+      //
+      cTDEmGeometry geometry(p.tx_height,
+			     p.tx_roll,
+			     p.tx_pitch,
+			     p.tx_yaw,
+			     p.txrx_dx,
+			     p.txrx_dy,
+			     p.txrx_dz,
+			     p.rx_roll,
+			     p.rx_pitch,
+			     p.rx_yaw);
+
+      for (int k = 0; k < (int)forwardmodel[worker].size(); k ++) {
+
+	cTDEmResponse response;
+    
+	forwardmodel[worker][k]->forwardmodel(geometry, earth1d, response);
+
+	//
+	// Add in the response of this system's component
+	//
+	aemresponse::direction_t d = components.size() == 1 ? components[0] : components[k];
+	aemresponse r(d);
+
+	switch (d) {
+	case aemresponse::DIRECTION_X:
+	  r.response = response.SX;
+	  break;
+	case aemresponse::DIRECTION_Y:
+	  r.response = response.SY;
+	  break;
+	case aemresponse::DIRECTION_Z:
+	  r.response = response.SZ;
+	  break;
+	}
+
+	p.responses.push_back(r);
+      }
+
+      return 0;
+    });
+}
+
+void synthetic_noise(aemobservations &obs,
+		     const std::vector<hierarchicalmodel*> &noise,
+		     const std::vector<double*> &time,
+		     Rng &random)
+{
+  for (auto &a: obs.points) {
+
+    int ri = 0;
+	
+    for (auto &r: a.responses) {
+
+      hierarchicalmodel *noisemodel = noise[ri];
+      double *t = time[ri];
+      int di = 0;
+
+      for (auto &d: r.response) {
+	double sigma = noisemodel->noise(d, t[di], 1.0);
+	d = d + random.normal(sigma);
+	di ++;
+      }
+	  
+      ri ++;
+    }
+  }
+}
+
+static aemimage *mkconstantimage(int hsamples,
+				 int dsamples,
+				 double depth,
+				 double background_conductivity,
+				 double conductivity)
+{
+  return new aemimage(dsamples, hsamples, depth, background_conductivity);
+}
+
+
+static aemimage *mkdettmerimage(int hsamples,
+				int dsamples,
+				double depth,
+				double background_conductivity,
+				double conductivity)
+{
+  aemimage *image = new aemimage(dsamples, hsamples, depth, 0.0);
+
+  int vscale = dsamples/8;
+  int hscale = hsamples/8;
+
+  for (int j = 0; j < dsamples; j ++) {
+
+    int jj = j/vscale;
+
+    for (int i = 0; i < hsamples; i ++) {
+
+      int ii = i/hscale;
+
+      double c = background_conductivity;
+
+      if (ii >= 4 && ii <= 6 &&
+	  jj >= 4 && jj <= 6) {
+	c = conductivity;
+      }
+
+      image->conductivity[j * hsamples + i] = c;
+    }
+  }
+
+  return image;
+}
+
+static aemimage *mkdettmerpatternimage(int hsamples,
+				       int dsamples,
+				       double depth,
+				       double background_conductivity,
+				       double conductivity)
+{
+  aemimage *image = new aemimage(dsamples, hsamples, depth, 0.0);
+
+  int vscale = dsamples/16;
+  int hscale = hsamples/16;
+
+  for (int j = 0; j < dsamples; j ++) {
+
+    int jj = j/vscale;
+
+    for (int i = 0; i < hsamples; i ++) {
+
+      int ii = i/hscale;
+
+      double c = background_conductivity;
+
+      if (ii >= 8 && ii <= 13 &&
+	  jj >= 8 && jj <= 13) {
+
+	if (ii == 8 || ii == 13 ||
+	    jj == 8 || jj == 13) {
+	  c = conductivity;
+	} else if (ii == jj || (ii == 12 && jj == 11) || (ii == 11 && jj == 12)) {
+	  c = conductivity;
+	}
+      }
+
+      image->conductivity[j * hsamples + i] = c;
+    }
+  }
+
+  return image;
+}
+
+static double random_walk_init(Rng &random,
+			       double mu,
+			       double sigma)
+{
+  if (sigma > 0.0) {
+    return mu + random.normal(sigma);
+  } else {
+    return mu;
+  }
+}
+
+static double random_walk_step(Rng &random,
+			       double x0,
+			       double mu,
+			       double sigma,
+			       double scale)
+{
+  if (sigma > 0.0) {
+    double x = x0 + random.normal(sigma/scale);
+    double u = log(random.uniform());
+    
+    while (u > ((x0 - mu)*(x0 - mu)/(2.0 * sigma * sigma) - (x - mu)*(x - mu)/(2.0 * sigma * sigma))) {
+      x = x0 + random.normal(sigma/scale);
+      u = log(random.uniform());
+    }
+
+    return x;
+  } else {
+    return x0;
+  }
+}
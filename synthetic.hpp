@@ -0,0 +1,111 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#pragma once
+#ifndef synthetic_hpp
+#define synthetic_hpp
+
+#include <string>
+#include <vector>
+
+#include "aemimage.hpp"
+#include "aemobservations.hpp"
+#include "hierarchicalmodel.hpp"
+#include "rng.hpp"
+#include "workerpool.hpp"
+
+#include "tdemsystem.h"
+
+//
+// Construction of synthetic surveys, shared by the mksynthetic tools which
+// go through files at each stage and by bench_sampler which builds the
+// survey in memory.
+//
+
+//
+// Returns a new image of the named model, or nullptr if there is no model
+// of that name.
+//
+aemimage *synthetic_image(const char *name,
+			  int hsamples,
+			  int dsamples,
+			  double depth,
+			  double background_conductivity,
+			  double conductivity);
+
+std::vector<std::string> synthetic_image_names();
+
+//
+// Mean and standard deviation of each geometry parameter of a random walk
+// flight path (a standard deviation of 0 holds the parameter constant).
+//
+struct syntheticpath {
+  syntheticpath();
+
+  double height_mean;
+  double height_std;
+  double pitch_mean;
+  double pitch_std;
+  double roll_mean;
+  double roll_std;
+  double dx_mean;
+  double dx_std;
+  double dz_mean;
+  double dz_std;
+};
+
+void synthetic_flightpath(aemobservations &obs,
+			  int nsamples,
+			  const syntheticpath &path,
+			  Rng &random);
+
+//
+// Computes the noise free responses of columns column_offset to
+// column_offset + column_size - 1 of the image, appending one response for
+// each system to the corresponding points. components holds either a single
+// component used for every system or one component per system, as the
+// inversion expects exactly one response per system. forwardmodel holds one
+// set of systems per worker of the pool. Returns -1 on error.
+//
+int synthetic_responses(aemobservations &obs,
+			const aemimage &image,
+			std::vector<std::vector<cTDEmSystem*>> &forwardmodel,
+			const std::vector<aemresponse::direction_t> &components,
+			workerpool &pool,
+			int column_offset,
+			int column_size);
+
+//
+// Adds noise drawn from each system's noise model at lambda = 1 to every
+// response, where time holds the window centre times of each system.
+//
+void synthetic_noise(aemobservations &obs,
+		     const std::vector<hierarchicalmodel*> &noise,
+		     const std::vector<double*> &time,
+		     Rng &random);
+
+#endif // synthetic_hpp
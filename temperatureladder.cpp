@@ -0,0 +1,200 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#include <stdio.h>
+#include <math.h>
+
+#include "temperatureladder.hpp"
+
+#include "aemexception.hpp"
+#include "checkpoint.hpp"
+
+TemperatureLadder::TemperatureLadder(int ntemperatures, double max_temperature) :
+  log_max_temperature(log10(max_temperature)),
+  temperatures(ntemperatures, 1.0),
+  log_gaps(ntemperatures > 1 ? ntemperatures - 1 : 0, 0.0),
+  acceptance(ntemperatures > 1 ? ntemperatures - 1 : 0, 0.0),
+  nupdates(0)
+{
+  if (ntemperatures < 1) {
+    throw AEMEXCEPTION("Invalid no. temperatures: %d\n", ntemperatures);
+  }
+  
+  update_temperatures();
+}
+
+TemperatureLadder::~TemperatureLadder()
+{
+}
+
+bool
+TemperatureLadder::load(const char *filename)
+{
+  FILE *fp = fopen(filename, "r");
+  if (fp == NULL) {
+    return false;
+  }
+
+  std::vector<double> t;
+  double v;
+  while (fscanf(fp, "%lf", &v) == 1) {
+    t.push_back(v);
+  }
+  fclose(fp);
+
+  if (t.size() != temperatures.size()) {
+    fprintf(stderr, "TemperatureLadder::load: expected %d temperatures, got %d\n",
+	    (int)temperatures.size(), (int)t.size());
+    return false;
+  }
+
+  for (int i = 1; i < (int)t.size(); i ++) {
+    if (t[i] <= t[i - 1]) {
+      fprintf(stderr, "TemperatureLadder::load: temperatures must be increasing\n");
+      return false;
+    }
+  }
+
+  temperatures = t;
+  if (t.size() > 1) {
+    log_max_temperature = log10(t[t.size() - 1]/t[0]);
+    for (int i = 0; i < (int)log_gaps.size(); i ++) {
+      log_gaps[i] = log(log10(t[i + 1]/t[i]));
+    }
+  }
+
+  return true;
+}
+
+bool
+TemperatureLadder::save(const char *filename)
+{
+  FILE *fp = fopen(filename, "w");
+  if (fp == NULL) {
+    return false;
+  }
+
+  for (auto &t : temperatures) {
+    fprintf(fp, "%.9g\n", t);
+  }
+
+  fclose(fp);
+  return true;
+}
+
+double
+TemperatureLadder::temperature(int temp_id) const
+{
+  return temperatures[temp_id];
+}
+
+void
+TemperatureLadder::adapt(const int *pair_propose, const int *pair_accept)
+{
+  int npairs = log_gaps.size();
+  if (npairs < 2 || log_max_temperature <= 0.0) {
+    return;
+  }
+
+  //
+  // Smoothed acceptance estimates so that pairs without attempts in this
+  // window do not drive the spacing.
+  //
+  double mean_acceptance = 0.0;
+  for (int i = 0; i < npairs; i ++) {
+    acceptance[i] = ((double)pair_accept[i] + 0.5)/((double)pair_propose[i] + 1.0);
+    mean_acceptance += acceptance[i];
+  }
+  mean_acceptance /= (double)npairs;
+
+  //
+  // Pairs with low acceptance have their spacing reduced, those with high
+  // acceptance increased.
+  //
+  double kappa = KAPPA0 * TAU/((double)nupdates + TAU);
+  for (int i = 0; i < npairs; i ++) {
+    log_gaps[i] += kappa * (acceptance[i] - mean_acceptance);
+  }
+
+  nupdates ++;
+  update_temperatures();
+}
+
+double
+TemperatureLadder::pair_acceptance(int i) const
+{
+  return acceptance[i];
+}
+
+int
+TemperatureLadder::size() const
+{
+  return temperatures.size();
+}
+
+void
+TemperatureLadder::update_temperatures()
+{
+  int npairs = log_gaps.size();
+  if (npairs == 0) {
+    return;
+  }
+  
+  double sum = 0.0;
+  for (int i = 0; i < npairs; i ++) {
+    sum += exp(log_gaps[i]);
+  }
+
+  double t0 = temperatures[0];
+  double s = 0.0;
+  for (int i = 0; i < npairs; i ++) {
+    s += exp(log_gaps[i]);
+    temperatures[i + 1] = t0 * pow(10.0, log_max_temperature * s/sum);
+  }
+}
+
+void
+TemperatureLadder::save_state(checkpoint &cp)
+{
+  cp.section("ladder");
+  cp.write(log_max_temperature);
+  cp.write(nupdates);
+  cp.write_vector(temperatures);
+  cp.write_vector(log_gaps);
+  cp.write_vector(acceptance);
+}
+
+void
+TemperatureLadder::load_state(checkpoint &cp)
+{
+  cp.section("ladder");
+  cp.read(log_max_temperature);
+  cp.read(nupdates);
+  cp.read_vector(temperatures);
+  cp.read_vector(log_gaps);
+  cp.read_vector(acceptance);
+}
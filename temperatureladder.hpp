@@ -0,0 +1,84 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#pragma once
+#ifndef temperatureladder_hpp
+#define temperatureladder_hpp
+
+#include <vector>
+
+class checkpoint;
+
+//
+// Parallel tempering temperature ladder. The default ladder is geometric
+// between 1 and the maximum temperature. In adaptive mode the log spacings
+// between adjacent temperatures are adjusted from the measured exchange
+// acceptance rates of each adjacent pair so as to equalise them, with a
+// diminishing step size, keeping both end points fixed.
+//
+class TemperatureLadder {
+public:
+
+  TemperatureLadder(int ntemperatures, double max_temperature);
+  ~TemperatureLadder();
+
+  bool load(const char *filename);
+  bool save(const char *filename);
+
+  double temperature(int temp_id) const;
+
+  //
+  // Update from per adjacent pair (i, i + 1) exchange proposal/acceptance
+  // counts accumulated since the last update.
+  //
+  void adapt(const int *pair_propose, const int *pair_accept);
+
+  double pair_acceptance(int i) const;
+  
+  int size() const;
+
+  void save_state(checkpoint &cp);
+  void load_state(checkpoint &cp);
+  
+private:
+
+  void update_temperatures();
+
+  static constexpr double KAPPA0 = 1.0;
+  static constexpr double TAU = 10.0;
+
+  double log_max_temperature;
+  
+  std::vector<double> temperatures;
+  std::vector<double> log_gaps;
+  std::vector<double> acceptance;
+
+  int nupdates;
+  
+};
+
+#endif // temperatureladder_hpp
@@ -31,20 +31,76 @@ extern "C" {
 #include "value.hpp"
 
 #include "aemutil.hpp"
+#include "checkpoint.hpp"
+#include "linearisation.hpp"
+#include "profiler.hpp"
 
-Value::Value(Global &_global) :
+static double log_sum_weights(int n, const int *valid, const double *log_weight);
+
+Value::Value(Global &_global, int _tries) :
   global(_global),
+  tries(_tries),
+  adapting(false),
+  target_acceptance(0.0),
+  adapt_count(new int[global.treemaxdepth + 1]),
   propose(0),
   accept(0),
+  screen_reject(0),
   propose_depth(new int[global.treemaxdepth + 1]),
   accept_depth(new int[global.treemaxdepth + 1]),
   communicator(MPI_COMM_NULL),
   mpi_size(-1),
-  mpi_rank(-1)
+  mpi_rank(-1),
+  candidate_valid(nullptr),
+  candidate_idx(nullptr),
+  candidate_depth(nullptr),
+  candidate_value(nullptr),
+  candidate_prior_ratio(nullptr),
+  candidate_likelihood(nullptr),
+  candidate_log_normalization(nullptr),
+  candidate_log_weight(nullptr),
+  candidate_lo(nullptr),
+  candidate_hi(nullptr),
+  partial(nullptr)
 {
   for (int i = 0; i <= global.treemaxdepth; i ++) {
     propose_depth[i] = 0;
     accept_depth[i] = 0;
+    adapt_count[i] = 0;
+  }
+
+  if (tries < 1) {
+    throw AEMEXCEPTION("Invalid no. of value tries: %d\n", tries);
+  }
+
+  if (tries > 1) {
+    candidate_valid = new int[tries];
+    candidate_idx = new int[tries];
+    candidate_depth = new int[tries];
+    candidate_value = new double[tries];
+    candidate_prior_ratio = new double[tries];
+    candidate_likelihood = new double[tries];
+    candidate_log_normalization = new double[tries];
+    candidate_log_weight = new double[tries];
+    candidate_lo = new int[tries];
+    candidate_hi = new int[tries];
+    partial = new double[2 * tries];
+
+    if (!global.posteriork) {
+      candidate_residual.resize(tries * global.residual_size);
+      candidate_residual_normed.resize(tries * global.residual_size);
+      selected_residual.resize(global.residual_size);
+      selected_residual_normed.resize(global.residual_size);
+      base_coefficients.resize(global.size);
+      proposed_image.resize(global.size);
+      base_residual_normed.resize(global.residuals_per_column);
+
+      earth1d.conductivity.resize(global.image->rows);
+      earth1d.thickness.resize(global.image->rows - 1);
+      for (int i = 0; i < (global.image->rows - 1); i ++) {
+	earth1d.thickness[i] = global.image->layer_thickness[i];
+      }
+    }
   }
 }
 
@@ -52,11 +108,28 @@ Value::~Value()
 {
   delete [] propose_depth;
   delete [] accept_depth;
+  delete [] adapt_count;
+
+  delete [] candidate_valid;
+  delete [] candidate_idx;
+  delete [] candidate_depth;
+  delete [] candidate_value;
+  delete [] candidate_prior_ratio;
+  delete [] candidate_likelihood;
+  delete [] candidate_log_normalization;
+  delete [] candidate_log_weight;
+  delete [] candidate_lo;
+  delete [] candidate_hi;
+  delete [] partial;
 }
 
 int
 Value::step()
 {
+  if (tries > 1) {
+    return step_mtm();
+  }
+  
   propose ++;
 
   if (wavetree2d_sub_set_invalid_perturbation(global.wt, WT_PERTURB_VALUE) < 0) {
@@ -97,6 +170,14 @@ Value::step()
 
     propose_depth[value_depth] ++;
 
+    double current_value = 0.0;
+    if (screening()) {
+      if (wavetree2d_sub_get_coeff(global.wt, value_idx, &current_value) < 0) {
+	ERROR("failed to get coefficient value\n");
+	return -1;
+      }
+    }
+    
     if (propose_value(valid_proposal,
 		      value_idx,
 		      value_depth,
@@ -104,17 +185,38 @@ Value::step()
       return -1;
     }
 
-    if (compute_likelihood(value_idx, proposed_likelihood, proposed_log_normalization) < 0) {
+    bool accept_proposal = false;
+    double screen_delta = 0.0;
+    double screen_log_alpha = 0.0;
+    bool screen_pass = true;
+
+    if (screen_proposal(valid_proposal,
+			value_idx,
+			value - current_value,
+			value_prior_ratio,
+			screen_delta,
+			screen_log_alpha,
+			screen_pass) < 0) {
       return -1;
     }
 
-    bool accept_proposal = false;
-    if (compute_acceptance(value_idx,
-			   value_prior_ratio,
-			   proposed_likelihood,
-			   proposed_log_normalization,
-			   accept_proposal) < 0) {
-      return -1;
+    if (screen_pass) {
+      if (compute_likelihood(value_idx, proposed_likelihood, proposed_log_normalization) < 0) {
+	return -1;
+      }
+
+      if (compute_acceptance(value_idx,
+			     value_prior_ratio,
+			     proposed_likelihood,
+			     proposed_log_normalization,
+			     screening(),
+			     screen_delta,
+			     screen_log_alpha,
+			     accept_proposal) < 0) {
+	return -1;
+      }
+    } else {
+      screen_reject ++;
     }
 
     if (communicate_acceptance(accept_proposal) < 0) {
@@ -129,6 +231,7 @@ Value::step()
 
       accept ++;
       accept_depth[value_depth] ++;
+      adapt(value_depth, true);
       
       if (coefficient_histogram_accept_value(global.coeff_hist, value_idx, value) < 0) {
         ERROR("failed to update histogram for value acceptance\n");
@@ -151,6 +254,8 @@ Value::step()
       //
       // Reject
       //
+
+      adapt(value_depth, false);
       
       if (coefficient_histogram_reject_value(global.coeff_hist, value_idx, value) < 0) {
         ERROR("failed to update histogram for value rejection\n");
@@ -172,6 +277,254 @@ Value::step()
   return 0;
 }
 
+int
+Value::step_mtm()
+{
+  //
+  // Multiple-try Metropolis (Liu, Liang and Wong 2000) with a symmetric value
+  // perturbation and weights equal to the tempered posterior. All weights
+  // are relative to the current model x:
+  //
+  //   log w(y) = log p(y)/p(x) + (L(x) - L(y))/T
+  //
+  // 1. Draw y_1..y_M from the value proposal about x and select y_j with
+  //    probability proportional to w(y_j).
+  // 2. Draw x*_1..x*_M-1 from the value proposal about y_j and set x*_M = x.
+  // 3. Accept y_j with probability min(1, sum w(y_i)/sum w(x*_i)).
+  //
+  // Each candidate changes one coefficient so only the columns in its
+  // support are solved, the other columns keep the residuals of the model
+  // the candidates are drawn about. The likelihoods for each set of
+  // candidates are computed with a single reduction so that the
+  // communication cost per candidate is amortized.
+  //
+  global.validate_residuals();
+  
+  propose ++;
+
+  if (wavetree2d_sub_set_invalid_perturbation(global.wt, WT_PERTURB_VALUE) < 0) {
+    return -1;
+  }
+
+  //
+  // Forward candidates
+  //
+  if (choose_candidates(tries) < 0) {
+    return -1;
+  }
+
+  if (communicate_candidates(tries) < 0) {
+    return -1;
+  }
+
+  int nvalid = 0;
+  for (int i = 0; i < tries; i ++) {
+    nvalid += candidate_valid[i];
+  }
+  if (nvalid == 0) {
+    return 0;
+  }
+
+  if (compute_candidate_likelihoods(tries,
+				    global.current_likelihood,
+				    global.current_log_normalization,
+				    nullptr,
+				    0,
+				    -1) < 0) {
+    return -1;
+  }
+
+  int selected = -1;
+  double log_forward_weight = 0.0;
+  double selected_log_prior_ratio = 0.0;
+  
+  if (primary()) {
+
+    for (int i = 0; i < tries; i ++) {
+      if (candidate_valid[i]) {
+	candidate_log_weight[i] = log(candidate_prior_ratio[i]) +
+	  (global.current_likelihood - candidate_likelihood[i])/global.temperature;
+      }
+    }
+
+    log_forward_weight = log_sum_weights(tries, candidate_valid, candidate_log_weight);
+
+    double u = global.random.uniform();
+    double c = 0.0;
+    for (int i = 0; i < tries; i ++) {
+      if (candidate_valid[i]) {
+	selected = i;
+	c += exp(candidate_log_weight[i] - log_forward_weight);
+	if (u < c) {
+	  break;
+	}
+      }
+    }
+
+    selected_log_prior_ratio = log(candidate_prior_ratio[selected]);
+  }
+
+  if (communicator != MPI_COMM_NULL) {
+    PROFILE_SCOPE(profiler::MPI_BCAST);
+    if (MPI_Bcast(&selected, 1, MPI_INT, 0, communicator) != MPI_SUCCESS) {
+      throw AEMEXCEPTION("Failed to broadcast selected candidate\n");
+    }
+  }
+
+  int value_idx = candidate_idx[selected];
+  int value_depth = candidate_depth[selected];
+  double value = candidate_value[selected];
+  double selected_likelihood = candidate_likelihood[selected];
+  double selected_log_normalization = candidate_log_normalization[selected];
+  int selected_lo = candidate_lo[selected];
+  int selected_hi = candidate_hi[selected];
+
+  if (!global.posteriork) {
+    //
+    // Keep y_j's residuals, they are the base for the reference set and
+    // become the current residuals if y_j is accepted.
+    //
+    std::copy(candidate_residual.begin() + selected * global.residual_size,
+	      candidate_residual.begin() + (selected + 1) * global.residual_size,
+	      selected_residual.begin());
+    std::copy(candidate_residual_normed.begin() + selected * global.residual_size,
+	      candidate_residual_normed.begin() + (selected + 1) * global.residual_size,
+	      selected_residual_normed.begin());
+  }
+
+  propose_depth[value_depth] ++;
+
+  if (primary()) {
+    if (coefficient_histogram_propose_value(global.coeff_hist, value_idx) < 0) {
+      ERROR("failed to update histogram for value proposal\n");
+      return -1;
+    }
+  }
+
+  //
+  // Move to y_j temporarily to draw the reference set
+  //
+  double current_value;
+  if (wavetree2d_sub_get_coeff(global.wt, value_idx, &current_value) < 0) {
+    ERROR("failed to get coefficient value\n");
+    return -1;
+  }
+
+  if (wavetree2d_sub_propose_value(global.wt, value_idx, value_depth, value) < 0 ||
+      wavetree2d_sub_commit(global.wt) < 0) {
+    ERROR("failed to move to selected candidate\n");
+    return -1;
+  }
+
+  //
+  // Reference candidates, the last is the current model
+  //
+  if (choose_candidates(tries - 1) < 0) {
+    return -1;
+  }
+
+  if (communicate_candidates(tries - 1) < 0) {
+    return -1;
+  }
+
+  if (compute_candidate_likelihoods(tries - 1,
+				    selected_likelihood,
+				    selected_log_normalization,
+				    selected_residual.data(),
+				    selected_lo,
+				    selected_hi) < 0) {
+    return -1;
+  }
+
+  //
+  // Restore x and reapply y_j as a normal proposal so that the chain history
+  // and undo see a single value perturbation.
+  //
+  if (wavetree2d_sub_propose_value(global.wt, value_idx, value_depth, current_value) < 0 ||
+      wavetree2d_sub_commit(global.wt) < 0) {
+    ERROR("failed to restore current model\n");
+    return -1;
+  }
+
+  if (wavetree2d_sub_propose_value(global.wt, value_idx, value_depth, value) < 0) {
+    ERROR("failed to propose value\n");
+    return -1;
+  }
+  
+  bool accept_proposal = false;
+  if (primary()) {
+
+    for (int i = 0; i < tries - 1; i ++) {
+      if (candidate_valid[i]) {
+	candidate_log_weight[i] = log(candidate_prior_ratio[i]) + selected_log_prior_ratio +
+	  (global.current_likelihood - candidate_likelihood[i])/global.temperature;
+      }
+    }
+    candidate_valid[tries - 1] = 1;
+    candidate_log_weight[tries - 1] = 0.0;
+
+    double log_reverse_weight = log_sum_weights(tries, candidate_valid, candidate_log_weight);
+
+    double alpha = log_forward_weight - log_reverse_weight;
+    
+    if (coefficient_histogram_sample_value_alpha(global.coeff_hist, value_idx, exp(alpha)) < 0) {
+      ERROR("failed to sample alpha\n");
+      return -1;
+    }
+
+    accept_proposal = log(global.random.uniform()) < alpha;
+  }
+
+  if (communicate_acceptance(accept_proposal) < 0) {
+    return -1;
+  }
+
+  if (accept_proposal) {
+
+    accept ++;
+    accept_depth[value_depth] ++;
+    adapt(value_depth, true);
+
+    if (!global.posteriork) {
+      accept_selected_residuals(selected_lo, selected_hi);
+    }
+    
+    if (coefficient_histogram_accept_value(global.coeff_hist, value_idx, value) < 0) {
+      ERROR("failed to update histogram for value acceptance\n");
+      return -1;
+    }
+
+    if (wavetree2d_sub_commit(global.wt) < 0) {
+      ERROR("failed to commit value\n");
+      return -1;
+    }
+    
+    global.current_likelihood = selected_likelihood;
+    global.current_log_normalization = selected_log_normalization;
+    global.accept();
+
+    return 1;
+    
+  } else {
+
+    adapt(value_depth, false);
+    
+    if (coefficient_histogram_reject_value(global.coeff_hist, value_idx, value) < 0) {
+      ERROR("failed to update histogram for value rejection\n");
+      return -1;
+    }
+
+    if (wavetree2d_sub_undo(global.wt) < 0) {
+      ERROR("failed to undo value\n");
+      return -1;
+    }
+    
+    global.reject();
+    
+    return 0;
+  }
+}
+
 std::string
 Value::write_short_stats()
 {
@@ -193,6 +546,10 @@ Value::write_long_stats()
 			   propose_depth[i] == 0 ? 0.0 : 100.0*(double)accept_depth[i]/(double)propose_depth[i]);
   }
 
+  if (screening()) {
+    s = s + mkformatstring(" screened %6d", screen_reject);
+  }
+
   return s;
 }
 
@@ -207,6 +564,16 @@ Value::initialize_mpi(MPI_Comm _communicator)
   if (MPI_Comm_rank(communicator, &mpi_rank) != MPI_SUCCESS) {
     throw AEMEXCEPTION("MPI Failure\n");
   }
+
+  if (tries > 1 && global.partitioned && !global.posteriork) {
+    //
+    // Only our own columns' residuals are stored
+    //
+    candidate_residual.resize(tries * global.residual_size);
+    candidate_residual_normed.resize(tries * global.residual_size);
+    selected_residual.resize(global.residual_size);
+    selected_residual_normed.resize(global.residual_size);
+  }
 }
 
 bool
@@ -215,6 +582,16 @@ Value::primary() const
   return (communicator == MPI_COMM_NULL || mpi_rank == 0);
 }
 
+bool
+Value::screening() const
+{
+  //
+  // As for Birth, only when the likelihood is not distributed. The multiple
+  // try variant is not screened.
+  //
+  return (global.screen != nullptr && tries == 1 && (communicator == MPI_COMM_NULL || mpi_size == 1));
+}
+
 int
 Value::choose_value_location_and_value(int &value_depth,
 				       int &value_idx,
@@ -245,10 +622,8 @@ Value::choose_value_location_and_value(int &value_depth,
       return -1;
     }
     
-    if (wavetree2d_sub_2dindices(global.wt, value_idx, &ii, &ij) < 0) {
-      ERROR("failed to compute 2d indices for birth\n");
-      return -1;
-    }
+    ii = global.coefficients[value_idx].ii;
+    ij = global.coefficients[value_idx].ij;
     
     if (coefficient_histogram_propose_value(global.coeff_hist, value_idx) < 0) {
       ERROR("failed to update histogram for value proposal\n");
@@ -267,7 +642,7 @@ Value::choose_value_location_and_value(int &value_depth,
 				    value_depth, 
 				    global.maxdepth, 
 				    value_parent_coeff,
-				    global.temperature,
+				    global.value_proposal_temperature(value_depth),
 				    &value,
 				    &value_prior_ratio) < 0) {
       ERROR("failed to perturb value\n");
@@ -296,6 +671,7 @@ Value::communicate_value_location_and_value(int &valid_proposal,
 					    double &value)
 {
   if (communicator != MPI_COMM_NULL) {
+    PROFILE_SCOPE(profiler::MPI_BCAST);
 
     if (MPI_Bcast(&valid_proposal, 1, MPI_INT, 0, communicator) != MPI_SUCCESS) {
       throw AEMEXCEPTION("Failed to broadcast valid proposal\n");
@@ -335,6 +711,44 @@ Value::propose_value(int valid_proposal,
   return 0;
 }
 
+int
+Value::screen_proposal(int valid_proposal,
+		       int value_idx,
+		       double delta,
+		       double value_prior_ratio,
+		       double &screen_delta,
+		       double &screen_log_alpha,
+		       bool &screen_pass)
+{
+  screen_delta = 0.0;
+  screen_log_alpha = 0.0;
+  screen_pass = true;
+
+  if (valid_proposal && screening()) {
+    //
+    // First stage of delayed acceptance with the linearised likelihood
+    //
+    screen_delta = global.screen->delta_likelihood(value_idx, delta);
+
+    double u = log(global.random.uniform());
+    double alpha = log(value_prior_ratio) - screen_delta/global.temperature;
+
+    screen_pass = (u < alpha);
+    if (alpha < 0.0) {
+      screen_log_alpha = alpha;
+    }
+
+    if (!screen_pass) {
+      if (coefficient_histogram_sample_value_alpha(global.coeff_hist, value_idx, exp(alpha)) < 0) {
+	ERROR("failed to sample alpha\n");
+	return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
 int
 Value::compute_likelihood(int value_idx, double &proposed_likelihood, double &proposed_log_normalization)
 {
@@ -352,6 +766,9 @@ Value::compute_acceptance(int value_idx,
 			  double value_prior_ratio,
 			  double proposed_likelihood,
 			  double proposed_log_normalization,
+			  bool screened,
+			  double screen_delta,
+			  double screen_log_alpha,
 			  bool &accept_proposal)
 {
   if (primary()) {
@@ -359,8 +776,16 @@ Value::compute_acceptance(int value_idx,
     double u = log(global.random.uniform());
     
     double alpha = (log(value_prior_ratio) + (global.current_likelihood - proposed_likelihood)/global.temperature);
+
+    if (screened) {
+      //
+      // Second stage of delayed acceptance, the prior ratio cancels with the
+      // first stage. The overall acceptance is the product of the stages.
+      //
+      alpha = (global.current_likelihood - proposed_likelihood + screen_delta)/global.temperature;
+    }
     
-    if (coefficient_histogram_sample_value_alpha(global.coeff_hist, value_idx, exp(alpha)) < 0) {
+    if (coefficient_histogram_sample_value_alpha(global.coeff_hist, value_idx, exp(screen_log_alpha + alpha)) < 0) {
       ERROR("failed to sample alpha\n");
       return -1;
     }
@@ -372,11 +797,278 @@ Value::compute_acceptance(int value_idx,
   return 0;
 }
 
+int
+Value::choose_candidates(int ncandidates)
+{
+  if (primary()) {
+
+    for (int i = 0; i < ncandidates; i ++) {
+
+      double choose_prob;
+      int ii, ij;
+      
+      if (wavetree2d_sub_choose_value_global(global.wt,
+					     global.random.uniform(),
+					     global.treemaxdepth,
+					     &candidate_depth[i],
+					     &candidate_idx[i],
+					     &choose_prob) < 0) {
+	ERROR("failed to choose global value\n");
+	return -1;
+      }
+      
+      if (wavetree2d_sub_get_coeff(global.wt,
+				   candidate_idx[i],
+				   &candidate_value[i]) < 0) {
+	ERROR("failed to get coefficient value\n");
+	return -1;
+      }
+      
+      ii = global.coefficients[candidate_idx[i]].ii;
+      ij = global.coefficients[candidate_idx[i]].ij;
+      
+      if (wavetree_pp_value_init(global.proposal) < 0) {
+	ERROR("failed to initialize value proposal\n");
+	return -1;
+      }
+      
+      candidate_prior_ratio[i] = 1.0;
+      if (wavetree_pp_propose_value2d(global.proposal, 
+				      ii, ij, 
+				      candidate_depth[i], 
+				      global.maxdepth, 
+				      0.0,
+				      global.value_proposal_temperature(candidate_depth[i]),
+				      &candidate_value[i],
+				      &candidate_prior_ratio[i]) < 0) {
+	ERROR("failed to perturb value\n");
+	return -1;
+      }
+      
+      int prior_errors = wavetree_pp_value_error_count(global.proposal);
+      if (prior_errors < 0) {
+	ERROR("failed to check errors\n");
+	return -1;
+      }
+      
+      candidate_valid[i] = (prior_errors == 0);
+    }
+  }
+
+  return 0;
+}
+
+int
+Value::communicate_candidates(int ncandidates)
+{
+  if (communicator != MPI_COMM_NULL && ncandidates > 0) {
+    PROFILE_SCOPE(profiler::MPI_BCAST);
+
+    if (MPI_Bcast(candidate_valid, ncandidates, MPI_INT, 0, communicator) != MPI_SUCCESS) {
+      throw AEMEXCEPTION("Failed to broadcast valid candidates\n");
+    }
+    if (MPI_Bcast(candidate_idx, ncandidates, MPI_INT, 0, communicator) != MPI_SUCCESS) {
+      throw AEMEXCEPTION("Failed to broadcast candidate indices\n");
+    }
+    if (MPI_Bcast(candidate_depth, ncandidates, MPI_INT, 0, communicator) != MPI_SUCCESS) {
+      throw AEMEXCEPTION("Failed to broadcast candidate depths\n");
+    }
+    if (MPI_Bcast(candidate_value, ncandidates, MPI_DOUBLE, 0, communicator) != MPI_SUCCESS) {
+      throw AEMEXCEPTION("Failed to broadcast candidate values\n");
+    }
+  }
+
+  return 0;
+}
+
+int
+Value::compute_candidate_likelihoods(int ncandidates,
+				     double base_likelihood,
+				     double base_log_normalization,
+				     const double *base_residual,
+				     int base_lo,
+				     int base_hi)
+{
+  if (global.posteriork) {
+    for (int i = 0; i < ncandidates; i ++) {
+      candidate_likelihood[i] = 1.0;
+      candidate_log_normalization[i] = 0.0;
+    }
+    return 0;
+  }
+
+  memset(base_coefficients.data(), 0, sizeof(double) * global.size);
+  if (wavetree2d_sub_map_to_array(global.wt, base_coefficients.data(), global.size) < 0) {
+    ERROR("failed to map model to array\n");
+    return -1;
+  }
+
+  int column_offset = 0;
+  int column_size = global.image->columns;
+  if (communicator != MPI_COMM_NULL) {
+    column_offset = global.column_offsets[global.mpi_rank];
+    column_size = global.column_sizes[global.mpi_rank];
+  }
+  int column_end = column_offset + column_size - 1;
+
+  for (int i = 0; i < ncandidates; i ++) {
+
+    candidate_likelihood[i] = 0.0;
+    candidate_log_normalization[i] = 0.0;
+    candidate_lo[i] = 0;
+    candidate_hi[i] = -1;
+    
+    if (candidate_valid[i]) {
+
+      global.column_support(candidate_idx[i], candidate_lo[i], candidate_hi[i]);
+
+      int lo = candidate_lo[i] > column_offset ? candidate_lo[i] : column_offset;
+      int hi = candidate_hi[i] < column_end ? candidate_hi[i] : column_end;
+      if (lo > hi) {
+	continue;
+      }
+
+      memcpy(proposed_image.data(), base_coefficients.data(), sizeof(double) * global.size);
+      proposed_image[candidate_idx[i]] = candidate_value[i];
+
+      {
+	PROFILE_SCOPE(profiler::WAVELET);
+	if (generic_lift_inverse2d(proposed_image.data(),
+				   global.width,
+				   global.height,
+				   global.width,
+				   global.workspace,
+				   global.hwaveletf,
+				   global.vwaveletf,
+				   1) < 0) {
+	  ERROR("failed to do inverse transform on coefficients\n");
+	  return -1;
+	}
+      }
+
+      double *residual = candidate_residual.data() + i * global.residual_size;
+      double *residual_normed = candidate_residual_normed.data() + i * global.residual_size;
+      
+      for (int c = lo; c <= hi; c ++) {
+	int residual_offset = c * global.residuals_per_column - global.residual_base;
+
+	const double *current_residual = global.last_valid_residual + residual_offset;
+	if (base_residual != nullptr && c >= base_lo && c <= base_hi) {
+	  current_residual = base_residual + residual_offset;
+	}
+
+	double current_log_normalization = 0.0;
+	double current_likelihood = global.column_nll(c,
+						      current_residual,
+						      base_residual_normed.data(),
+						      current_log_normalization);
+
+	double proposed_log_normalization = 0.0;
+	double proposed_likelihood = global.column_likelihood(c,
+							      proposed_image.data(),
+							      earth1d,
+							      residual + residual_offset,
+							      residual_normed + residual_offset,
+							      proposed_log_normalization);
+
+	candidate_likelihood[i] += proposed_likelihood - current_likelihood;
+	candidate_log_normalization[i] += proposed_log_normalization - current_log_normalization;
+      }
+    }
+  }
+
+  if (communicator != MPI_COMM_NULL && ncandidates > 0) {
+    PROFILE_SCOPE(profiler::MPI_REDUCE);
+
+    //
+    // One reduction for all candidates
+    //
+    for (int i = 0; i < ncandidates; i ++) {
+      partial[2 * i] = candidate_likelihood[i];
+      partial[2 * i + 1] = candidate_log_normalization[i];
+    }
+    
+    if (MPI_Allreduce(MPI_IN_PLACE, partial, 2 * ncandidates, MPI_DOUBLE, MPI_SUM, communicator) != MPI_SUCCESS) {
+      throw AEMEXCEPTION("Failed to reduce candidate likelihoods\n");
+    }
+
+    for (int i = 0; i < ncandidates; i ++) {
+      candidate_likelihood[i] = partial[2 * i];
+      candidate_log_normalization[i] = partial[2 * i + 1];
+    }
+  }
+
+  for (int i = 0; i < ncandidates; i ++) {
+    candidate_likelihood[i] += base_likelihood;
+    candidate_log_normalization[i] += base_log_normalization;
+  }
+  
+  return 0;
+}
+
+void
+Value::accept_selected_residuals(int selected_lo, int selected_hi)
+{
+  //
+  // Rebuild the residuals from the last valid ones with the selected
+  // candidate's columns replaced.
+  //
+  int column_offset = 0;
+  int column_size = global.image->columns;
+  if (communicator != MPI_COMM_NULL) {
+    column_offset = global.column_offsets[global.mpi_rank];
+    column_size = global.column_sizes[global.mpi_rank];
+  }
+
+  for (int mi = 0, i = column_offset; mi < column_size; mi ++, i ++) {
+
+    int residual_offset = i * global.residuals_per_column - global.residual_base;
+    
+    if (i >= selected_lo && i <= selected_hi) {
+      memcpy(global.residual + residual_offset,
+	     selected_residual.data() + residual_offset,
+	     sizeof(double) * global.residuals_per_column);
+      memcpy(global.residual_normed + residual_offset,
+	     selected_residual_normed.data() + residual_offset,
+	     sizeof(double) * global.residuals_per_column);
+    } else {
+      memcpy(global.residual + residual_offset,
+	     global.last_valid_residual + residual_offset,
+	     sizeof(double) * global.residuals_per_column);
+      memcpy(global.residual_normed + residual_offset,
+	     global.last_valid_residual_normed + residual_offset,
+	     sizeof(double) * global.residuals_per_column);
+    }
+  }
+  
+  if (communicator != MPI_COMM_NULL && !global.partitioned) {
+    PROFILE_SCOPE(profiler::MPI_ALLGATHER);
+    MPI_Allgatherv(global.residual + global.residual_offsets[global.mpi_rank],
+		   global.residual_sizes[global.mpi_rank],
+		   MPI_DOUBLE,
+		   global.residual,
+		   global.residual_sizes,
+		   global.residual_offsets,
+		   MPI_DOUBLE,
+		   communicator);
+    
+    MPI_Allgatherv(global.residual_normed + global.residual_offsets[global.mpi_rank],
+		   global.residual_sizes[global.mpi_rank],
+		   MPI_DOUBLE,
+		   global.residual_normed,
+		   global.residual_sizes,
+		   global.residual_offsets,
+		   MPI_DOUBLE,
+		   communicator);
+  }
+}
+
 int
 Value::communicate_acceptance(bool &accept_proposal)
 {
   
   if (communicator != MPI_COMM_NULL) {
+    PROFILE_SCOPE(profiler::MPI_BCAST);
 
     int ta;
 
@@ -396,3 +1088,120 @@ Value::communicate_acceptance(bool &accept_proposal)
 
   return 0;
 }
+
+void
+Value::start_adaptation(double _target_acceptance)
+{
+  adapting = true;
+  target_acceptance = _target_acceptance;
+}
+
+void
+Value::stop_adaptation()
+{
+  adapting = false;
+}
+
+std::string
+Value::write_proposal_scales()
+{
+  std::string s = mkformatstring("Value scales%s:", adapting ? " (adapting)" : "");
+
+  for (int i = 0; i <= global.treemaxdepth; i ++) {
+    s = s + mkformatstring("%8.4f ", global.value_proposal_scale[i]);
+  }
+
+  return s;
+}
+
+bool
+Value::save_proposal_scales(const char *filename)
+{
+  FILE *fp = fopen(filename, "w");
+  if (fp == NULL) {
+    return false;
+  }
+
+  for (int i = 0; i <= global.treemaxdepth; i ++) {
+    fprintf(fp, "%d %.9g %d %d\n", i, global.value_proposal_scale[i], propose_depth[i], accept_depth[i]);
+  }
+
+  fclose(fp);
+  return true;
+}
+
+void
+Value::adapt(int depth, bool accepted)
+{
+  static const double ADAPT_EXPONENT = 0.6;
+  static const double LOG_SCALE_LIMIT = 7.0;
+
+  if (adapting) {
+
+    //
+    // Step size n^-0.6 satisfies the diminishing adaptation condition, the
+    // scale is bounded to keep early, noisy updates from running away.
+    //
+    adapt_count[depth] ++;
+    double gamma = pow((double)adapt_count[depth], -ADAPT_EXPONENT);
+    
+    double log_scale = log(global.value_proposal_scale[depth]) +
+      gamma * ((accepted ? 1.0 : 0.0) - target_acceptance);
+    
+    if (log_scale > LOG_SCALE_LIMIT) {
+      log_scale = LOG_SCALE_LIMIT;
+    } else if (log_scale < -LOG_SCALE_LIMIT) {
+      log_scale = -LOG_SCALE_LIMIT;
+    }
+    
+    global.value_proposal_scale[depth] = exp(log_scale);
+  }
+}
+
+void
+Value::save_state(checkpoint &cp)
+{
+  cp.section("value");
+  cp.write(propose);
+  cp.write(accept);
+  cp.write_array(propose_depth, global.treemaxdepth + 1);
+  cp.write_array(accept_depth, global.treemaxdepth + 1);
+  cp.write(adapting);
+  cp.write(target_acceptance);
+  cp.write_array(adapt_count, global.treemaxdepth + 1);
+}
+
+void
+Value::load_state(checkpoint &cp)
+{
+  cp.section("value");
+  cp.read(propose);
+  cp.read(accept);
+  cp.read_array(propose_depth, global.treemaxdepth + 1);
+  cp.read_array(accept_depth, global.treemaxdepth + 1);
+  cp.read(adapting);
+  cp.read(target_acceptance);
+  cp.read_array(adapt_count, global.treemaxdepth + 1);
+}
+
+static double log_sum_weights(int n, const int *valid, const double *log_weight)
+{
+  double max_weight = 0.0;
+  bool first = true;
+  
+  for (int i = 0; i < n; i ++) {
+    if (valid[i] && (first || log_weight[i] > max_weight)) {
+      max_weight = log_weight[i];
+      first = false;
+    }
+  }
+
+  double sum = 0.0;
+  for (int i = 0; i < n; i ++) {
+    if (valid[i]) {
+      sum += exp(log_weight[i] - max_weight);
+    }
+  }
+
+  return max_weight + log(sum);
+}
@@ -35,7 +35,13 @@
 class Value {
 public:
 
-  Value(Global &global);
+  //
+  // With tries > 1 the value step is a multiple-try Metropolis move: tries
+  // candidate perturbations are evaluated together with a single reduction
+  // across the chain communicator and one is selected in proportion to its
+  // posterior weight.
+  //
+  Value(Global &global, int tries = 1);
   ~Value();
 
   int step();
@@ -44,13 +50,39 @@ public:
 
   std::string write_long_stats();
 
+  void save_state(checkpoint &cp);
+  void load_state(checkpoint &cp);
+
   void initialize_mpi(MPI_Comm communicator);
 
+  //
+  // Adaptation of the per depth value proposal scaling toward a target
+  // acceptance rate. Updates are a Robbins-Monro recursion on the log scale
+  // with a diminishing step size and should be stopped at the end of burn-in.
+  //
+  void start_adaptation(double target_acceptance);
+  void stop_adaptation();
+
+  std::string write_proposal_scales();
+  bool save_proposal_scales(const char *filename);
+
   Global &global;
 
+  int tries;
+
+  bool adapting;
+  double target_acceptance;
+  int *adapt_count;
+
   int propose;
   int accept;
 
+  //
+  // Proposals rejected by the linearised screening stage without a full
+  // likelihood evaluation (see Global::initialize_screening)
+  //
+  int screen_reject;
+
   int *propose_depth;
   int *accept_depth;
 
@@ -62,6 +94,8 @@ private:
 
   bool primary() const;
 
+  bool screening() const;
+
   int choose_value_location_and_value(int &value_depth,
 				      int &value_idx,
 				      double &choose_prob,
@@ -82,15 +116,77 @@ private:
 		    int value_depth,
 		    double value);
 
+  int screen_proposal(int valid_proposal,
+		      int value_idx,
+		      double delta,
+		      double value_prior_ratio,
+		      double &screen_delta,
+		      double &screen_log_alpha,
+		      bool &screen_pass);
+
   int compute_likelihood(int valid_idx, double &proposed_likelihood, double &proposed_log_normalization);
 
   int compute_acceptance(int value_idx,
 			 double value_prior_ratio,
 			 double proposed_likelihood,
 			 double proposed_log_normalization,
+			 bool screened,
+			 double screen_delta,
+			 double screen_log_alpha,
 			 bool &accept_proposal);
   
   int communicate_acceptance(bool &accept_proposal);
+
+  void adapt(int depth, bool accepted);
+
+  int step_mtm();
+
+  int choose_candidates(int ncandidates);
+
+  int communicate_candidates(int ncandidates);
+
+  //
+  // Likelihoods of the candidates relative to the model in the tree. Only
+  // the columns in each candidate's support are solved, the remaining
+  // columns are unchanged from the base model whose likelihood is given.
+  // The base residuals are the last valid residuals of global except for
+  // columns base_lo to base_hi which are taken from base_residual if set.
+  // The residuals of each candidate's support are kept in
+  // candidate_residual.
+  //
+  int compute_candidate_likelihoods(int ncandidates,
+				    double base_likelihood,
+				    double base_log_normalization,
+				    const double *base_residual,
+				    int base_lo,
+				    int base_hi);
+
+  //
+  // Replace the residuals of the selected candidate's support columns in
+  // the current residuals before accepting it.
+  //
+  void accept_selected_residuals(int selected_lo, int selected_hi);
+
+  int *candidate_valid;
+  int *candidate_idx;
+  int *candidate_depth;
+  double *candidate_value;
+  double *candidate_prior_ratio;
+  double *candidate_likelihood;
+  double *candidate_log_normalization;
+  double *candidate_log_weight;
+  int *candidate_lo;
+  int *candidate_hi;
+  double *partial;
+
+  std::vector<double> candidate_residual;
+  std::vector<double> candidate_residual_normed;
+  std::vector<double> selected_residual;
+  std::vector<double> selected_residual_normed;
+  std::vector<double> base_coefficients;
+  std::vector<double> proposed_image;
+  std::vector<double> base_residual_normed;
+  cEarth1D earth1d;
 };
 
 #endif // value_hpp
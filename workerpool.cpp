@@ -0,0 +1,122 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+
+#include <stdio.h>
+
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <vector>
+
+#include "workerpool.hpp"
+
+#include "aemexception.hpp"
+
+workerpool::workerpool(int _nworkers) :
+  nworkers(_nworkers)
+{
+  if (nworkers <= 0) {
+    nworkers = hardware_workers();
+  }
+}
+
+workerpool::~workerpool()
+{
+}
+
+int
+workerpool::run(int nitems, task_t task)
+{
+  std::atomic<int> next(0);
+  std::atomic<bool> failed(false);
+
+  int n = nworkers;
+  if (n > nitems) {
+    n = nitems;
+  }
+
+  auto worker = [&](int w) {
+    int item;
+    while (!failed && (item = next++) < nitems) {
+      //
+      // An exception escaping a std::thread terminates the process, so
+      // treat it as a failed item on every path.
+      //
+      try {
+	if (task(w, item) < 0) {
+	  failed = true;
+	}
+      } catch (aemexception &e) {
+	//
+	// Already logged when thrown
+	//
+	failed = true;
+      } catch (std::exception &e) {
+	fprintf(stderr, "error: worker %d item %d: %s\n", w, item, e.what());
+	failed = true;
+      } catch (...) {
+	fprintf(stderr, "error: worker %d item %d: unknown exception\n", w, item);
+	failed = true;
+      }
+    }
+  };
+
+  if (n <= 1) {
+    worker(0);
+  } else {
+    std::vector<std::thread> threads;
+    for (int w = 0; w < n; w ++) {
+      threads.push_back(std::thread(worker, w));
+    }
+
+    for (auto &t : threads) {
+      t.join();
+    }
+  }
+
+  if (failed) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+workerpool::size() const
+{
+  return nworkers;
+}
+
+int
+workerpool::hardware_workers()
+{
+  int n = (int)std::thread::hardware_concurrency();
+  if (n <= 0) {
+    n = 1;
+  }
+  return n;
+}
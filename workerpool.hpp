@@ -0,0 +1,63 @@
+//
+//    AEM Invert : Software for inversion of AEM data using the
+//    trans-dimensional tree method and forward modelling code
+//    written by Ross Brodie from Geoscience Australia. See
+//
+//      R Hawkins, R Brodie and M Sambridge, "Bayesian trans-dimensional inversion of
+//    Airborne Electromagnetic 2D Conductivity profiles", Exploration Geophysics, 2017
+//    https://doi.org/10.1071/EG16139
+//    
+//    Copyright (C) 2014 - 2018 Rhys Hawkins
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+
+#pragma once
+#ifndef workerpool_hpp
+#define workerpool_hpp
+
+#include <functional>
+
+//
+// A simple bounded pool of worker threads that processes a range of work items,
+// each worker pulling the next unprocessed item until all are done. The task
+// is called with the worker index (0 .. nworkers - 1) so that callers can keep
+// per worker accumulators that are merged after run returns.
+//
+class workerpool {
+public:
+
+  typedef std::function<int(int worker, int item)> task_t;
+  
+  workerpool(int nworkers);
+  ~workerpool();
+
+  //
+  // Returns -1 if any task returned an error or threw (remaining items are
+  // abandoned), 0 otherwise.
+  //
+  int run(int nitems, task_t task);
+
+  int size() const;
+
+  static int hardware_workers();
+
+private:
+
+  int nworkers;
+  
+};
+
+#endif // workerpool_hpp